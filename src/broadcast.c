@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "broadcast.h"
+
+// Output of a subscriber above which it is dropped instead of getting more messages
+const size_t BROADCAST_MAX_BACKLOG = 4 * 1024 * 1024;
+
+/**
+ * The hub takes ownership of the heartbeat buffer, heartbeat is NULL for none
+ *
+ * Returns NULL on allocation failure
+ */
+broadcast_hub_t *create_broadcast_hub(broadcast_message_t *heartbeat, uint64_t heartbeat_interval_ms) {
+    broadcast_hub_t *hub = calloc(1, sizeof(broadcast_hub_t));
+    if (hub == NULL) {
+        if (heartbeat != NULL) {
+            release_shared_buffer(heartbeat->buffer);
+        }
+        return NULL;
+    }
+
+    pthread_mutex_init(&hub->lock, NULL);
+
+    if (heartbeat != NULL) {
+        hub->heartbeat = *heartbeat;
+        hub->heartbeat_interval_ms = heartbeat_interval_ms;
+    }
+
+    return hub;
+}
+
+// The worker loops must be done with the hub, its groups are still registered in them
+void free_broadcast_hub(void *arg) {
+    broadcast_hub_t *hub = arg;
+    broadcast_group_t *group = hub->groups;
+
+    while (group != NULL) {
+        broadcast_group_t *next = group->next;
+
+        for (size_t i = 0; i < group->inbox_length; i++) {
+            release_shared_buffer(group->inbox[i].buffer);
+        }
+
+        close(group->watcher.fd);
+        pthread_mutex_destroy(&group->lock);
+        free(group->inbox);
+        free(group);
+        group = next;
+    }
+
+    if (hub->heartbeat.buffer != NULL) {
+        release_shared_buffer(hub->heartbeat.buffer);
+    }
+
+    pthread_mutex_destroy(&hub->lock);
+    free(hub);
+}
+
+/**
+ * Hands messages to every subscriber of the group, each subscriber is flushed once
+ * for all of them
+ */
+static void deliver(broadcast_group_t *group, broadcast_message_t *messages, size_t count) {
+    broadcast_subscriber_t *subscriber = group->subscribers;
+
+    while (subscriber != NULL) {
+        // Waking a subscriber can close it, which unlinks it
+        broadcast_subscriber_t *next = subscriber->next;
+        connection_t *connection = subscriber->connection;
+        int dropped = 0;
+        // A closing connection only finishes its response, a stream is one ending with the connection
+        int closing = connection->state == CONNECTION_CLOSING && connection->stream == NULL;
+
+        for (size_t i = 0; i < count && !closing; i++) {
+            size_t backlog = connection->output.buffered_bytes + connection->output.spliced_bytes;
+            broadcast_message_t *message = &messages[i];
+            size_t offset = subscriber->framed ? 0 : message->offset;
+            size_t length = subscriber->framed ? message->buffer->length : message->length;
+
+            if (backlog + length > BROADCAST_MAX_BACKLOG ||
+                output_queue_push_shared(&connection->output, message->buffer, offset, length) == -1) {
+                close_connection(connection);
+                dropped = 1;
+                break;
+            }
+        }
+
+        if (!dropped) {
+            connection_wake(connection);
+        }
+
+        subscriber = next;
+    }
+}
+
+static void on_group_inbox(event_loop_t *loop, io_watcher_t *watcher, uint32_t events) {
+    (void)loop;
+    (void)events;
+    broadcast_group_t *group = (broadcast_group_t *)watcher;
+
+    uint64_t value;
+    read(group->watcher.fd, &value, sizeof(value));
+
+    pthread_mutex_lock(&group->lock);
+    broadcast_message_t *messages = group->inbox;
+    size_t count = group->inbox_length;
+    group->inbox = NULL;
+    group->inbox_length = 0;
+    group->inbox_capacity = 0;
+    pthread_mutex_unlock(&group->lock);
+
+    deliver(group, messages, count);
+
+    for (size_t i = 0; i < count; i++) {
+        release_shared_buffer(messages[i].buffer);
+    }
+    free(messages);
+}
+
+static void on_group_heartbeat(wheel_timer_t *timer) {
+    broadcast_group_t *group = (broadcast_group_t *)((char *)timer - offsetof(broadcast_group_t, heartbeat_timer));
+    broadcast_hub_t *hub = group->hub;
+
+    deliver(group, &hub->heartbeat, 1);
+    event_loop_schedule(group->loop, &group->heartbeat_timer, hub->heartbeat_interval_ms);
+}
+
+// Returns the group of the loop, created on first use, or NULL on failure
+static broadcast_group_t *get_group(broadcast_hub_t *hub, event_loop_t *loop) {
+    pthread_mutex_lock(&hub->lock);
+
+    broadcast_group_t *group = hub->groups;
+    while (group != NULL && group->loop != loop) {
+        group = group->next;
+    }
+
+    if (group != NULL) {
+        pthread_mutex_unlock(&hub->lock);
+        return group;
+    }
+
+    group = calloc(1, sizeof(broadcast_group_t));
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (group == NULL || fd == -1) {
+        pthread_mutex_unlock(&hub->lock);
+        free(group);
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    io_watcher_init(&group->watcher, fd, on_group_inbox);
+    if (event_loop_add(loop, &group->watcher, EPOLLIN) == -1) {
+        pthread_mutex_unlock(&hub->lock);
+        close(fd);
+        free(group);
+        return NULL;
+    }
+
+    pthread_mutex_init(&group->lock, NULL);
+    atomic_init(&group->subscriber_count, 0);
+    group->loop = loop;
+    group->hub = hub;
+    group->next = hub->groups;
+    hub->groups = group;
+
+    wheel_timer_init(&group->heartbeat_timer, on_group_heartbeat);
+    if (hub->heartbeat.buffer != NULL) {
+        event_loop_schedule(loop, &group->heartbeat_timer, hub->heartbeat_interval_ms);
+    }
+
+    pthread_mutex_unlock(&hub->lock);
+    return group;
+}
+
+/**
+ * Subscribes a connection to the messages of hub, from the loop of the connection
+ *
+ * The subscriber must be unsubscribed before the connection is closed.
+ *
+Returns
+- -1 on failure
+- 0 if succeed
+*/
+int broadcast_subscribe(broadcast_hub_t *hub, broadcast_subscriber_t *subscriber, connection_t *connection) {
+    broadcast_group_t *group = get_group(hub, connection->loop);
+    if (group == NULL) {
+        return -1;
+    }
+
+    subscriber->connection = connection;
+    subscriber->group = group;
+    subscriber->previous = NULL;
+    subscriber->next = group->subscribers;
+    if (group->subscribers != NULL) {
+        group->subscribers->previous = subscriber;
+    }
+    group->subscribers = subscriber;
+    atomic_fetch_add(&group->subscriber_count, 1);
+
+    return 0;
+}
+
+void broadcast_unsubscribe(broadcast_subscriber_t *subscriber) {
+    broadcast_group_t *group = subscriber->group;
+    if (group == NULL) {
+        return;
+    }
+
+    if (subscriber->previous != NULL) {
+        subscriber->previous->next = subscriber->next;
+    } else {
+        group->subscribers = subscriber->next;
+    }
+
+    if (subscriber->next != NULL) {
+        subscriber->next->previous = subscriber->previous;
+    }
+
+    atomic_fetch_sub(&group->subscriber_count, 1);
+    subscriber->group = NULL;
+}
+
+// Returns -1 if the inbox can't grow, otherwise 0
+static int post_message(broadcast_group_t *group, broadcast_message_t *message) {
+    pthread_mutex_lock(&group->lock);
+
+    if (group->inbox_length == group->inbox_capacity) {
+        size_t new_capacity = group->inbox_capacity == 0 ? 16 : group->inbox_capacity * 2;
+        broadcast_message_t *inbox = realloc(group->inbox, sizeof(broadcast_message_t) * new_capacity);
+
+        if (inbox == NULL) {
+            pthread_mutex_unlock(&group->lock);
+            return -1;
+        }
+
+        group->inbox = inbox;
+        group->inbox_capacity = new_capacity;
+    }
+
+    retain_shared_buffer(message->buffer);
+    group->inbox[group->inbox_length++] = *message;
+    int first = group->inbox_length == 1;
+
+    pthread_mutex_unlock(&group->lock);
+
+    // The loop empties the whole inbox on a single wake up
+    if (first) {
+        uint64_t value = 1;
+        write(group->watcher.fd, &value, sizeof(value));
+    }
+
+    return 0;
+}
+
+/**
+ * Sends a message to every subscriber of the hub, can be called from any thread
+ *
+ * The groups take their own references, the caller keeps its own.
+ *
+Returns
+- -1 if a group missed the message
+- 0 if succeed
+*/
+int broadcast_publish(broadcast_hub_t *hub, broadcast_message_t *message) {
+    int result = 0;
+
+    pthread_mutex_lock(&hub->lock);
+    for (broadcast_group_t *group = hub->groups; group != NULL; group = group->next) {
+        if (atomic_load(&group->subscriber_count) > 0 && post_message(group, message) == -1) {
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&hub->lock);
+
+    return result;
+}
+
+size_t broadcast_subscriber_count(broadcast_hub_t *hub) {
+    size_t count = 0;
+
+    pthread_mutex_lock(&hub->lock);
+    for (broadcast_group_t *group = hub->groups; group != NULL; group = group->next) {
+        count += atomic_load(&group->subscriber_count);
+    }
+    pthread_mutex_unlock(&hub->lock);
+
+    return count;
+}
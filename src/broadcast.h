@@ -0,0 +1,82 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connection.h"
+#include "event_loop.h"
+#include "output_queue.h"
+#include "timer_wheel.h"
+
+// Fans messages out to connections of every worker loop (WebSocket hubs, event stream topics)
+//
+// A message is serialized once in a shared buffer that every subscriber queues.
+// Subscribers are grouped by worker loop: a publish from any thread posts the message
+// to the inbox of every group and wakes its loop, which hands the whole inbox to its
+// connections and flushes each of them once. A subscriber costs its links in the group,
+// neither a thread nor a buffer of its own. Subscribers too slow to keep up are dropped
+// rather than buffering for them without bound.
+//
+// A hub can have a heartbeat, sent by every group on a timer of its loop so that idle
+// subscribers don't cost a timer each.
+
+typedef struct BroadcastHub broadcast_hub_t;
+typedef struct BroadcastGroup broadcast_group_t;
+
+// Slice of a shared buffer, subscribers that frame messages themselves take the whole buffer
+typedef struct BroadcastMessage {
+    shared_buffer_t *buffer;
+    // Range of the payload without framing
+    size_t offset;
+    size_t length;
+} broadcast_message_t;
+
+// Embedded in the state of a subscribed connection
+typedef struct BroadcastSubscriber {
+    connection_t *connection;
+    // Takes the whole buffer instead of the payload range
+    int framed;
+
+    // Only touched by the loop of the group
+    broadcast_group_t *group;
+    struct BroadcastSubscriber *previous;
+    struct BroadcastSubscriber *next;
+} broadcast_subscriber_t;
+
+// Subscribers of a hub running on the same worker loop
+struct BroadcastGroup {
+    // eventfd readable while the inbox holds messages, must be the first member
+    io_watcher_t watcher;
+    wheel_timer_t heartbeat_timer;
+    event_loop_t *loop;
+    broadcast_hub_t *hub;
+    struct BroadcastGroup *next;
+
+    broadcast_subscriber_t *subscribers;
+    atomic_size_t subscriber_count;
+
+    pthread_mutex_t lock;
+    broadcast_message_t *inbox;
+    size_t inbox_length;
+    size_t inbox_capacity;
+};
+
+struct BroadcastHub {
+    pthread_mutex_t lock;
+    // Groups are only added, they live as long as the hub
+    broadcast_group_t *groups;
+
+    // Sent to every subscriber each interval when the buffer is set
+    broadcast_message_t heartbeat;
+    uint64_t heartbeat_interval_ms;
+};
+
+broadcast_hub_t *create_broadcast_hub(broadcast_message_t *heartbeat, uint64_t heartbeat_interval_ms);
+void free_broadcast_hub(void *hub);
+
+int broadcast_subscribe(broadcast_hub_t *hub, broadcast_subscriber_t *subscriber, connection_t *connection);
+void broadcast_unsubscribe(broadcast_subscriber_t *subscriber);
+int broadcast_publish(broadcast_hub_t *hub, broadcast_message_t *message);
+size_t broadcast_subscriber_count(broadcast_hub_t *hub);
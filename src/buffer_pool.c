@@ -0,0 +1,170 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer_pool.h"
+#include "stats.h"
+
+#define BUFFER_CLASS_COUNT 3
+
+static const size_t BUFFER_CLASS_SIZES[BUFFER_CLASS_COUNT] = {4 * 1024, 16 * 1024, 64 * 1024};
+
+// Buffers kept per class and thread, 1MB of each class at most
+static const size_t BUFFER_CLASS_LIMITS[BUFFER_CLASS_COUNT] = {256, 64, 16};
+
+// Checkouts counted by a thread before they are added to the shared stats
+const uint64_t BUFFER_STATS_BATCH = 64;
+
+// A cached buffer holds the link to the next one
+typedef struct FreeBuffer {
+    struct FreeBuffer *next;
+} free_buffer_t;
+
+typedef struct BufferPool {
+    free_buffer_t *free_lists[BUFFER_CLASS_COUNT];
+    size_t cached[BUFFER_CLASS_COUNT];
+
+    // Not yet added to the shared stats
+    uint64_t hits;
+    uint64_t misses;
+    int64_t cached_change;
+} buffer_pool_t;
+
+static __thread buffer_pool_t pool = {0};
+
+static void publish_counters() {
+    stats_count_buffers(pool.hits, pool.misses, pool.cached_change);
+    pool.hits = 0;
+    pool.misses = 0;
+    pool.cached_change = 0;
+}
+
+// Returns the class of the smallest buffer holding size bytes, or BUFFER_CLASS_COUNT if none does
+static size_t get_buffer_class(size_t size) {
+    size_t class = 0;
+
+    while (class < BUFFER_CLASS_COUNT && BUFFER_CLASS_SIZES[class] < size) {
+        class++;
+    }
+
+    return class;
+}
+
+/**
+ * Checks out a buffer of at least size bytes, its actual size is written in capacity
+ * and must be given back to put_buffer or grow_buffer
+ *
+ * Returns NULL on allocation failure
+ */
+char *get_buffer(size_t size, size_t *capacity) {
+    size_t class = get_buffer_class(size);
+
+    if (class == BUFFER_CLASS_COUNT) {
+        char *buffer = malloc(size);
+        *capacity = buffer == NULL ? 0 : size;
+        return buffer;
+    }
+
+    free_buffer_t *buffer = pool.free_lists[class];
+
+    if (buffer != NULL) {
+        pool.free_lists[class] = buffer->next;
+        pool.cached[class]--;
+        pool.cached_change--;
+        pool.hits++;
+    } else {
+        buffer = malloc(BUFFER_CLASS_SIZES[class]);
+        pool.misses++;
+    }
+
+    if (pool.hits + pool.misses >= BUFFER_STATS_BATCH) {
+        publish_counters();
+    }
+
+    *capacity = buffer == NULL ? 0 : BUFFER_CLASS_SIZES[class];
+    return (char *)buffer;
+}
+
+// Gives a buffer back to the pool of the calling thread, it is freed when it has no class or the list is full
+void put_buffer(char *buffer, size_t capacity) {
+    if (buffer == NULL) {
+        return;
+    }
+
+    size_t class = get_buffer_class(capacity);
+
+    if (class == BUFFER_CLASS_COUNT || BUFFER_CLASS_SIZES[class] != capacity ||
+        pool.cached[class] == BUFFER_CLASS_LIMITS[class]) {
+        free(buffer);
+        return;
+    }
+
+    free_buffer_t *free_buffer = (free_buffer_t *)buffer;
+    free_buffer->next = pool.free_lists[class];
+    pool.free_lists[class] = free_buffer;
+    pool.cached[class]++;
+    pool.cached_change++;
+}
+
+/**
+ * Moves the first length bytes of buffer to a buffer of at least needed bytes, at least
+ * twice as big as the current one so that big inputs are not copied over and over.
+ * The old buffer goes back to the pool, capacity is updated.
+ *
+ * Returns NULL on allocation failure, the buffer is left as it was
+ */
+char *grow_buffer(char *buffer, size_t length, size_t *capacity, size_t needed) {
+    size_t new_capacity;
+    char *new_buffer = get_buffer(needed > *capacity * 2 ? needed : *capacity * 2, &new_capacity);
+
+    if (new_buffer == NULL) {
+        return NULL;
+    }
+
+    if (length > 0) {
+        memcpy(new_buffer, buffer, length);
+    }
+
+    put_buffer(buffer, *capacity);
+    *capacity = new_capacity;
+    return new_buffer;
+}
+
+/**
+ * Creates an empty string whose data is a pooled buffer, the output queue gives it back
+ * to the pool once sent
+ *
+ * Returns NULL on allocation failure
+ */
+string_t *create_pooled_string(size_t initial_capacity) {
+    string_t *string = malloc(sizeof(string_t));
+    if (string == NULL) {
+        return NULL;
+    }
+
+    string->data = get_buffer(initial_capacity, &string->capacity);
+    if (string->data == NULL) {
+        free(string);
+        return NULL;
+    }
+
+    string->data[0] = '\0';
+    string->length = 0;
+    return string;
+}
+
+// Frees the buffers cached by the calling thread, called before it exits
+void release_buffer_pool() {
+    for (size_t class = 0; class < BUFFER_CLASS_COUNT; class++) {
+        while (pool.free_lists[class] != NULL) {
+            free_buffer_t *buffer = pool.free_lists[class];
+            pool.free_lists[class] = buffer->next;
+            free(buffer);
+        }
+
+        pool.cached_change -= pool.cached[class];
+        pool.cached[class] = 0;
+    }
+
+    publish_counters();
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "str.h"
+
+// Per thread free lists of I/O buffers (receive buffers, response heads)
+//
+// Buffers come in a few size classes, a released buffer goes back to the list of its
+// class in the releasing thread, without any locking, and the next checkout of that
+// class reuses it instead of going through the allocator. Every list keeps a bounded
+// number of buffers, the rest are freed. Requests above the largest class are plain
+// allocations. Pooled buffers are ordinary malloc() blocks, code unaware of the pool
+// can still free() or realloc() them.
+
+char *get_buffer(size_t size, size_t *capacity);
+void put_buffer(char *buffer, size_t capacity);
+char *grow_buffer(char *buffer, size_t length, size_t *capacity, size_t needed);
+string_t *create_pooled_string(size_t initial_capacity);
+void release_buffer_pool();
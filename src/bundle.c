@@ -0,0 +1,112 @@
+#include <string.h>
+
+#include "bundle.h"
+#include "http/headers.h"
+#include "http/status.h"
+
+// Index page of the directories, like the directory mounts
+static const char INDEX_FILE[] = "index.html";
+
+static const char NOT_FOUND_BODY[] = "<!DOCTYPE html><html><body><h1>File not found :(</h1></body></html>";
+
+// Same hash as the generator, tools/embed_assets.c
+static uint32_t hash_path(char *path, size_t length, uint32_t seed) {
+    // FNV-1a with the seed in the offset basis, then the murmur3 finalizer
+    uint32_t hash = 2166136261u ^ seed;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/**
+ * Looks a path up in the perfect hash of the bundle, two hashes and one comparison
+ *
+ * Returns NULL if the bundle has no such asset
+ */
+const bundle_asset_t *find_bundle_asset(char *path, size_t length) {
+    if (bundle_asset_count == 0) {
+        return NULL;
+    }
+
+    uint32_t seed = bundle_seeds[hash_path(path, length, 0) % bundle_bucket_count];
+    int32_t index = bundle_slots[hash_path(path, length, seed) % bundle_slot_count];
+
+    if (index == -1) {
+        return NULL;
+    }
+
+    const bundle_asset_t *asset = &bundle_assets[index];
+    if (strncmp(asset->path, path, length) != 0 || asset->path[length] != '\0') {
+        return NULL;
+    }
+
+    return asset;
+}
+
+/**
+ * Request handler serving the embedded assets, the asset is the "path" parameter of
+ * the route. The gzip variant goes to the clients accepting it and a matching
+ * If-None-Match is answered with 304.
+ *
+ * Returns -1 to close the connection, otherwise 0
+ */
+int serve_bundle(connection_t *connection, request_t *request, void *arg) {
+    (void)arg;
+    char *path = get_request_param(request, "path");
+
+    if (path == NULL) {
+        path = "";
+    }
+
+    // Directories are requested with a trailing slash, the prefix itself with an empty path
+    size_t path_length = strlen(path);
+    const bundle_asset_t *asset = NULL;
+
+    if (path_length == 0 || path[path_length - 1] == '/') {
+        char index_path[256];
+        if (path_length + sizeof(INDEX_FILE) <= sizeof(index_path)) {
+            memcpy(index_path, path, path_length);
+            memcpy(index_path + path_length, INDEX_FILE, sizeof(INDEX_FILE));
+            asset = find_bundle_asset(index_path, path_length + sizeof(INDEX_FILE) - 1);
+        }
+    } else {
+        asset = find_bundle_asset(path, path_length);
+    }
+
+    response_t response = {.status = OK};
+
+    if (asset == NULL) {
+        response.status = NOT_FOUND;
+        response.body = (char *)NOT_FOUND_BODY;
+        response.body_length = sizeof(NOT_FOUND_BODY) - 1;
+        return connection_send_string(connection, create_response(request, &response));
+    }
+
+    int gzip = asset->gzip.data != NULL && has_header_token(request->headers, "Accept-Encoding", "gzip");
+    const bundle_variant_t *variant = gzip ? &asset->gzip : &asset->identity;
+
+    response.raw_headers = variant->headers;
+    response.body_length = variant->length;
+
+    // The head still carries the length of the representation, the body is left out
+    if (has_header_token(request->headers, "If-None-Match", (char *)variant->etag) ||
+        has_header_token(request->headers, "If-None-Match", "*")) {
+        response.status = NOT_MODIFIED;
+        return connection_send_string(connection, create_response(request, &response));
+    }
+
+    if (connection_send_string(connection, create_response(request, &response)) == -1) {
+        return -1;
+    }
+
+    return connection_send_static(connection, variant->data, variant->length);
+}
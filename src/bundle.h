@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connection.h"
+#include "http/http.h"
+
+// Assets embedded in the binary at build time, see tools/embed_assets.c
+//
+// The data, header lines and ETags live in .rodata: a request is answered without any
+// file system call and the body is queued without a copy. An empty bundle is built
+// unless CMake is given -DEMBED_PUBLIC=ON.
+
+typedef struct BundleVariant {
+    const char *data;
+    size_t length;
+    // Header lines of the response ("Content-Type: ...\r\nETag: ...\r\n"), without Content-Length
+    const char *headers;
+    const char *etag;
+} bundle_variant_t;
+
+typedef struct BundleAsset {
+    // Path below the bundle prefix, "index.html" or "css/site.css"
+    const char *path;
+    bundle_variant_t identity;
+    // Gzip compressed body, data is NULL when it wouldn't be smaller
+    bundle_variant_t gzip;
+} bundle_asset_t;
+
+// Generated tables, a path hashed with the seed 0 gives its bucket, hashed with the seed
+// of its bucket it gives its slot, the slot holds its index in bundle_assets or -1
+extern const bundle_asset_t bundle_assets[];
+extern const size_t bundle_asset_count;
+extern const uint32_t bundle_seeds[];
+extern const size_t bundle_bucket_count;
+extern const int32_t bundle_slots[];
+extern const size_t bundle_slot_count;
+
+const bundle_asset_t *find_bundle_asset(char *path, size_t length);
+int serve_bundle(connection_t *connection, request_t *request, void *arg);
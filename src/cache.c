@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cache.h"
+#include "clock.h"
+
+// A fill taking longer than this is considered abandoned, the next request starts another one
+const uint64_t CACHE_FILL_TIMEOUT_MS = 30000;
+
+// How long a key whose response couldn't be stored goes straight to the backend
+const uint64_t CACHE_BYPASS_MS = 5000;
+
+// Statuses cacheable by default (RFC 9110 section 15.1), only stored with an explicit lifetime
+static const int CACHEABLE_STATUSES[] = {200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501};
+
+static uint64_t hash_key(char *key) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (char *c = key; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static cache_shard_t *get_shard(response_cache_t *cache, uint64_t hash) {
+    return &cache->shards[hash % CACHE_SHARDS];
+}
+
+static cache_entry_t **get_bucket(cache_shard_t *shard, uint64_t hash) {
+    return &shard->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS_PER_SHARD];
+}
+
+/**
+ * Creates a cache holding up to `capacity` bytes of responses,
+ * responses larger than `max_entry_size` are never stored
+ *
+ * Returns NULL on allocation failure
+ */
+response_cache_t *create_response_cache(size_t capacity, size_t max_entry_size) {
+    response_cache_t *cache = calloc(1, sizeof(response_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_init(&cache->shards[i].lock, NULL);
+    }
+
+    cache->shard_capacity = capacity / CACHE_SHARDS;
+    cache->max_entry_size = max_entry_size;
+
+    return cache;
+}
+
+static void free_entry(cache_entry_t *entry) {
+    free(entry->key);
+    free_header_list(entry->headers);
+    free_header_list(entry->vary);
+    free(entry->body);
+    free(entry);
+}
+
+void release_cache_entry(cache_entry_t *entry) {
+    if (atomic_fetch_sub_explicit(&entry->references, 1, memory_order_acq_rel) == 1) {
+        free_entry(entry);
+    }
+}
+
+void free_response_cache(response_cache_t *cache) {
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+
+        cache_entry_t *entry = shard->newest;
+        while (entry != NULL) {
+            cache_entry_t *older = entry->older;
+            release_cache_entry(entry);
+            entry = older;
+        }
+
+        cache_fill_t *fill = shard->fills;
+        while (fill != NULL) {
+            cache_fill_t *next = fill->next;
+            free(fill->key);
+            free(fill);
+            fill = next;
+        }
+
+        pthread_rwlock_destroy(&shard->lock);
+    }
+
+    free(cache);
+}
+
+/**
+ * Looks for `directive` in a Cache-Control value, its argument (if any) goes to `argument`
+ *
+ * Returns 1 if the directive is present, otherwise 0
+ */
+static int find_cache_directive(char *value, char *directive, uint64_t *argument) {
+    size_t directive_length = strlen(directive);
+    char *c = value;
+
+    while (*c != '\0') {
+        while (*c == ' ' || *c == '\t' || *c == ',') {
+            c++;
+        }
+
+        size_t token_length = strcspn(c, "=, \t");
+
+        if (token_length == directive_length && strncasecmp(c, directive, directive_length) == 0) {
+            if (argument != NULL) {
+                char *number = c + token_length;
+                *argument = *number == '=' ? strtoull(number + (number[1] == '"' ? 2 : 1), NULL, 10) : 0;
+            }
+
+            return 1;
+        }
+
+        c += strcspn(c, ",");
+    }
+
+    return 0;
+}
+
+/**
+ * Whether the response of a request may come from the cache: GET or HEAD without
+ * credentials and without the client asking for a fresh response
+ */
+int is_cacheable_request(request_t *request) {
+    if (strcmp(request->method, "GET") != 0 && strcmp(request->method, "HEAD") != 0) {
+        return 0;
+    }
+
+    if (request->chunked || request->content_length > 0 || find_header(request->headers, "Authorization") != NULL) {
+        return 0;
+    }
+
+    header_t *cache_control = find_header(request->headers, "Cache-Control");
+    if (cache_control != NULL && (find_cache_directive(cache_control->value, "no-cache", NULL) ||
+                                  find_cache_directive(cache_control->value, "no-store", NULL))) {
+        return 0;
+    }
+
+    header_t *pragma = find_header(request->headers, "Pragma");
+    return pragma == NULL || !find_cache_directive(pragma->value, "no-cache", NULL);
+}
+
+/**
+ * Reads how long a response may be cached from its Cache-Control header,
+ * s-maxage wins over max-age as this is a shared cache
+ *
+Returns
+- -1 if the response can't be stored
+- 0 if succeed
+*/
+int get_cache_lifetime(int status, header_list_t *headers, cache_lifetime_t *lifetime) {
+    int cacheable_status = 0;
+    for (size_t i = 0; i < sizeof(CACHEABLE_STATUSES) / sizeof(CACHEABLE_STATUSES[0]); i++) {
+        cacheable_status |= CACHEABLE_STATUSES[i] == status;
+    }
+
+    header_t *cache_control = find_header(headers, "Cache-Control");
+    header_t *vary = find_header(headers, "Vary");
+
+    // Responses setting cookies belong to a single client
+    if (!cacheable_status || cache_control == NULL || find_header(headers, "Set-Cookie") != NULL ||
+        (vary != NULL && strchr(vary->value, '*') != NULL)) {
+        return -1;
+    }
+
+    char *value = cache_control->value;
+    if (find_cache_directive(value, "no-store", NULL) || find_cache_directive(value, "no-cache", NULL) ||
+        find_cache_directive(value, "private", NULL)) {
+        return -1;
+    }
+
+    if (!find_cache_directive(value, "s-maxage", &lifetime->max_age) &&
+        !find_cache_directive(value, "max-age", &lifetime->max_age)) {
+        return -1;
+    }
+
+    if (!find_cache_directive(value, "stale-while-revalidate", &lifetime->stale_while_revalidate)) {
+        lifetime->stale_while_revalidate = 0;
+    }
+
+    header_t *age = find_header(headers, "Age");
+    lifetime->age = age != NULL ? strtoull(age->value, NULL, 10) : 0;
+
+    return lifetime->max_age + lifetime->stale_while_revalidate > lifetime->age ? 0 : -1;
+}
+
+static int matches_vary(cache_entry_t *entry, header_list_t *request_headers) {
+    for (size_t i = 0; i < entry->vary->length; i++) {
+        header_t *varied = entry->vary->data[i];
+        header_t *header = find_header(request_headers, varied->name);
+
+        if (strcmp(header != NULL ? header->value : "", varied->value) != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Finds the response stored for a key and the request headers it varies on,
+ * expired entries are only returned within their stale-while-revalidate window
+ *
+ * Returns the entry, to be given back with release_cache_entry, or NULL if none is usable
+ */
+cache_entry_t *cache_lookup(response_cache_t *cache, char *key, header_list_t *request_headers,
+                            cache_freshness_t *freshness) {
+    uint64_t hash = hash_key(key);
+    cache_shard_t *shard = get_shard(cache, hash);
+    uint64_t now = monotonic_ms();
+    cache_entry_t *found = NULL;
+
+    pthread_rwlock_rdlock(&shard->lock);
+
+    for (cache_entry_t *entry = *get_bucket(shard, hash); entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && now < entry->stale_until_ms && strcmp(entry->key, key) == 0 &&
+            matches_vary(entry, request_headers)) {
+            atomic_fetch_add_explicit(&entry->references, 1, memory_order_relaxed);
+            found = entry;
+            break;
+        }
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (found != NULL) {
+        *freshness = now < found->fresh_until_ms ? CACHE_FRESH : CACHE_STALE;
+    }
+
+    return found;
+}
+
+/**
+ * Claims the fetch of a key, so that concurrent misses wait for a single backend request.
+ * When another request fetches it, `waiter` (unless NULL) is woken once it is done and
+ * has to be cancelled with cache_cancel_wait if the caller stops waiting before.
+ *
+ * Returns whether the caller fetches the response for the cache, waits for another fetch
+ * or fetches it for itself only
+ */
+cache_fill_status_t cache_begin_fill(response_cache_t *cache, char *key, cache_waiter_t *waiter) {
+    uint64_t hash = hash_key(key);
+    cache_shard_t *shard = get_shard(cache, hash);
+    uint64_t now = monotonic_ms();
+    cache_fill_status_t status = CACHE_FILL_STARTED;
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    cache_fill_t **link = &shard->fills;
+    while (*link != NULL) {
+        cache_fill_t *fill = *link;
+
+        // Expired bypass marks of every key are dropped on the way
+        if (fill->bypass_until_ms != 0 && fill->bypass_until_ms <= now) {
+            *link = fill->next;
+            free(fill->key);
+            free(fill);
+            continue;
+        }
+
+        if (fill->hash == hash && strcmp(fill->key, key) == 0) {
+            if (fill->bypass_until_ms != 0) {
+                status = CACHE_FILL_BYPASS;
+            } else if (now - fill->started_ms < CACHE_FILL_TIMEOUT_MS) {
+                status = CACHE_FILL_PENDING;
+
+                if (waiter != NULL) {
+                    waiter->next = fill->waiters;
+                    fill->waiters = waiter;
+                }
+            } else {
+                // The previous fetch was abandoned, it is taken over
+                fill->started_ms = now;
+            }
+
+            pthread_rwlock_unlock(&shard->lock);
+            return status;
+        }
+
+        link = &fill->next;
+    }
+
+    cache_fill_t *fill = calloc(1, sizeof(cache_fill_t));
+    char *key_copy = strdup(key);
+
+    if (fill == NULL || key_copy == NULL) {
+        // Without a record the other requests simply don't wait
+        free(fill);
+        free(key_copy);
+    } else {
+        fill->hash = hash;
+        fill->key = key_copy;
+        fill->started_ms = now;
+        fill->next = shard->fills;
+        shard->fills = fill;
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+    return status;
+}
+
+/**
+ * Ends a fill started with cache_begin_fill, with `bypass` when the response
+ * couldn't be stored so that the next requests don't wait for another fill.
+ * The requests waiting for it are woken.
+ */
+void cache_end_fill(response_cache_t *cache, char *key, int bypass) {
+    uint64_t hash = hash_key(key);
+    cache_shard_t *shard = get_shard(cache, hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    for (cache_fill_t **link = &shard->fills; *link != NULL; link = &(*link)->next) {
+        cache_fill_t *fill = *link;
+
+        if (fill->hash == hash && strcmp(fill->key, key) == 0) {
+            // Under the lock, so that a cancelled waiter is never woken after cache_cancel_wait
+            for (cache_waiter_t *waiter = fill->waiters; waiter != NULL;) {
+                cache_waiter_t *next = waiter->next;
+                waiter->wake(waiter);
+                waiter = next;
+            }
+            fill->waiters = NULL;
+
+            if (bypass) {
+                fill->bypass_until_ms = monotonic_ms() + CACHE_BYPASS_MS;
+            } else {
+                *link = fill->next;
+                free(fill->key);
+                free(fill);
+            }
+            break;
+        }
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+// Stops the wait of a request registered with cache_begin_fill, its waiter isn't woken after this returns
+void cache_cancel_wait(response_cache_t *cache, char *key, cache_waiter_t *waiter) {
+    uint64_t hash = hash_key(key);
+    cache_shard_t *shard = get_shard(cache, hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    for (cache_fill_t *fill = shard->fills; fill != NULL; fill = fill->next) {
+        if (fill->hash != hash || strcmp(fill->key, key) != 0) {
+            continue;
+        }
+
+        for (cache_waiter_t **link = &fill->waiters; *link != NULL; link = &(*link)->next) {
+            if (*link == waiter) {
+                *link = waiter->next;
+                break;
+            }
+        }
+        break;
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+// Unlinks an entry from its bucket and from the insertion order, the lock is held for writing
+static void remove_entry(cache_shard_t *shard, cache_entry_t *entry) {
+    for (cache_entry_t **link = get_bucket(shard, entry->hash); *link != NULL; link = &(*link)->next) {
+        if (*link == entry) {
+            *link = entry->next;
+            break;
+        }
+    }
+
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        shard->newest = entry->older;
+    }
+
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        shard->oldest = entry->newer;
+    }
+
+    shard->size -= entry->size;
+
+    // Readers holding the entry keep it alive until they are done
+    release_cache_entry(entry);
+}
+
+static header_list_t *create_vary_values(header_list_t *headers, header_list_t *request_headers) {
+    header_list_t *vary_values = create_header_list(2);
+    header_t *vary = find_header(headers, "Vary");
+
+    if (vary_values == NULL || vary == NULL) {
+        return vary_values;
+    }
+
+    char *c = vary->value;
+    while (*c != '\0') {
+        c += strspn(c, ", \t");
+        size_t name_length = strcspn(c, ", \t");
+
+        if (name_length == 0) {
+            break;
+        }
+
+        char *name = strndup(c, name_length);
+        header_t *header = name != NULL ? find_header(request_headers, name) : NULL;
+        header_t *varied = name != NULL ? create_header(name, header != NULL ? header->value : "") : NULL;
+        free(name);
+
+        if (varied == NULL || append_header_list(vary_values, varied) == -1) {
+            if (varied != NULL) {
+                free_header(varied);
+            }
+            free_header_list(vary_values);
+            return NULL;
+        }
+
+        c += name_length;
+    }
+
+    return vary_values;
+}
+
+static cache_entry_t *create_entry(char *key, header_list_t *request_headers, int status, header_list_t *headers,
+                                   char *body, size_t body_length, cache_lifetime_t *lifetime) {
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    entry->key = strdup(key);
+    entry->headers = create_header_list(headers->length + 1);
+    entry->vary = create_vary_values(headers, request_headers);
+    entry->body = malloc(body_length + 1);
+
+    if (entry->key == NULL || entry->headers == NULL || entry->vary == NULL || entry->body == NULL) {
+        free_entry(entry);
+        return NULL;
+    }
+
+    entry->size = sizeof(cache_entry_t) + strlen(key) + body_length;
+
+    // The framing and the age are computed again for every response served
+    for (size_t i = 0; i < headers->length; i++) {
+        header_t *header = headers->data[i];
+
+        if (strcasecmp(header->name, "Content-Length") == 0 || strcasecmp(header->name, "Age") == 0) {
+            continue;
+        }
+
+        header_t *copy = create_header(header->name, header->value);
+        if (copy == NULL || append_header_list(entry->headers, copy) == -1) {
+            if (copy != NULL) {
+                free_header(copy);
+            }
+            free_entry(entry);
+            return NULL;
+        }
+
+        entry->size += strlen(header->name) + strlen(header->value) + sizeof(header_t);
+    }
+
+    memcpy(entry->body, body, body_length);
+    entry->body_length = body_length;
+    entry->hash = hash_key(key);
+    entry->status = status;
+    entry->stored_ms = monotonic_ms();
+    entry->initial_age = lifetime->age;
+
+    uint64_t fresh_ms = lifetime->max_age > lifetime->age ? (lifetime->max_age - lifetime->age) * 1000 : 0;
+    entry->fresh_until_ms = entry->stored_ms + fresh_ms;
+    entry->stale_until_ms = entry->fresh_until_ms + lifetime->stale_while_revalidate * 1000;
+
+    // The reference of the cache itself
+    atomic_init(&entry->references, 1);
+
+    return entry;
+}
+
+/**
+ * Stores a complete response, replacing the one of the same key and request variant,
+ * the oldest entries of the shard are evicted to make room
+ *
+Returns
+- -1 if the response is too large or on allocation failure
+- 0 if succeed
+*/
+int cache_store(response_cache_t *cache, char *key, header_list_t *request_headers, int status,
+                header_list_t *headers, char *body, size_t body_length, cache_lifetime_t *lifetime) {
+    if (body_length > cache->max_entry_size) {
+        return -1;
+    }
+
+    // Built outside of the lock, readers are never held by the copies
+    cache_entry_t *entry = create_entry(key, request_headers, status, headers, body, body_length, lifetime);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    cache_shard_t *shard = get_shard(cache, entry->hash);
+
+    if (entry->size > cache->shard_capacity) {
+        free_entry(entry);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    cache_entry_t **bucket = get_bucket(shard, entry->hash);
+    for (cache_entry_t *existing = *bucket; existing != NULL; existing = existing->next) {
+        if (existing->hash == entry->hash && strcmp(existing->key, key) == 0 &&
+            matches_vary(existing, request_headers)) {
+            remove_entry(shard, existing);
+            break;
+        }
+    }
+
+    while (shard->size + entry->size > cache->shard_capacity) {
+        remove_entry(shard, shard->oldest);
+    }
+
+    entry->next = *bucket;
+    *bucket = entry;
+
+    entry->older = shard->newest;
+    if (shard->newest != NULL) {
+        shard->newest->newer = entry;
+    } else {
+        shard->oldest = entry;
+    }
+    shard->newest = entry;
+    shard->size += entry->size;
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    return 0;
+}
+
+/**
+ * Serializes a stored response for a request, with its current Age
+ *
+ * Returns NULL on allocation failure
+ */
+string_t *create_cached_response(request_t *request, cache_entry_t *entry, int closing) {
+    header_list_t *headers = copy_header_list(entry->headers);
+    if (headers == NULL) {
+        return NULL;
+    }
+
+    char age[24];
+    snprintf(age, sizeof(age), "%lu", entry->initial_age + (monotonic_ms() - entry->stored_ms) / 1000);
+    header_t *age_header = create_header("Age", age);
+
+    if (age_header == NULL || append_header_list(headers, age_header) == -1) {
+        if (age_header != NULL) {
+            free_header(age_header);
+        }
+        free_header_list(headers);
+        return NULL;
+    }
+
+    response_t response = {
+        .status = entry->status,
+        .headers = headers,
+        .body_length = entry->body_length,
+        .closing = closing,
+    };
+
+    // HEAD responses carry the length of the body without the body
+    if (strcmp(request->method, "HEAD") != 0) {
+        response.body = entry->body;
+    }
+
+    string_t *res = create_response(request, &response);
+    free_header_list(headers);
+
+    return res;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http/headers.h"
+#include "http/http.h"
+#include "str.h"
+
+// Shared in-memory cache of complete responses, for the proxied ones whose upstream
+// gives them a Cache-Control max-age (a one second micro-cache is enough to absorb
+// bursts on hot endpoints). Responses of the other handlers are not cached.
+//
+// Entries are keyed on the URI of GET requests (HEAD requests are served from them)
+// and on the request values of the headers listed in the response Vary header.
+// The cache is split in shards with their own read-write lock, so lookups of
+// different workers only contend on writes to the same shard. Entries are
+// immutable once stored and reference counted, a lookup holds the lock for the
+// bucket walk only.
+//
+// A miss starts a fill, the requests of the same key arriving meanwhile wait for it
+// instead of going to the backend too: they are linked to the fill and woken by the
+// thread ending it, whatever its loop. A fill whose response can't be stored leaves
+// a short bypass mark, so uncacheable keys are not serialized behind fills.
+// Stale entries within stale-while-revalidate are served while one request refreshes them.
+
+#define CACHE_SHARDS 64
+#define CACHE_BUCKETS_PER_SHARD 256
+
+typedef struct CacheEntry {
+    // Next entry of the bucket
+    struct CacheEntry *next;
+    // Insertion order of the shard, the oldest entries are evicted first
+    struct CacheEntry *newer;
+    struct CacheEntry *older;
+
+    uint64_t hash;
+    char *key;
+    atomic_int references;
+
+    int status;
+    header_list_t *headers;
+    char *body;
+    size_t body_length;
+    // Request values of the headers the response varies on, empty when absent
+    header_list_t *vary;
+
+    uint64_t stored_ms;
+    // Age of the response when it was stored, in seconds
+    uint64_t initial_age;
+    uint64_t fresh_until_ms;
+    uint64_t stale_until_ms;
+    size_t size;
+} cache_entry_t;
+
+// Request waiting for the fill of its key, embedded in the state of the request
+typedef struct CacheWaiter {
+    struct CacheWaiter *next;
+    // Called by the thread ending the fill with the lock of its shard held, it must not block
+    void (*wake)(struct CacheWaiter *waiter);
+} cache_waiter_t;
+
+typedef struct CacheFill {
+    struct CacheFill *next;
+    uint64_t hash;
+    char *key;
+    uint64_t started_ms;
+    // Set once the fill found an uncacheable response, requests go to the backend until then
+    uint64_t bypass_until_ms;
+    cache_waiter_t *waiters;
+} cache_fill_t;
+
+typedef struct CacheShard {
+    pthread_rwlock_t lock;
+    cache_entry_t *buckets[CACHE_BUCKETS_PER_SHARD];
+    cache_entry_t *newest;
+    cache_entry_t *oldest;
+    size_t size;
+    // Keys whose response is being fetched
+    cache_fill_t *fills;
+} cache_shard_t;
+
+typedef struct ResponseCache {
+    cache_shard_t shards[CACHE_SHARDS];
+    size_t shard_capacity;
+    size_t max_entry_size;
+} response_cache_t;
+
+typedef enum CacheFreshness {
+    CACHE_FRESH,
+    // Expired but within stale-while-revalidate
+    CACHE_STALE,
+} cache_freshness_t;
+
+typedef enum CacheFillStatus {
+    // The caller fetches the response, then calls cache_end_fill
+    CACHE_FILL_STARTED,
+    // Another request is fetching it, the waiter given is woken once it is done
+    CACHE_FILL_PENDING,
+    // The key is not cacheable, the caller fetches without filling
+    CACHE_FILL_BYPASS,
+} cache_fill_status_t;
+
+typedef struct CacheLifetime {
+    uint64_t max_age;
+    uint64_t stale_while_revalidate;
+    // Age header of the response
+    uint64_t age;
+} cache_lifetime_t;
+
+extern const uint64_t CACHE_FILL_TIMEOUT_MS;
+
+response_cache_t *create_response_cache(size_t capacity, size_t max_entry_size);
+void free_response_cache(response_cache_t *cache);
+
+int is_cacheable_request(request_t *request);
+int get_cache_lifetime(int status, header_list_t *headers, cache_lifetime_t *lifetime);
+
+cache_entry_t *cache_lookup(response_cache_t *cache, char *key, header_list_t *request_headers,
+                            cache_freshness_t *freshness);
+void release_cache_entry(cache_entry_t *entry);
+
+cache_fill_status_t cache_begin_fill(response_cache_t *cache, char *key, cache_waiter_t *waiter);
+void cache_end_fill(response_cache_t *cache, char *key, int bypass);
+void cache_cancel_wait(response_cache_t *cache, char *key, cache_waiter_t *waiter);
+
+int cache_store(response_cache_t *cache, char *key, header_list_t *request_headers, int status,
+                header_list_t *headers, char *body, size_t body_length, cache_lifetime_t *lifetime);
+
+string_t *create_cached_response(request_t *request, cache_entry_t *entry, int closing);
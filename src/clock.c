@@ -0,0 +1,14 @@
+#include <time.h>
+
+#include "clock.h"
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t monotonic_ms() {
+    return monotonic_ns() / 1000000ull;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+// Monotonic clock helpers, used for deadlines and queue wait measurements
+
+uint64_t monotonic_ns();
+uint64_t monotonic_ms();
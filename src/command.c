@@ -0,0 +1,203 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "coroutine.h"
+#include "http/status.h"
+#include "str.h"
+
+const size_t COMMAND_MAX_OUTPUT = 1024 * 1024;
+
+extern char **environ;
+
+// The environment of the server with `variable` in place of its own QUERY_STRING, NULL without memory
+static char **create_command_environment(char *variable) {
+    size_t count = 0;
+    while (environ[count] != NULL) {
+        count++;
+    }
+
+    char **environment = malloc(sizeof(char *) * (count + 2));
+    if (environment == NULL) {
+        return NULL;
+    }
+
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], "QUERY_STRING=", sizeof("QUERY_STRING=") - 1) != 0) {
+            environment[length++] = environ[i];
+        }
+    }
+    environment[length++] = variable;
+    environment[length] = NULL;
+
+    return environment;
+}
+
+/**
+ * Starts `/bin/sh -c command` with its standard output on a pipe. The worker threads block
+ * the signals of the acceptor and the server ignores SIGPIPE, the command gets the default ones.
+ *
+ * Returns the pid, or -1 if it can't be started
+ */
+static pid_t spawn_command(char *command, request_t *request, int output_fd) {
+    size_t variable_size = sizeof("QUERY_STRING=") + request->query_length;
+    char *variable = malloc(variable_size);
+    if (variable == NULL) {
+        return -1;
+    }
+
+    snprintf(variable, variable_size, "QUERY_STRING=%.*s", (int)request->query_length,
+             request->query == NULL ? "" : request->query);
+
+    char **environment = create_command_environment(variable);
+    if (environment == NULL) {
+        free(variable);
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+
+    posix_spawnattr_t attributes;
+    sigset_t signals;
+    posix_spawnattr_init(&attributes);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attributes, &signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attributes, &signals);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    char *argv[] = {"/bin/sh", "-c", command, NULL};
+    if (posix_spawn(&pid, "/bin/sh", &actions, &attributes, argv, environment) != 0) {
+        pid = -1;
+    }
+
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    free(environment);
+    free(variable);
+
+    return pid;
+}
+
+// Reads the whole output of the command, the coroutine waits while the pipe is empty. NULL if it failed
+static string_t *read_command_output(int fd) {
+    string_t *output = create_string(4096);
+    if (output == NULL) {
+        return NULL;
+    }
+
+    char buffer[4096];
+    while (1) {
+        ssize_t read_result = coroutine_read(fd, buffer, sizeof(buffer));
+
+        if (read_result == 0) {
+            return output;
+        }
+
+        if (read_result == -1 || output->length + read_result > COMMAND_MAX_OUTPUT ||
+            append_rawchars(output, buffer, read_result) == -1) {
+            free_string(output);
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Waits for the command to exit, the coroutine waits on a pidfd meanwhile. It is killed
+ * if the wait fails, when the connection closed.
+ *
+ * Returns its wait status, or -1 if it was killed
+ */
+static int wait_command(pid_t pid) {
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    int status = 0;
+
+    if (pidfd == -1 || coroutine_wait_fd(pidfd, EPOLLIN) == -1) {
+        kill(pid, SIGKILL);
+        status = -1;
+    }
+
+    if (pidfd != -1) {
+        close(pidfd);
+    }
+
+    int exit_status;
+    while (waitpid(pid, &exit_status, 0) == -1 && errno == EINTR) {
+    }
+
+    return status == -1 ? -1 : exit_status;
+}
+
+static int send_output(connection_t *connection, request_t *request, int status, string_t *output) {
+    header_list_t *headers = create_header_list(1);
+    if (headers == NULL || append_header_list(headers, create_header("Content-Type", "text/plain")) == -1) {
+        if (headers != NULL) {
+            free_header_list(headers);
+        }
+        return -1;
+    }
+
+    response_t response = {
+        .status = status,
+        .headers = headers,
+        .body = output != NULL ? output->data : get_status_string(status),
+    };
+    response.body_length = output != NULL ? output->length : strlen(response.body);
+
+    int result = connection_send_string(connection, create_response(request, &response));
+    free_header_list(headers);
+    return result;
+}
+
+/**
+ * Request handler running the command given as arg, added with router_add_coroutine
+ *
+ * Returns -1 to close the connection, otherwise 0
+ */
+int command_request(connection_t *connection, request_t *request, void *arg) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        return send_output(connection, request, INTERNAL_SERVER_ERROR, NULL);
+    }
+
+    pid_t pid = spawn_command(arg, request, pipe_fds[1]);
+    close(pipe_fds[1]);
+
+    if (pid == -1) {
+        close(pipe_fds[0]);
+        return send_output(connection, request, INTERNAL_SERVER_ERROR, NULL);
+    }
+
+    // Only the end of the server, the command writes to a blocking one
+    fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+    string_t *output = read_command_output(pipe_fds[0]);
+    close(pipe_fds[0]);
+
+    int status = wait_command(pid);
+
+    // The connection is gone once a wait failed
+    if (coroutine_current()->cancelled) {
+        free_string(output);
+        return -1;
+    }
+
+    int succeeded = output != NULL && status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    int result = send_output(connection, request, succeeded ? OK : BAD_GATEWAY, succeeded ? output : NULL);
+
+    free_string(output);
+    return result;
+}
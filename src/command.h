@@ -0,0 +1,17 @@
+#pragma once
+
+#include "connection.h"
+#include "http/http.h"
+
+// Paths answered with the output of a shell command, written in a blocking style
+//
+// A GET or HEAD runs the command of the route with /bin/sh, its query string in QUERY_STRING,
+// and answers its standard output once it exited: 200 when it succeeded, 502 otherwise.
+// The handler runs on a coroutine (see coroutine_handler.h): it reads the pipe and waits
+// for the exit through a pidfd like blocking code would, the loop serves the other
+// connections meanwhile. A client closing its connection kills the command.
+
+// Larger outputs are answered with 502
+extern const size_t COMMAND_MAX_OUTPUT;
+
+int command_request(connection_t *connection, request_t *request, void *arg);
@@ -0,0 +1,222 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+server_config_t server_config = {
+    .port = 3000,
+    .file_threads = 4,
+    .drain_timeout = 10,
+    .rate_burst = 100,
+    .max_request_line = 8 * 1024,
+    .max_header_count = 100,
+    .max_header_size = 32 * 1024,
+    .max_body_size = 8 * 1024 * 1024,
+    .body_spill_size = 64 * 1024,
+    .body_spill_dir = "/tmp",
+    .cache_size = 64 * 1024 * 1024,
+    .cache_max_entry_size = 1024 * 1024,
+};
+
+typedef enum ConfigOptionType {
+    CONFIG_INT,
+    CONFIG_SIZE,
+    CONFIG_STRING,
+    CONFIG_LIST,
+} config_option_type_t;
+
+typedef struct ConfigOption {
+    char *name;
+    config_option_type_t type;
+    size_t offset;
+    char *description;
+} config_option_t;
+
+static const config_option_t config_options[] = {
+    {"port", CONFIG_INT, offsetof(server_config_t, port), "port to listen on"},
+    {"listen", CONFIG_LIST, offsetof(server_config_t, listeners),
+     "listen on [HOST:]PORT, [IPV6]:PORT, unix:/path or unix:@name followed by ,OPTION=VALUE, repeatable"},
+    {"workers", CONFIG_INT, offsetof(server_config_t, workers),
+     "worker processes forked by a master process, 0 serves from a single process"},
+    {"file-threads", CONFIG_INT, offsetof(server_config_t, file_threads),
+     "threads running the blocking file system calls of the mounted directories, 0 runs them on the event loops"},
+    {"drain-timeout", CONFIG_INT, offsetof(server_config_t, drain_timeout),
+     "seconds given to open connections once the server stops"},
+    {"handover", CONFIG_STRING, offsetof(server_config_t, handover_path),
+     "Unix socket path handing the listening sockets over to the next server started with it"},
+    {"rate-limit", CONFIG_INT, offsetof(server_config_t, rate_limit),
+     "requests per second of a client address before it gets 429, 0 disables"},
+    {"rate-burst", CONFIG_INT, offsetof(server_config_t, rate_burst), "requests a client address can make at once"},
+    {"max-client-connections", CONFIG_INT, offsetof(server_config_t, max_client_connections),
+     "connections open at once from a client address, 0 disables"},
+    {"max-request-line", CONFIG_SIZE, offsetof(server_config_t, max_request_line),
+     "longest accepted request line, longer ones get 414"},
+    {"max-header-count", CONFIG_INT, offsetof(server_config_t, max_header_count),
+     "most headers accepted in a request, more get 431, 0 disables"},
+    {"max-header-size", CONFIG_SIZE, offsetof(server_config_t, max_header_size),
+     "largest accepted request head, request line included, larger ones get 431"},
+    {"max-body-size", CONFIG_SIZE, offsetof(server_config_t, max_body_size), "largest accepted request body"},
+    {"body-spill-size", CONFIG_SIZE, offsetof(server_config_t, body_spill_size),
+     "collected bodies above this size go to disk, 0 disables"},
+    {"body-spill-dir", CONFIG_STRING, offsetof(server_config_t, body_spill_dir), "directory of spilled bodies"},
+    {"mount", CONFIG_LIST, offsetof(server_config_t, mounts), "serve a directory as PREFIX=DIRECTORY, repeatable"},
+    {"pack", CONFIG_LIST, offsetof(server_config_t, packs),
+     "serve an asset pack made by pack_assets as PREFIX=FILE, repeatable"},
+    {"bundle", CONFIG_STRING, offsetof(server_config_t, bundle_prefix),
+     "serve the assets embedded at build time on PREFIX, built with -DEMBED_PUBLIC=ON"},
+    {"proxy", CONFIG_LIST, offsetof(server_config_t, proxies),
+     "forward a prefix as PREFIX=HOST:PORT[,unix:/path...], repeatable"},
+    {"websocket", CONFIG_LIST, offsetof(server_config_t, websockets),
+     "relay the WebSocket messages of a path to all its clients, repeatable"},
+    {"events", CONFIG_LIST, offsetof(server_config_t, events),
+     "serve event streams as PREFIX/TOPIC, a POST publishes to the topic, repeatable"},
+    {"command", CONFIG_LIST, offsetof(server_config_t, commands),
+     "answer GET requests of a path with the output of a shell command as PATH=COMMAND, repeatable"},
+    {"cache-size", CONFIG_SIZE, offsetof(server_config_t, cache_size),
+     "memory of the proxy response cache, 0 disables"},
+    {"cache-max-entry-size", CONFIG_SIZE, offsetof(server_config_t, cache_max_entry_size),
+     "largest cached response body"},
+    {"tls-cert", CONFIG_STRING, offsetof(server_config_t, tls_certificate),
+     "PEM certificate chain, enables TLS with --tls-key"},
+    {"tls-key", CONFIG_STRING, offsetof(server_config_t, tls_key), "PEM private key of the certificate"},
+};
+
+static const size_t CONFIG_OPTIONS_SIZE = sizeof(config_options) / sizeof(config_options[0]);
+
+/**
+Returns
+- -1 if the value is not a valid size
+- 0 if succeed
+*/
+static int parse_size(char *value, size_t *size) {
+    char *end = NULL;
+    unsigned long long number = strtoull(value, &end, 10);
+
+    if (end == value) {
+        return -1;
+    }
+
+    switch (*end) {
+    case 'g':
+    case 'G':
+        number *= 1024;
+        // fallthrough
+    case 'm':
+    case 'M':
+        number *= 1024;
+        // fallthrough
+    case 'k':
+    case 'K':
+        number *= 1024;
+        end++;
+        break;
+    }
+
+    if (*end != '\0') {
+        return -1;
+    }
+
+    *size = number;
+    return 0;
+}
+
+static int set_config_option(server_config_t *config, const config_option_t *option, char *value) {
+    char *field = (char *)config + option->offset;
+
+    switch (option->type) {
+    case CONFIG_INT: {
+        char *end = NULL;
+        long number = strtol(value, &end, 10);
+        if (end == value || *end != '\0') {
+            return -1;
+        }
+        *(int *)field = number;
+        return 0;
+    }
+
+    case CONFIG_SIZE:
+        return parse_size(value, (size_t *)field);
+
+    case CONFIG_STRING:
+        *(char **)field = value;
+        return 0;
+
+    case CONFIG_LIST: {
+        config_list_t *list = (config_list_t *)field;
+        char **items = realloc(list->items, sizeof(char *) * (list->length + 1));
+        if (items == NULL) {
+            return -1;
+        }
+        items[list->length++] = value;
+        list->items = items;
+        return 0;
+    }
+    }
+
+    return -1;
+}
+
+/**
+ * A bare first argument is the port, to stay compatible with `server <PORT>`
+ *
+Returns
+- -1 if an option is unknown or invalid
+- 0 if succeed
+*/
+int parse_server_config(server_config_t *config, int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        char *argument = argv[i];
+
+        if (i == 1 && argument[0] != '-') {
+            config->port = atoi(argument);
+            continue;
+        }
+
+        if (strncmp(argument, "--", 2) != 0) {
+            printf("Unexpected argument %s\n", argument);
+            return -1;
+        }
+
+        char *name = argument + 2;
+        char *value = strchr(name, '=');
+
+        if (value == NULL) {
+            printf("Missing value for %s\n", argument);
+            return -1;
+        }
+
+        size_t name_length = value - name;
+        value++;
+
+        const config_option_t *option = NULL;
+        for (size_t j = 0; j < CONFIG_OPTIONS_SIZE; j++) {
+            if (strlen(config_options[j].name) == name_length &&
+                strncmp(config_options[j].name, name, name_length) == 0) {
+                option = &config_options[j];
+                break;
+            }
+        }
+
+        if (option == NULL) {
+            printf("Unknown option %s\n", argument);
+            return -1;
+        }
+
+        if (set_config_option(config, option, value) == -1) {
+            printf("Invalid value for %s\n", argument);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void print_server_config_usage(char *program) {
+    printf("Usage: %s [PORT] [--name=value ...]\n", program);
+
+    for (size_t i = 0; i < CONFIG_OPTIONS_SIZE; i++) {
+        printf("  --%-24s %s\n", config_options[i].name, config_options[i].description);
+    }
+}
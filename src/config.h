@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+
+// Server configuration, filled once at startup from the command line
+//
+// Usage: server [PORT] [--name=value ...]
+// Sizes accept a k, m or g suffix (1024 based).
+
+// Values of an option that can be given several times
+typedef struct ConfigList {
+    char **items;
+    size_t length;
+} config_list_t;
+
+typedef struct ServerConfig {
+    int port;
+    // Listeners as "ADDRESS[,OPTION...]", see listener.h. Every IPv4 address of port when empty
+    config_list_t listeners;
+    // Worker processes forked by a master, 0 serves from a single process
+    int workers;
+    // Threads running the blocking file system calls of the mounted directories, 0 runs them on the loops
+    int file_threads;
+    // Seconds given to open connections on SIGTERM and SIGINT before they are closed
+    int drain_timeout;
+    // Unix socket handing the listening socket over to the next server, see handover.h
+    char *handover_path;
+
+    // Requests per second of a client address with bursts of rate_burst, 0 disables, see rate_limit.h
+    int rate_limit;
+    int rate_burst;
+    // Connections open at once from a client address, 0 disables
+    int max_client_connections;
+
+    // Request lines above this length are rejected with 414
+    size_t max_request_line;
+    // Heads with more headers, or larger (request line included), are rejected with 431
+    int max_header_count;
+    size_t max_header_size;
+    // Bodies above this size are rejected with 413
+    size_t max_body_size;
+    // Collected bodies above this size are moved to a temporary file, 0 keeps them in memory
+    size_t body_spill_size;
+    char *body_spill_dir;
+
+    // Static directories as "PREFIX=DIRECTORY", the public directory is served on / when empty
+    config_list_t mounts;
+    // Prefix serving the assets embedded at build time instead of the public directory
+    char *bundle_prefix;
+    // Asset packs as "PREFIX=FILE", see pack.h
+    config_list_t packs;
+    // Reverse proxied prefixes as "PREFIX=UPSTREAM[,UPSTREAM...]"
+    config_list_t proxies;
+    // Paths relaying the messages of their WebSocket clients to all of them
+    config_list_t websockets;
+    // Prefixes serving Server-Sent Events, "<prefix>/<topic>" subscribes to a topic
+    config_list_t events;
+    // Paths answered with the output of a shell command as "PATH=COMMAND"
+    config_list_t commands;
+    // Memory of the response cache of the proxies, 0 disables it
+    size_t cache_size;
+    // Responses with larger bodies are not cached
+    size_t cache_max_entry_size;
+
+    // PEM certificate chain and private key, the listener speaks TLS when both are given
+    char *tls_certificate;
+    char *tls_key;
+} server_config_t;
+
+extern server_config_t server_config;
+
+int parse_server_config(server_config_t *config, int argc, char **argv);
+void print_server_config_usage(char *program);
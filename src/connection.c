@@ -0,0 +1,1349 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "clock.h"
+#include "config.h"
+#include "connection.h"
+#include "event_loop.h"
+#include "http/parser.h"
+#include "http/status.h"
+#include "http2.h"
+#include "rate_limit.h"
+#include "stats.h"
+#include "str.h"
+#include "tls.h"
+#include "websocket.h"
+
+const size_t READ_CHUNK_SIZE = 4096;
+
+// The whole head must arrive within this time, slow clients can't hold a worker
+const uint64_t HEAD_READ_TIMEOUT_MS = 10000;
+// Body, keep-alive and write deadlines are pushed back every time there is progress
+const uint64_t BODY_READ_TIMEOUT_MS = 30000;
+const uint64_t KEEP_ALIVE_TIMEOUT_MS = 5000;
+const uint64_t WRITE_TIMEOUT_MS = 30000;
+// Silent WebSocket peers are pinged after this time, and closed when still silent after as much
+const uint64_t WEBSOCKET_IDLE_TIMEOUT_MS = 30000;
+
+// Buffered output above which we stop reading requests, and below which we resume
+const size_t OUTPUT_HIGH_WATERMARK = 256 * 1024;
+const size_t OUTPUT_LOW_WATERMARK = 64 * 1024;
+
+// Streams are pulled until this much output is buffered
+const size_t STREAM_BUFFER_SIZE = 32 * 1024;
+// Producer calls per loop iteration, so an endless stream can't starve the other connections
+const int STREAM_MAX_CALLS = 16;
+
+static void on_connection_event(event_loop_t *loop, io_watcher_t *watcher, uint32_t events);
+static void on_connection_timeout(wheel_timer_t *timer);
+static void drive_connection(connection_t *connection);
+
+/**
+ * Serves a socket accepted by the acceptor, `client` holds the limits of its address
+ * (NULL when not limited) and is released with the connection
+ */
+void open_connection(event_loop_t *loop, int client_fd, void *handler, void *client) {
+    connection_t *connection = calloc(1, sizeof(connection_t));
+    if (connection == NULL) {
+        if (client != NULL) {
+            rate_limit_release(client, loop->now_ms);
+        }
+        close(client_fd);
+        return;
+    }
+
+    io_watcher_init(&connection->watcher, client_fd, on_connection_event);
+    wheel_timer_init(&connection->timer, on_connection_timeout);
+    output_queue_init(&connection->output);
+    connection->loop = loop;
+    connection->handler = handler;
+    connection->client = client;
+    connection->state = CONNECTION_READING_HEAD;
+    connection->pipe_fds[0] = -1;
+    connection->pipe_fds[1] = -1;
+
+    connection->next = loop->connections;
+    if (loop->connections != NULL) {
+        loop->connections->previous = connection;
+    }
+    loop->connections = connection;
+
+    if (connection->handler->tls != NULL) {
+        connection->tls = create_tls_connection(connection->handler->tls, client_fd);
+        if (connection->tls == NULL) {
+            close_connection(connection);
+            return;
+        }
+    }
+
+    if (event_loop_add(loop, &connection->watcher, EPOLLIN) == -1) {
+        close_connection(connection);
+        return;
+    }
+
+    event_loop_schedule(loop, &connection->timer, HEAD_READ_TIMEOUT_MS);
+}
+
+/**
+ * Opens a connection without socket running a stream of an HTTP/2 session, the request
+ * is given with connection_feed and the output is taken by the session
+ *
+ * Returns NULL on allocation failure
+ */
+connection_t *open_stream_connection(connection_t *parent, struct Http2Stream *stream) {
+    connection_t *connection = calloc(1, sizeof(connection_t));
+    if (connection == NULL) {
+        return NULL;
+    }
+
+    io_watcher_init(&connection->watcher, -1, NULL);
+    wheel_timer_init(&connection->timer, on_connection_timeout);
+    output_queue_init(&connection->output);
+    connection->loop = parent->loop;
+    connection->handler = parent->handler;
+    // Requests of the streams count for the client, the connection only once
+    connection->client = parent->client;
+    connection->state = CONNECTION_READING_HEAD;
+    connection->pipe_fds[0] = -1;
+    connection->pipe_fds[1] = -1;
+    connection->http2_stream = stream;
+
+    event_loop_schedule(connection->loop, &connection->timer, HEAD_READ_TIMEOUT_MS);
+    return connection;
+}
+
+static void record_request(connection_t *connection) {
+    if (connection->request_started_ns != 0) {
+        stats_record_request(monotonic_ns() - connection->request_started_ns);
+        connection->request_started_ns = 0;
+    }
+}
+
+static void end_stream(connection_t *connection) {
+    response_stream_t *stream = connection->stream;
+
+    record_request(connection);
+
+    if (stream->release != NULL) {
+        stream->release(stream->state);
+    }
+
+    // While it is still the current request, end_request frees it
+    if (stream->request != NULL && stream->request != connection->request) {
+        free_request(stream->request);
+    }
+
+    free(stream);
+    connection->stream = NULL;
+}
+
+static void end_body_reader(connection_t *connection) {
+    body_reader_t *reader = connection->body_reader;
+
+    if (reader->release != NULL) {
+        reader->release(reader->state);
+    }
+
+    free(reader);
+    connection->body_reader = NULL;
+}
+
+void close_connection(connection_t *connection) {
+    event_loop_cancel(connection->loop, &connection->timer);
+
+    if (connection->http2 != NULL) {
+        free_http2_session(connection->http2);
+    }
+
+    if (connection->http2_stream != NULL) {
+        http2_stream_closed(connection);
+    }
+
+    if (connection->stream != NULL) {
+        end_stream(connection);
+    }
+
+    if (connection->body_reader != NULL) {
+        end_body_reader(connection);
+    }
+
+    if (connection->websocket != NULL) {
+        free_websocket(connection);
+    }
+
+    if (connection->request != NULL) {
+        free_request(connection->request);
+    }
+
+    if (connection->tls != NULL) {
+        free_tls_connection(connection->tls);
+    }
+
+    // close() also removes the fd from the epoll set
+    if (connection->watcher.fd != -1) {
+        close(connection->watcher.fd);
+    }
+
+    if (connection->pipe_fds[0] != -1) {
+        close(connection->pipe_fds[0]);
+        close(connection->pipe_fds[1]);
+    }
+
+    output_queue_clear(&connection->output);
+    put_buffer(connection->buffer, connection->buffer_capacity);
+
+    if (connection->client != NULL && connection->http2_stream == NULL) {
+        rate_limit_release(connection->client, connection->loop->now_ms);
+    }
+
+    event_loop_t *loop = connection->loop;
+    if (connection->watcher.fd != -1) {
+        if (connection->previous != NULL) {
+            connection->previous->next = connection->next;
+        } else {
+            loop->connections = connection->next;
+        }
+
+        if (connection->next != NULL) {
+            connection->next->previous = connection->previous;
+        }
+    }
+
+    event_loop_forget(loop, &connection->watcher);
+    free(connection);
+
+    if (loop->draining && loop->connections == NULL) {
+        event_loop_stop(loop);
+    }
+}
+
+static void on_connection_timeout(wheel_timer_t *timer) {
+    connection_t *connection = (connection_t *)((char *)timer - offsetof(connection_t, timer));
+
+    // A draining loop ends idle connections right away, once their output is sent
+    if (connection->loop->draining && !connection->write_blocked &&
+        (connection->state == CONNECTION_IDLE || connection->state == CONNECTION_HTTP2)) {
+        connection->state = CONNECTION_CLOSING;
+        drive_connection(connection);
+        return;
+    }
+
+    if (connection->state == CONNECTION_WEBSOCKET && !connection->write_blocked &&
+        websocket_keep_alive(connection) == 0) {
+        event_loop_schedule(connection->loop, &connection->timer, WEBSOCKET_IDLE_TIMEOUT_MS);
+        drive_connection(connection);
+        return;
+    }
+
+    close_connection(connection);
+}
+
+// While a write is blocked its deadline wins over the one of the input side
+static void schedule_state_timer(connection_t *connection) {
+    if (connection->write_blocked) {
+        return;
+    }
+
+    // A stream is either making progress or waiting on its producer, which owns its deadlines,
+    // the body of the request still has to arrive in time
+    if (connection->stream != NULL && connection->state != CONNECTION_READING_BODY) {
+        event_loop_cancel(connection->loop, &connection->timer);
+        return;
+    }
+
+    uint64_t timeout = WRITE_TIMEOUT_MS;
+
+    switch (connection->state) {
+    case CONNECTION_READING_HEAD:
+        timeout = HEAD_READ_TIMEOUT_MS;
+        break;
+    case CONNECTION_READING_BODY:
+        timeout = BODY_READ_TIMEOUT_MS;
+        break;
+    case CONNECTION_IDLE:
+        timeout = connection->loop->draining ? 0 : KEEP_ALIVE_TIMEOUT_MS;
+        break;
+    case CONNECTION_CLOSING:
+        break;
+    case CONNECTION_HTTP2:
+        // Streams have their own deadlines, a session without stream is idle
+        if (!http2_session_idle(connection->http2)) {
+            event_loop_cancel(connection->loop, &connection->timer);
+            return;
+        }
+        timeout = connection->loop->draining ? 0 : KEEP_ALIVE_TIMEOUT_MS;
+        break;
+    case CONNECTION_WEBSOCKET:
+        timeout = WEBSOCKET_IDLE_TIMEOUT_MS;
+        break;
+    }
+
+    event_loop_schedule(connection->loop, &connection->timer, timeout);
+}
+
+/**
+Returns
+- -1 if the connection has been closed
+- 0 if succeed
+*/
+static int update_interest(connection_t *connection) {
+    if (connection->http2_stream != NULL) {
+        http2_stream_update(connection);
+        return 0;
+    }
+
+    uint32_t events = 0;
+
+    int body_paused = connection->body_paused && connection->state == CONNECTION_READING_BODY;
+
+    // Requests pipelined behind a response stop being read once they fill a head, this bounds the input buffer
+    int heads_full = (connection->state == CONNECTION_IDLE || connection->state == CONNECTION_READING_HEAD) &&
+                     connection->buffer_length >= server_config.max_header_size;
+
+    if (connection->state != CONNECTION_CLOSING && !connection->reading_paused && !body_paused && !heads_full) {
+        events |= EPOLLIN;
+    }
+
+    // A stream with more to produce keeps polling for writability so that it is
+    // resumed by the loop, in turn with the other connections
+    if (connection->write_blocked || (connection->stream != NULL && !connection->stream->waiting) ||
+        (connection->http2 != NULL && http2_session_wants_write(connection->http2)) ||
+        (connection->tls != NULL && connection->tls->read_wants_write)) {
+        events |= EPOLLOUT;
+    }
+
+    if (event_loop_modify(connection->loop, &connection->watcher, events) == -1) {
+        close_connection(connection);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+Returns
+- -1 if the connection has been closed
+- 0 if there is nothing more to read for now
+- 1 if new bytes have been read
+*/
+static int read_connection(connection_t *connection) {
+    // A TLS read takes a whole record, what would be left of it is out of sight of epoll
+    size_t chunk_size = connection->tls != NULL ? TLS_MAX_RECORD_SIZE : READ_CHUNK_SIZE;
+
+    if (connection->buffer_length + chunk_size + 1 > connection->buffer_capacity) {
+        char *new_buffer = grow_buffer(connection->buffer, connection->buffer_length, &connection->buffer_capacity,
+                                       connection->buffer_length + chunk_size + 1);
+        if (new_buffer == NULL) {
+            close_connection(connection);
+            return -1;
+        }
+
+        connection->buffer = new_buffer;
+    }
+
+    // One byte is always kept free for the null terminator expected by parse_request
+    char *data = connection->buffer + connection->buffer_length;
+    size_t length = connection->buffer_capacity - connection->buffer_length - 1;
+    ssize_t read_result = connection->tls != NULL ? tls_read(connection->tls, data, length)
+                                                  : read(connection->watcher.fd, data, length);
+
+    if (read_result == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+
+        close_connection(connection);
+        return -1;
+    }
+
+    if (read_result == 0) {
+        // Client closed its side, a partial request can't be completed anymore
+        // but the responses already queued are still delivered
+        if (output_queue_empty(&connection->output) &&
+            (connection->tls == NULL || !tls_output_pending(connection->tls))) {
+            close_connection(connection);
+            return -1;
+        }
+
+        connection->state = CONNECTION_CLOSING;
+        return 0;
+    }
+
+    connection->buffer_length += read_result;
+
+    if (connection->state == CONNECTION_IDLE) {
+        connection->state = CONNECTION_READING_HEAD;
+        schedule_state_timer(connection);
+    } else if (connection->state == CONNECTION_READING_BODY || connection->state == CONNECTION_WEBSOCKET) {
+        schedule_state_timer(connection);
+    }
+
+    return 1;
+}
+
+/**
+Returns
+- -1 if the connection has been closed
+- 0 if succeed, the output may still be pending
+*/
+static int flush_connection(connection_t *connection) {
+    int result;
+
+    if (connection->http2_stream != NULL) {
+        result = http2_stream_flush(connection);
+    } else if (connection->tls != NULL) {
+        result = tls_flush(connection->tls, &connection->output, connection->watcher.fd);
+    } else {
+        result = output_queue_flush(&connection->output, connection->watcher.fd);
+    }
+
+    if (result == -1) {
+        close_connection(connection);
+        return -1;
+    }
+
+    if (result == 0) {
+        // Still blocked, the deadline moves since the loop only calls us when writable
+        connection->write_blocked = 1;
+        event_loop_schedule(connection->loop, &connection->timer, WRITE_TIMEOUT_MS);
+    } else {
+        int was_blocked = connection->write_blocked;
+        connection->write_blocked = 0;
+
+        if (connection->state == CONNECTION_CLOSING && connection->stream == NULL &&
+            connection->http2_stream == NULL) {
+            if (connection->tls != NULL) {
+                // close_notify has to go out before the socket is shut down
+                free_tls_connection(connection->tls);
+                connection->tls = NULL;
+            }
+            shutdown(connection->watcher.fd, SHUT_RDWR);
+            close_connection(connection);
+            return -1;
+        }
+
+        // A stream connection carries a single request, it is done once its response is handed over
+        if (connection->http2_stream != NULL && connection->stream == NULL &&
+            (connection->state == CONNECTION_IDLE || connection->state == CONNECTION_CLOSING)) {
+            http2_stream_end(connection);
+            close_connection(connection);
+            return -1;
+        }
+
+        if (was_blocked) {
+            schedule_state_timer(connection);
+        }
+    }
+
+    if (connection->reading_paused && connection->output.buffered_bytes <= OUTPUT_LOW_WATERMARK) {
+        connection->reading_paused = 0;
+    }
+
+    return 0;
+}
+
+// Queues a copy of a constant piece of output
+static int queue_literal(connection_t *connection, char *literal) {
+    char *data = strdup(literal);
+    if (data == NULL) {
+        return -1;
+    }
+
+    return output_queue_push_buffer(&connection->output, data, strlen(literal));
+}
+
+// Drops the first `length` bytes of the input buffer
+static void consume_input(connection_t *connection, size_t length) {
+    connection->buffer_length -= length;
+    memmove(connection->buffer, connection->buffer + length, connection->buffer_length);
+}
+
+/**
+ * Moves on once the current request is done, to the next one or to closing
+ *
+ * Returns -1 if the connection has been closed, otherwise 0
+ */
+static int end_request(connection_t *connection) {
+    // A deferred response still reading it frees it with its stream
+    if (connection->stream == NULL || connection->stream->request != connection->request) {
+        free_request(connection->request);
+    }
+    connection->request = NULL;
+
+    // A streamed response is counted once it ends
+    if (connection->stream == NULL) {
+        record_request(connection);
+    }
+
+    if (connection->websocket != NULL) {
+        // The handler accepted a WebSocket handshake, the bytes that follow are frames
+        connection->state = CONNECTION_WEBSOCKET;
+    } else {
+        connection->state = connection->keep_alive ? CONNECTION_IDLE : CONNECTION_CLOSING;
+    }
+    schedule_state_timer(connection);
+
+    // Idle connections only keep their bookkeeping around
+    if (connection->buffer_length == 0) {
+        put_buffer(connection->buffer, connection->buffer_capacity);
+        connection->buffer = NULL;
+        connection->buffer_capacity = 0;
+    }
+
+    if (connection->output.buffered_bytes >= OUTPUT_HIGH_WATERMARK) {
+        connection->reading_paused = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Called once the whole body has been received, the reader queues the response
+ *
+ * Returns -1 if the connection has been closed, otherwise 0
+ */
+static int finish_request(connection_t *connection) {
+    if (connection->body_reader != NULL) {
+        body_reader_t *reader = connection->body_reader;
+        int result = reader->on_end(connection, connection->request, reader->state);
+        end_body_reader(connection);
+
+        if (result == -1) {
+            close_connection(connection);
+            return -1;
+        }
+    }
+
+    return end_request(connection);
+}
+
+// Queues a minimal error response for the current request, the connection closes after it
+static int send_error(connection_t *connection, status_code_t status) {
+    char *message = get_status_string(status);
+    response_t response = {
+        .status = status,
+        .body = message,
+        .body_length = strlen(message),
+        .closing = 1,
+    };
+
+    return connection_send_string(connection, create_response(connection->request, &response));
+}
+
+/**
+ * Answers a head that can't be parsed or is over the limits with `status` before
+ * the rest of it arrives, the input is dropped and the connection closes after the answer
+ *
+ * Returns -1 if the connection has been closed, otherwise 0
+ */
+static int reject_head(connection_t *connection, status_code_t status) {
+    char *message = get_status_string(status);
+    char response[256];
+
+    // There is no request to answer, the head of the response is written out directly
+    snprintf(response, sizeof(response), "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s",
+             status, message, strlen(message), message);
+
+    if (queue_literal(connection, response) == -1) {
+        close_connection(connection);
+        return -1;
+    }
+
+    stats_count_response(status);
+    connection->keep_alive = 0;
+    connection->state = CONNECTION_CLOSING;
+    consume_input(connection, connection->buffer_length);
+    schedule_state_timer(connection);
+    return 0;
+}
+
+/**
+ * Stops reading a body that can't be accepted
+ *
+ * A handler waiting for the body gets no response yet so it is answered with `status`,
+ * otherwise its response is delivered. The connection is closed afterwards since the
+ * rest of the body is not read.
+ *
+ * Returns -1 if the connection has been closed, otherwise 0
+ */
+static int reject_body(connection_t *connection, status_code_t status) {
+    connection->keep_alive = 0;
+
+    if (connection->body_reader != NULL) {
+        end_body_reader(connection);
+
+        if (send_error(connection, status) == -1) {
+            close_connection(connection);
+            return -1;
+        }
+    }
+
+    return end_request(connection);
+}
+
+/**
+ * Answers an upgrade to h2c with 101 (Switching Protocols), the request becomes
+ * the first stream of the session
+ *
+ * Returns -1 if the connection has been closed, otherwise 0
+ */
+static int upgrade_to_http2(connection_t *connection, request_t *request) {
+    string_t *response = create_string(128);
+    char *status_code = int_to_str(SWITCHING_PROTOCOLS);
+
+    int failed = response == NULL || status_code == NULL || append_string(response, "HTTP/1.1 ") == -1 ||
+                 append_string(response, status_code) == -1 || append_string(response, " ") == -1 ||
+                 append_string(response, get_status_string(SWITCHING_PROTOCOLS)) == -1 ||
+                 append_string(response, "\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n") == -1;
+
+    free(status_code);
+
+    if (failed) {
+        if (response != NULL) {
+            free_string(response);
+        }
+        free_request(request);
+        close_connection(connection);
+        return -1;
+    }
+
+    if (connection_send_string(connection, response) == -1 || http2_session_start(connection, request) == -1) {
+        free_request(request);
+        close_connection(connection);
+        return -1;
+    }
+
+    free_request(request);
+    schedule_state_timer(connection);
+    return 0;
+}
+
+/**
+ * Parses the head at the start of the buffer and hands the request to the handler,
+ * the bytes that follow are the body or the next (pipelined) request
+ *
+ * Returns -1 if the connection has been closed, otherwise 0
+ */
+static int handle_request_head(connection_t *connection, size_t head_length) {
+    char next_char = connection->buffer[head_length];
+    connection->buffer[head_length] = '\0';
+
+    request_t *request = parse_request(connection->buffer, head_length + 1);
+
+    connection->buffer[head_length] = next_char;
+    consume_input(connection, head_length);
+    memset(&connection->head_scan, 0, sizeof(request_head_scan_t));
+
+    if (request == NULL) {
+        // Malformed, or no memory left to parse it
+        return reject_head(connection, BAD_REQUEST);
+    }
+
+    // h2c is cleartext only, TLS clients negotiate h2 with ALPN
+    if (connection->http2_stream == NULL && connection->tls == NULL && http2_is_upgrade_request(request)) {
+        return upgrade_to_http2(connection, request);
+    }
+
+    connection->request = request;
+    connection->request_started_ns = monotonic_ns();
+    connection->keep_alive = is_keep_alive_request(request);
+    connection->body_remaining = request->chunked ? 0 : request->content_length;
+    connection->body_received = 0;
+    chunked_decoder_init(&connection->chunked);
+
+    int has_body = request->chunked || request->content_length > 0;
+
+    // Announced bodies are refused before the handler runs, chunked ones while they are read
+    if (!request->chunked && (size_t)request->content_length > server_config.max_body_size) {
+        connection->keep_alive = 0;
+
+        if (send_error(connection, PAYLOAD_TOO_LARGE) == -1) {
+            close_connection(connection);
+            return -1;
+        }
+
+        return end_request(connection);
+    }
+
+    // A client over its rate gets its answer without the handler and loses the connection, its body is discarded
+    if (connection->client != NULL && rate_limit_request(connection->client, connection->loop->now_ms) == -1) {
+        connection->keep_alive = 0;
+        stats_count_rate_limited();
+        stats_count_response(TOO_MANY_REQUESTS);
+
+        if (connection_send_static(connection, TOO_MANY_REQUESTS_RESPONSE, TOO_MANY_REQUESTS_RESPONSE_LENGTH) == -1) {
+            close_connection(connection);
+            return -1;
+        }
+    } else if (connection->handler->handle(connection, request, connection->handler->arg) == -1) {
+        close_connection(connection);
+        return -1;
+    }
+
+    if (!has_body) {
+        return finish_request(connection);
+    }
+
+    // The client holds the body back until told to go on, there is nothing to discard
+    if (connection->body_reader == NULL && request->expect_continue) {
+        connection->keep_alive = 0;
+        return end_request(connection);
+    }
+
+    connection->state = CONNECTION_READING_BODY;
+    schedule_state_timer(connection);
+    return 0;
+}
+
+/**
+ * Hands the buffered body bytes of the current request to its reader, they are
+ * consumed right away so a body of any size only costs a read buffer
+ *
+Returns
+- -1 if the connection has been closed
+- 0 if more of the body is expected, or if it has been rejected
+- 1 if the body is complete
+*/
+static int read_request_body(connection_t *connection) {
+    request_t *request = connection->request;
+    size_t consumed = 0;
+    int complete = 0;
+
+    while (consumed < connection->buffer_length && !complete && !connection->body_paused) {
+        char *input = connection->buffer + consumed;
+        size_t available = connection->buffer_length - consumed;
+        char *data;
+        size_t data_length;
+
+        if (request->chunked) {
+            consumed += chunked_decode(&connection->chunked, input, available, &data, &data_length);
+
+            if (connection->chunked.state == CHUNKED_ERROR) {
+                consume_input(connection, consumed);
+                return reject_body(connection, BAD_REQUEST) == -1 ? -1 : 0;
+            }
+
+            complete = connection->chunked.state == CHUNKED_DONE;
+        } else {
+            data = input;
+            data_length = available < connection->body_remaining ? available : connection->body_remaining;
+            consumed += data_length;
+            connection->body_remaining -= data_length;
+            complete = connection->body_remaining == 0;
+        }
+
+        if (data_length == 0) {
+            continue;
+        }
+
+        connection->body_received += data_length;
+        if (connection->body_received > server_config.max_body_size) {
+            consume_input(connection, consumed);
+            return reject_body(connection, PAYLOAD_TOO_LARGE) == -1 ? -1 : 0;
+        }
+
+        // Bodies nobody asked for are discarded
+        body_reader_t *reader = connection->body_reader;
+        if (reader != NULL && reader->on_data(connection, request, data, data_length, reader->state) == -1) {
+            close_connection(connection);
+            return -1;
+        }
+    }
+
+    consume_input(connection, consumed);
+    return complete;
+}
+
+/**
+ * Handles every request fully received, stops when reading is paused
+ *
+ * Returns -1 if the connection has been closed, otherwise 0
+ */
+static int process_input(connection_t *connection) {
+    // Responses must go out in order, the next request waits for the stream to end,
+    // the body of the current request is still read meanwhile
+    while (!connection->reading_paused &&
+           (connection->stream == NULL || connection->state == CONNECTION_READING_BODY)) {
+        switch (connection->state) {
+        case CONNECTION_CLOSING:
+            return 0;
+
+        case CONNECTION_IDLE:
+            if (connection->buffer_length == 0) {
+                return 0;
+            }
+
+            connection->state = CONNECTION_READING_HEAD;
+            schedule_state_timer(connection);
+            break;
+
+        case CONNECTION_HTTP2:
+            return http2_session_input(connection);
+
+        case CONNECTION_WEBSOCKET:
+            return websocket_input(connection);
+
+        case CONNECTION_READING_HEAD: {
+            // Clients with prior knowledge of HTTP/2 start with its preface
+            if (connection->http2_stream == NULL) {
+                int preface = http2_detect_preface(connection->buffer, connection->buffer_length);
+
+                if (preface == 0) {
+                    return 0;
+                }
+
+                if (preface == 1) {
+                    if (http2_session_start(connection, NULL) == -1) {
+                        close_connection(connection);
+                        return -1;
+                    }
+
+                    schedule_state_timer(connection);
+                    break;
+                }
+            }
+
+            request_limits_t limits = {
+                .max_request_line = server_config.max_request_line,
+                .max_header_count = server_config.max_header_count,
+                .max_head_size = server_config.max_header_size,
+            };
+            size_t head_length = 0;
+            status_code_t status = scan_request_head(&connection->head_scan, connection->buffer,
+                                                     connection->buffer_length, &limits, &head_length);
+
+            if (status != OK) {
+                return reject_head(connection, status);
+            }
+
+            if (head_length == 0) {
+                return 0;
+            }
+
+            if (handle_request_head(connection, head_length) == -1) {
+                return -1;
+            }
+            break;
+        }
+
+        case CONNECTION_READING_BODY: {
+            if (connection->body_paused) {
+                return 0;
+            }
+
+            int result = read_request_body(connection);
+            if (result != 1) {
+                return result;
+            }
+
+            if (finish_request(connection) == -1) {
+                return -1;
+            }
+            break;
+        }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Pulls the current stream until enough output is buffered
+ *
+ * Returns -1 if the connection has been closed, otherwise 0
+ */
+static int pump_stream(connection_t *connection) {
+    response_stream_t *stream = connection->stream;
+
+    for (int calls = 0; calls < STREAM_MAX_CALLS; calls++) {
+        size_t pending = connection->output.buffered_bytes + connection->output.spliced_bytes;
+        if (stream->waiting || pending >= STREAM_BUFFER_SIZE) {
+            return 0;
+        }
+
+        stream_status_t status = stream->produce(connection, stream->state);
+
+        if (status == STREAM_ERROR) {
+            close_connection(connection);
+            return -1;
+        }
+
+        if (status == STREAM_WAIT) {
+            stream->waiting = 1;
+            return 0;
+        }
+
+        if (status == STREAM_DONE) {
+            if (stream->chunked && queue_literal(connection, "0\r\n\r\n") == -1) {
+                close_connection(connection);
+                return -1;
+            }
+
+            end_stream(connection);
+            schedule_state_timer(connection);
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+// Runs requests and flushes responses until one of the two sides has to wait
+static void drive_connection(connection_t *connection) {
+    int streams_ran = 0;
+    int progress;
+
+    do {
+        if (process_input(connection) == -1) {
+            return;
+        }
+
+        int had_stream = connection->stream != NULL;
+        if (had_stream && pump_stream(connection) == -1) {
+            return;
+        }
+
+        int was_paused = connection->reading_paused;
+
+        if (flush_connection(connection) == -1) {
+            return;
+        }
+
+        // A finished stream or a drained queue can unblock pipelined requests
+        progress = (was_paused && !connection->reading_paused) || (had_stream && connection->stream == NULL);
+
+        // Once the socket drained, the streams of an HTTP/2 session get a turn and their frames are flushed
+        if (!progress && connection->http2 != NULL && !connection->write_blocked && !streams_ran) {
+            streams_ran = 1;
+            progress = http2_session_run(connection);
+        }
+    } while (progress);
+
+    if (connection->http2 != NULL) {
+        schedule_state_timer(connection);
+    }
+
+    update_interest(connection);
+}
+
+static void on_connection_event(event_loop_t *loop, io_watcher_t *watcher, uint32_t events) {
+    (void)loop;
+    connection_t *connection = (connection_t *)watcher;
+
+    // Pending input is still read on a hang up, the read reports the end of stream
+    if ((events & EPOLLERR) || ((events & EPOLLHUP) && !(events & EPOLLIN))) {
+        close_connection(connection);
+        return;
+    }
+
+    int readable = (events & EPOLLIN) || (connection->tls != NULL && connection->tls->read_wants_write &&
+                                          (events & EPOLLOUT));
+    if (readable && read_connection(connection) == -1) {
+        return;
+    }
+
+    drive_connection(connection);
+}
+
+/**
+ * Appends input to a connection without socket and handles it
+ *
+ * The connection may be closed when the function returns
+ */
+void connection_feed(connection_t *connection, char *data, size_t length) {
+    if (connection->buffer_length + length + 1 > connection->buffer_capacity) {
+        char *new_buffer = grow_buffer(connection->buffer, connection->buffer_length, &connection->buffer_capacity,
+                                       connection->buffer_length + length + 1);
+        if (new_buffer == NULL) {
+            close_connection(connection);
+            return;
+        }
+
+        connection->buffer = new_buffer;
+    }
+
+    memcpy(connection->buffer + connection->buffer_length, data, length);
+    connection->buffer_length += length;
+
+    if (connection->state == CONNECTION_READING_BODY) {
+        schedule_state_timer(connection);
+    }
+
+    drive_connection(connection);
+}
+
+/**
+ * Drives a connection without socket again, once its session can take more of its output
+ *
+ * The connection may be closed when the function returns
+ */
+void connection_wake(connection_t *connection) {
+    drive_connection(connection);
+}
+
+// Asks a connection to end once its current exchange is done
+static void drain_connection(connection_t *connection) {
+    if (connection->state == CONNECTION_WEBSOCKET) {
+        websocket_close(connection, WEBSOCKET_CLOSE_GOING_AWAY);
+        drive_connection(connection);
+        return;
+    }
+
+    if (connection->http2 != NULL) {
+        http2_session_drain(connection->http2);
+    }
+
+    if (connection->stream != NULL && connection->stream->unbounded) {
+        connection_stream_resume(connection);
+        return;
+    }
+
+    // Idle connections get a deadline of 0, see on_connection_timeout
+    schedule_state_timer(connection);
+}
+
+/**
+ * Stops the loop from keeping connections alive: idle ones are closed, the others once
+ * their current request is answered. The loop stops with its last connection.
+ *
+ * The caller bounds the drain, see connection_close_all
+ */
+void connection_drain_loop(event_loop_t *loop) {
+    loop->draining = 1;
+
+    connection_t *connection = loop->connections;
+    while (connection != NULL) {
+        // Draining a connection can close it, never another one
+        connection_t *next = connection->next;
+        drain_connection(connection);
+        connection = next;
+    }
+
+    if (loop->connections == NULL) {
+        event_loop_stop(loop);
+    }
+}
+
+// Closes the connections still open at the drain deadline, the loop stops
+void connection_close_all(event_loop_t *loop) {
+    loop->draining = 1;
+
+    while (loop->connections != NULL) {
+        close_connection(loop->connections);
+    }
+
+    event_loop_stop(loop);
+}
+
+/**
+ * Queues a string to be sent, the connection takes ownership of it
+ *
+Returns
+- -1 if append fails
+- 0 if succeed
+*/
+int connection_send_string(connection_t *connection, string_t *string) {
+    if (string == NULL) {
+        return -1;
+    }
+
+    return output_queue_push_string(&connection->output, string);
+}
+
+// Queues a file region to be sent with sendfile, the connection takes ownership of fd
+int connection_send_file(connection_t *connection, int fd, off_t offset, size_t length) {
+    return output_queue_push_file(&connection->output, fd, offset, length);
+}
+
+// Queues bytes living as long as the program (embedded assets), they are never copied nor released
+int connection_send_static(connection_t *connection, const char *data, size_t length) {
+    return output_queue_push_static(&connection->output, data, length);
+}
+
+// Like connection_send_file for a fd that stays open after the response (asset packs)
+int connection_send_borrowed_file(connection_t *connection, int fd, off_t offset, size_t length) {
+    return output_queue_push_borrowed_file(&connection->output, fd, offset, length);
+}
+
+/**
+ * Asks for the body of the current request, to be called from the request handler
+ * which then leaves the response to the reader
+ *
+Returns
+- -1 if the reader can't be installed, its state is released
+- 0 if succeed
+*/
+int connection_read_body(connection_t *connection, body_reader_t *reader) {
+    body_reader_t *copy = malloc(sizeof(body_reader_t));
+
+    if (copy == NULL) {
+        if (reader->release != NULL) {
+            reader->release(reader->state);
+        }
+        return -1;
+    }
+
+    *copy = *reader;
+    connection->body_reader = copy;
+
+    // The client holds the body back until it is told to go on
+    request_t *request = connection->request;
+    if (request->expect_continue && is_http_1_1_request(request)) {
+        return queue_literal(connection, "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+
+    return 0;
+}
+
+typedef struct BodyCollector {
+    body_complete_t complete;
+    void *arg;
+} body_collector_t;
+
+static int collect_body_data(connection_t *connection, request_t *request, char *data, size_t length, void *state) {
+    (void)connection;
+    (void)state;
+
+    return append_request_body(request->body, data, length, server_config.body_spill_size,
+                               server_config.body_spill_dir);
+}
+
+static int collect_body_end(connection_t *connection, request_t *request, void *state) {
+    body_collector_t *collector = state;
+    return collector->complete(connection, request, collector->arg);
+}
+
+/**
+ * Collects the whole body into request->body before calling `complete`,
+ * bodies above the configured spill size are kept in a temporary file
+ *
+Returns
+- -1 if the body can't be collected
+- 0 if succeed
+*/
+int connection_collect_body(connection_t *connection, body_complete_t complete, void *arg) {
+    request_t *request = connection->request;
+
+    request->body = create_request_body();
+    if (request->body == NULL) {
+        return -1;
+    }
+
+    body_collector_t *collector = malloc(sizeof(body_collector_t));
+    if (collector == NULL) {
+        return -1;
+    }
+
+    collector->complete = complete;
+    collector->arg = arg;
+
+    body_reader_t reader = {
+        .on_data = collect_body_data,
+        .on_end = collect_body_end,
+        .release = free,
+        .state = collector,
+    };
+
+    return connection_read_body(connection, &reader);
+}
+
+/**
+ * Pauses the body of the current request, to be called from the on_data callback
+ * of a body reader that can't keep up
+ */
+void connection_pause_body(connection_t *connection) {
+    connection->body_paused = 1;
+}
+
+/**
+ * Resumes a body paused with connection_pause_body
+ *
+ * Must be called from the loop owning the connection, the connection may be
+ * closed when the function returns
+ */
+void connection_resume_body(connection_t *connection) {
+    if (!connection->body_paused) {
+        return;
+    }
+
+    connection->body_paused = 0;
+    drive_connection(connection);
+}
+
+static int start_stream(connection_t *connection, stream_producer_t produce, void (*release)(void *state),
+                        void *state, int chunked) {
+    response_stream_t *stream = calloc(1, sizeof(response_stream_t));
+
+    if (stream == NULL) {
+        if (release != NULL) {
+            release(state);
+        }
+        return -1;
+    }
+
+    stream->produce = produce;
+    stream->release = release;
+    stream->state = state;
+    stream->chunked = chunked;
+
+    connection->stream = stream;
+    return 0;
+}
+
+/**
+ * Sends the head of a response whose body is produced later by `produce`
+ *
+ * The connection owns `state` from now on, it is given back to `release` once done
+ *
+Returns
+- -1 if the stream can't be started, `state` is released
+- 0 if succeed
+*/
+int connection_stream_response(connection_t *connection, request_t *request, response_t *response,
+                               stream_producer_t produce, void (*release)(void *state), void *state) {
+    if (start_stream(connection, produce, release, state, is_http_1_1_request(request)) == -1) {
+        return -1;
+    }
+
+    if (!connection->stream->chunked) {
+        connection->keep_alive = 0;
+    }
+
+    response->streaming = 1;
+    return connection_send_string(connection, create_response(request, response));
+}
+
+/**
+ * Reserves the response of the current request for a producer that writes it later,
+ * head and body framing included, the following requests wait for it
+ *
+ * The producer starts waiting, it is called once connection_stream_resume is
+ *
+Returns
+- -1 if the response can't be deferred, `state` is released
+- 0 if succeed
+*/
+int connection_defer_response(connection_t *connection, stream_producer_t produce, void (*release)(void *state),
+                              void *state) {
+    if (start_stream(connection, produce, release, state, 0) == -1) {
+        return -1;
+    }
+
+    connection->stream->waiting = 1;
+    return 0;
+}
+
+/**
+ * Queues a copy of data as the next piece of the streamed body
+ *
+Returns
+- -1 if append fails
+- 0 if succeed
+*/
+int connection_stream_write(connection_t *connection, char *data, size_t length) {
+    // An empty chunk would end the body
+    if (length == 0) {
+        return 0;
+    }
+
+    // Chunk size in hex, CRLF, data, CRLF
+    char size_line[20];
+    int size_length = connection->stream->chunked ? snprintf(size_line, sizeof(size_line), "%zx\r\n", length) : 0;
+    size_t framing = connection->stream->chunked ? size_length + 2 : 0;
+
+    char *chunk = malloc(length + framing);
+    if (chunk == NULL) {
+        return -1;
+    }
+
+    memcpy(chunk, size_line, size_length);
+    memcpy(chunk + size_length, data, length);
+
+    if (connection->stream->chunked) {
+        chunk[size_length + length] = '\r';
+        chunk[size_length + length + 1] = '\n';
+    }
+
+    return output_queue_push_buffer(&connection->output, chunk, length + framing);
+}
+
+/**
+ * Moves up to max_length bytes of the socket fd to the streamed body through the pipe
+ * of the connection, the data never gets copied to user space
+ *
+Returns
+- -1 if the splice fails, errno is EAGAIN when fd or the pipe is empty or full
+- 0 at the end of fd
+- otherwise the number of bytes queued
+*/
+ssize_t connection_stream_splice(connection_t *connection, int fd, size_t max_length) {
+    if (connection->pipe_fds[0] == -1) {
+        if (pipe2(connection->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            return -1;
+        }
+
+        int capacity = fcntl(connection->pipe_fds[1], F_GETPIPE_SZ);
+        connection->pipe_capacity = capacity > 0 ? (size_t)capacity : 65536;
+    }
+
+    // Everything queued before is still in the pipe until the socket drained it
+    size_t room = connection->pipe_capacity - connection->output.spliced_bytes;
+    if (room == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (max_length > room) {
+        max_length = room;
+    }
+
+    ssize_t spliced = splice(fd, NULL, connection->pipe_fds[1], NULL, max_length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (spliced > 0 && output_queue_push_pipe(&connection->output, connection->pipe_fds[0], spliced) == -1) {
+        return -1;
+    }
+
+    return spliced;
+}
+
+/**
+ * Wakes up a stream whose producer returned STREAM_WAIT
+ *
+ * Must be called from the loop owning the connection, the connection may be
+ * closed when the function returns
+ */
+void connection_stream_resume(connection_t *connection) {
+    if (connection->stream == NULL || !connection->stream->waiting) {
+        return;
+    }
+
+    connection->stream->waiting = 0;
+    drive_connection(connection);
+}
+
+/**
+ * Keeps the current request until the stream of its response ends, for a producer
+ * started by connection_defer_response that still reads it
+ */
+void connection_keep_request(connection_t *connection) {
+    connection->stream->request = connection->request;
+}
+
+/**
+ * Closes the connection once the current response is sent, for producers finding out
+ * late that their body can't be framed or that it failed
+ */
+void connection_end_keep_alive(connection_t *connection) {
+    connection->keep_alive = 0;
+
+    if (connection->state == CONNECTION_IDLE || connection->state == CONNECTION_READING_HEAD) {
+        connection->state = CONNECTION_CLOSING;
+    }
+}
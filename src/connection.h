@@ -0,0 +1,195 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "event_loop.h"
+#include "http/chunked.h"
+#include "http/http.h"
+#include "http/parser.h"
+#include "output_queue.h"
+#include "str.h"
+#include "timer_wheel.h"
+
+// Non blocking HTTP connection driven by the worker event loop
+//
+// The input side goes through READING_HEAD -> READING_BODY and then either
+// waits in IDLE for the next request when kept alive, or stops reading in CLOSING.
+// Responses are appended to the output queue and flushed when the socket is writable,
+// reading is paused while the client doesn't drain its responses (high watermark)
+// and resumed once the queue went back under the low watermark.
+// Streamed bodies are pulled from their producer only while the queue is almost empty.
+// Request bodies are never buffered whole, they are handed to the body reader of the
+// handler as they arrive, or discarded when the handler didn't ask for them.
+// Every state has its own deadline enforced with a single timer of the loop wheel.
+//
+// TLS connections read and write through their session, the rest is unchanged.
+// A connection upgraded to WebSocket reads frames until it closes.
+// A connection switched to HTTP/2 holds a session, every stream of which runs on a
+// connection of its own without socket (see http2.h).
+
+typedef enum ConnectionState {
+    CONNECTION_READING_HEAD,
+    CONNECTION_READING_BODY,
+    CONNECTION_IDLE,
+    // No more requests are read, the connection is closed once the output is sent
+    CONNECTION_CLOSING,
+    // The input is made of HTTP/2 frames, see http2.h
+    CONNECTION_HTTP2,
+    // The input is made of WebSocket frames, see websocket.h
+    CONNECTION_WEBSOCKET,
+} connection_state_t;
+
+typedef struct Connection connection_t;
+
+/**
+ * Queues the response of the request with the connection_send_* functions
+ *
+ * Returns -1 to close the connection, otherwise 0
+ */
+typedef int (*request_handler_t)(connection_t *connection, request_t *request, void *arg);
+
+typedef enum StreamStatus {
+    STREAM_ERROR = -1,
+    // More data will follow, the producer is called again once the output drained
+    STREAM_MORE = 0,
+    STREAM_DONE = 1,
+    // Nothing to send for now, the producer calls connection_stream_resume when it has
+    STREAM_WAIT = 2,
+} stream_status_t;
+
+/**
+ * Writes the next part of a streamed body with connection_stream_write
+ *
+ * It is only called while the buffered output is below the stream buffer size,
+ * so a stream never holds more than a few chunks in memory.
+ */
+typedef stream_status_t (*stream_producer_t)(connection_t *connection, void *state);
+
+// Streams are pulled until this much output is buffered
+extern const size_t STREAM_BUFFER_SIZE;
+
+typedef struct ResponseStream {
+    stream_producer_t produce;
+    // Called once the stream ends or the connection is closed, can be NULL
+    void (*release)(void *state);
+    void *state;
+    // HTTP/1.1 bodies are framed with chunked encoding, older clients read until close
+    int chunked;
+    int waiting;
+    // The body only ends when the server stops (event streams), a draining loop resumes
+    // it so that the producer can end it
+    int unbounded;
+    // Request kept for the producer until the stream ends, see connection_keep_request
+    request_t *request;
+} response_stream_t;
+
+/**
+ * Receives the body of the current request as it arrives
+ *
+ * on_data is called for every piece of the body, the data is only valid during the call.
+ * on_end is called once the whole body has been received, it queues the response.
+ * Both return -1 to close the connection, otherwise 0
+ */
+typedef struct BodyReader {
+    int (*on_data)(connection_t *connection, request_t *request, char *data, size_t length, void *state);
+    int (*on_end)(connection_t *connection, request_t *request, void *state);
+    // Called once the body ends or the connection is closed, can be NULL
+    void (*release)(void *state);
+    void *state;
+} body_reader_t;
+
+// Called once the body collected by connection_collect_body is complete in request->body
+typedef int (*body_complete_t)(connection_t *connection, request_t *request, void *arg);
+
+typedef struct ConnectionHandler {
+    request_handler_t handle;
+    void *arg;
+    // Connections of the listener are encrypted when set, see tls.h
+    struct TlsContext *tls;
+} connection_handler_t;
+
+struct Connection {
+    // Must be the first member, the loop hands the watcher back to us
+    io_watcher_t watcher;
+    wheel_timer_t timer;
+    event_loop_t *loop;
+    // Connections of the loop, stream connections are not linked
+    struct Connection *previous;
+    struct Connection *next;
+    connection_handler_t *handler;
+    connection_state_t state;
+
+    // Received bytes not consumed yet, released while the connection is idle
+    char *buffer;
+    size_t buffer_length;
+    size_t buffer_capacity;
+    // Progress through the head being received, checked against the limits as it arrives
+    request_head_scan_t head_scan;
+
+    // Request being received, from its head until the end of its body
+    request_t *request;
+    body_reader_t *body_reader;
+    // Content-Length bytes still expected, or the decoder of a chunked body
+    size_t body_remaining;
+    size_t body_received;
+    chunked_decoder_t chunked;
+
+    output_queue_t output;
+    // Body being produced for the current response, requests after it wait
+    response_stream_t *stream;
+    // Set while the socket send buffer is full
+    int write_blocked;
+    // Set between the high and the low watermark of the output queue
+    int reading_paused;
+    // Set by the body reader while it can't take more data
+    int body_paused;
+    int keep_alive;
+    // Start of the current request, 0 once its latency has been counted
+    uint64_t request_started_ns;
+
+    // Pipe of the bodies spliced from another socket, created on first use
+    int pipe_fds[2];
+    size_t pipe_capacity;
+
+    // Set on the connections of a TLS listener
+    struct TlsConnection *tls;
+
+    // Limits of the client address, NULL when it is not limited (see rate_limit.h)
+    struct ClientLimit *client;
+
+    // Set by the handler accepting a WebSocket handshake, the connection switches after the request
+    struct WebSocket *websocket;
+
+    // HTTP/2 session of the socket, or stream run by a connection without socket (watcher fd is -1)
+    struct Http2Session *http2;
+    struct Http2Stream *http2_stream;
+};
+
+void open_connection(event_loop_t *loop, int client_fd, void *handler, void *client);
+connection_t *open_stream_connection(connection_t *parent, struct Http2Stream *stream);
+void close_connection(connection_t *connection);
+void connection_feed(connection_t *connection, char *data, size_t length);
+void connection_wake(connection_t *connection);
+void connection_drain_loop(event_loop_t *loop);
+void connection_close_all(event_loop_t *loop);
+
+int connection_send_string(connection_t *connection, string_t *string);
+int connection_send_file(connection_t *connection, int fd, off_t offset, size_t length);
+int connection_send_static(connection_t *connection, const char *data, size_t length);
+int connection_send_borrowed_file(connection_t *connection, int fd, off_t offset, size_t length);
+
+int connection_read_body(connection_t *connection, body_reader_t *reader);
+int connection_collect_body(connection_t *connection, body_complete_t complete, void *arg);
+void connection_pause_body(connection_t *connection);
+void connection_resume_body(connection_t *connection);
+
+int connection_stream_response(connection_t *connection, request_t *request, response_t *response,
+                               stream_producer_t produce, void (*release)(void *state), void *state);
+int connection_defer_response(connection_t *connection, stream_producer_t produce, void (*release)(void *state),
+                              void *state);
+int connection_stream_write(connection_t *connection, char *data, size_t length);
+ssize_t connection_stream_splice(connection_t *connection, int fd, size_t max_length);
+void connection_stream_resume(connection_t *connection);
+void connection_keep_request(connection_t *connection);
+void connection_end_keep_alive(connection_t *connection);
@@ -0,0 +1,445 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+#include "coroutine.h"
+
+// Usable size of a stack, handlers with large local buffers should allocate them
+const size_t COROUTINE_STACK_SIZE = 64 * 1024;
+
+// Stacks kept by a thread once their coroutine ended
+const size_t COROUTINE_STACK_POOL_SIZE = 128;
+
+// A pooled stack holds the link to the next one, right above its guard page
+typedef struct FreeStack {
+    struct FreeStack *next;
+} free_stack_t;
+
+typedef struct StackPool {
+    free_stack_t *free_stacks;
+    size_t length;
+    size_t page_size;
+} stack_pool_t;
+
+static __thread stack_pool_t stack_pool = {0};
+
+// Coroutine running on the thread, NULL while the loop runs
+static __thread coroutine_t *current = NULL;
+
+static void run_coroutine();
+
+#if defined(__SANITIZE_ADDRESS__)
+static void start_switch(void **fake_stack, const void *bottom, size_t size) {
+    __sanitizer_start_switch_fiber(fake_stack, bottom, size);
+}
+
+static void finish_switch(void *fake_stack, const void **bottom, size_t *size) {
+    __sanitizer_finish_switch_fiber(fake_stack, bottom, size);
+}
+#else
+static void start_switch(void **fake_stack, const void *bottom, size_t size) {
+    (void)fake_stack;
+    (void)bottom;
+    (void)size;
+}
+
+static void finish_switch(void *fake_stack, const void **bottom, size_t *size) {
+    (void)fake_stack;
+    (void)bottom;
+    (void)size;
+}
+#endif
+
+#if defined(__x86_64__)
+// Pushes the callee saved registers (and the SSE and x87 control words) of the caller on
+// its stack, saves its stack pointer in from and pops the registers saved on the stack to
+void coroutine_switch_context(void **from, void *to) __attribute__((visibility("hidden")));
+// First return of a new coroutine, its entry is in r12
+void coroutine_start_context() __attribute__((visibility("hidden")));
+
+__asm__(".pushsection .text\n"
+        ".globl coroutine_switch_context\n"
+        ".type coroutine_switch_context, @function\n"
+        "coroutine_switch_context:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size coroutine_switch_context, .-coroutine_switch_context\n"
+        ".globl coroutine_start_context\n"
+        ".type coroutine_start_context, @function\n"
+        "coroutine_start_context:\n"
+        "    callq *%r12\n"
+        "    ud2\n"
+        ".size coroutine_start_context, .-coroutine_start_context\n"
+        ".popsection\n");
+
+// Frame popped by the first switch to the coroutine, from the control words to the return address
+typedef struct InitialFrame {
+    uint32_t mxcsr;
+    uint32_t x87_control;
+    uint64_t r15;
+    uint64_t r14;
+    uint64_t r13;
+    uint64_t r12;
+    uint64_t rbx;
+    uint64_t rbp;
+    uint64_t return_address;
+} initial_frame_t;
+
+static int init_context(coroutine_t *coroutine, char *stack_top) {
+    // The stack is 16 bytes aligned once the return address is popped, like right before a call
+    initial_frame_t *frame = (initial_frame_t *)(stack_top - 16 - sizeof(initial_frame_t));
+
+    memset(frame, 0, sizeof(initial_frame_t));
+    frame->mxcsr = 0x1F80;
+    frame->x87_control = 0x037F;
+    frame->r12 = (uint64_t)run_coroutine;
+    frame->return_address = (uint64_t)coroutine_start_context;
+
+    coroutine->context = frame;
+    return 0;
+}
+
+static void free_context(coroutine_t *coroutine) {
+    (void)coroutine;
+}
+
+static void switch_in(coroutine_t *coroutine) {
+    coroutine_switch_context(&coroutine->caller_context, coroutine->context);
+}
+
+static void switch_out(coroutine_t *coroutine) {
+    coroutine_switch_context(&coroutine->context, coroutine->caller_context);
+}
+#else
+static int init_context(coroutine_t *coroutine, char *stack_top) {
+    // Both contexts of the coroutine in a single allocation
+    ucontext_t *contexts = malloc(2 * sizeof(ucontext_t));
+    if (contexts == NULL || getcontext(&contexts[0]) == -1) {
+        free(contexts);
+        return -1;
+    }
+
+    contexts[0].uc_stack.ss_sp = stack_top - COROUTINE_STACK_SIZE;
+    contexts[0].uc_stack.ss_size = COROUTINE_STACK_SIZE;
+    contexts[0].uc_link = NULL;
+    makecontext(&contexts[0], run_coroutine, 0);
+
+    coroutine->context = &contexts[0];
+    coroutine->caller_context = &contexts[1];
+    return 0;
+}
+
+static void free_context(coroutine_t *coroutine) {
+    free(coroutine->context);
+}
+
+static void switch_in(coroutine_t *coroutine) {
+    swapcontext(coroutine->caller_context, coroutine->context);
+}
+
+static void switch_out(coroutine_t *coroutine) {
+    swapcontext(coroutine->context, coroutine->caller_context);
+}
+#endif
+
+// Takes a stack from the pool of the thread, or maps a new one. Returns NULL if it can't be mapped
+static char *get_stack() {
+    if (stack_pool.page_size == 0) {
+        stack_pool.page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    if (stack_pool.free_stacks != NULL) {
+        free_stack_t *stack = stack_pool.free_stacks;
+        stack_pool.free_stacks = stack->next;
+        stack_pool.length--;
+        return (char *)stack - stack_pool.page_size;
+    }
+
+    char *stack = mmap(NULL, stack_pool.page_size + COROUTINE_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Guard page, an overflow faults instead of writing over another stack
+    if (mprotect(stack, stack_pool.page_size, PROT_NONE) == -1) {
+        munmap(stack, stack_pool.page_size + COROUTINE_STACK_SIZE);
+        return NULL;
+    }
+
+    return stack;
+}
+
+static void put_stack(char *stack) {
+    if (stack_pool.length == COROUTINE_STACK_POOL_SIZE) {
+        munmap(stack, stack_pool.page_size + COROUTINE_STACK_SIZE);
+        return;
+    }
+
+#if defined(__SANITIZE_ADDRESS__)
+    // Frames of the ended coroutine left their redzones poisoned
+    ASAN_UNPOISON_MEMORY_REGION(stack + stack_pool.page_size, COROUTINE_STACK_SIZE);
+#endif
+
+    free_stack_t *free_stack = (free_stack_t *)(stack + stack_pool.page_size);
+    free_stack->next = stack_pool.free_stacks;
+    stack_pool.free_stacks = free_stack;
+    stack_pool.length++;
+}
+
+/**
+ * Creates a coroutine running entry(arg) on the first coroutine_resume, wake(arg) is
+ * called by loop once what it waits for is ready
+ *
+ * Returns NULL on allocation failure
+ */
+coroutine_t *create_coroutine(event_loop_t *loop, coroutine_entry_t entry, void (*wake)(void *arg), void *arg) {
+    coroutine_t *coroutine = calloc(1, sizeof(coroutine_t));
+    if (coroutine == NULL) {
+        return NULL;
+    }
+
+    coroutine->stack = get_stack();
+    if (coroutine->stack == NULL) {
+        free(coroutine);
+        return NULL;
+    }
+
+    if (init_context(coroutine, coroutine->stack + stack_pool.page_size + COROUTINE_STACK_SIZE) == -1) {
+        put_stack(coroutine->stack);
+        free(coroutine);
+        return NULL;
+    }
+
+    io_watcher_init(&coroutine->watcher, -1, NULL);
+    wheel_timer_init(&coroutine->timer, NULL);
+    coroutine->loop = loop;
+    coroutine->entry = entry;
+    coroutine->wake = wake;
+    coroutine->arg = arg;
+    return coroutine;
+}
+
+// Frees a coroutine, a suspended one is cancelled first so that it can release what it holds
+void free_coroutine(coroutine_t *coroutine) {
+    if (!coroutine->finished) {
+        coroutine_cancel(coroutine);
+    }
+
+    free_context(coroutine);
+    put_stack(coroutine->stack);
+    free(coroutine);
+}
+
+static void run_coroutine() {
+    coroutine_t *coroutine = current;
+
+    finish_switch(NULL, &coroutine->caller_stack_bottom, &coroutine->caller_stack_size);
+    coroutine->entry(coroutine->arg);
+    coroutine->finished = 1;
+
+    // The stack is about to be dropped, its fake frames too
+    start_switch(NULL, coroutine->caller_stack_bottom, coroutine->caller_stack_size);
+    switch_out(coroutine);
+}
+
+/**
+ * Runs the coroutine until it waits or ends
+ *
+ * Returns 1 once it ended, otherwise 0
+ */
+int coroutine_resume(coroutine_t *coroutine) {
+    void *fake_stack = NULL;
+
+    if (coroutine->finished) {
+        return 1;
+    }
+
+    coroutine->caller = current;
+    current = coroutine;
+
+    start_switch(&fake_stack, coroutine->stack + stack_pool.page_size, COROUTINE_STACK_SIZE);
+    switch_in(coroutine);
+    finish_switch(fake_stack, NULL, NULL);
+
+    current = coroutine->caller;
+    return coroutine->finished;
+}
+
+// Switches back to whoever resumed the running coroutine
+void coroutine_yield() {
+    coroutine_t *coroutine = current;
+
+    if (coroutine == NULL) {
+        return;
+    }
+
+    start_switch(&coroutine->sanitizer_stack, coroutine->caller_stack_bottom, coroutine->caller_stack_size);
+    switch_out(coroutine);
+    finish_switch(coroutine->sanitizer_stack, &coroutine->caller_stack_bottom, &coroutine->caller_stack_size);
+}
+
+/**
+ * Makes every wait of the coroutine fail from now on and runs it to its end, the code
+ * of the coroutine has to return once a wait failed
+ */
+void coroutine_cancel(coroutine_t *coroutine) {
+    coroutine->cancelled = 1;
+
+    while (!coroutine_resume(coroutine)) {
+    }
+}
+
+coroutine_t *coroutine_current() {
+    return current;
+}
+
+static void on_coroutine_fd(event_loop_t *loop, io_watcher_t *watcher, uint32_t events) {
+    (void)loop;
+    (void)events;
+    coroutine_t *coroutine = (coroutine_t *)watcher;
+
+    coroutine->wake(coroutine->arg);
+}
+
+static void on_coroutine_timer(wheel_timer_t *timer) {
+    coroutine_t *coroutine = (coroutine_t *)((char *)timer - offsetof(coroutine_t, timer));
+
+    coroutine->wake(coroutine->arg);
+}
+
+/**
+ * Suspends the running coroutine until fd is ready for events (EPOLLIN, EPOLLOUT)
+ *
+Returns
+- -1 if not called from a coroutine, if the fd can't be watched or if the coroutine is cancelled
+- 0 once the fd is ready
+*/
+int coroutine_wait_fd(int fd, uint32_t events) {
+    coroutine_t *coroutine = current;
+
+    if (coroutine == NULL || coroutine->cancelled) {
+        return -1;
+    }
+
+    io_watcher_init(&coroutine->watcher, fd, on_coroutine_fd);
+    if (event_loop_add(coroutine->loop, &coroutine->watcher, events) == -1) {
+        return -1;
+    }
+
+    coroutine_yield();
+
+    // An event may still be pending in the current batch of the loop
+    event_loop_remove(coroutine->loop, &coroutine->watcher);
+    event_loop_forget(coroutine->loop, &coroutine->watcher);
+
+    return coroutine->cancelled ? -1 : 0;
+}
+
+/**
+ * Reads from a non blocking fd like read, the running coroutine waits while nothing can be read
+ *
+ * Returns the result of read, or -1 if the wait failed
+ */
+ssize_t coroutine_read(int fd, void *buffer, size_t length) {
+    while (1) {
+        ssize_t result = read(fd, buffer, length);
+
+        if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return result;
+        }
+
+        if (errno != EINTR && coroutine_wait_fd(fd, EPOLLIN) == -1) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Writes the whole data to a non blocking fd, the running coroutine waits while it is full
+ *
+ * Returns length, or -1 if a write or a wait failed
+ */
+ssize_t coroutine_write(int fd, const void *data, size_t length) {
+    size_t written = 0;
+
+    while (written < length) {
+        ssize_t result = write(fd, (const char *)data + written, length - written);
+
+        if (result >= 0) {
+            written += result;
+        } else if (errno != EINTR && ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+                                      coroutine_wait_fd(fd, EPOLLOUT) == -1)) {
+            return -1;
+        }
+    }
+
+    return written;
+}
+
+/**
+ * Suspends the running coroutine for timeout_ms, with the precision of the loop timers
+ *
+Returns
+- -1 if not called from a coroutine or if the coroutine is cancelled
+- 0 once the time elapsed
+*/
+int coroutine_sleep(uint64_t timeout_ms) {
+    coroutine_t *coroutine = current;
+
+    if (coroutine == NULL || coroutine->cancelled) {
+        return -1;
+    }
+
+    wheel_timer_init(&coroutine->timer, on_coroutine_timer);
+    event_loop_schedule(coroutine->loop, &coroutine->timer, timeout_ms);
+
+    // The owner may resume the coroutine before the time elapsed
+    while (wheel_timer_pending(&coroutine->timer) && !coroutine->cancelled) {
+        coroutine_yield();
+    }
+
+    event_loop_cancel(coroutine->loop, &coroutine->timer);
+    return coroutine->cancelled ? -1 : 0;
+}
+
+// Unmaps the stacks pooled by the calling thread, called before it exits
+void release_coroutine_stacks() {
+    while (stack_pool.free_stacks != NULL) {
+        free_stack_t *stack = stack_pool.free_stacks;
+        stack_pool.free_stacks = stack->next;
+        munmap((char *)stack - stack_pool.page_size, stack_pool.page_size + COROUTINE_STACK_SIZE);
+    }
+
+    stack_pool.length = 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "event_loop.h"
+#include "timer_wheel.h"
+
+// Stackful coroutines of an event loop, for code written in a blocking style
+//
+// A coroutine runs on a small stack of its own until it waits: coroutine_read and
+// coroutine_write on a non blocking fd that isn't ready, or coroutine_sleep, switch
+// back to whoever resumed it. The loop watches the fd (or the timer) meanwhile and
+// calls the wake callback of the coroutine once it is ready, its owner resumes it.
+// A waiting coroutine costs its stack and nothing else, a thread holds thousands.
+//
+// The context switch only saves the callee saved registers on x86-64, other
+// architectures go through ucontext. Stacks come from a pool of the thread, a
+// guard page below each of them turns an overflow into a crash.
+
+typedef void (*coroutine_entry_t)(void *arg);
+
+typedef struct Coroutine {
+    // Must be the first member, the loop hands the watcher back to us
+    io_watcher_t watcher;
+    wheel_timer_t timer;
+    event_loop_t *loop;
+
+    coroutine_entry_t entry;
+    // Called by the loop once what the coroutine waits for is ready, it has to resume it
+    void (*wake)(void *arg);
+    void *arg;
+
+    // Saved contexts of the coroutine while it is suspended, and of its caller while it runs
+    void *context;
+    void *caller_context;
+    // Coroutine running when this one was resumed, NULL for the loop itself
+    struct Coroutine *caller;
+    // Mapping of the stack, guard page included
+    char *stack;
+    int finished;
+    // Set by coroutine_cancel, every wait fails from then on
+    int cancelled;
+
+    // Kept for AddressSanitizer, which has to be told about the stack switches
+    void *sanitizer_stack;
+    const void *caller_stack_bottom;
+    size_t caller_stack_size;
+} coroutine_t;
+
+coroutine_t *create_coroutine(event_loop_t *loop, coroutine_entry_t entry, void (*wake)(void *arg), void *arg);
+void free_coroutine(coroutine_t *coroutine);
+int coroutine_resume(coroutine_t *coroutine);
+void coroutine_yield();
+void coroutine_cancel(coroutine_t *coroutine);
+coroutine_t *coroutine_current();
+
+int coroutine_wait_fd(int fd, uint32_t events);
+ssize_t coroutine_read(int fd, void *buffer, size_t length);
+ssize_t coroutine_write(int fd, const void *data, size_t length);
+int coroutine_sleep(uint64_t timeout_ms);
+
+void release_coroutine_stacks();
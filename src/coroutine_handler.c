@@ -0,0 +1,130 @@
+#include <stdlib.h>
+
+#include "coroutine.h"
+#include "coroutine_handler.h"
+
+typedef struct HandlerCoroutine {
+    coroutine_t *coroutine;
+    connection_t *connection;
+    request_t *request;
+    coroutine_route_t *route;
+    int result;
+    // Set while the handler waits for the output to drain, it waits for the loop otherwise
+    int waiting_output;
+} handler_coroutine_t;
+
+static void run_handler(void *arg) {
+    handler_coroutine_t *handler = arg;
+
+    handler->result = handler->route->handle(handler->connection, handler->request, handler->route->arg);
+}
+
+static void wake_handler(void *arg) {
+    handler_coroutine_t *handler = arg;
+
+    connection_stream_resume(handler->connection);
+}
+
+static void release_handler(void *state) {
+    handler_coroutine_t *handler = state;
+
+    free_coroutine(handler->coroutine);
+    free(handler);
+}
+
+// Resumes the handler each time what it waits for is ready, its response ends with it
+static stream_status_t produce_handler_response(connection_t *connection, void *state) {
+    (void)connection;
+    handler_coroutine_t *handler = state;
+
+    handler->waiting_output = 0;
+
+    if (!coroutine_resume(handler->coroutine)) {
+        return handler->waiting_output ? STREAM_MORE : STREAM_WAIT;
+    }
+
+    return handler->result == -1 ? STREAM_ERROR : STREAM_DONE;
+}
+
+// Starts the handler on a coroutine, its response is deferred if it waits before returning
+static int start_handler(connection_t *connection, request_t *request, void *arg) {
+    handler_coroutine_t *handler = calloc(1, sizeof(handler_coroutine_t));
+    if (handler == NULL) {
+        return -1;
+    }
+
+    handler->connection = connection;
+    handler->request = request;
+    handler->route = arg;
+    handler->coroutine = create_coroutine(connection->loop, run_handler, wake_handler, handler);
+
+    if (handler->coroutine == NULL) {
+        free(handler);
+        return -1;
+    }
+
+    if (coroutine_resume(handler->coroutine)) {
+        int result = handler->result;
+        release_handler(handler);
+        return result;
+    }
+
+    // Handlers queue whole responses, a stream of their own would be replaced
+    if (connection->stream != NULL) {
+        release_handler(handler);
+        return -1;
+    }
+
+    if (connection_defer_response(connection, produce_handler_response, release_handler, handler) == -1) {
+        return -1;
+    }
+
+    connection_keep_request(connection);
+
+    // The stream is pulled once the output drained
+    if (handler->waiting_output) {
+        connection->stream->waiting = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Request handler running the coroutine_route_t given as arg on a coroutine, after
+ * collecting the body of the request if it has one
+ *
+ * Returns -1 to close the connection, otherwise 0
+ */
+int run_coroutine_handler(connection_t *connection, request_t *request, void *arg) {
+    if (request->chunked || request->content_length > 0) {
+        return connection_collect_body(connection, start_handler, arg);
+    }
+
+    return start_handler(connection, request, arg);
+}
+
+/**
+ * Suspends the handler running on the current coroutine until the output of its
+ * connection is small enough for more, so that large responses are sent piece by piece
+ *
+Returns
+- -1 if not called from a coroutine handler or if the connection closed
+- 0 once more output can be queued
+*/
+int coroutine_wait_output(connection_t *connection) {
+    coroutine_t *coroutine = coroutine_current();
+
+    if (coroutine == NULL || coroutine->cancelled) {
+        return -1;
+    }
+
+    if (connection->output.buffered_bytes + connection->output.spliced_bytes < STREAM_BUFFER_SIZE) {
+        return 0;
+    }
+
+    handler_coroutine_t *handler = coroutine->arg;
+    handler->waiting_output = 1;
+    coroutine_yield();
+
+    return coroutine->cancelled ? -1 : 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "connection.h"
+#include "http/http.h"
+
+// Request handlers written in a blocking style, run on a coroutine of the loop (see coroutine.h)
+//
+// The handler queues its response with the connection_send_* functions like any other
+// and may wait anywhere in between: on its own non blocking fds with coroutine_read and
+// coroutine_write, with coroutine_sleep, or for the client to take the output with
+// coroutine_wait_output. A handler that never waits costs a stack switch, one that does
+// has its response deferred and the request stays valid until it returns. Requests with a
+// body start the handler once the whole body is in request->body.
+//
+// When the connection closes while the handler waits, the wait fails: the handler has to
+// return without touching the connection again.
+
+typedef struct CoroutineRoute {
+    request_handler_t handle;
+    void *arg;
+} coroutine_route_t;
+
+int run_coroutine_handler(connection_t *connection, request_t *request, void *arg);
+int coroutine_wait_output(connection_t *connection);
@@ -0,0 +1,134 @@
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "event_loop.h"
+
+#define MAX_EVENTS 128
+
+const uint64_t TIMER_TICK_MS = 10;
+
+/**
+Returns
+- -1 if the epoll instance can't be created
+- 0 if succeed
+*/
+int event_loop_init(event_loop_t *loop) {
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        return -1;
+    }
+
+    loop->running = 0;
+    loop->connections = NULL;
+    loop->draining = 0;
+    loop->batch = NULL;
+    loop->batch_length = 0;
+    loop->now_ms = monotonic_ms();
+    timer_wheel_init(&loop->timers, TIMER_TICK_MS, loop->now_ms);
+
+    return 0;
+}
+
+void event_loop_destroy(event_loop_t *loop) {
+    close(loop->epoll_fd);
+}
+
+void io_watcher_init(io_watcher_t *watcher, int fd, io_callback_t callback) {
+    watcher->fd = fd;
+    watcher->events = 0;
+    watcher->callback = callback;
+}
+
+int event_loop_add(event_loop_t *loop, io_watcher_t *watcher, uint32_t events) {
+    struct epoll_event event = {.events = events, .data.ptr = watcher};
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, watcher->fd, &event) == -1) {
+        return -1;
+    }
+
+    watcher->events = events;
+    return 0;
+}
+
+int event_loop_modify(event_loop_t *loop, io_watcher_t *watcher, uint32_t events) {
+    if (watcher->events == events) {
+        return 0;
+    }
+
+    struct epoll_event event = {.events = events, .data.ptr = watcher};
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, watcher->fd, &event) == -1) {
+        return -1;
+    }
+
+    watcher->events = events;
+    return 0;
+}
+
+// Not needed before close(), closing the fd already removes it from epoll
+int event_loop_remove(event_loop_t *loop, io_watcher_t *watcher) {
+    watcher->events = 0;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watcher->fd, NULL);
+}
+
+/**
+ * Drops the events of the current iteration still pending for a watcher, called before
+ * the watcher is freed: a callback may free the watcher of an event coming later in the batch
+ */
+void event_loop_forget(event_loop_t *loop, io_watcher_t *watcher) {
+    for (int i = 0; i < loop->batch_length; i++) {
+        if (loop->batch[i].data.ptr == watcher) {
+            loop->batch[i].data.ptr = NULL;
+        }
+    }
+}
+
+void event_loop_schedule(event_loop_t *loop, wheel_timer_t *timer, uint64_t timeout_ms) {
+    timer_wheel_schedule(&loop->timers, timer, loop->now_ms + timeout_ms);
+}
+
+void event_loop_cancel(event_loop_t *loop, wheel_timer_t *timer) {
+    timer_wheel_cancel(&loop->timers, timer);
+}
+
+void event_loop_run(event_loop_t *loop) {
+    struct epoll_event events[MAX_EVENTS];
+
+    loop->running = 1;
+
+    while (loop->running) {
+        int timeout = timer_wheel_next_timeout(&loop->timers, loop->now_ms);
+        int ready = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+
+        if (ready == -1 && errno != EINTR) {
+            printf("Failed to wait for events\n");
+            return;
+        }
+
+        loop->now_ms = monotonic_ms();
+
+        for (int i = 0; i < ready; i++) {
+            io_watcher_t *watcher = events[i].data.ptr;
+
+            loop->batch = &events[i + 1];
+            loop->batch_length = ready - i - 1;
+
+            if (watcher != NULL) {
+                watcher->callback(loop, watcher, events[i].events);
+            }
+        }
+
+        loop->batch_length = 0;
+
+        // Expired timers are handled in a single batch once per iteration
+        timer_wheel_advance(&loop->timers, loop->now_ms);
+    }
+}
+
+// Makes event_loop_run return once the current iteration is done
+void event_loop_stop(event_loop_t *loop) {
+    loop->running = 0;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "timer_wheel.h"
+
+// Single threaded epoll event loop, every worker thread runs its own
+
+typedef struct EventLoop event_loop_t;
+typedef struct IoWatcher io_watcher_t;
+
+typedef void (*io_callback_t)(event_loop_t *loop, io_watcher_t *watcher, uint32_t events);
+
+// Watchers are embedded in the structure owning the fd, the epoll data points to them
+struct IoWatcher {
+    int fd;
+    uint32_t events;
+    io_callback_t callback;
+};
+
+struct EventLoop {
+    int epoll_fd;
+    int running;
+    timer_wheel_t timers;
+    // Refreshed once per iteration so callbacks don't need to read the clock
+    uint64_t now_ms;
+
+    // Socket connections of the loop, a draining loop stops with the last one
+    struct Connection *connections;
+    int draining;
+
+    // Events of the current iteration not dispatched yet, see event_loop_forget
+    struct epoll_event *batch;
+    int batch_length;
+};
+
+int event_loop_init(event_loop_t *loop);
+void event_loop_destroy(event_loop_t *loop);
+
+void io_watcher_init(io_watcher_t *watcher, int fd, io_callback_t callback);
+
+int event_loop_add(event_loop_t *loop, io_watcher_t *watcher, uint32_t events);
+int event_loop_modify(event_loop_t *loop, io_watcher_t *watcher, uint32_t events);
+int event_loop_remove(event_loop_t *loop, io_watcher_t *watcher);
+void event_loop_forget(event_loop_t *loop, io_watcher_t *watcher);
+
+void event_loop_schedule(event_loop_t *loop, wheel_timer_t *timer, uint64_t timeout_ms);
+void event_loop_cancel(event_loop_t *loop, wheel_timer_t *timer);
+
+void event_loop_run(event_loop_t *loop);
+void event_loop_stop(event_loop_t *loop);
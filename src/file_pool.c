@@ -0,0 +1,259 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "file_pool.h"
+
+// Jobs completed for a loop, created by its first submission
+typedef struct FileCompletions {
+    // Must be the first member, the loop hands the watcher back to us
+    io_watcher_t watcher;
+    pthread_mutex_t lock;
+    // Signaled with every completion, the loop waits for its jobs before it goes away
+    pthread_cond_t completed;
+    file_job_t *head;
+    file_job_t *tail;
+    // Jobs submitted and not completed yet
+    size_t pending;
+} file_completions_t;
+
+typedef struct FilePool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    file_job_t *head;
+    file_job_t *tail;
+    size_t length;
+    size_t capacity;
+    int stopping;
+
+    pthread_t *threads;
+    size_t thread_count;
+} file_pool_t;
+
+static file_pool_t pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+
+// Every loop runs on a thread of its own
+static __thread file_completions_t *completions = NULL;
+
+static void post_completion(file_job_t *job) {
+    file_completions_t *inbox = job->completions;
+    uint64_t value = 1;
+
+    job->next = NULL;
+
+    // The loop may release the inbox as soon as nothing is pending, the eventfd is written before
+    pthread_mutex_lock(&inbox->lock);
+    if (inbox->tail == NULL) {
+        inbox->head = job;
+    } else {
+        inbox->tail->next = job;
+    }
+    inbox->tail = job;
+    inbox->pending--;
+    write(inbox->watcher.fd, &value, sizeof(value));
+    pthread_cond_broadcast(&inbox->completed);
+    pthread_mutex_unlock(&inbox->lock);
+}
+
+static void *run_file_thread(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&pool.lock);
+
+    while (1) {
+        while (pool.head == NULL && !pool.stopping) {
+            pthread_cond_wait(&pool.ready, &pool.lock);
+        }
+
+        // The queued jobs still run once the pool stops, their loops wait for them
+        if (pool.head == NULL) {
+            break;
+        }
+
+        file_job_t *job = pool.head;
+        pool.head = job->next;
+        if (pool.head == NULL) {
+            pool.tail = NULL;
+        }
+        pool.length--;
+
+        pthread_mutex_unlock(&pool.lock);
+        job->run(job);
+        post_completion(job);
+        pthread_mutex_lock(&pool.lock);
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/**
+ * Starts thread_count file threads sharing a queue of queue_capacity jobs, the
+ * pool stays empty (every job is refused) when thread_count is 0
+ *
+Returns
+- -1 if a thread can't be started
+- 0 if succeed
+*/
+int start_file_pool(size_t thread_count, size_t queue_capacity) {
+    if (thread_count == 0) {
+        return 0;
+    }
+
+    pool.threads = calloc(thread_count, sizeof(pthread_t));
+    if (pool.threads == NULL) {
+        return -1;
+    }
+
+    pool.capacity = queue_capacity;
+
+    for (size_t i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool.threads[i], NULL, run_file_thread, NULL) != 0) {
+            stop_file_pool();
+            return -1;
+        }
+        pool.thread_count++;
+    }
+
+    return 0;
+}
+
+// Runs the queued jobs then stops the threads, once the loops are done submitting
+void stop_file_pool() {
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (size_t i = 0; i < pool.thread_count; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.thread_count = 0;
+    pool.stopping = 0;
+}
+
+static void on_completions(event_loop_t *loop, io_watcher_t *watcher, uint32_t events) {
+    (void)loop;
+    (void)events;
+    file_completions_t *inbox = (file_completions_t *)watcher;
+    uint64_t value;
+
+    read(inbox->watcher.fd, &value, sizeof(value));
+
+    pthread_mutex_lock(&inbox->lock);
+    file_job_t *job = inbox->head;
+    inbox->head = NULL;
+    inbox->tail = NULL;
+    pthread_mutex_unlock(&inbox->lock);
+
+    while (job != NULL) {
+        file_job_t *next = job->next;
+        job->complete(job);
+        job = next;
+    }
+}
+
+static file_completions_t *create_completions(event_loop_t *loop) {
+    file_completions_t *inbox = calloc(1, sizeof(file_completions_t));
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (inbox == NULL || fd == -1) {
+        free(inbox);
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    io_watcher_init(&inbox->watcher, fd, on_completions);
+    if (event_loop_add(loop, &inbox->watcher, EPOLLIN) == -1) {
+        close(fd);
+        free(inbox);
+        return NULL;
+    }
+
+    pthread_mutex_init(&inbox->lock, NULL);
+    pthread_cond_init(&inbox->completed, NULL);
+    return inbox;
+}
+
+/**
+ * Queues a job for the file threads, its complete callback is called by loop
+ * (the loop of the calling thread) once it ran
+ *
+Returns
+- -1 if the pool has no thread or its queue is full, the caller runs the job itself
+- 0 if succeed
+*/
+int file_pool_submit(event_loop_t *loop, file_job_t *job) {
+    if (pool.thread_count == 0) {
+        return -1;
+    }
+
+    if (completions == NULL) {
+        completions = create_completions(loop);
+        if (completions == NULL) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.length == pool.capacity) {
+        pthread_mutex_unlock(&pool.lock);
+        return -1;
+    }
+
+    job->next = NULL;
+    job->completions = completions;
+
+    pthread_mutex_lock(&completions->lock);
+    completions->pending++;
+    pthread_mutex_unlock(&completions->lock);
+
+    if (pool.tail == NULL) {
+        pool.head = job;
+    } else {
+        pool.tail->next = job;
+    }
+    pool.tail = job;
+    pool.length++;
+
+    pthread_cond_signal(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+/**
+ * Waits for the jobs of the calling thread still running and completes them, then
+ * releases its inbox, called once its loop stopped
+ */
+void release_file_completions() {
+    if (completions == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&completions->lock);
+    while (completions->pending > 0) {
+        pthread_cond_wait(&completions->completed, &completions->lock);
+    }
+
+    file_job_t *job = completions->head;
+    pthread_mutex_unlock(&completions->lock);
+
+    while (job != NULL) {
+        file_job_t *next = job->next;
+        job->complete(job);
+        job = next;
+    }
+
+    close(completions->watcher.fd);
+    pthread_mutex_destroy(&completions->lock);
+    pthread_cond_destroy(&completions->completed);
+    free(completions);
+    completions = NULL;
+}
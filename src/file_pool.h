@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "event_loop.h"
+
+// Bounded pool of threads running the blocking file system calls of the event loops
+//
+// A loop submits a job (path resolution, open, reads of cold files), a file thread runs it
+// and hands it back through an eventfd watched by the loop, which completes it: the loop
+// keeps serving its other connections meanwhile. Jobs wait in a bounded queue, a job that
+// doesn't fit (or any job when the pool has no thread) is refused and the caller runs it
+// itself.
+
+typedef struct FileJob file_job_t;
+
+typedef void (*file_job_callback_t)(file_job_t *job);
+
+struct FileJob {
+    // Called on a file thread, may block
+    file_job_callback_t run;
+    // Called on the submitting loop once run returned
+    file_job_callback_t complete;
+
+    struct FileJob *next;
+    struct FileCompletions *completions;
+};
+
+int start_file_pool(size_t thread_count, size_t queue_capacity);
+void stop_file_pool();
+int file_pool_submit(event_loop_t *loop, file_job_t *job);
+void release_file_completions();
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "handover.h"
+
+// Connection to the previous server until the new one is ready, -1 if there is none
+static int previous_server = -1;
+
+typedef struct HandoverServer {
+    int unix_fd;
+    int listen_fds[MAX_LISTENERS];
+    size_t listener_count;
+} handover_server_t;
+
+// Returns -1 if the path doesn't fit in a Unix socket address, otherwise 0
+static int make_address(char *path, struct sockaddr_un *address) {
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        return -1;
+    }
+
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+/**
+ * Asks the server listening on path for its listening sockets and fills fds with
+ * them, the connection stays open until handover_ready
+ *
+ * Returns their count, 0 if no server gave any
+ */
+size_t handover_receive(char *path, int *fds, size_t max_count) {
+    struct sockaddr_un address;
+    if (make_address(path, &address) == -1) {
+        return 0;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return 0;
+    }
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        return 0;
+    }
+
+    char byte;
+    struct iovec data = {.iov_base = &byte, .iov_len = 1};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    } control;
+
+    struct msghdr message = {
+        .msg_iov = &data,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer),
+    };
+
+    ssize_t received;
+    do {
+        received = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+    } while (received == -1 && errno == EINTR);
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (received != 1 || header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+        close(fd);
+        return 0;
+    }
+
+    size_t received_count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    size_t count = 0;
+
+    for (size_t i = 0; i < received_count; i++) {
+        int listen_fd;
+        memcpy(&listen_fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+
+        if (count == max_count) {
+            close(listen_fd);
+            continue;
+        }
+
+        // Inherited by the workers, the other descriptors are not
+        int flags = fcntl(listen_fd, F_GETFD);
+        fcntl(listen_fd, F_SETFD, flags & ~FD_CLOEXEC);
+        fds[count++] = listen_fd;
+    }
+
+    previous_server = fd;
+    return count;
+}
+
+// Tells the server the socket came from to drain, once this one serves it
+void handover_ready() {
+    if (previous_server == -1) {
+        return;
+    }
+
+    char byte = 1;
+    write(previous_server, &byte, 1);
+    close(previous_server);
+    previous_server = -1;
+}
+
+// Returns -1 if the descriptors can't be sent, otherwise 0
+static int send_listeners(int fd, handover_server_t *server) {
+    char byte = 0;
+    struct iovec data = {.iov_base = &byte, .iov_len = 1};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    } control;
+
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr message = {
+        .msg_iov = &data,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * server->listener_count),
+    };
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * server->listener_count);
+    memcpy(CMSG_DATA(header), server->listen_fds, sizeof(int) * server->listener_count);
+
+    return sendmsg(fd, &message, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static void *serve_handover(void *arg) {
+    handover_server_t *server = arg;
+
+    while (1) {
+        int fd = accept4(server->unix_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        if (send_listeners(fd, server) == -1) {
+            close(fd);
+            continue;
+        }
+
+        // The new server can take a while to start, its end of the connection closes if it dies
+        char byte;
+        ssize_t result;
+        do {
+            result = read(fd, &byte, 1);
+        } while (result == -1 && errno == EINTR);
+
+        close(fd);
+
+        if (result == 1) {
+            printf("Handed the listening sockets over, draining\n");
+            fflush(stdout);
+            kill(getpid(), SIGTERM);
+            break;
+        }
+
+        printf("The next server exited before it was ready, still serving\n");
+    }
+
+    // The path now belongs to the next server
+    close(server->unix_fd);
+    free(server);
+    return NULL;
+}
+
+/**
+ * Serves the listening sockets to the next server from a detached thread, which is
+ * created with the signal mask of the caller
+ *
+Returns
+- -1 if the Unix socket can't be bound
+- 0 if succeed
+*/
+int handover_listen(char *path, listener_t *listeners, size_t listener_count) {
+    struct sockaddr_un address;
+    if (make_address(path, &address) == -1) {
+        return -1;
+    }
+
+    handover_server_t *server = malloc(sizeof(handover_server_t));
+    if (server == NULL) {
+        return -1;
+    }
+
+    server->listener_count = listener_count < MAX_LISTENERS ? listener_count : MAX_LISTENERS;
+    for (size_t i = 0; i < server->listener_count; i++) {
+        server->listen_fds[i] = listeners[i].fd;
+    }
+    server->unix_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    // The previous server may still serve the old inode, it got our socket already
+    unlink(path);
+
+    // Whoever connects can take the socket, only our user may. The socket isn't listening before the chmod
+    if (server->unix_fd == -1 || bind(server->unix_fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        chmod(path, S_IRUSR | S_IWUSR) == -1 || listen(server->unix_fd, 1) == -1) {
+        if (server->unix_fd != -1) {
+            close(server->unix_fd);
+        }
+        free(server);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_handover, server) != 0) {
+        close(server->unix_fd);
+        free(server);
+        return -1;
+    }
+
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "listener.h"
+
+// Hands the listening sockets over to the next server process, for restarts without downtime
+//
+// A server started with --handover=PATH serves the Unix socket PATH from a thread. A new
+// server started with the same option connects to it first and receives the listening
+// sockets with SCM_RIGHTS, both processes then accept on the same sockets so that no
+// connection is refused. Once the new server is ready it says so on the Unix connection,
+// the old one stops accepting and drains like on SIGTERM. A new server dying before that
+// leaves the old one serving.
+
+size_t handover_receive(char *path, int *fds, size_t max_count);
+int handover_listen(char *path, listener_t *listeners, size_t listener_count);
+void handover_ready();
@@ -0,0 +1,118 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "body.h"
+
+request_body_t *create_request_body() {
+    request_body_t *body = malloc(sizeof(request_body_t));
+    if (body == NULL) {
+        return NULL;
+    }
+
+    body->length = 0;
+    body->data = NULL;
+    body->capacity = 0;
+    body->fd = -1;
+
+    return body;
+}
+
+static int write_all(int fd, char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+// Moves the in memory part of the body to an anonymous file in spill_dir
+static int spill_request_body(request_body_t *body, char *spill_dir) {
+    int fd = open(spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (write_all(fd, body->data, body->length) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    free(body->data);
+    body->data = NULL;
+    body->capacity = 0;
+    body->fd = fd;
+
+    return 0;
+}
+
+/**
+ * Appends data to the body, a spill_size of 0 keeps every body in memory
+ *
+Returns
+- -1 if append fails
+- 0 if succeed
+*/
+int append_request_body(request_body_t *body, char *data, size_t length, size_t spill_size, char *spill_dir) {
+    if (body->fd == -1 && spill_size > 0 && body->length + length > spill_size) {
+        if (spill_request_body(body, spill_dir) == -1) {
+            return -1;
+        }
+    }
+
+    if (body->fd != -1) {
+        if (write_all(body->fd, data, length) == -1) {
+            return -1;
+        }
+
+        body->length += length;
+        return 0;
+    }
+
+    // One extra byte keeps in memory bodies null terminated
+    if (body->length + length + 1 > body->capacity) {
+        size_t new_capacity = body->capacity * 2;
+        if (new_capacity < body->length + length + 1) {
+            new_capacity = body->length + length + 1;
+        }
+
+        char *new_data = realloc(body->data, new_capacity);
+        if (new_data == NULL) {
+            return -1;
+        }
+
+        body->data = new_data;
+        body->capacity = new_capacity;
+    }
+
+    memcpy(body->data + body->length, data, length);
+    body->length += length;
+    body->data[body->length] = '\0';
+
+    return 0;
+}
+
+void free_request_body(request_body_t *body) {
+    if (body == NULL) {
+        return;
+    }
+
+    if (body->fd != -1) {
+        close(body->fd);
+    }
+
+    free(body->data);
+    free(body);
+}
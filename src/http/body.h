@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+
+// Request body collected for a handler
+//
+// Small bodies stay in memory, once a body grows above the spill size it is moved
+// to an unlinked temporary file so that big uploads don't cost memory.
+
+typedef struct RequestBody {
+    size_t length;
+    // In memory body, NULL once spilled
+    char *data;
+    size_t capacity;
+    // Spilled body, -1 while in memory
+    int fd;
+} request_body_t;
+
+request_body_t *create_request_body();
+int append_request_body(request_body_t *body, char *data, size_t length, size_t spill_size, char *spill_dir);
+void free_request_body(request_body_t *body);
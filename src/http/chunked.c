@@ -0,0 +1,140 @@
+#include <stddef.h>
+
+#include "chunked.h"
+#include "parser_helpers.h"
+
+// Chunk sizes are limited to 15 hex digits so that they can't overflow
+#define MAX_SIZE_DIGITS 15
+
+void chunked_decoder_init(chunked_decoder_t *decoder) {
+    decoder->state = CHUNKED_SIZE;
+    decoder->chunk_remaining = 0;
+    decoder->size_digits = 0;
+}
+
+static size_t hex_value(char c) {
+    if (is_numeric(c)) {
+        return c - '0';
+    }
+
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    return c - 'A' + 10;
+}
+
+/**
+ * Consumes input until the end of the next data slice (or of the input)
+ *
+ * Returns how many bytes of input have been consumed, `data` and `data_length`
+ * describe the decoded bytes found in them (data_length is 0 if none).
+ * The caller keeps calling until the whole input is consumed, the decoder is then
+ * either waiting for more input, CHUNKED_DONE or CHUNKED_ERROR.
+ */
+size_t chunked_decode(chunked_decoder_t *decoder, char *input, size_t length, char **data, size_t *data_length) {
+    size_t i = 0;
+
+    *data = NULL;
+    *data_length = 0;
+
+    while (i < length) {
+        char c = input[i];
+
+        switch (decoder->state) {
+        case CHUNKED_SIZE:
+            if (is_hex(c) && decoder->size_digits < MAX_SIZE_DIGITS) {
+                decoder->chunk_remaining = decoder->chunk_remaining * 16 + hex_value(c);
+                decoder->size_digits++;
+            } else if (decoder->size_digits > 0 && (c == ';' || c == ' ' || c == '\t')) {
+                decoder->state = CHUNKED_EXTENSION;
+            } else if (decoder->size_digits > 0 && c == '\r') {
+                decoder->state = CHUNKED_SIZE_LF;
+            } else {
+                decoder->state = CHUNKED_ERROR;
+                return i;
+            }
+            i++;
+            break;
+
+        case CHUNKED_EXTENSION:
+            if (c == '\r') {
+                decoder->state = CHUNKED_SIZE_LF;
+            }
+            i++;
+            break;
+
+        case CHUNKED_SIZE_LF:
+            if (c != '\n') {
+                decoder->state = CHUNKED_ERROR;
+                return i;
+            }
+
+            decoder->size_digits = 0;
+            // The last chunk has size 0 and is followed by the trailer section
+            decoder->state = decoder->chunk_remaining == 0 ? CHUNKED_TRAILER : CHUNKED_DATA;
+            i++;
+            break;
+
+        case CHUNKED_DATA: {
+            size_t available = length - i;
+            size_t slice = available < decoder->chunk_remaining ? available : decoder->chunk_remaining;
+
+            *data = input + i;
+            *data_length = slice;
+            decoder->chunk_remaining -= slice;
+
+            if (decoder->chunk_remaining == 0) {
+                decoder->state = CHUNKED_DATA_CR;
+            }
+
+            return i + slice;
+        }
+
+        case CHUNKED_DATA_CR:
+            if (c != '\r') {
+                decoder->state = CHUNKED_ERROR;
+                return i;
+            }
+            decoder->state = CHUNKED_DATA_LF;
+            i++;
+            break;
+
+        case CHUNKED_DATA_LF:
+            if (c != '\n') {
+                decoder->state = CHUNKED_ERROR;
+                return i;
+            }
+            decoder->state = CHUNKED_SIZE;
+            i++;
+            break;
+
+        case CHUNKED_TRAILER:
+            // Start of a line, an empty one ends the message
+            decoder->state = c == '\r' ? CHUNKED_TRAILER_LF : CHUNKED_TRAILER_LINE;
+            i++;
+            break;
+
+        case CHUNKED_TRAILER_LINE:
+            if (c == '\n') {
+                decoder->state = CHUNKED_TRAILER;
+            }
+            i++;
+            break;
+
+        case CHUNKED_TRAILER_LF:
+            if (c != '\n') {
+                decoder->state = CHUNKED_ERROR;
+                return i;
+            }
+            decoder->state = CHUNKED_DONE;
+            return i + 1;
+
+        case CHUNKED_DONE:
+        case CHUNKED_ERROR:
+            return i;
+        }
+    }
+
+    return i;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+
+// Incremental decoder of chunked transfer encoding (RFC 9112 section 7.1)
+//
+// Input can be fed in pieces of any size, the decoded data is returned as slices
+// of the input so nothing is copied. Chunk extensions and trailers are skipped.
+
+typedef enum ChunkedState {
+    CHUNKED_SIZE,
+    CHUNKED_EXTENSION,
+    CHUNKED_SIZE_LF,
+    CHUNKED_DATA,
+    CHUNKED_DATA_CR,
+    CHUNKED_DATA_LF,
+    CHUNKED_TRAILER,
+    CHUNKED_TRAILER_LINE,
+    CHUNKED_TRAILER_LF,
+    CHUNKED_DONE,
+    CHUNKED_ERROR,
+} chunked_state_t;
+
+typedef struct ChunkedDecoder {
+    chunked_state_t state;
+    size_t chunk_remaining;
+    int size_digits;
+} chunked_decoder_t;
+
+void chunked_decoder_init(chunked_decoder_t *decoder);
+
+size_t chunked_decode(chunked_decoder_t *decoder, char *input, size_t length, char **data, size_t *data_length);
@@ -2,6 +2,11 @@
 #include <string.h>
 
 header_t *get_content_type_header(char *extension) {
+    // Files without extension
+    if (extension == NULL) {
+        return create_header("Content-Type", "text/plain");
+    }
+
     if (strcmp(extension, ".js") == 0) {
         return create_header("Content-Type", "text/javascript");
     }
@@ -1,9 +1,84 @@
 #include "headers.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+
+// Chosen so that the known names land in distinct slots of KNOWN_HEADERS
+static const uint32_t HEADER_HASH_SEED = 10110;
+#define KNOWN_HEADER_SLOTS 64
+
+typedef struct KnownHeader {
+    const char *name;
+    header_id_t id;
+} known_header_t;
+
+// Perfect hash table of the known names, by the top 6 bits of their hash
+static const known_header_t KNOWN_HEADERS[KNOWN_HEADER_SLOTS] = {
+    [0] = {"Range", HEADER_RANGE},
+    [3] = {"Content-Type", HEADER_CONTENT_TYPE},
+    [4] = {"Set-Cookie", HEADER_SET_COOKIE},
+    [5] = {"Last-Event-ID", HEADER_LAST_EVENT_ID},
+    [6] = {"Trailer", HEADER_TRAILER},
+    [12] = {"ETag", HEADER_ETAG},
+    [14] = {"Authorization", HEADER_AUTHORIZATION},
+    [15] = {"Sec-WebSocket-Key", HEADER_SEC_WEBSOCKET_KEY},
+    [18] = {"If-None-Match", HEADER_IF_NONE_MATCH},
+    [19] = {"Vary", HEADER_VARY},
+    [22] = {"Cookie", HEADER_COOKIE},
+    [26] = {"If-Modified-Since", HEADER_IF_MODIFIED_SINCE},
+    [27] = {"Proxy-Connection", HEADER_PROXY_CONNECTION},
+    [31] = {"Expect", HEADER_EXPECT},
+    [32] = {"Location", HEADER_LOCATION},
+    [35] = {"Host", HEADER_HOST},
+    [37] = {"Cache-Control", HEADER_CACHE_CONTROL},
+    [38] = {"Keep-Alive", HEADER_KEEP_ALIVE},
+    [39] = {"Accept-Encoding", HEADER_ACCEPT_ENCODING},
+    [42] = {"User-Agent", HEADER_USER_AGENT},
+    [46] = {"Pragma", HEADER_PRAGMA},
+    [47] = {"Connection", HEADER_CONNECTION},
+    [51] = {"Upgrade", HEADER_UPGRADE},
+    [54] = {"Transfer-Encoding", HEADER_TRANSFER_ENCODING},
+    [55] = {"Accept", HEADER_ACCEPT},
+    [56] = {"Content-Encoding", HEADER_CONTENT_ENCODING},
+    [58] = {"Sec-WebSocket-Version", HEADER_SEC_WEBSOCKET_VERSION},
+    [59] = {"Age", HEADER_AGE},
+    [60] = {"HTTP2-Settings", HEADER_HTTP2_SETTINGS},
+    [61] = {"Content-Length", HEADER_CONTENT_LENGTH},
+    [62] = {"TE", HEADER_TE},
+};
+
+// Header names are case insensitive as HTTP/1.0 spec, the hash folds the case instead of copying the name
+static uint32_t hash_header_name(const char *name) {
+    // FNV-1a
+    uint32_t hash = HEADER_HASH_SEED;
+
+    for (; *name != '\0'; name++) {
+        // Lowercases the letters, the few other bytes it merges only collide
+        hash ^= (unsigned char)*name | 0x20;
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+static header_id_t lookup_header_id(const char *name, uint32_t hash) {
+    const known_header_t *known = &KNOWN_HEADERS[hash >> 26];
+
+    if (known->name != NULL && strcasecmp(known->name, name) == 0) {
+        return known->id;
+    }
+
+    return HEADER_UNKNOWN;
+}
+
+// Returns the id of a known name, otherwise HEADER_UNKNOWN
+header_id_t get_header_id(const char *name) {
+    return lookup_header_id(name, hash_header_name(name));
+}
 
 header_list_t *create_header_list(size_t initial_capacity) {
-    header_list_t *list = malloc(sizeof(header_list_t));
+    header_list_t *list = calloc(1, sizeof(header_list_t));
 
     if (list == NULL) {
         return NULL;
@@ -22,15 +97,69 @@ header_list_t *create_header_list(size_t initial_capacity) {
     return list;
 }
 
+// Returns the slot of name in the table of the other names, or the empty slot where it belongs
+static size_t find_other_slot(header_t **others, size_t capacity, const char *name, uint32_t hash) {
+    size_t slot = hash & (capacity - 1);
+
+    while (others[slot] != NULL && strcasecmp(others[slot]->name, name) != 0) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+
+    return slot;
+}
+
+/**
+ * Indexes a header with an unknown name unless one with the same name already is,
+ * the table is kept at most half full
+ *
+Returns
+- -1 if the table can't grow
+- 0 if succeed
+*/
+static int index_other_header(header_list_t *header_list, header_t *item, uint32_t hash) {
+    if ((header_list->others_length + 1) * 2 > header_list->others_capacity) {
+        size_t capacity = header_list->others_capacity == 0 ? 8 : header_list->others_capacity * 2;
+        header_t **others = calloc(capacity, sizeof(header_t *));
+
+        if (others == NULL) {
+            return -1;
+        }
+
+        for (size_t i = 0; i < header_list->others_capacity; i++) {
+            header_t *header = header_list->others[i];
+
+            if (header != NULL) {
+                others[find_other_slot(others, capacity, header->name, hash_header_name(header->name))] = header;
+            }
+        }
+
+        free(header_list->others);
+        header_list->others = others;
+        header_list->others_capacity = capacity;
+    }
+
+    size_t slot = find_other_slot(header_list->others, header_list->others_capacity, item->name, hash);
+    if (header_list->others[slot] == NULL) {
+        header_list->others[slot] = item;
+        header_list->others_length++;
+    }
+
+    return 0;
+}
+
 /**
 Returns
 - -1 if append fails
 - 0 if succeed
 */
 int append_header_list(header_list_t *header_list, header_t *item) {
+    if (item == NULL) {
+        return -1;
+    }
+
     if (header_list->length == header_list->capacity) {
-        int new_capacity = header_list->capacity + 2;
-        header_t **new_data = realloc(header_list->data, sizeof(header_t) * (new_capacity));
+        size_t new_capacity = header_list->capacity == 0 ? 4 : header_list->capacity * 2;
+        header_t **new_data = realloc(header_list->data, sizeof(header_t *) * new_capacity);
 
         if (new_data == NULL) {
             return -1;
@@ -40,6 +169,18 @@ int append_header_list(header_list_t *header_list, header_t *item) {
         header_list->capacity = new_capacity;
     }
 
+    // Lookups return the first header of a name, like the linear search did
+    uint32_t hash = hash_header_name(item->name);
+    item->id = lookup_header_id(item->name, hash);
+
+    if (item->id != HEADER_UNKNOWN) {
+        if (header_list->known[item->id] == NULL) {
+            header_list->known[item->id] = item;
+        }
+    } else if (index_other_header(header_list, item, hash) == -1) {
+        return -1;
+    }
+
     header_list->data[header_list->length++] = item;
     return 0;
 }
@@ -68,21 +209,86 @@ void free_header_list(header_list_t *header_list) {
     }
 
     free(header_list->data);
+    free(header_list->others);
     free(header_list);
 }
 
+/**
+ * Copies the list and its headers, the copy is released with free_header_list
+ *
+ * Returns NULL on allocation failure
+ */
+header_list_t *copy_header_list(header_list_t *header_list) {
+    header_list_t *copy = create_header_list(header_list->length + 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < header_list->length; i++) {
+        header_t *header = create_header(header_list->data[i]->name, header_list->data[i]->value);
+
+        if (header == NULL || append_header_list(copy, header) == -1) {
+            if (header != NULL) {
+                free_header(header);
+            }
+            free_header_list(copy);
+            return NULL;
+        }
+    }
+
+    return copy;
+}
+
+// Name and value are copied so that every header can be released with free_header
 header_t *create_header(char *name, char *value) {
     header_t *header = malloc(sizeof(header_t));
     if (header == NULL) {
         return NULL;
     }
 
-    header->name = name;
-    header->value = value;
+    header->name = strdup(name);
+    header->value = strdup(value);
+    header->id = HEADER_UNKNOWN;
+
+    if (header->name == NULL || header->value == NULL) {
+        free(header->name);
+        free(header->value);
+        free(header);
+        return NULL;
+    }
 
     return header;
 }
 
+// Returns the first header named name, in constant time
+header_t *find_header(header_list_t *header_list, char *name) {
+    if (header_list == NULL) {
+        return NULL;
+    }
+
+    uint32_t hash = hash_header_name(name);
+    header_id_t id = lookup_header_id(name, hash);
+
+    if (id != HEADER_UNKNOWN) {
+        return header_list->known[id];
+    }
+
+    if (header_list->others == NULL) {
+        return NULL;
+    }
+
+    return header_list->others[find_other_slot(header_list->others, header_list->others_capacity, name, hash)];
+}
+
+// Returns the first header with a known name, without hashing it
+header_t *find_known_header(header_list_t *header_list, header_id_t id) {
+    if (header_list == NULL || id == HEADER_UNKNOWN) {
+        return NULL;
+    }
+
+    return header_list->known[id];
+}
+
 // Returns malloc allocated string
 char *format_header_string(header_t *header) {
     if (header == NULL) {
@@ -1,21 +1,71 @@
 #pragma once
 #include <stdlib.h>
 
+// Header names the server looks up, they are found by id without comparing names
+typedef enum HeaderId {
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_AGE,
+    HEADER_AUTHORIZATION,
+    HEADER_CACHE_CONTROL,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_ENCODING,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_COOKIE,
+    HEADER_ETAG,
+    HEADER_EXPECT,
+    HEADER_HOST,
+    HEADER_HTTP2_SETTINGS,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_KEEP_ALIVE,
+    HEADER_LAST_EVENT_ID,
+    HEADER_LOCATION,
+    HEADER_PRAGMA,
+    HEADER_PROXY_CONNECTION,
+    HEADER_RANGE,
+    HEADER_SEC_WEBSOCKET_KEY,
+    HEADER_SEC_WEBSOCKET_VERSION,
+    HEADER_SET_COOKIE,
+    HEADER_TE,
+    HEADER_TRAILER,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_UPGRADE,
+    HEADER_USER_AGENT,
+    HEADER_VARY,
+    // Any other name, also the number of known ones
+    HEADER_UNKNOWN,
+} header_id_t;
+
 typedef struct Header {
     char *name;
     char *value;
+    // Set when the header is appended to a list
+    header_id_t id;
 } header_t;
 
+// Headers in arrival order (data), indexed by name: lookups cost the same for 3 headers or 100
 typedef struct HeaderList {
     size_t capacity;
     size_t length;
     header_t **data;
+    // First header of each known name, by id
+    header_t *known[HEADER_UNKNOWN];
+    // Open addressing table of the first header of each other name, NULL until there is one
+    header_t **others;
+    size_t others_capacity;
+    size_t others_length;
 } header_list_t;
 
 header_list_t *create_header_list(size_t initial_capacity);
 int append_header_list(header_list_t *header_list, header_t *item);
 void free_header_list(header_list_t *header_list);
+header_list_t *copy_header_list(header_list_t *header_list);
 
 void free_header(header_t *header);
 header_t *create_header(char *name, char *value);
+header_id_t get_header_id(const char *name);
+header_t *find_header(header_list_t *header_list, char *name);
+header_t *find_known_header(header_list_t *header_list, header_id_t id);
 char *format_header_string(header_t *header);
@@ -0,0 +1,571 @@
+#include <string.h>
+
+#include "hpack.h"
+#include "huffman.h"
+
+// Every entry costs its length plus this overhead in the table size
+#define HPACK_ENTRY_OVERHEAD 32
+// Integers above this are not needed by any sane peer, it also prevents overflows
+#define HPACK_MAX_INTEGER_SHIFT 28
+
+typedef struct StaticEntry {
+    char *name;
+    char *value;
+} static_entry_t;
+
+static const static_entry_t STATIC_TABLE[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static const size_t STATIC_TABLE_SIZE = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+
+// Values that change with every response would only churn the table
+static const char *UNINDEXED_HEADERS[] = {
+    "age", "content-length", "content-range", "etag", "last-modified", "location",
+};
+
+// Never stored by intermediaries either, so secrets can't be probed through compression
+static const char *SENSITIVE_HEADERS[] = {
+    "authorization",
+    "set-cookie",
+};
+
+typedef enum FieldIndexing {
+    FIELD_INCREMENTAL,
+    FIELD_WITHOUT_INDEXING,
+    FIELD_NEVER_INDEXED,
+} field_indexing_t;
+
+void hpack_table_init(hpack_table_t *table, size_t max_size) {
+    table->entries = NULL;
+    table->capacity = 0;
+    table->first = 0;
+    table->count = 0;
+    table->size = 0;
+    table->max_size = max_size;
+    table->size_update_pending = 0;
+}
+
+static size_t entry_size(header_t *entry) {
+    return strlen(entry->name) + strlen(entry->value) + HPACK_ENTRY_OVERHEAD;
+}
+
+static void evict_oldest(hpack_table_t *table) {
+    header_t *oldest = table->entries[(table->first + table->count - 1) % table->capacity];
+
+    table->size -= entry_size(oldest);
+    table->count--;
+    free_header(oldest);
+}
+
+void hpack_table_destroy(hpack_table_t *table) {
+    while (table->count > 0) {
+        evict_oldest(table);
+    }
+
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = 0;
+}
+
+static void set_max_size(hpack_table_t *table, size_t max_size) {
+    table->max_size = max_size;
+
+    while (table->size > table->max_size) {
+        evict_oldest(table);
+    }
+}
+
+// Changes the limit of an encoder table, the next block announces it to the peer
+void hpack_table_resize(hpack_table_t *table, size_t max_size) {
+    set_max_size(table, max_size);
+    table->size_update_pending = 1;
+}
+
+/**
+ * Inserts a new entry, an entry larger than the whole table just empties it
+ *
+Returns
+- -1 if allocation fails
+- 0 if succeed
+*/
+static int add_entry(hpack_table_t *table, char *name, char *value) {
+    size_t size = strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+
+    while (table->count > 0 && table->size + size > table->max_size) {
+        evict_oldest(table);
+    }
+
+    if (size > table->max_size) {
+        return 0;
+    }
+
+    if (table->count == table->capacity) {
+        size_t new_capacity = table->capacity == 0 ? 16 : table->capacity * 2;
+        header_t **entries = malloc(sizeof(header_t *) * new_capacity);
+        if (entries == NULL) {
+            return -1;
+        }
+
+        for (size_t i = 0; i < table->count; i++) {
+            entries[i] = table->entries[(table->first + i) % table->capacity];
+        }
+
+        free(table->entries);
+        table->entries = entries;
+        table->capacity = new_capacity;
+        table->first = 0;
+    }
+
+    header_t *entry = create_header(name, value);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    table->first = (table->first + table->capacity - 1) % table->capacity;
+    table->entries[table->first] = entry;
+    table->count++;
+    table->size += size;
+
+    return 0;
+}
+
+/**
+ * Index 1 to 61 are the static table, the dynamic table follows, newest first
+ *
+ * Returns the name and value of the entry, or -1 if there is no such index
+ */
+static int lookup_index(hpack_table_t *table, size_t index, char **name, char **value) {
+    if (index == 0) {
+        return -1;
+    }
+
+    if (index <= STATIC_TABLE_SIZE) {
+        *name = STATIC_TABLE[index - 1].name;
+        *value = STATIC_TABLE[index - 1].value;
+        return 0;
+    }
+
+    index -= STATIC_TABLE_SIZE + 1;
+    if (index >= table->count) {
+        return -1;
+    }
+
+    header_t *entry = table->entries[(table->first + index) % table->capacity];
+    *name = entry->name;
+    *value = entry->value;
+    return 0;
+}
+
+/**
+ * Reads an integer whose first byte keeps `prefix_bits` low bits (RFC 7541 section 5.1)
+ *
+ * Returns -1 if it is truncated or too large, otherwise 0
+ */
+static int decode_integer(const uint8_t *block, size_t length, size_t *position, int prefix_bits, size_t *value) {
+    size_t max_prefix = (1 << prefix_bits) - 1;
+
+    *value = block[*position] & max_prefix;
+    (*position)++;
+
+    if (*value < max_prefix) {
+        return 0;
+    }
+
+    for (int shift = 0; shift <= HPACK_MAX_INTEGER_SHIFT; shift += 7) {
+        if (*position >= length) {
+            return -1;
+        }
+
+        uint8_t byte = block[(*position)++];
+        *value += (size_t)(byte & 0x7f) << shift;
+
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Reads a string literal, Huffman coded or not
+ *
+ * Returns a null terminated copy, or NULL if it is invalid or contains a null byte
+ */
+static char *decode_string(const uint8_t *block, size_t length, size_t *position, size_t *string_length) {
+    if (*position >= length) {
+        return NULL;
+    }
+
+    int huffman = block[*position] & 0x80;
+    size_t encoded_length;
+
+    if (decode_integer(block, length, position, 7, &encoded_length) == -1 || encoded_length > length - *position) {
+        return NULL;
+    }
+
+    const uint8_t *data = block + *position;
+    *position += encoded_length;
+
+    char *string;
+    if (huffman) {
+        string = malloc(huffman_decoded_max_length(encoded_length) + 1);
+        if (string == NULL) {
+            return NULL;
+        }
+
+        ssize_t decoded = huffman_decode(data, encoded_length, string);
+        if (decoded == -1) {
+            free(string);
+            return NULL;
+        }
+        *string_length = decoded;
+    } else {
+        string = malloc(encoded_length + 1);
+        if (string == NULL) {
+            return NULL;
+        }
+
+        memcpy(string, data, encoded_length);
+        *string_length = encoded_length;
+    }
+
+    string[*string_length] = '\0';
+
+    if (memchr(string, '\0', *string_length) != NULL) {
+        free(string);
+        return NULL;
+    }
+
+    return string;
+}
+
+/**
+ * Decodes a literal field whose first byte has `prefix_bits` bits of name index,
+ * the name is a literal when the index is 0
+ *
+ * Returns the new header, or NULL if it is invalid
+ */
+static header_t *decode_literal(hpack_table_t *table, const uint8_t *block, size_t length, size_t *position,
+                                int prefix_bits) {
+    size_t index;
+    if (decode_integer(block, length, position, prefix_bits, &index) == -1) {
+        return NULL;
+    }
+
+    header_t *header = malloc(sizeof(header_t));
+    if (header == NULL) {
+        return NULL;
+    }
+
+    header->name = NULL;
+    header->value = NULL;
+    header->id = HEADER_UNKNOWN;
+
+    size_t string_length;
+
+    if (index == 0) {
+        header->name = decode_string(block, length, position, &string_length);
+    } else {
+        char *name;
+        char *value;
+
+        if (lookup_index(table, index, &name, &value) == 0) {
+            header->name = strdup(name);
+        }
+    }
+
+    if (header->name != NULL) {
+        header->value = decode_string(block, length, position, &string_length);
+    }
+
+    if (header->value == NULL) {
+        free(header->name);
+        free(header);
+        return NULL;
+    }
+
+    return header;
+}
+
+/**
+ * Decodes a whole header block (the HEADERS fragment and its CONTINUATION frames)
+ * and appends its fields to headers, in order
+ *
+ * max_list_size bounds the decoded size of the fields, as counted in the table,
+ * so that a small block repeating large indexed entries can't blow up memory
+ *
+Returns
+- -1 if the block is invalid, the table can't be used anymore
+- 0 if succeed
+*/
+int hpack_decode(hpack_table_t *table, const uint8_t *block, size_t length, size_t max_list_size,
+                 header_list_t *headers) {
+    size_t position = 0;
+    size_t list_size = 0;
+    int has_fields = 0;
+
+    while (position < length) {
+        uint8_t byte = block[position];
+        header_t *header;
+
+        if (byte & 0x80) {
+            size_t index;
+            char *name;
+            char *value;
+
+            if (decode_integer(block, length, &position, 7, &index) == -1 ||
+                lookup_index(table, index, &name, &value) == -1) {
+                return -1;
+            }
+
+            header = create_header(name, value);
+        } else if (byte & 0x40) {
+            header = decode_literal(table, block, length, &position, 6);
+
+            if (header != NULL && add_entry(table, header->name, header->value) == -1) {
+                free_header(header);
+                return -1;
+            }
+        } else if (byte & 0x20) {
+            // Size updates are only allowed at the start of a block, within our setting
+            size_t max_size;
+
+            if (has_fields || decode_integer(block, length, &position, 5, &max_size) == -1 ||
+                max_size > HPACK_DEFAULT_TABLE_SIZE) {
+                return -1;
+            }
+
+            set_max_size(table, max_size);
+            continue;
+        } else {
+            // Without indexing (0000) or never indexed (0001), the same for a server
+            header = decode_literal(table, block, length, &position, 4);
+        }
+
+        if (header == NULL) {
+            return -1;
+        }
+
+        list_size += entry_size(header);
+        if (list_size > max_list_size || append_header_list(headers, header) == -1) {
+            free_header(header);
+            return -1;
+        }
+
+        has_fields = 1;
+    }
+
+    return 0;
+}
+
+static int encode_integer(string_t *output, uint8_t first_byte, int prefix_bits, size_t value) {
+    // A 64 bits value takes at most 10 bytes after the prefix
+    char bytes[11];
+    size_t length = 0;
+    size_t max_prefix = (1 << prefix_bits) - 1;
+
+    if (value < max_prefix) {
+        bytes[length++] = first_byte | value;
+    } else {
+        bytes[length++] = first_byte | max_prefix;
+        value -= max_prefix;
+
+        while (value >= 0x80) {
+            bytes[length++] = (value & 0x7f) | 0x80;
+            value >>= 7;
+        }
+        bytes[length++] = value;
+    }
+
+    return append_rawchars(output, bytes, length);
+}
+
+// Huffman coding is used whenever it is shorter
+static int encode_string(string_t *output, char *string) {
+    size_t length = strlen(string);
+    size_t encoded_length = huffman_encoded_length(string, length);
+
+    if (encoded_length >= length) {
+        if (encode_integer(output, 0x00, 7, length) == -1) {
+            return -1;
+        }
+        return append_rawchars(output, string, length);
+    }
+
+    if (encode_integer(output, 0x80, 7, encoded_length) == -1) {
+        return -1;
+    }
+
+    uint8_t *encoded = malloc(encoded_length);
+    if (encoded == NULL) {
+        return -1;
+    }
+
+    huffman_encode(string, length, encoded);
+    int result = append_rawchars(output, (char *)encoded, encoded_length);
+    free(encoded);
+
+    return result;
+}
+
+static int is_listed(const char **names, size_t count, char *name) {
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Starts a header block, with the table size update owed to the peer if any
+ *
+Returns
+- -1 if append fails
+- 0 if succeed
+*/
+int hpack_encode_start(hpack_table_t *table, string_t *output) {
+    if (!table->size_update_pending) {
+        return 0;
+    }
+
+    table->size_update_pending = 0;
+    return encode_integer(output, 0x20, 5, table->max_size);
+}
+
+/**
+ * Appends a field to the block, `name` must be lower case
+ *
+ * Fields found in a table are sent as an index, the others as a literal
+ * that is added to the dynamic table unless its value is volatile or sensitive.
+ *
+Returns
+- -1 if append fails
+- 0 if succeed
+*/
+int hpack_encode_header(hpack_table_t *table, string_t *output, char *name, char *value) {
+    size_t name_index = 0;
+
+    for (size_t i = 0; i < STATIC_TABLE_SIZE; i++) {
+        if (strcmp(STATIC_TABLE[i].name, name) != 0) {
+            continue;
+        }
+
+        if (strcmp(STATIC_TABLE[i].value, value) == 0) {
+            return encode_integer(output, 0x80, 7, i + 1);
+        }
+
+        if (name_index == 0) {
+            name_index = i + 1;
+        }
+    }
+
+    for (size_t i = 0; i < table->count; i++) {
+        header_t *entry = table->entries[(table->first + i) % table->capacity];
+        if (strcmp(entry->name, name) != 0) {
+            continue;
+        }
+
+        if (strcmp(entry->value, value) == 0) {
+            return encode_integer(output, 0x80, 7, STATIC_TABLE_SIZE + 1 + i);
+        }
+
+        if (name_index == 0) {
+            name_index = STATIC_TABLE_SIZE + 1 + i;
+        }
+    }
+
+    field_indexing_t indexing = FIELD_INCREMENTAL;
+    if (is_listed(SENSITIVE_HEADERS, sizeof(SENSITIVE_HEADERS) / sizeof(char *), name)) {
+        indexing = FIELD_NEVER_INDEXED;
+    } else if (is_listed(UNINDEXED_HEADERS, sizeof(UNINDEXED_HEADERS) / sizeof(char *), name)) {
+        indexing = FIELD_WITHOUT_INDEXING;
+    }
+
+    int result;
+    switch (indexing) {
+    case FIELD_INCREMENTAL:
+        result = encode_integer(output, 0x40, 6, name_index);
+        break;
+    case FIELD_WITHOUT_INDEXING:
+        result = encode_integer(output, 0x00, 4, name_index);
+        break;
+    case FIELD_NEVER_INDEXED:
+        result = encode_integer(output, 0x10, 4, name_index);
+        break;
+    }
+
+    if (result == -1 || (name_index == 0 && encode_string(output, name) == -1) ||
+        encode_string(output, value) == -1) {
+        return -1;
+    }
+
+    if (indexing == FIELD_INCREMENTAL) {
+        return add_entry(table, name, value);
+    }
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../str.h"
+#include "headers.h"
+
+// Header compression of HTTP/2 (RFC 7541)
+//
+// Every direction of a connection has its own dynamic table: the decoder table follows
+// the header blocks of the client, the encoder table the ones we send. Entries are kept
+// in a ring, the newest first, and the oldest are evicted once the size (the length of
+// name and value plus 32 per entry) goes above the limit.
+
+// Limit of both tables until a peer setting says otherwise
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+typedef struct HpackTable {
+    header_t **entries;
+    size_t capacity;
+    // Ring position of the newest entry
+    size_t first;
+    size_t count;
+    size_t size;
+    size_t max_size;
+    // Encoder only, the next block starts with a table size update
+    int size_update_pending;
+} hpack_table_t;
+
+void hpack_table_init(hpack_table_t *table, size_t max_size);
+void hpack_table_destroy(hpack_table_t *table);
+void hpack_table_resize(hpack_table_t *table, size_t max_size);
+
+int hpack_decode(hpack_table_t *table, const uint8_t *block, size_t length, size_t max_list_size,
+                 header_list_t *headers);
+
+int hpack_encode_start(hpack_table_t *table, string_t *output);
+int hpack_encode_header(hpack_table_t *table, string_t *output, char *name, char *value);
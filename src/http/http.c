@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <strings.h>
+
+#include "../buffer_pool.h"
+#include "../stats.h"
+#include "../str.h"
+#include "headers.h"
+#include "http.h"
+#include "status.h"
+
+void free_request(request_t *request) {
+    if (request == NULL) {
+        return;
+    }
+
+    free(request->method);
+    free(request->uri);
+    free(request->target);
+    free_query_params(request->query_params);
+    free(request->version);
+    free_request_body(request->body);
+    free_header_list(request->headers);
+    free_header_list(request->params);
+    free(request);
+}
+
+/**
+ * Returns 1 if the client speaks HTTP/1.1 or later
+ * otherwise 0
+ */
+int is_http_1_1_request(request_t *request) {
+    return request->version->major > 1 || (request->version->major == 1 && request->version->minor >= 1);
+}
+
+/**
+ * Returns the value of a path parameter captured by the router
+ * or NULL if the route has no such parameter
+ */
+char *get_request_param(request_t *request, char *name) {
+    if (request->params == NULL) {
+        return NULL;
+    }
+
+    header_t *param = find_header(request->params, name);
+    return param == NULL ? NULL : param->value;
+}
+
+/**
+ * Returns the decoded value of a query parameter, its length in `length` (it may hold
+ * null bytes), or NULL if the query has no such parameter. The query is parsed on the
+ * first call, the values live as long as the request.
+ */
+char *get_query_param(request_t *request, char *name, size_t *length) {
+    if (request->query == NULL) {
+        return NULL;
+    }
+
+    if (request->query_params == NULL) {
+        request->query_params = parse_query(request->query, request->query_length);
+        if (request->query_params == NULL) {
+            return NULL;
+        }
+    }
+
+    query_param_t *param = find_query_param(request->query_params, name);
+    if (param == NULL) {
+        return NULL;
+    }
+
+    if (length != NULL) {
+        *length = param->value_length;
+    }
+    return param->value;
+}
+
+/**
+ * HTTP/1.1 connections are persistent unless the client asks to close them,
+ * HTTP/1.0 connections only when the client sends "Connection: keep-alive"
+ *
+ * Returns 1 if the connection should be kept open after the response
+ * otherwise 0
+ */
+int is_keep_alive_request(request_t *request) {
+    header_t *connection = find_known_header(request->headers, HEADER_CONNECTION);
+
+    if (is_http_1_1_request(request)) {
+        return connection == NULL || strcasecmp(connection->value, "close") != 0;
+    }
+
+    return connection != NULL && strcasecmp(connection->value, "keep-alive") == 0;
+}
+
+// Returns 1 if the comma separated list of the header contains token, otherwise 0
+int has_header_token(header_list_t *headers, char *name, char *token) {
+    header_t *header = find_header(headers, name);
+    if (header == NULL) {
+        return 0;
+    }
+
+    size_t token_length = strlen(token);
+    char *item = header->value;
+
+    while (*item != '\0') {
+        while (*item == ' ' || *item == '\t' || *item == ',') {
+            item++;
+        }
+
+        size_t item_length = strcspn(item, ", \t");
+        if (item_length == token_length && strncasecmp(item, token, token_length) == 0) {
+            return 1;
+        }
+
+        item += item_length;
+    }
+
+    return 0;
+}
+
+string_t *create_response(request_t *request, response_t *response) {
+    // Heads fit in the smallest pooled buffer, bodies appended to them may grow it past the pool
+    string_t *res = create_pooled_string(256);
+    if (res == NULL) {
+        return NULL;
+    }
+
+    char *status_code = int_to_str(response->status);
+    char *status_message = get_status_string(response->status);
+
+    if (status_code == NULL) {
+        free_string(res);
+        return NULL;
+    }
+
+    stats_count_response(response->status);
+
+    int is_http_1_1 = is_http_1_1_request(request);
+    // Without chunked encoding the end of a streamed body is signaled by closing the connection
+    int keep_alive = !response->closing && is_keep_alive_request(request) && (!response->streaming || is_http_1_1);
+
+    append_string(res, is_http_1_1 ? "HTTP/1.1" : "HTTP/1.0");
+    append_string(res, " ");
+    append_string(res, status_code);
+    append_string(res, " ");
+    append_string(res, status_message);
+    append_string(res, "\r\n");
+
+    if (response->headers && response->headers->length > 0) {
+        for (size_t i = 0; i < response->headers->length; i++) {
+            char *header_str = format_header_string(response->headers->data[i]);
+            append_string(res, header_str);
+            free(header_str);
+        }
+    }
+
+    if (response->raw_headers != NULL) {
+        append_string(res, (char *)response->raw_headers);
+    }
+
+    if (response->streaming) {
+        if (is_http_1_1) {
+            append_string(res, "Transfer-Encoding: chunked\r\n");
+        }
+    } else if (find_known_header(response->headers, HEADER_CONTENT_LENGTH) == NULL) {
+        // Persistent connections need the length to find where the next response starts
+        char *body_length = int_to_str(response->body_length);
+
+        if (body_length == NULL) {
+            free_string(res);
+            free(status_code);
+            return NULL;
+        }
+
+        append_string(res, "Content-Length: ");
+        append_string(res, body_length);
+        append_string(res, "\r\n");
+        free(body_length);
+    }
+
+    if (keep_alive && !is_http_1_1) {
+        append_string(res, "Connection: keep-alive\r\n");
+    } else if (!keep_alive && is_http_1_1) {
+        append_string(res, "Connection: close\r\n");
+    }
+
+    append_string(res, "\r\n");
+
+    if (response->body != NULL) {
+        append_rawchars(res, response->body, response->body_length);
+    }
+
+    free(status_code);
+
+    return res;
+}
+
+/**
+ * Adds the codings listed in a Transfer-Encoding value to the ones of the previous fields
+ * of the message, TRANSFER_IDENTITY before the first one. The body is chunked only when
+ * chunked is the last coding and the only one: a body with another coding can't be
+ * decoded, and one whose last coding isn't chunked has no length at all.
+ */
+transfer_coding_t add_transfer_codings(transfer_coding_t coding, char *value) {
+    int empty = 1;
+
+    while (*value != '\0') {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+
+        size_t length = strcspn(value, ", \t");
+        if (length == 0) {
+            break;
+        }
+
+        empty = 0;
+        int chunked = length == 7 && strncasecmp(value, "chunked", 7) == 0;
+        coding = coding == TRANSFER_IDENTITY && chunked ? TRANSFER_CHUNKED : TRANSFER_UNSUPPORTED;
+        value += length;
+    }
+
+    return empty ? TRANSFER_UNSUPPORTED : coding;
+}
+
+/**
+ * Reads a Content-Length value into `length`, which is -1 before the first field of the message
+ *
+Returns
+- -1 if the value isn't made of digits only, is too large or differs from a previous field
+- 0 if succeed
+*/
+int add_content_length(long *length, char *value) {
+    size_t digits = strspn(value, "0123456789");
+
+    // 18 digits always fit in a long, trailing white space isn't part of the value
+    if (digits == 0 || digits > 18 || value[digits + strspn(value + digits, " \t")] != '\0') {
+        return -1;
+    }
+
+    long parsed = strtol(value, NULL, 10);
+    if (*length != -1 && *length != parsed) {
+        return -1;
+    }
+
+    *length = parsed;
+    return 0;
+}
@@ -1,5 +1,16 @@
 #pragma once
+#include "../str.h"
+#include "body.h"
 #include "headers.h"
+#include "uri.h"
+
+// Framing of a body given by the Transfer-Encoding fields of its message
+typedef enum TransferCoding {
+    TRANSFER_IDENTITY,
+    TRANSFER_CHUNKED,
+    // Other codings than a single chunked, which can't be decoded
+    TRANSFER_UNSUPPORTED,
+} transfer_coding_t;
 
 typedef struct HttpVersion {
     long major;
@@ -8,15 +19,49 @@ typedef struct HttpVersion {
 
 typedef struct Request {
     char *method;
+    // Request target as received
     char *uri;
+    // Decoded path without dot segments, followed by '?' and the query as received when there is one.
+    // The path is the first path_length bytes, the router matches them (see uri.h)
+    char *target;
+    size_t path_length;
+    // Slice of target, NULL without query
+    char *query;
+    size_t query_length;
+    // Parsed on first use by get_query_param
+    query_params_t *query_params;
     http_version_t *version;
     header_list_t *headers;
-    char *body;
+    // Framing of the body, read by the connection after the head
+    long content_length;
+    int chunked;
+    int expect_continue;
+    // Only set for handlers collecting the whole body, see connection_collect_body
+    request_body_t *body;
+    // Path parameters captured by the router, NULL when the route has none
+    header_list_t *params;
 } request_t;
 
 typedef struct Response {
     int status;
     header_list_t *headers;
+    // Header lines already formatted, written after headers (the precomputed ones of embedded assets)
+    const char *raw_headers;
     char *body;
     size_t body_length;
+    // The body is produced after the head, see connection_stream_response
+    int streaming;
+    // The connection is closed after this response, the client is told so
+    int closing;
 } response_t;
+
+void free_request(request_t *request);
+int is_http_1_1_request(request_t *request);
+int is_keep_alive_request(request_t *request);
+char *get_request_param(request_t *request, char *name);
+char *get_query_param(request_t *request, char *name, size_t *length);
+int has_header_token(header_list_t *headers, char *name, char *token);
+transfer_coding_t add_transfer_codings(transfer_coding_t coding, char *value);
+int add_content_length(long *length, char *value);
+
+string_t *create_response(request_t *request, response_t *response);
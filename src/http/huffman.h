@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Huffman code of HPACK string literals (RFC 7541 appendix B)
+
+size_t huffman_encoded_length(const char *data, size_t length);
+void huffman_encode(const char *data, size_t length, uint8_t *output);
+size_t huffman_decoded_max_length(size_t length);
+ssize_t huffman_decode(const uint8_t *data, size_t length, char *output);
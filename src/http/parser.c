@@ -2,10 +2,13 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "headers.h"
 #include "http.h"
+#include "parser.h"
 #include "parser_helpers.h"
+#include "uri.h"
 
 // IF the character is matched we consume it by incementing i
 // TODO: use buffer_size and avoid overflow
@@ -85,12 +88,8 @@ char *extract_uri(char **buffer, size_t buffer_size, size_t *index) {
     size_t l = i;
     char *buf = *buffer;
 
-    // TODO implement other spec of http with hex string and some special chars
-    while (l + 1 < buffer_size &&
-
-           (is_alpha(buf[l]) || buf[l] == '/' || buf[l] == '.' || buf[l] == '_' || buf[l] == '-' || is_numeric(buf[l]))
-
-    ) {
+    // Any visible character, escapes and the query are handled by normalize_uri
+    while (l + 1 < buffer_size && buf[l] > ' ' && buf[l] != 0x7f) {
         l++;
     }
 
@@ -208,6 +207,7 @@ header_t *extract_header(char **buffer, size_t buffer_size, size_t *index) {
 
     header->name = name;
     header->value = value;
+    header->id = HEADER_UNKNOWN;
 
     return header;
 }
@@ -270,3 +270,258 @@ http_version_t *extract_http_version(char **buffer, size_t buffer_size, size_t *
 
     return version;
 }
+
+/**
+ * Parses the head of a request (request line and headers), the buffer is not modified
+ *
+ * buffer_size includes the null terminator that must follow the head,
+ * the body is read separately by the connection. The body must be framed by a
+ * single Content-Length (repeated fields must agree) or by chunked encoding, never both,
+ * so that the server and any proxy in front of it agree on where the request ends.
+ */
+request_t *parse_request(char *buffer, size_t buffer_size) {
+    // 0 is a simple request - 1 is not
+    int simple_request_candidate = 1;
+    char *method = NULL;
+    char *uri = NULL;
+    http_version_t *version = NULL;
+    header_list_t *header_list = NULL;
+
+    // The body is not part of the buffer, we only take note of how it is framed
+    long content_length = -1;
+    transfer_coding_t coding = TRANSFER_IDENTITY;
+    int malformed_framing = 0;
+    int expect_continue = 0;
+
+    size_t i = 0;
+
+    method = extract_method(&buffer, buffer_size, &i);
+    if (method == NULL) {
+        // FAILED TO EXTRACT METHOD
+        return NULL;
+    }
+
+    simple_request_candidate = strcmp(method, "GET");
+
+    // AS for HTML 1 spec we have a space after a METHOD
+    if (expect_char(&buffer, &i, ' ') == -1) {
+        free(method);
+        return NULL;
+    }
+
+    uri = extract_uri(&buffer, buffer_size, &i);
+    if (uri == NULL) {
+        free(method);
+        return NULL;
+    }
+
+    // AS for HTML 1 spec we have a space after a URI
+    if (expect_char(&buffer, &i, ' ') == -1) {
+        free(method);
+        free(uri);
+        return NULL;
+    }
+
+    version = extract_http_version(&buffer, buffer_size, &i);
+
+    if (version == NULL) {
+        if (simple_request_candidate == 0) {
+            // IF NO VERSION we are receiving an HTTP/0.9 request so we can also
+            // fallback
+            version = malloc(sizeof(http_version_t));
+            if (version == NULL) {
+                free(method);
+                free(uri);
+                return NULL;
+            }
+
+            version->major = 0;
+            version->minor = 9;
+
+        } else {
+            free(method);
+            free(uri);
+            return NULL;
+        }
+    } else {
+        simple_request_candidate = 1;
+    }
+
+    if (expect_char(&buffer, &i, '\r') == -1) {
+        free(method);
+        free(uri);
+        free(version);
+        return NULL;
+    }
+
+    if (expect_char(&buffer, &i, '\n') == -1) {
+        free(method);
+        free(uri);
+        free(version);
+        return NULL;
+    }
+
+    // No longer in HTTP/0.9 land
+    if (simple_request_candidate != 0) {
+        header_list = create_header_list(5);
+
+        if (header_list == NULL) {
+            free(method);
+            free(uri);
+            free(version);
+            return NULL;
+        }
+
+        // Why this strange check ?
+        // IN HTTP spec we have atleast 4 charcater that separates the headers to
+        // the body As we see in the spec we have STATUS_LINE *(HEADERS) CRLF [BODY]
+        // Each section ends with CRLF so even if we dont have any header we can
+        // still consume the 4 tokens
+        while (i + 1 < buffer_size &&
+               !(buffer[i - 2] == '\r' && buffer[i - 1] == '\n' && buffer[i] == '\r' && buffer[i + 1] == '\n')) {
+
+            header_t *header = extract_header(&buffer, buffer_size, &i);
+            if (header == NULL) {
+                free(method);
+                free(uri);
+                free(version);
+                free_header_list(header_list);
+                // Failed to extract an header
+                return NULL;
+            }
+
+            if (append_header_list(header_list, header) == -1) {
+                free(method);
+                free(uri);
+                free(version);
+                free_header(header);
+                free_header_list(header_list);
+                return NULL;
+            }
+
+            // The list recognized the name, case insensitive as HTTP/1.0 spec
+            if (header->id == HEADER_CONTENT_LENGTH) {
+                malformed_framing |= add_content_length(&content_length, header->value) == -1;
+            } else if (header->id == HEADER_TRANSFER_ENCODING) {
+                coding = add_transfer_codings(coding, header->value);
+            } else if (header->id == HEADER_EXPECT && strcasecmp("100-continue", header->value) == 0) {
+                expect_continue = 1;
+            }
+        }
+        // Increment to skip the \r and \n checks since they are done in the while
+        // loop
+        // TODO avoid overflow of buffer:
+        i += 2;
+    }
+
+    // Both framings at once is how requests are smuggled past a proxy disagreeing on the one to use
+    if (malformed_framing || coding == TRANSFER_UNSUPPORTED || (coding == TRANSFER_CHUNKED && content_length != -1)) {
+        free(method);
+        free(uri);
+        free(version);
+        free_header_list(header_list);
+        return NULL;
+    }
+
+    int chunked = coding == TRANSFER_CHUNKED;
+
+    // Malformed escapes and targets that are neither a path nor an absolute URI fail here
+    size_t path_length = 0;
+    char *target = normalize_uri(uri, &path_length);
+    request_t *request = target != NULL ? malloc(sizeof(request_t)) : NULL;
+
+    if (request == NULL) {
+        free(method);
+        free(uri);
+        free(target);
+        free(version);
+        free_header_list(header_list);
+        return NULL;
+    }
+
+    request->method = method;
+    request->uri = uri;
+    request->target = target;
+    request->path_length = path_length;
+    request->query = target[path_length] == '?' ? target + path_length + 1 : NULL;
+    request->query_length = request->query != NULL ? strlen(request->query) : 0;
+    request->query_params = NULL;
+    request->version = version;
+    request->headers = header_list;
+    // A chunked body has no length known upfront, the two framings can't be mixed
+    request->content_length = content_length > 0 ? content_length : 0;
+    request->chunked = chunked;
+    request->expect_continue = expect_continue;
+    request->body = NULL;
+    request->params = NULL;
+
+    return request;
+}
+
+/**
+ * Looks at the bytes of a request head received since the last call, so that a head
+ * over the limits or with a malformed method is rejected before the rest of it arrives.
+ * head_length is set once the head is complete, it stays 0 otherwise.
+ *
+ * A request line without an HTTP version is a simple request (HTTP/0.9) and has no headers
+ *
+Returns
+- OK while the head is within the limits
+- BAD_REQUEST if the method isn't made of letters
+- URI_TOO_LONG if the request line is too long
+- REQUEST_HEADER_FIELDS_TOO_LARGE if there are too many headers or the head is too large
+*/
+status_code_t scan_request_head(request_head_scan_t *scan, char *buffer, size_t buffer_size,
+                                const request_limits_t *limits, size_t *head_length) {
+    *head_length = 0;
+
+    while (scan->scanned < buffer_size) {
+        char *newline = memchr(buffer + scan->scanned, '\n', buffer_size - scan->scanned);
+        size_t line_end = newline != NULL ? (size_t)(newline - buffer) : buffer_size;
+
+        if (!scan->request_line_done) {
+            // The method is the only part known before the line ends, garbage shows there first
+            for (size_t i = scan->scanned; i < line_end && !scan->method_done; i++) {
+                if (buffer[i] == ' ' && i > 0) {
+                    scan->method_done = 1;
+                } else if (!is_alpha(buffer[i])) {
+                    return BAD_REQUEST;
+                }
+            }
+
+            if (line_end > limits->max_request_line) {
+                return URI_TOO_LONG;
+            }
+        }
+
+        if (line_end >= limits->max_head_size) {
+            return REQUEST_HEADER_FIELDS_TOO_LARGE;
+        }
+
+        if (newline == NULL) {
+            scan->scanned = buffer_size;
+            return OK;
+        }
+
+        char *line = buffer + scan->line_start;
+        size_t line_length = line_end - scan->line_start;
+        scan->scanned = line_end + 1;
+        scan->line_start = line_end + 1;
+
+        if (!scan->request_line_done) {
+            scan->request_line_done = 1;
+
+            if (memmem(line, line_length, " HTTP/", 6) == NULL) {
+                *head_length = line_end + 1;
+                return OK;
+            }
+        } else if (line_length == 0 || (line_length == 1 && line[0] == '\r')) {
+            *head_length = line_end + 1;
+            return OK;
+        } else if (++scan->header_count > limits->max_header_count && limits->max_header_count != 0) {
+            return REQUEST_HEADER_FIELDS_TOO_LARGE;
+        }
+    }
+
+    return OK;
+}
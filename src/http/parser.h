@@ -8,6 +8,26 @@
 #include "headers.h"
 #include "http.h"
 #include "parser_helpers.h"
+#include "status.h"
+
+// Bounds of a request head, enforced while it arrives
+typedef struct RequestLimits {
+    size_t max_request_line;
+    // 0 for no limit
+    size_t max_header_count;
+    // Request line, headers and the empty line that ends them
+    size_t max_head_size;
+} request_limits_t;
+
+// Progress of scan_request_head over a head received in pieces, zeroed for every head
+typedef struct RequestHeadScan {
+    // Bytes already looked at, and start of the line being received
+    size_t scanned;
+    size_t line_start;
+    size_t header_count;
+    int method_done;
+    int request_line_done;
+} request_head_scan_t;
 
 int expect_char(char **buffer, size_t *i, char expected);
 
@@ -21,3 +41,8 @@ char *extract_text(char **buffer, size_t buffer_size, size_t *index);
 
 header_t *extract_header(char **buffer, size_t buffer_size, size_t *index);
 http_version_t *extract_http_version(char **buffer, size_t buffer_size, size_t *index);
+
+request_t *parse_request(char *buffer, size_t buffer_size);
+
+status_code_t scan_request_head(request_head_scan_t *scan, char *buffer, size_t buffer_size,
+                                const request_limits_t *limits, size_t *head_length);
@@ -2,6 +2,20 @@
 
 #include "status.h"
 
+const char SERVICE_UNAVAILABLE_RESPONSE[] = "HTTP/1.0 503 Service Unavailable\r\n"
+                                            "Retry-After: 1\r\n"
+                                            "Content-Length: 0\r\n"
+                                            "Connection: close\r\n"
+                                            "\r\n";
+const size_t SERVICE_UNAVAILABLE_RESPONSE_LENGTH = sizeof(SERVICE_UNAVAILABLE_RESPONSE) - 1;
+
+const char TOO_MANY_REQUESTS_RESPONSE[] = "HTTP/1.1 429 Too Many Requests\r\n"
+                                          "Retry-After: 1\r\n"
+                                          "Content-Length: 0\r\n"
+                                          "Connection: close\r\n"
+                                          "\r\n";
+const size_t TOO_MANY_REQUESTS_RESPONSE_LENGTH = sizeof(TOO_MANY_REQUESTS_RESPONSE) - 1;
+
 static const status_map_t status_map[] = {
     // Informational Responses (100–199)
     {.code = CONTINUE, .message = "Continue"},
@@ -15,24 +29,33 @@ static const status_map_t status_map[] = {
     {.code = ACCEPTED, .message = "Accepted"},
     {.code = NON_AUTHORITATIVE_INFORMATION, .message = "Non-Authoritative Information"},
     {.code = NO_CONTENT, .message = "No Content"},
+    {.code = PARTIAL_CONTENT, .message = "Partial Content"},
 
     // Redirection Responses (300–399)
     {.code = MULTIPLE_CHOICES, .message = "Multiple Choices"},
     {.code = MOVED_PERMANENTLY, .message = "Moved Permanently"},
     {.code = FOUND, .message = "Found"},
     {.code = NOT_MODIFIED, .message = "Not Modified"},
+    {.code = TEMPORARY_REDIRECT, .message = "Temporary Redirect"},
+    {.code = PERMANENT_REDIRECT, .message = "Permanent Redirect"},
 
     // Client Error Responses (400–499)
     {.code = BAD_REQUEST, .message = "Bad Request"},
     {.code = UNAUTHORIZED, .message = "Unauthorized"},
     {.code = FORBIDDEN, .message = "Forbidden"},
     {.code = NOT_FOUND, .message = "Not Found"},
+    {.code = METHOD_NOT_ALLOWED, .message = "Method Not Allowed"},
+    {.code = PAYLOAD_TOO_LARGE, .message = "Payload Too Large"},
+    {.code = URI_TOO_LONG, .message = "URI Too Long"},
+    {.code = TOO_MANY_REQUESTS, .message = "Too Many Requests"},
+    {.code = REQUEST_HEADER_FIELDS_TOO_LARGE, .message = "Request Header Fields Too Large"},
 
     // Server Error Responses (500–599)
     {.code = INTERNAL_SERVER_ERROR, .message = "Internal Server Error"},
     {.code = NOT_IMPLEMENTED, .message = "Not Implemented"},
     {.code = BAD_GATEWAY, .message = "Bad Gateway"},
     {.code = SERVICE_UNAVAILABLE, .message = "Service Unavailable"},
+    {.code = GATEWAY_TIMEOUT, .message = "Gateway Timeout"},
 };
 
 static const size_t STATUS_CODE_MAP_SIZE = sizeof(status_map) / sizeof(status_map[0]);
@@ -13,24 +13,33 @@ typedef enum StatusCode {
     ACCEPTED = 202,
     NON_AUTHORITATIVE_INFORMATION = 203,
     NO_CONTENT = 204,
+    PARTIAL_CONTENT = 206,
 
     // Redirection Responses (300–399)
     MULTIPLE_CHOICES = 300,
     MOVED_PERMANENTLY = 301,
     FOUND = 302,
     NOT_MODIFIED = 304,
+    TEMPORARY_REDIRECT = 307,
+    PERMANENT_REDIRECT = 308,
 
     // Client Error Responses (400–499)
     BAD_REQUEST = 400,
     UNAUTHORIZED = 401,
     FORBIDDEN = 403,
     NOT_FOUND = 404,
+    METHOD_NOT_ALLOWED = 405,
+    PAYLOAD_TOO_LARGE = 413,
+    URI_TOO_LONG = 414,
+    TOO_MANY_REQUESTS = 429,
+    REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
 
     // Server Error Responses (500–599)
     INTERNAL_SERVER_ERROR = 500,
     NOT_IMPLEMENTED = 501,
     BAD_GATEWAY = 502,
     SERVICE_UNAVAILABLE = 503,
+    GATEWAY_TIMEOUT = 504,
 
 } status_code_t;
 
@@ -39,4 +48,10 @@ typedef struct StatusMap {
     char *message;
 } status_map_t;
 
+// Prebuilt so that shedding a connection or refusing a client costs a single send
+extern const char SERVICE_UNAVAILABLE_RESPONSE[];
+extern const size_t SERVICE_UNAVAILABLE_RESPONSE_LENGTH;
+extern const char TOO_MANY_REQUESTS_RESPONSE[];
+extern const size_t TOO_MANY_REQUESTS_RESPONSE_LENGTH;
+
 char *get_status_string(status_code_t code);
@@ -0,0 +1,295 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser_helpers.h"
+#include "uri.h"
+
+static char hex_value(char c) {
+    if (is_numeric(c)) {
+        return c - '0';
+    }
+
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    return c - 'A' + 10;
+}
+
+// Returns the offset of the path in an absolute form target ("http://host/path"), or -1 if it is not one
+static long find_absolute_path(char *uri, size_t length) {
+    char *scheme_end = memmem(uri, length, "://", 3);
+    if (scheme_end == NULL || scheme_end == uri || memchr(uri, '/', scheme_end - uri) != NULL) {
+        return -1;
+    }
+
+    char *authority = scheme_end + 3;
+    return authority - uri + strcspn(authority, "/?#");
+}
+
+/**
+ * Writes the decoded path with its dot and empty segments removed to output, ".." above
+ * the root stays at the root (RFC 3986 section 5.2.4). An escaped "/" separates segments
+ * like a literal one, it can't hide a ".." either.
+ *
+ * Returns the length written, or -1 if an escape is malformed or decodes to a null byte
+ */
+static long remove_dot_segments(char *path, size_t length, char *output) {
+    size_t written = 0;
+    size_t segment_start = 0;
+
+    for (size_t i = 0; i <= length; i++) {
+        char c = '/';
+
+        if (i < length && path[i] == '%') {
+            if (i + 2 >= length || !is_hex(path[i + 1]) || !is_hex(path[i + 2])) {
+                return -1;
+            }
+
+            c = hex_value(path[i + 1]) << 4 | hex_value(path[i + 2]);
+            i += 2;
+
+            if (c == '\0') {
+                return -1;
+            }
+        } else if (i < length) {
+            c = path[i];
+        }
+
+        if (c != '/') {
+            output[written++] = c;
+            continue;
+        }
+
+        // The segment ends, "." is dropped and ".." takes the previous segment with it
+        size_t segment_length = written - segment_start;
+        char *segment = output + segment_start;
+
+        if (segment_length == 1 && segment[0] == '.') {
+            written = segment_start;
+        } else if (segment_length == 2 && segment[0] == '.' && segment[1] == '.') {
+            written = segment_start;
+
+            if (written > 1) {
+                written--;
+                while (output[written - 1] != '/') {
+                    written--;
+                }
+            }
+        }
+
+        if (i == length) {
+            break;
+        }
+
+        if (written == 0 || output[written - 1] != '/') {
+            output[written++] = '/';
+        }
+        segment_start = written;
+    }
+
+    return written;
+}
+
+/**
+ * Normalizes a request target: the path is decoded and cleaned up, the query that
+ * follows it is kept as received and a fragment is dropped. An absolute form target
+ * loses its scheme and authority, "*" (OPTIONS) is kept.
+ *
+ * The path is the first `path_length` bytes of the result, a '?' and the query follow
+ * when there is one. The path may contain a decoded '?', only path_length tells where it ends.
+ *
+ * Returns NULL if the target is malformed, or without memory
+ */
+char *normalize_uri(char *uri, size_t *path_length) {
+    size_t length = strcspn(uri, "#");
+    size_t start = 0;
+
+    if (uri[0] != '/') {
+        if (length == 1 && uri[0] == '*') {
+            *path_length = 1;
+            return strdup("*");
+        }
+
+        long absolute_path = find_absolute_path(uri, length);
+        if (absolute_path == -1) {
+            return NULL;
+        }
+
+        start = absolute_path;
+    }
+
+    char *path = uri + start;
+    size_t raw_length = strcspn(path, "?#");
+    size_t query_length = length - start - raw_length;
+
+    // One more byte for the "/" of an absolute form target without path
+    char *normalized = malloc(raw_length + query_length + 2);
+    if (normalized == NULL) {
+        return NULL;
+    }
+
+    long written = 0;
+
+    if (raw_length == 0) {
+        normalized[written++] = '/';
+    } else if (memchr(path, '%', raw_length) == NULL && memmem(path, raw_length, "/.", 2) == NULL &&
+               memmem(path, raw_length, "//", 2) == NULL) {
+        memcpy(normalized, path, raw_length);
+        written = raw_length;
+    } else {
+        written = remove_dot_segments(path, raw_length, normalized);
+    }
+
+    if (written == -1 || normalized[0] != '/') {
+        free(normalized);
+        return NULL;
+    }
+
+    memcpy(normalized + written, path + raw_length, query_length);
+    normalized[written + query_length] = '\0';
+    *path_length = written;
+
+    return normalized;
+}
+
+// Characters a path segment holds as they are, besides letters and digits (RFC 3986 section 3.3)
+static int is_path_char(char c) {
+    return is_alpha(c) || is_numeric(c) || (c != '\0' && strchr("-._~!$&'()*+,;=:@/", c) != NULL);
+}
+
+/**
+ * Encodes a normalized target back to the origin form forwarded to upstreams: the bytes of
+ * the path that can't appear in it as they are, a decoded '%', '?' or space among them, are
+ * escaped again and the query follows as received
+ *
+ * Returns NULL without memory
+ */
+char *encode_target(char *target, size_t path_length) {
+    static const char hex_digits[] = "0123456789ABCDEF";
+    size_t length = strlen(target);
+
+    char *encoded = malloc(path_length * 3 + (length - path_length) + 1);
+    if (encoded == NULL) {
+        return NULL;
+    }
+
+    size_t written = 0;
+    for (size_t i = 0; i < path_length; i++) {
+        unsigned char c = target[i];
+
+        if (is_path_char(c) || (i == 0 && c == '*')) {
+            encoded[written++] = c;
+        } else {
+            encoded[written++] = '%';
+            encoded[written++] = hex_digits[c >> 4];
+            encoded[written++] = hex_digits[c & 0x0f];
+        }
+    }
+
+    memcpy(encoded + written, target + path_length, length - path_length + 1);
+    return encoded;
+}
+
+// Decodes a query component in place ('+' is a space), malformed escapes are kept. Returns its new length
+static size_t decode_query_component(char *component, size_t length) {
+    size_t written = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        if (component[i] == '+') {
+            component[written++] = ' ';
+        } else if (component[i] == '%' && i + 2 < length && is_hex(component[i + 1]) && is_hex(component[i + 2])) {
+            component[written++] = hex_value(component[i + 1]) << 4 | hex_value(component[i + 2]);
+            i += 2;
+        } else {
+            component[written++] = component[i];
+        }
+    }
+
+    component[written] = '\0';
+    return written;
+}
+
+/**
+ * Splits a query in its "name=value" parameters separated by '&', a name without
+ * value has an empty one
+ *
+ * Returns NULL without memory
+ */
+query_params_t *parse_query(char *query, size_t length) {
+    query_params_t *params = calloc(1, sizeof(query_params_t));
+    if (params == NULL) {
+        return NULL;
+    }
+
+    size_t max_count = 1;
+    for (char *separator = memchr(query, '&', length); separator != NULL;
+         separator = memchr(separator + 1, '&', length - (separator + 1 - query))) {
+        max_count++;
+    }
+
+    params->data = malloc(length + 1);
+    params->items = malloc(sizeof(query_param_t) * max_count);
+    if (params->data == NULL || params->items == NULL) {
+        free_query_params(params);
+        return NULL;
+    }
+
+    memcpy(params->data, query, length);
+    params->data[length] = '\0';
+
+    size_t start = 0;
+    while (start <= length) {
+        char *part = params->data + start;
+        size_t part_length = strcspn(part, "&");
+        start += part_length + 1;
+
+        if (part_length == 0) {
+            continue;
+        }
+
+        part[part_length] = '\0';
+
+        query_param_t *param = &params->items[params->length++];
+        char *equals = memchr(part, '=', part_length);
+        size_t name_length = equals != NULL ? (size_t)(equals - part) : part_length;
+
+        param->name = part;
+        param->name_length = decode_query_component(part, name_length);
+
+        if (equals != NULL) {
+            param->value = equals + 1;
+            param->value_length = decode_query_component(equals + 1, part_length - name_length - 1);
+        } else {
+            // The null byte ending the name
+            param->value = part + param->name_length;
+            param->value_length = 0;
+        }
+    }
+
+    return params;
+}
+
+// Returns the first parameter of the query named `name`, or NULL if there is none
+query_param_t *find_query_param(query_params_t *params, char *name) {
+    size_t name_length = strlen(name);
+
+    for (size_t i = 0; i < params->length; i++) {
+        query_param_t *param = &params->items[i];
+        if (param->name_length == name_length && memcmp(param->name, name, name_length) == 0) {
+            return param;
+        }
+    }
+
+    return NULL;
+}
+
+void free_query_params(query_params_t *params) {
+    if (params == NULL) {
+        return;
+    }
+
+    free(params->data);
+    free(params->items);
+    free(params);
+}
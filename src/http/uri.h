@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+
+// Request targets (RFC 9112 section 3.2) and their query (RFC 3986 section 3.4)
+//
+// The path of a target is percent-decoded and its ".", ".." and empty segments are
+// removed in a single pass, so that "/a//b/../c%20d" and "/a/c d" name the same
+// resource and no ".." ever reaches a handler. Paths without escapes nor dot or empty
+// segments, most of them, are found with a few memchr and copied as they are.
+// The query is kept as received, its parameters are only decoded when asked for.
+// Proxied requests carry the normalized target, encoded again by encode_target, so that
+// an upstream sees the resource the router matched.
+
+typedef struct QueryParam {
+    // Decoded, followed by a null byte too
+    char *name;
+    size_t name_length;
+    char *value;
+    size_t value_length;
+} query_param_t;
+
+typedef struct QueryParams {
+    // Decoded copy of the query, the parameters are slices of it
+    char *data;
+    query_param_t *items;
+    size_t length;
+} query_params_t;
+
+char *normalize_uri(char *uri, size_t *path_length);
+char *encode_target(char *target, size_t path_length);
+
+query_params_t *parse_query(char *query, size_t length);
+query_param_t *find_query_param(query_params_t *params, char *name);
+void free_query_params(query_params_t *params);
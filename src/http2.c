@@ -0,0 +1,1547 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http2.h"
+
+#define FRAME_HEADER_SIZE 9
+
+static const char CLIENT_PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const size_t CLIENT_PREFACE_LENGTH = sizeof(CLIENT_PREFACE) - 1;
+
+// Streams a client can open at once, the following ones are refused
+const uint32_t HTTP2_MAX_CONCURRENT_STREAMS = 100;
+// Decoded size of a header block, also the size of the block itself
+const size_t HTTP2_MAX_HEADER_LIST_SIZE = 64 * 1024;
+// Largest HTTP/1.1 response head converted to a HEADERS frame
+const size_t HTTP2_MAX_RESPONSE_HEAD_SIZE = 64 * 1024;
+const int64_t HTTP2_DEFAULT_WINDOW = 65535;
+const int64_t HTTP2_MAX_WINDOW = 0x7fffffff;
+// Received bytes given back at once, so that small frames don't each cost a WINDOW_UPDATE
+const size_t HTTP2_WINDOW_UPDATE_THRESHOLD = 16 * 1024;
+// Socket output above which streams stop converting their responses and frames stop being read
+const size_t HTTP2_OUTPUT_LIMIT = 256 * 1024;
+
+typedef enum Http2FrameType {
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9,
+} http2_frame_type_t;
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+typedef enum Http2Error {
+    HTTP2_NO_ERROR = 0x0,
+    HTTP2_PROTOCOL_ERROR = 0x1,
+    HTTP2_INTERNAL_ERROR = 0x2,
+    HTTP2_FLOW_CONTROL_ERROR = 0x3,
+    HTTP2_STREAM_CLOSED = 0x5,
+    HTTP2_FRAME_SIZE_ERROR = 0x6,
+    HTTP2_REFUSED_STREAM = 0x7,
+    HTTP2_COMPRESSION_ERROR = 0x9,
+    HTTP2_ENHANCE_YOUR_CALM = 0xb,
+} http2_error_t;
+
+typedef enum Http2Setting {
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+} http2_setting_t;
+
+// Connection specific fields, they are meaningless (and forbidden) in HTTP/2
+static int is_hop_by_hop(char *name) {
+    switch (get_header_id(name)) {
+    case HEADER_CONNECTION:
+    case HEADER_KEEP_ALIVE:
+    case HEADER_PROXY_CONNECTION:
+    case HEADER_TRANSFER_ENCODING:
+    case HEADER_UPGRADE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static uint32_t read_uint32(const uint8_t *data) {
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+static void write_uint32(uint8_t *data, uint32_t value) {
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >> 8;
+    data[3] = value;
+}
+
+static int append_text(string_t *string, char *text) {
+    return append_rawchars(string, text, strlen(text));
+}
+
+/**
+ * Looks for the client connection preface at the start of a connection
+ *
+Returns
+- -1 if the input is not HTTP/2
+- 0 if the input is a start of the preface, more is needed
+- 1 if the input starts with the preface
+*/
+int http2_detect_preface(char *buffer, size_t length) {
+    size_t compared = length < CLIENT_PREFACE_LENGTH ? length : CLIENT_PREFACE_LENGTH;
+
+    if (memcmp(buffer, CLIENT_PREFACE, compared) != 0) {
+        return -1;
+    }
+
+    return compared == CLIENT_PREFACE_LENGTH ? 1 : 0;
+}
+
+/**
+ * Upgrades are only taken for HTTP/1.1 requests without body, the body would have to be
+ * read before switching (RFC 7540 section 3.2)
+ *
+ * Returns 1 if the request asks to switch to h2c, otherwise 0
+ */
+int http2_is_upgrade_request(request_t *request) {
+    return is_http_1_1_request(request) && !request->chunked && request->content_length == 0 &&
+           has_header_token(request->headers, "Upgrade", "h2c") &&
+           has_header_token(request->headers, "Connection", "Upgrade") &&
+           find_header(request->headers, "HTTP2-Settings") != NULL;
+}
+
+/**
+ * Asks the loop for a writable event of the socket, frames queued by streams outside of
+ * the session input are flushed from there and runnable streams get their turn
+ */
+static void request_write(http2_session_t *session) {
+    connection_t *connection = session->connection;
+    event_loop_modify(connection->loop, &connection->watcher, connection->watcher.events | EPOLLOUT);
+}
+
+/**
+Returns
+- -1 if append fails
+- 0 if succeed
+*/
+static int queue_frame(http2_session_t *session, uint8_t type, uint8_t flags, uint32_t stream_id,
+                       const void *payload, size_t length) {
+    uint8_t *frame = malloc(FRAME_HEADER_SIZE + length);
+    if (frame == NULL) {
+        return -1;
+    }
+
+    frame[0] = length >> 16;
+    frame[1] = length >> 8;
+    frame[2] = length;
+    frame[3] = type;
+    frame[4] = flags;
+    write_uint32(frame + 5, stream_id & 0x7fffffff);
+
+    if (length > 0) {
+        memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+    }
+
+    return output_queue_push_buffer(&session->connection->output, (char *)frame, FRAME_HEADER_SIZE + length);
+}
+
+static int queue_rst_stream(http2_session_t *session, uint32_t stream_id, http2_error_t error) {
+    uint8_t payload[4];
+    write_uint32(payload, error);
+
+    return queue_frame(session, FRAME_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static int queue_window_update(http2_session_t *session, uint32_t stream_id, size_t increment) {
+    uint8_t payload[4];
+    write_uint32(payload, increment);
+
+    return queue_frame(session, FRAME_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+/**
+ * Ends the session after a connection error, the GOAWAY is sent and the socket closed
+ * once the output drained
+ *
+ * Returns -1 so that frame handlers can return it
+ */
+static int fail_session(http2_session_t *session, http2_error_t error) {
+    // A draining session already sent its GOAWAY
+    if (session->goaway_sent) {
+        session->connection->state = CONNECTION_CLOSING;
+        return -1;
+    }
+
+    uint8_t payload[8];
+    write_uint32(payload, session->last_stream_id);
+    write_uint32(payload + 4, error);
+
+    queue_frame(session, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    session->goaway_sent = 1;
+    session->connection->state = CONNECTION_CLOSING;
+
+    return -1;
+}
+
+/**
+ * Tells the client that the server is going away, the streams it opened so far still
+ * get their response (RFC 9113 section 6.8)
+ */
+void http2_session_drain(http2_session_t *session) {
+    if (session->goaway_sent) {
+        return;
+    }
+
+    uint8_t payload[8];
+    write_uint32(payload, session->last_stream_id);
+    write_uint32(payload + 4, HTTP2_NO_ERROR);
+
+    if (queue_frame(session, FRAME_GOAWAY, 0, 0, payload, sizeof(payload)) == 0) {
+        session->goaway_sent = 1;
+        request_write(session);
+    }
+}
+
+static http2_stream_t *find_stream(http2_session_t *session, uint32_t id) {
+    for (http2_stream_t *stream = session->streams; stream != NULL; stream = stream->next) {
+        if (stream->id == id) {
+            return stream;
+        }
+    }
+
+    return NULL;
+}
+
+static void remove_stream(http2_session_t *session, http2_stream_t *stream) {
+    http2_stream_t **link = &session->streams;
+
+    while (*link != stream) {
+        link = &(*link)->next;
+    }
+
+    *link = stream->next;
+    session->stream_count--;
+
+    if (stream->response_head != NULL) {
+        free_string(stream->response_head);
+    }
+    free(stream);
+}
+
+// Stops a stream after a stream error, its connection is closed
+static void reset_stream(http2_stream_t *stream, http2_error_t error) {
+    queue_rst_stream(stream->session, stream->id, error);
+    stream->finished = 1;
+    close_connection(stream->connection);
+}
+
+/**
+ * Opens a stream whose request head is already written in HTTP/1.1
+ *
+ * The request starts running right away, the stream may be closed when the function returns
+ */
+static void open_stream(http2_session_t *session, uint32_t id, string_t *head, int end_stream, int head_request) {
+    http2_stream_t *stream = calloc(1, sizeof(http2_stream_t));
+    if (stream == NULL) {
+        queue_rst_stream(session, id, HTTP2_INTERNAL_ERROR);
+        return;
+    }
+
+    stream->session = session;
+    stream->id = id;
+    stream->send_window = session->initial_window;
+    stream->receive_window = HTTP2_DEFAULT_WINDOW;
+    stream->end_stream_received = end_stream;
+    stream->head_request = head_request;
+    chunked_decoder_init(&stream->chunked);
+
+    stream->next = session->streams;
+    session->streams = stream;
+    session->stream_count++;
+
+    stream->connection = open_stream_connection(session->connection, stream);
+    if (stream->connection == NULL) {
+        queue_rst_stream(session, id, HTTP2_INTERNAL_ERROR);
+        remove_stream(session, stream);
+        return;
+    }
+
+    connection_feed(stream->connection, head->data, head->length);
+}
+
+static int is_token_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+// Field names are lower case tokens in HTTP/2
+static int is_valid_name(char *name) {
+    if (*name == '\0') {
+        return 0;
+    }
+
+    for (; *name != '\0'; name++) {
+        if ((*name >= 'A' && *name <= 'Z') || !is_token_char(*name)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Values end up in an HTTP/1.1 head, line breaks would smuggle fields
+static int is_valid_value(char *value) {
+    return strpbrk(value, "\r\n") == NULL;
+}
+
+// Methods, paths and authorities end up in the request line, they can't contain spaces
+static int is_valid_request_part(char *part) {
+    for (; *part != '\0'; part++) {
+        if ((unsigned char)*part <= ' ' || *part == 0x7f) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int append_field(string_t *head, char *name, char *value) {
+    if (append_text(head, name) == -1 || append_text(head, ": ") == -1 || append_text(head, value) == -1) {
+        return -1;
+    }
+
+    return append_text(head, "\r\n");
+}
+
+/**
+ * Writes the request of a header block as an HTTP/1.1 head, the body follows in
+ * chunked encoding when the HEADERS frame didn't end the stream
+ *
+ * Returns NULL if the fields are malformed (RFC 9113 section 8.2 and 8.3)
+ */
+static string_t *create_request_head(header_list_t *fields, int has_body, int *head_request) {
+    char *method = NULL;
+    char *path = NULL;
+    char *scheme = NULL;
+    char *authority = NULL;
+    size_t pseudo_count = 0;
+
+    // Pseudo-header fields come first, once each
+    for (; pseudo_count < fields->length && fields->data[pseudo_count]->name[0] == ':'; pseudo_count++) {
+        header_t *field = fields->data[pseudo_count];
+        char **target = NULL;
+
+        if (strcmp(field->name, ":method") == 0) {
+            target = &method;
+        } else if (strcmp(field->name, ":path") == 0) {
+            target = &path;
+        } else if (strcmp(field->name, ":scheme") == 0) {
+            target = &scheme;
+        } else if (strcmp(field->name, ":authority") == 0) {
+            target = &authority;
+        }
+
+        if (target == NULL || *target != NULL || !is_valid_request_part(field->value)) {
+            return NULL;
+        }
+        *target = field->value;
+    }
+
+    // CONNECT tunnels are not supported, like in HTTP/1.1
+    if (method == NULL || path == NULL || scheme == NULL || strcmp(method, "CONNECT") == 0 ||
+        (path[0] != '/' && strcmp(path, "*") != 0)) {
+        return NULL;
+    }
+
+    string_t *head = create_string(256);
+    if (head == NULL) {
+        return NULL;
+    }
+
+    int failed = append_text(head, method) == -1 || append_text(head, " ") == -1 || append_text(head, path) == -1 ||
+                 append_text(head, " HTTP/1.1\r\n") == -1 ||
+                 (authority != NULL && append_field(head, "Host", authority) == -1);
+
+    // Cookies may be split in several fields, HTTP/1.1 expects a single one
+    string_t *cookie = NULL;
+
+    for (size_t i = pseudo_count; i < fields->length && !failed; i++) {
+        header_t *field = fields->data[i];
+
+        if (!is_valid_name(field->name) || !is_valid_value(field->value) || is_hop_by_hop(field->name) ||
+            (strcmp(field->name, "te") == 0 && strcmp(field->value, "trailers") != 0)) {
+            failed = 1;
+            break;
+        }
+
+        // The body is chunked anyway and the client doesn't wait for a 100 (Continue)
+        if (strcmp(field->name, "te") == 0 || strcmp(field->name, "content-length") == 0 ||
+            strcmp(field->name, "expect") == 0 || (authority != NULL && strcmp(field->name, "host") == 0)) {
+            continue;
+        }
+
+        if (strcmp(field->name, "cookie") == 0) {
+            if (cookie == NULL) {
+                cookie = create_string(128);
+                failed = cookie == NULL;
+            } else {
+                failed = append_text(cookie, "; ") == -1;
+            }
+
+            failed = failed || append_text(cookie, field->value) == -1;
+            continue;
+        }
+
+        failed = append_field(head, field->name, field->value) == -1;
+    }
+
+    if (cookie != NULL) {
+        // Null terminated for append_field
+        failed = failed || append_rawchars(cookie, "", 1) == -1 || append_field(head, "cookie", cookie->data) == -1;
+        free_string(cookie);
+    }
+
+    failed = failed || (has_body && append_text(head, "Transfer-Encoding: chunked\r\n") == -1) ||
+             append_text(head, "\r\n") == -1;
+
+    if (failed) {
+        free_string(head);
+        return NULL;
+    }
+
+    *head_request = strcmp(method, "HEAD") == 0;
+    return head;
+}
+
+/**
+ * Writes the request that upgraded to h2c again without its connection fields,
+ * it becomes stream 1
+ *
+ * Returns NULL on allocation failure
+ */
+static string_t *create_upgraded_request_head(request_t *request) {
+    string_t *head = create_string(256);
+    if (head == NULL) {
+        return NULL;
+    }
+
+    int failed = append_text(head, request->method) == -1 || append_text(head, " ") == -1 ||
+                 append_text(head, request->uri) == -1 || append_text(head, " HTTP/1.1\r\n") == -1;
+
+    for (size_t i = 0; i < request->headers->length && !failed; i++) {
+        header_t *header = request->headers->data[i];
+
+        if (is_hop_by_hop(header->name) || header->id == HEADER_HTTP2_SETTINGS || header->id == HEADER_TE) {
+            continue;
+        }
+
+        failed = append_field(head, header->name, header->value) == -1;
+    }
+
+    if (failed || append_text(head, "\r\n") == -1) {
+        free_string(head);
+        return NULL;
+    }
+
+    return head;
+}
+
+/**
+ * Hands DATA to the stream connection as a chunk, the end of the stream as the last chunk
+ *
+ * The stream may be closed when the function returns
+ */
+static void feed_body(http2_stream_t *stream, const uint8_t *data, size_t length, int end_stream) {
+    char size_line[20];
+    int size_length = length > 0 ? snprintf(size_line, sizeof(size_line), "%zx\r\n", length) : 0;
+    size_t chunk_length = length > 0 ? size_length + length + 2 : 0;
+    size_t total = chunk_length + (end_stream ? 5 : 0);
+
+    if (total == 0) {
+        return;
+    }
+
+    char *chunk = malloc(total);
+    if (chunk == NULL) {
+        reset_stream(stream, HTTP2_INTERNAL_ERROR);
+        return;
+    }
+
+    if (length > 0) {
+        memcpy(chunk, size_line, size_length);
+        memcpy(chunk + size_length, data, length);
+        memcpy(chunk + size_length + length, "\r\n", 2);
+    }
+
+    if (end_stream) {
+        memcpy(chunk + chunk_length, "0\r\n\r\n", 5);
+    }
+
+    connection_feed(stream->connection, chunk, total);
+    free(chunk);
+}
+
+/**
+ * Returns -1 after a connection error, otherwise 0
+ */
+static int apply_setting(http2_session_t *session, uint16_t id, uint32_t value) {
+    switch (id) {
+    case SETTINGS_HEADER_TABLE_SIZE: {
+        size_t size = value < HPACK_DEFAULT_TABLE_SIZE ? value : HPACK_DEFAULT_TABLE_SIZE;
+        if (size != session->encoder.max_size) {
+            hpack_table_resize(&session->encoder, size);
+        }
+        return 0;
+    }
+
+    case SETTINGS_ENABLE_PUSH:
+        return value > 1 ? fail_session(session, HTTP2_PROTOCOL_ERROR) : 0;
+
+    case SETTINGS_INITIAL_WINDOW_SIZE: {
+        if (value > HTTP2_MAX_WINDOW) {
+            return fail_session(session, HTTP2_FLOW_CONTROL_ERROR);
+        }
+
+        // The change applies to the windows of the open streams too
+        int64_t delta = (int64_t)value - session->initial_window;
+        session->initial_window = value;
+
+        for (http2_stream_t *stream = session->streams; stream != NULL; stream = stream->next) {
+            stream->send_window += delta;
+            if (stream->send_window > HTTP2_MAX_WINDOW) {
+                return fail_session(session, HTTP2_FLOW_CONTROL_ERROR);
+            }
+        }
+        return 0;
+    }
+
+    case SETTINGS_MAX_FRAME_SIZE:
+        // We keep sending frames of the initial size, which every peer accepts
+        return value < HTTP2_MAX_FRAME_SIZE || value > 0xffffff ? fail_session(session, HTTP2_PROTOCOL_ERROR) : 0;
+
+    default:
+        return 0;
+    }
+}
+
+static int apply_settings(http2_session_t *session, const uint8_t *payload, size_t length) {
+    for (size_t i = 0; i + 6 <= length; i += 6) {
+        uint16_t id = (payload[i] << 8) | payload[i + 1];
+
+        if (apply_setting(session, id, read_uint32(payload + i + 2)) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int base64url_value(char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '-' || c == '+') {
+        return 62;
+    }
+    if (c == '_' || c == '/') {
+        return 63;
+    }
+
+    return -1;
+}
+
+/**
+ * Decodes the HTTP2-Settings header of an upgrade, the SETTINGS payload in base64url
+ *
+ * Returns the payload length, or -1 if the value is invalid
+ */
+static ssize_t decode_upgrade_settings(char *value, uint8_t *payload, size_t capacity) {
+    size_t length = 0;
+    uint32_t bits = 0;
+    int bit_count = 0;
+
+    for (; *value != '\0' && *value != '='; value++) {
+        int digit = base64url_value(*value);
+        if (digit == -1) {
+            return -1;
+        }
+
+        bits = (bits << 6) | digit;
+        bit_count += 6;
+
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            if (length == capacity) {
+                return -1;
+            }
+            payload[length++] = bits >> bit_count;
+        }
+    }
+
+    return length % 6 == 0 ? (ssize_t)length : -1;
+}
+
+/**
+ * Switches the connection to HTTP/2 once its preface has been detected, or after
+ * the 101 (Switching Protocols) response of an upgrade, whose request becomes stream 1
+ *
+Returns
+- -1 if the session can't be started
+- 0 if succeed
+*/
+int http2_session_start(connection_t *connection, request_t *upgrade_request) {
+    http2_session_t *session = calloc(1, sizeof(http2_session_t));
+    if (session == NULL) {
+        return -1;
+    }
+
+    session->connection = connection;
+    session->send_window = HTTP2_DEFAULT_WINDOW;
+    session->initial_window = HTTP2_DEFAULT_WINDOW;
+    hpack_table_init(&session->decoder, HPACK_DEFAULT_TABLE_SIZE);
+    hpack_table_init(&session->encoder, HPACK_DEFAULT_TABLE_SIZE);
+
+    connection->http2 = session;
+    connection->state = CONNECTION_HTTP2;
+
+    // Our connection preface
+    uint8_t settings[12];
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    write_uint32(settings + 2, HTTP2_MAX_CONCURRENT_STREAMS);
+    settings[6] = 0;
+    settings[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    write_uint32(settings + 8, HTTP2_MAX_HEADER_LIST_SIZE);
+
+    if (queue_frame(session, FRAME_SETTINGS, 0, 0, settings, sizeof(settings)) == -1) {
+        return -1;
+    }
+
+    if (upgrade_request == NULL) {
+        return 0;
+    }
+
+    // The 101 response acknowledges these settings, no SETTINGS ACK is sent for them
+    uint8_t payload[256];
+    header_t *header = find_header(upgrade_request->headers, "HTTP2-Settings");
+    ssize_t length = decode_upgrade_settings(header->value, payload, sizeof(payload));
+
+    if (length == -1 || apply_settings(session, payload, length) == -1) {
+        return -1;
+    }
+
+    string_t *head = create_upgraded_request_head(upgrade_request);
+    if (head == NULL) {
+        return -1;
+    }
+
+    session->last_stream_id = 1;
+    open_stream(session, 1, head, 1, strcmp(upgrade_request->method, "HEAD") == 0);
+    free_string(head);
+
+    return 0;
+}
+
+// Closes every stream, they send nothing anymore
+void free_http2_session(http2_session_t *session) {
+    session->closing = 1;
+
+    while (session->streams != NULL) {
+        close_connection(session->streams->connection);
+    }
+
+    if (session->header_block != NULL) {
+        free_string(session->header_block);
+    }
+
+    hpack_table_destroy(&session->decoder);
+    hpack_table_destroy(&session->encoder);
+
+    session->connection->http2 = NULL;
+    free(session);
+}
+
+/**
+ * Handles a complete header block: opens a stream, or ends one with its trailers
+ *
+ * Returns -1 after a connection error, otherwise 0
+ */
+static int end_header_block(http2_session_t *session) {
+    string_t *block = session->header_block;
+    uint32_t id = session->header_block_stream;
+    int end_stream = session->header_block_end_stream;
+
+    session->header_block = NULL;
+
+    header_list_t *fields = create_header_list(16);
+    if (fields == NULL) {
+        free_string(block);
+        return fail_session(session, HTTP2_INTERNAL_ERROR);
+    }
+
+    // The block is decoded even for refused streams, the table must stay in sync
+    int result = hpack_decode(&session->decoder, (uint8_t *)block->data, block->length, HTTP2_MAX_HEADER_LIST_SIZE,
+                              fields);
+    free_string(block);
+
+    if (result == -1) {
+        free_header_list(fields);
+        return fail_session(session, HTTP2_COMPRESSION_ERROR);
+    }
+
+    http2_stream_t *stream = find_stream(session, id);
+
+    if (stream != NULL) {
+        // Trailers, they are dropped like the ones of chunked bodies
+        if (!end_stream || stream->end_stream_received) {
+            reset_stream(stream, HTTP2_PROTOCOL_ERROR);
+        } else {
+            stream->end_stream_received = 1;
+            feed_body(stream, NULL, 0, 1);
+        }
+    } else if (id > session->last_stream_id) {
+        session->last_stream_id = id;
+
+        int head_request = 0;
+        string_t *head = NULL;
+
+        if (session->stream_count >= HTTP2_MAX_CONCURRENT_STREAMS) {
+            queue_rst_stream(session, id, HTTP2_REFUSED_STREAM);
+        } else if ((head = create_request_head(fields, !end_stream, &head_request)) == NULL) {
+            queue_rst_stream(session, id, HTTP2_PROTOCOL_ERROR);
+        } else {
+            open_stream(session, id, head, end_stream, head_request);
+            free_string(head);
+        }
+    }
+
+    // Blocks of streams already closed are ignored
+    free_header_list(fields);
+    return 0;
+}
+
+/**
+ * Strips the padding of DATA and HEADERS frames
+ *
+ * Returns -1 if the padding is longer than the frame, otherwise 0
+ */
+static int remove_padding(uint8_t flags, const uint8_t **payload, size_t *length) {
+    if (!(flags & FLAG_PADDED)) {
+        return 0;
+    }
+
+    if (*length < 1 || (*payload)[0] >= *length) {
+        return -1;
+    }
+
+    *length -= 1 + (*payload)[0];
+    *payload += 1;
+    return 0;
+}
+
+static int on_headers(http2_session_t *session, uint8_t flags, uint32_t id, const uint8_t *payload,
+                      size_t length) {
+    if (id == 0 || id % 2 == 0 || remove_padding(flags, &payload, &length) == -1) {
+        return fail_session(session, HTTP2_PROTOCOL_ERROR);
+    }
+
+    // Priorities are deprecated, the stream dependency and weight are skipped
+    if (flags & FLAG_PRIORITY) {
+        if (length < 5) {
+            return fail_session(session, HTTP2_PROTOCOL_ERROR);
+        }
+
+        payload += 5;
+        length -= 5;
+    }
+
+    session->header_block = create_string(length + 1);
+    if (session->header_block == NULL || append_rawchars(session->header_block, (char *)payload, length) == -1) {
+        return fail_session(session, HTTP2_INTERNAL_ERROR);
+    }
+
+    session->header_block_stream = id;
+    session->header_block_end_stream = flags & FLAG_END_STREAM;
+
+    return flags & FLAG_END_HEADERS ? end_header_block(session) : 0;
+}
+
+static int on_continuation(http2_session_t *session, uint8_t flags, uint32_t id, const uint8_t *payload,
+                           size_t length) {
+    if (session->header_block == NULL || id != session->header_block_stream) {
+        return fail_session(session, HTTP2_PROTOCOL_ERROR);
+    }
+
+    if (session->header_block->length + length > HTTP2_MAX_HEADER_LIST_SIZE) {
+        return fail_session(session, HTTP2_ENHANCE_YOUR_CALM);
+    }
+
+    if (append_rawchars(session->header_block, (char *)payload, length) == -1) {
+        return fail_session(session, HTTP2_INTERNAL_ERROR);
+    }
+
+    return flags & FLAG_END_HEADERS ? end_header_block(session) : 0;
+}
+
+static int on_data(http2_session_t *session, uint8_t flags, uint32_t id, const uint8_t *payload, size_t length) {
+    if (id == 0) {
+        return fail_session(session, HTTP2_PROTOCOL_ERROR);
+    }
+
+    // The whole frame counts against the windows, padding included
+    size_t frame_length = length;
+    session->unacknowledged += frame_length;
+
+    if (remove_padding(flags, &payload, &length) == -1) {
+        return fail_session(session, HTTP2_PROTOCOL_ERROR);
+    }
+
+    http2_stream_t *stream = find_stream(session, id);
+
+    if (stream == NULL) {
+        // Streams we already closed may still have frames in flight
+        return id > session->last_stream_id ? fail_session(session, HTTP2_PROTOCOL_ERROR) : 0;
+    }
+
+    if (stream->end_stream_received) {
+        reset_stream(stream, HTTP2_STREAM_CLOSED);
+        return 0;
+    }
+
+    if ((int64_t)frame_length > stream->receive_window) {
+        reset_stream(stream, HTTP2_FLOW_CONTROL_ERROR);
+        return 0;
+    }
+
+    stream->receive_window -= frame_length;
+    stream->unacknowledged += frame_length;
+    stream->end_stream_received = flags & FLAG_END_STREAM;
+
+    feed_body(stream, payload, length, flags & FLAG_END_STREAM);
+    return 0;
+}
+
+static int on_rst_stream(http2_session_t *session, uint32_t id, size_t length) {
+    if (id == 0) {
+        return fail_session(session, HTTP2_PROTOCOL_ERROR);
+    }
+
+    if (length != 4) {
+        return fail_session(session, HTTP2_FRAME_SIZE_ERROR);
+    }
+
+    http2_stream_t *stream = find_stream(session, id);
+
+    if (stream == NULL) {
+        return id > session->last_stream_id ? fail_session(session, HTTP2_PROTOCOL_ERROR) : 0;
+    }
+
+    stream->finished = 1;
+    close_connection(stream->connection);
+    return 0;
+}
+
+static int on_settings(http2_session_t *session, uint8_t flags, uint32_t id, const uint8_t *payload,
+                       size_t length) {
+    if (id != 0) {
+        return fail_session(session, HTTP2_PROTOCOL_ERROR);
+    }
+
+    if (flags & FLAG_ACK) {
+        return length == 0 ? 0 : fail_session(session, HTTP2_FRAME_SIZE_ERROR);
+    }
+
+    if (length % 6 != 0) {
+        return fail_session(session, HTTP2_FRAME_SIZE_ERROR);
+    }
+
+    if (apply_settings(session, payload, length) == -1) {
+        return -1;
+    }
+
+    return queue_frame(session, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static int on_ping(http2_session_t *session, uint8_t flags, uint32_t id, const uint8_t *payload, size_t length) {
+    if (id != 0) {
+        return fail_session(session, HTTP2_PROTOCOL_ERROR);
+    }
+
+    if (length != 8) {
+        return fail_session(session, HTTP2_FRAME_SIZE_ERROR);
+    }
+
+    if (flags & FLAG_ACK) {
+        return 0;
+    }
+
+    return queue_frame(session, FRAME_PING, FLAG_ACK, 0, payload, length);
+}
+
+static int on_window_update(http2_session_t *session, uint32_t id, const uint8_t *payload, size_t length) {
+    if (length != 4) {
+        return fail_session(session, HTTP2_FRAME_SIZE_ERROR);
+    }
+
+    uint32_t increment = read_uint32(payload) & 0x7fffffff;
+
+    if (id == 0) {
+        session->send_window += increment;
+
+        if (increment == 0) {
+            return fail_session(session, HTTP2_PROTOCOL_ERROR);
+        }
+
+        return session->send_window > HTTP2_MAX_WINDOW ? fail_session(session, HTTP2_FLOW_CONTROL_ERROR) : 0;
+    }
+
+    http2_stream_t *stream = find_stream(session, id);
+
+    if (stream == NULL) {
+        return id > session->last_stream_id ? fail_session(session, HTTP2_PROTOCOL_ERROR) : 0;
+    }
+
+    stream->send_window += increment;
+
+    if (increment == 0) {
+        reset_stream(stream, HTTP2_PROTOCOL_ERROR);
+    } else if (stream->send_window > HTTP2_MAX_WINDOW) {
+        reset_stream(stream, HTTP2_FLOW_CONTROL_ERROR);
+    }
+
+    return 0;
+}
+
+/**
+ * Returns -1 after a connection error, otherwise 0
+ */
+static int handle_frame(http2_session_t *session, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *payload,
+                        size_t length) {
+    // Nothing may come between the frames of a header block
+    if (session->header_block != NULL && type != FRAME_CONTINUATION) {
+        return fail_session(session, HTTP2_PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+    case FRAME_DATA:
+        return on_data(session, flags, id, payload, length);
+
+    case FRAME_HEADERS:
+        return on_headers(session, flags, id, payload, length);
+
+    case FRAME_CONTINUATION:
+        return on_continuation(session, flags, id, payload, length);
+
+    case FRAME_PRIORITY:
+        if (id == 0) {
+            return fail_session(session, HTTP2_PROTOCOL_ERROR);
+        }
+        if (length != 5) {
+            return fail_session(session, HTTP2_FRAME_SIZE_ERROR);
+        }
+        return 0;
+
+    case FRAME_RST_STREAM:
+        return on_rst_stream(session, id, length);
+
+    case FRAME_SETTINGS:
+        return on_settings(session, flags, id, payload, length);
+
+    case FRAME_PING:
+        return on_ping(session, flags, id, payload, length);
+
+    case FRAME_GOAWAY:
+        // The client stops opening streams, the open ones are still answered
+        return id == 0 ? 0 : fail_session(session, HTTP2_PROTOCOL_ERROR);
+
+    case FRAME_WINDOW_UPDATE:
+        return on_window_update(session, id, payload, length);
+
+    case FRAME_PUSH_PROMISE:
+        // Only servers push
+        return fail_session(session, HTTP2_PROTOCOL_ERROR);
+
+    default:
+        // Unknown frame types are ignored (RFC 9113 section 4.1)
+        return 0;
+    }
+}
+
+/**
+ * Handles the frames received on the socket connection, streams run their requests
+ * as their frames arrive
+ *
+ * Reading stops while the output is above its limit, the socket flush resumes it
+ *
+ * Returns -1 if the connection has been closed, otherwise 0
+ */
+int http2_session_input(connection_t *connection) {
+    http2_session_t *session = connection->http2;
+    uint8_t *input = (uint8_t *)connection->buffer;
+    size_t offset = 0;
+
+    if (!session->preface_received) {
+        int preface = http2_detect_preface(connection->buffer, connection->buffer_length);
+
+        if (preface == -1) {
+            close_connection(connection);
+            return -1;
+        }
+
+        if (preface == 0) {
+            return 0;
+        }
+
+        session->preface_received = 1;
+        offset = CLIENT_PREFACE_LENGTH;
+    }
+
+    while (connection->state == CONNECTION_HTTP2 && !connection->reading_paused) {
+        size_t available = connection->buffer_length - offset;
+        if (available < FRAME_HEADER_SIZE) {
+            break;
+        }
+
+        uint8_t *frame = input + offset;
+        size_t length = (frame[0] << 16) | (frame[1] << 8) | frame[2];
+
+        if (length > HTTP2_MAX_FRAME_SIZE) {
+            fail_session(session, HTTP2_FRAME_SIZE_ERROR);
+            break;
+        }
+
+        if (available < FRAME_HEADER_SIZE + length) {
+            break;
+        }
+
+        uint32_t id = read_uint32(frame + 5) & 0x7fffffff;
+        offset += FRAME_HEADER_SIZE + length;
+
+        if (handle_frame(session, frame[3], frame[4], id, frame + FRAME_HEADER_SIZE, length) == -1) {
+            break;
+        }
+
+        if (connection->output.buffered_bytes >= HTTP2_OUTPUT_LIMIT) {
+            connection->reading_paused = 1;
+        }
+    }
+
+    connection->buffer_length -= offset;
+    memmove(connection->buffer, connection->buffer + offset, connection->buffer_length);
+
+    // The connection window is given back as soon as the frames have been handed to their streams,
+    // the stream windows bound what is buffered
+    if (session->unacknowledged >= HTTP2_WINDOW_UPDATE_THRESHOLD && !session->goaway_sent) {
+        if (queue_window_update(session, 0, session->unacknowledged) == -1) {
+            close_connection(connection);
+            return -1;
+        }
+
+        session->unacknowledged = 0;
+    }
+
+    return 0;
+}
+
+static int has_window(http2_stream_t *stream) {
+    return stream->send_window > 0 && stream->session->send_window > 0;
+}
+
+// Streams waiting for the socket, and with a window when their head is already sent
+static int can_run(http2_stream_t *stream) {
+    return stream->runnable && (!stream->head_sent || has_window(stream));
+}
+
+/**
+ * Gives a turn to every stream that has more to send, the socket output must have drained
+ *
+ * Returns 1 if frames have been queued, otherwise 0
+ */
+int http2_session_run(connection_t *connection) {
+    http2_session_t *session = connection->http2;
+    size_t buffered = connection->output.buffered_bytes;
+
+    session->run_round++;
+
+    // Running a stream can close it, or others, the list is walked again every time
+    while (connection->state == CONNECTION_HTTP2) {
+        http2_stream_t *stream = session->streams;
+
+        while (stream != NULL && (stream->run_round == session->run_round || !can_run(stream))) {
+            stream = stream->next;
+        }
+
+        if (stream == NULL) {
+            break;
+        }
+
+        stream->run_round = session->run_round;
+        connection_wake(stream->connection);
+    }
+
+    return connection->output.buffered_bytes != buffered;
+}
+
+// Returns 1 if a stream can make progress once the socket is writable, otherwise 0
+int http2_session_wants_write(http2_session_t *session) {
+    for (http2_stream_t *stream = session->streams; stream != NULL; stream = stream->next) {
+        if (can_run(stream)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Returns 1 if no stream is open, otherwise 0
+int http2_session_idle(http2_session_t *session) {
+    return session->stream_count == 0;
+}
+
+/**
+ * Sends a header block in a HEADERS frame, followed by CONTINUATION frames when it
+ * doesn't fit
+ *
+Returns
+- -1 if append fails
+- 0 if succeed
+*/
+static int queue_header_block(http2_stream_t *stream, string_t *block, int end_stream) {
+    size_t offset = 0;
+    uint8_t type = FRAME_HEADERS;
+
+    do {
+        size_t length = block->length - offset;
+        if (length > HTTP2_MAX_FRAME_SIZE) {
+            length = HTTP2_MAX_FRAME_SIZE;
+        }
+
+        uint8_t flags = (type == FRAME_HEADERS && end_stream ? FLAG_END_STREAM : 0) |
+                        (offset + length == block->length ? FLAG_END_HEADERS : 0);
+
+        if (queue_frame(stream->session, type, flags, stream->id, block->data + offset, length) == -1) {
+            return -1;
+        }
+
+        offset += length;
+        type = FRAME_CONTINUATION;
+    } while (offset < block->length);
+
+    return 0;
+}
+
+/**
+ * Encodes a field of the response head, names are lower cased
+ *
+Returns
+- -1 if append fails
+- 0 if succeed
+*/
+static int encode_field(http2_session_t *session, string_t *block, char *name, size_t name_length, char *value,
+                        size_t value_length) {
+    char *lower_name = strndup(name, name_length);
+    char *value_copy = strndup(value, value_length);
+    int result = -1;
+
+    if (lower_name != NULL && value_copy != NULL) {
+        for (char *c = lower_name; *c != '\0'; c++) {
+            if (*c >= 'A' && *c <= 'Z') {
+                *c += 'a' - 'A';
+            }
+        }
+
+        result = hpack_encode_header(&session->encoder, block, lower_name, value_copy);
+    }
+
+    free(lower_name);
+    free(value_copy);
+    return result;
+}
+
+/**
+ * Converts the complete HTTP/1.1 head of the response to a HEADERS frame
+ * and finds how its body is framed, interim responses are dropped
+ *
+ * Returns -1 if the head is invalid or can't be sent, otherwise 0
+ */
+static int send_response_head(http2_stream_t *stream) {
+    http2_session_t *session = stream->session;
+    char *line = stream->response_head->data;
+    char *end = line + stream->response_head->length;
+
+    // "HTTP/1.x NNN Reason"
+    if (stream->response_head->length < 12 || strncmp(line, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+
+    char status[4] = {line[9], line[10], line[11], '\0'};
+    int status_code = atoi(status);
+
+    if (status_code < 100 || status_code > 999) {
+        return -1;
+    }
+
+    if (status_code < 200) {
+        stream->response_head->length = 0;
+        return 0;
+    }
+
+    string_t *block = create_string(256);
+    if (block == NULL) {
+        return -1;
+    }
+
+    int failed = hpack_encode_start(&session->encoder, block) == -1 ||
+                 hpack_encode_header(&session->encoder, block, ":status", status) == -1;
+
+    long content_length = -1;
+    int chunked = 0;
+
+    line = memchr(line, '\n', end - line) + 1;
+
+    while (!failed && line < end && !(line[0] == '\r' && line[1] == '\n')) {
+        char *line_end = memchr(line, '\n', end - line);
+        char *colon = memchr(line, ':', line_end - line);
+
+        if (colon == NULL) {
+            failed = 1;
+            break;
+        }
+
+        char *value = colon + 1;
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+
+        size_t value_length = line_end - value;
+        while (value_length > 0 && (value[value_length - 1] == '\r' || value[value_length - 1] == ' ')) {
+            value_length--;
+        }
+
+        size_t name_length = colon - line;
+
+        if (name_length == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+            chunked = strncasecmp(value, "chunked", 7) == 0;
+        } else if (name_length == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+            content_length = strtol(value, NULL, 10);
+        }
+
+        char name[32];
+        int hop_by_hop = 0;
+        if (name_length < sizeof(name)) {
+            memcpy(name, line, name_length);
+            name[name_length] = '\0';
+            hop_by_hop = is_hop_by_hop(name);
+        }
+
+        if (!hop_by_hop) {
+            failed = encode_field(session, block, line, name_length, value, value_length) == -1;
+        }
+
+        line = line_end + 1;
+    }
+
+    if (stream->head_request || status_code == 204 || status_code == 304 || (!chunked && content_length == 0)) {
+        stream->framing = HTTP2_BODY_NONE;
+    } else if (chunked) {
+        stream->framing = HTTP2_BODY_CHUNKED;
+    } else if (content_length > 0) {
+        stream->framing = HTTP2_BODY_LENGTH;
+        stream->body_remaining = content_length;
+    } else {
+        stream->framing = HTTP2_BODY_CLOSE;
+    }
+
+    int end_stream = stream->framing == HTTP2_BODY_NONE;
+    failed = failed || queue_header_block(stream, block, end_stream) == -1;
+    free_string(block);
+
+    if (failed) {
+        return -1;
+    }
+
+    stream->head_sent = 1;
+    stream->end_stream_sent = end_stream;
+    free_string(stream->response_head);
+    stream->response_head = NULL;
+
+    return 0;
+}
+
+/**
+ * Accumulates the response head until its end, then sends it
+ *
+ * Returns -1 if the head is invalid or too large, otherwise how many bytes of input it took
+ */
+static ssize_t read_response_head(http2_stream_t *stream, char *input, size_t length) {
+    if (stream->response_head == NULL) {
+        stream->response_head = create_string(512);
+        if (stream->response_head == NULL) {
+            return -1;
+        }
+    }
+
+    string_t *head = stream->response_head;
+    size_t previous_length = head->length;
+
+    if (append_rawchars(head, input, length) == -1) {
+        return -1;
+    }
+
+    // The end of the head may straddle the previous input
+    size_t start = previous_length > 3 ? previous_length - 3 : 0;
+    for (size_t i = start; i + 4 <= head->length; i++) {
+        if (memcmp(head->data + i, "\r\n\r\n", 4) == 0) {
+            head->length = i + 4;
+            size_t consumed = head->length - previous_length;
+
+            return send_response_head(stream) == -1 ? -1 : (ssize_t)consumed;
+        }
+    }
+
+    if (head->length > HTTP2_MAX_RESPONSE_HEAD_SIZE) {
+        return -1;
+    }
+
+    return length;
+}
+
+static int body_complete(http2_stream_t *stream) {
+    switch (stream->framing) {
+    case HTTP2_BODY_LENGTH:
+        return stream->body_remaining == 0;
+    case HTTP2_BODY_CHUNKED:
+        return stream->chunked.state == CHUNKED_DONE;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Sends the decoded body data as DATA frames, as far as the windows and the socket output allow
+ *
+ * Returns -1 if append fails, otherwise 0
+ */
+static int send_body_data(http2_stream_t *stream) {
+    http2_session_t *session = stream->session;
+
+    while (stream->data_length > 0) {
+        if (!has_window(stream) || session->connection->output.buffered_bytes >= HTTP2_OUTPUT_LIMIT) {
+            return 0;
+        }
+
+        size_t length = stream->data_length;
+        if ((int64_t)length > stream->send_window) {
+            length = stream->send_window;
+        }
+        if ((int64_t)length > session->send_window) {
+            length = session->send_window;
+        }
+        if (length > HTTP2_MAX_FRAME_SIZE) {
+            length = HTTP2_MAX_FRAME_SIZE;
+        }
+
+        int last = length == stream->data_length && body_complete(stream);
+
+        if (queue_frame(session, FRAME_DATA, last ? FLAG_END_STREAM : 0, stream->id, stream->data, length) == -1) {
+            return -1;
+        }
+
+        stream->send_window -= length;
+        session->send_window -= length;
+        stream->data += length;
+        stream->data_length -= length;
+        stream->end_stream_sent = last;
+    }
+
+    return 0;
+}
+
+/**
+ * Takes the next piece of body out of the raw response bytes, the chunked framing is removed
+ *
+ * Returns -1 if the chunked framing is invalid, otherwise 0
+ */
+static int decode_body(http2_stream_t *stream) {
+    char *input = stream->input + stream->input_offset;
+    size_t available = stream->input_length - stream->input_offset;
+
+    switch (stream->framing) {
+    case HTTP2_BODY_CHUNKED:
+        stream->input_offset += chunked_decode(&stream->chunked, input, available, &stream->data, &stream->data_length);
+        return stream->chunked.state == CHUNKED_ERROR ? -1 : 0;
+
+    case HTTP2_BODY_LENGTH: {
+        size_t length = available < stream->body_remaining ? available : stream->body_remaining;
+
+        stream->data = input;
+        stream->data_length = length;
+        stream->body_remaining -= length;
+        // Bytes beyond the announced length are dropped, like a client would
+        stream->input_offset = length == 0 ? stream->input_length : stream->input_offset + length;
+        return 0;
+    }
+
+    case HTTP2_BODY_CLOSE:
+        stream->data = input;
+        stream->data_length = available;
+        stream->input_offset = stream->input_length;
+        return 0;
+
+    default:
+        stream->input_offset = stream->input_length;
+        return 0;
+    }
+}
+
+/**
+ * Output side of a stream connection: its HTTP/1.1 response is converted to frames
+ * queued on the socket connection
+ *
+Returns
+- -1 if the response can't be converted, the stream connection has to be closed
+- 0 if the window of the peer or the socket output is full, the rest waits in the queue
+- 1 if the queue has been fully converted
+*/
+int http2_stream_flush(connection_t *connection) {
+    http2_stream_t *stream = connection->http2_stream;
+    int result = 1;
+
+    while (1) {
+        if (stream->data_length > 0) {
+            if (send_body_data(stream) == -1) {
+                result = -1;
+                break;
+            }
+
+            if (stream->data_length > 0) {
+                result = 0;
+                break;
+            }
+        }
+
+        if (stream->head_sent && !stream->end_stream_sent && body_complete(stream)) {
+            if (queue_frame(stream->session, FRAME_DATA, FLAG_END_STREAM, stream->id, NULL, 0) == -1) {
+                result = -1;
+                break;
+            }
+            stream->end_stream_sent = 1;
+        }
+
+        if (stream->input_offset == stream->input_length) {
+            if (output_queue_empty(&connection->output)) {
+                break;
+            }
+
+            if (stream->session->connection->output.buffered_bytes >= HTTP2_OUTPUT_LIMIT) {
+                result = 0;
+                break;
+            }
+
+            ssize_t read_result = output_queue_read(&connection->output, stream->input, HTTP2_STREAM_INPUT_SIZE);
+            if (read_result == -1) {
+                result = errno == EAGAIN ? 0 : -1;
+                break;
+            }
+
+            stream->input_length = read_result;
+            stream->input_offset = 0;
+        }
+
+        if (!stream->head_sent) {
+            ssize_t consumed = read_response_head(stream, stream->input + stream->input_offset,
+                                                  stream->input_length - stream->input_offset);
+            if (consumed == -1) {
+                result = -1;
+                break;
+            }
+
+            stream->input_offset += consumed;
+        } else if (stream->end_stream_sent) {
+            stream->input_offset = stream->input_length;
+        } else if (decode_body(stream) == -1) {
+            result = -1;
+            break;
+        }
+    }
+
+    request_write(stream->session);
+    return result;
+}
+
+/**
+ * Called whenever the stream connection is done with an event: remembers whether it
+ * has more to send and gives back the window of the body it consumed
+ */
+void http2_stream_update(connection_t *connection) {
+    http2_stream_t *stream = connection->http2_stream;
+    http2_session_t *session = stream->session;
+
+    stream->runnable = connection->write_blocked || (connection->stream != NULL && !connection->stream->waiting);
+
+    // A paused body reader leaves its input in the buffer, the window closes until it resumes
+    if (!stream->end_stream_received && stream->unacknowledged >= HTTP2_WINDOW_UPDATE_THRESHOLD &&
+        connection->buffer_length == 0) {
+        if (queue_window_update(session, stream->id, stream->unacknowledged) == 0) {
+            stream->receive_window += stream->unacknowledged;
+            stream->unacknowledged = 0;
+        }
+    }
+
+    request_write(session);
+}
+
+/**
+ * Called before the stream connection closes once its response has been handed over,
+ * bodies delimited by the end of the connection end the stream there
+ */
+void http2_stream_end(connection_t *connection) {
+    http2_stream_t *stream = connection->http2_stream;
+
+    if (stream->head_sent && stream->framing == HTTP2_BODY_CLOSE && !stream->end_stream_sent &&
+        queue_frame(stream->session, FRAME_DATA, FLAG_END_STREAM, stream->id, NULL, 0) == 0) {
+        stream->end_stream_sent = 1;
+    }
+}
+
+/**
+ * Called when the stream connection closes, the stream is released
+ *
+ * A stream whose response is incomplete is reset, so is one whose response is complete
+ * while the request body is still coming, the client stops sending it (RFC 9113 section 8.1)
+ */
+void http2_stream_closed(connection_t *connection) {
+    http2_stream_t *stream = connection->http2_stream;
+    http2_session_t *session = stream->session;
+
+    if (!session->closing && !stream->finished) {
+        if (!stream->end_stream_sent) {
+            queue_rst_stream(session, stream->id, HTTP2_INTERNAL_ERROR);
+        } else if (!stream->end_stream_received) {
+            queue_rst_stream(session, stream->id, HTTP2_NO_ERROR);
+        }
+
+        request_write(session);
+    }
+
+    remove_stream(session, stream);
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connection.h"
+#include "http/chunked.h"
+#include "http/hpack.h"
+#include "http/http.h"
+#include "str.h"
+
+// Cleartext HTTP/2 (RFC 9113), reached with the client connection preface (prior knowledge)
+// or with an HTTP/1.1 request upgrading to h2c
+//
+// The socket connection holds the session, which reads frames and queues frames on its
+// output. Every stream runs on a connection of its own without socket: its request is
+// handed over as an HTTP/1.1 request (the body in chunked encoding) so the router,
+// handlers and body readers work unchanged, and the HTTP/1.1 response it produces is
+// turned back into HEADERS and DATA frames within the flow control windows of the peer.
+// Streams stalled on a window or with a producer keep a flag so that the session runs
+// them again, in turn, whenever the socket is writable.
+//
+// Priorities are read and ignored (RFC 9113 deprecates them), streams are served round robin.
+
+// Frames we accept and send, also the initial size of every peer allows
+#define HTTP2_MAX_FRAME_SIZE 16384
+// Raw response bytes converted at once
+#define HTTP2_STREAM_INPUT_SIZE HTTP2_MAX_FRAME_SIZE
+
+typedef struct Http2Session http2_session_t;
+
+typedef enum Http2BodyFraming {
+    HTTP2_BODY_NONE,
+    HTTP2_BODY_LENGTH,
+    HTTP2_BODY_CHUNKED,
+    // HTTP/1.1 body delimited by the end of the connection, it ends with the stream connection
+    HTTP2_BODY_CLOSE,
+} http2_body_framing_t;
+
+typedef struct Http2Stream {
+    struct Http2Stream *next;
+    http2_session_t *session;
+    // Runs the request, the stream is released when it is closed
+    connection_t *connection;
+    uint32_t id;
+
+    int64_t send_window;
+    int64_t receive_window;
+    // DATA received but not acknowledged with a WINDOW_UPDATE yet
+    size_t unacknowledged;
+    int end_stream_received;
+    int end_stream_sent;
+    // Closed by the peer, or ended by us, no RST_STREAM is needed anymore
+    int finished;
+    int head_request;
+    // Set while the stream connection has more to send once the socket or the window allows it
+    int runnable;
+    unsigned int run_round;
+
+    // Head of the HTTP/1.1 response until it is complete
+    string_t *response_head;
+    int head_sent;
+    http2_body_framing_t framing;
+    size_t body_remaining;
+    chunked_decoder_t chunked;
+
+    // Raw response bytes taken from the stream connection, and the decoded part not sent yet
+    char input[HTTP2_STREAM_INPUT_SIZE];
+    size_t input_length;
+    size_t input_offset;
+    char *data;
+    size_t data_length;
+} http2_stream_t;
+
+struct Http2Session {
+    // Socket connection, frames are queued on its output
+    connection_t *connection;
+    http2_stream_t *streams;
+    size_t stream_count;
+    uint32_t last_stream_id;
+    int preface_received;
+    int goaway_sent;
+    // Set while the session is released, streams closing then send nothing
+    int closing;
+    unsigned int run_round;
+
+    hpack_table_t decoder;
+    hpack_table_t encoder;
+
+    int64_t send_window;
+    size_t unacknowledged;
+    int64_t initial_window;
+
+    // Header block split over HEADERS and CONTINUATION frames
+    string_t *header_block;
+    uint32_t header_block_stream;
+    int header_block_end_stream;
+};
+
+int http2_detect_preface(char *buffer, size_t length);
+int http2_is_upgrade_request(request_t *request);
+
+int http2_session_start(connection_t *connection, request_t *upgrade_request);
+void free_http2_session(http2_session_t *session);
+int http2_session_input(connection_t *connection);
+int http2_session_run(connection_t *connection);
+int http2_session_wants_write(http2_session_t *session);
+int http2_session_idle(http2_session_t *session);
+void http2_session_drain(http2_session_t *session);
+
+int http2_stream_flush(connection_t *connection);
+void http2_stream_update(connection_t *connection);
+void http2_stream_end(connection_t *connection);
+void http2_stream_closed(connection_t *connection);
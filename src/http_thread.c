@@ -2,51 +2,238 @@
 #include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "clock.h"
+#include "coroutine.h"
+#include "event_loop.h"
+#include "file_pool.h"
+#include "proxy.h"
+
+// Tasks taken by a worker per wake up, the rest is left to the other workers
+#define DEQUEUE_BATCH 16
 
 // Implements a thread pool for http task handling
 
-// TODO investigate if these should be declared in the main function
-pthread_mutex_t task_queue_mutex;
-pthread_cond_t task_queue_cond;
+int enqueue_http_task(http_task_queue_t *queue, http_task_t *task) {
+    pthread_mutex_lock(&queue->mutex);
+
+    if (queue->count == queue->capacity) {
+        queue->shed_queue_full++;
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+
+    // While overloaded we only accept work when the workers have drained the queue,
+    // this keeps the wait time of admitted tasks close to the target
+    if (queue->overloaded && queue->count > 0) {
+        queue->shed_overload++;
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+
+    task->enqueued_at = monotonic_ns();
+    queue->tasks[(queue->head + queue->count) % queue->capacity] = *task;
+    queue->count++;
+    queue->admitted++;
+
+    pthread_mutex_unlock(&queue->mutex);
+
+    uint64_t value = 1;
+    write(queue->event_fd, &value, sizeof(value));
+
+    return 0;
+}
+
+// Must be called with the queue mutex held
+static void update_queue_delay(http_task_queue_t *queue, uint64_t sojourn_ns, uint64_t now) {
+    queue->last_sojourn_ns = sojourn_ns;
+
+    if (sojourn_ns < queue->target_ns) {
+        queue->first_above_time = 0;
+        queue->overloaded = 0;
+        return;
+    }
+
+    if (queue->first_above_time == 0) {
+        queue->first_above_time = now + queue->interval_ns;
+    } else if (now >= queue->first_above_time) {
+        queue->overloaded = 1;
+    }
+}
+
+typedef struct HttpWorker {
+    io_watcher_t watcher;
+    http_task_queue_t *queue;
+    http_thread_args_t *args;
+    event_loop_t *loop;
+
+    io_watcher_t drain_watcher;
+    wheel_timer_t drain_deadline;
+} http_worker_t;
+
+static void on_tasks_ready(event_loop_t *loop, io_watcher_t *watcher, uint32_t events) {
+    (void)events;
+    http_worker_t *worker = (http_worker_t *)watcher;
+    http_task_queue_t *queue = worker->queue;
+
+    uint64_t value;
+    read(queue->event_fd, &value, sizeof(value));
+
+    http_task_t tasks[DEQUEUE_BATCH];
+    size_t count = 0;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    uint64_t now = monotonic_ns();
+    while (queue->count > 0 && count < DEQUEUE_BATCH) {
+        tasks[count] = queue->tasks[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+
+        update_queue_delay(queue, now - tasks[count].enqueued_at, now);
+        count++;
+    }
+
+    int has_more = queue->count > 0;
+
+    pthread_mutex_unlock(&queue->mutex);
 
-void enqueue_http_task(http_task_t **tasks_queue, size_t *tasks_queue_count, http_task_t *task) {
-    pthread_mutex_lock(&task_queue_mutex);
-    (*tasks_queue)[(*tasks_queue_count)] = *task;
-    (*tasks_queue_count)++;
-    pthread_mutex_unlock(&task_queue_mutex);
-    pthread_cond_signal(&task_queue_cond);
+    // The counter has been reset by the read, wake up another worker for the leftovers
+    if (has_more) {
+        value = 1;
+        write(queue->event_fd, &value, sizeof(value));
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        tasks[i].handle(loop, tasks[i].arg1, tasks[i].arg2, tasks[i].arg3);
+    }
+}
+
+static void on_drain_deadline(wheel_timer_t *timer) {
+    http_worker_t *worker = (http_worker_t *)((char *)timer - offsetof(http_worker_t, drain_deadline));
+    worker->args->expire(worker->loop);
+}
+
+static void on_drain(event_loop_t *loop, io_watcher_t *watcher, uint32_t events) {
+    (void)events;
+    http_worker_t *worker = (http_worker_t *)((char *)watcher - offsetof(http_worker_t, drain_watcher));
+
+    // The eventfd stays readable for the other workers
+    event_loop_remove(loop, &worker->drain_watcher);
+    event_loop_schedule(loop, &worker->drain_deadline, worker->queue->drain_timeout_ms);
+
+    worker->args->drain(loop);
 }
 
 void *start_http_task(http_thread_args_t *args) {
-    size_t *tasks_queue_count = args->tasks_queue_count;
-    http_task_t **tasks_queue = args->tasks_queue;
+    event_loop_t loop;
 
-    http_task_t task;
+    if (event_loop_init(&loop) == -1) {
+        printf("Failed to create the worker event loop\n");
+        return NULL;
+    }
 
-    while (1) {
-        pthread_mutex_lock(&task_queue_mutex);
+    http_worker_t worker = {.queue = args->queue, .args = args, .loop = &loop};
+    io_watcher_init(&worker.watcher, args->queue->event_fd, on_tasks_ready);
+    io_watcher_init(&worker.drain_watcher, args->queue->drain_fd, on_drain);
+    wheel_timer_init(&worker.drain_deadline, on_drain_deadline);
 
-        while (*tasks_queue_count == 0) {
-            pthread_cond_wait(&task_queue_cond, &task_queue_mutex);
-        }
+    // EPOLLEXCLUSIVE avoids waking up every worker for a single connection, a drain wakes them all
+    if (event_loop_add(&loop, &worker.watcher, EPOLLIN | EPOLLEXCLUSIVE) == -1 ||
+        event_loop_add(&loop, &worker.drain_watcher, EPOLLIN) == -1) {
+        printf("Failed to watch the task queue\n");
+        event_loop_destroy(&loop);
+        return NULL;
+    }
 
-        task = (*tasks_queue)[0];
+    event_loop_run(&loop);
 
-        for (size_t i = 0; i < (*tasks_queue_count) - 1; i++) {
-            (*tasks_queue)[i] = (*tasks_queue)[i + 1];
-        }
-        (*tasks_queue_count)--;
+    event_loop_destroy(&loop);
+    release_file_completions();
+    release_idle_connections();
+    release_proxy_cache_waits();
+    release_coroutine_stacks();
+    release_buffer_pool();
+    return NULL;
+}
 
-        pthread_mutex_unlock(&task_queue_mutex);
+/**
+Returns
+- -1 if the setup fails
+- 0 if succeed
+*/
+int setup_http_tasks(http_task_queue_t *queue, size_t capacity, uint64_t target_ns, uint64_t interval_ns) {
+    queue->tasks = malloc(sizeof(http_task_t) * capacity);
+    if (queue->tasks == NULL) {
+        return -1;
+    }
+
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+
+    queue->target_ns = target_ns;
+    queue->interval_ns = interval_ns;
+    queue->first_above_time = 0;
+    queue->overloaded = 0;
+
+    queue->admitted = 0;
+    queue->shed_queue_full = 0;
+    queue->shed_overload = 0;
+    queue->last_sojourn_ns = 0;
 
-        task.handle(task.arg1, task.arg2);
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    queue->drain_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    queue->drain_timeout_ms = 0;
+
+    if (queue->event_fd == -1 || queue->drain_fd == -1) {
+        if (queue->event_fd != -1) {
+            close(queue->event_fd);
+        }
+        if (queue->drain_fd != -1) {
+            close(queue->drain_fd);
+        }
+        free(queue->tasks);
+        return -1;
     }
+
+    pthread_mutex_init(&queue->mutex, NULL);
+
+    return 0;
 }
 
-void setup_http_tasks() {
-    pthread_cond_init(&task_queue_cond, NULL);
+/**
+ * Makes every worker drain its loop, the loops still running after timeout_ms are
+ * expired. The workers still take the tasks left in the queue.
+ */
+void drain_http_tasks(http_task_queue_t *queue, uint64_t timeout_ms) {
+    queue->drain_timeout_ms = timeout_ms;
+
+    uint64_t value = 1;
+    write(queue->drain_fd, &value, sizeof(value));
 }
 
-void destroy_http_tasks() {
-    pthread_cond_destroy(&task_queue_cond);
+void destroy_http_tasks(http_task_queue_t *queue) {
+    close(queue->event_fd);
+    close(queue->drain_fd);
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue->tasks);
+}
+
+void get_http_queue_stats(http_task_queue_t *queue, http_queue_stats_t *stats) {
+    pthread_mutex_lock(&queue->mutex);
+
+    stats->depth = queue->count;
+    stats->capacity = queue->capacity;
+    stats->admitted = queue->admitted;
+    stats->shed_queue_full = queue->shed_queue_full;
+    stats->shed_overload = queue->shed_overload;
+    stats->last_sojourn_ns = queue->last_sojourn_ns;
+    stats->overloaded = queue->overloaded;
+
+    pthread_mutex_unlock(&queue->mutex);
 }
@@ -2,23 +2,87 @@
 
 #include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "event_loop.h"
 
 // Implements a thread pool for http task handling
+// Every worker runs its own event loop, tasks hand new connections over to one of them
 
 typedef struct HttpTask {
-    void (*handle)(int, char *);
+    void (*handle)(event_loop_t *, int, void *, void *);
     int arg1;
-    char *arg2;
+    void *arg2;
+    void *arg3;
+    // Filled by enqueue_http_task, used to measure the time spent in queue
+    uint64_t enqueued_at;
 } http_task_t;
 
+typedef struct HttpQueueStats {
+    size_t depth;
+    size_t capacity;
+    uint64_t admitted;
+    // Rejected because the queue was full
+    uint64_t shed_queue_full;
+    // Rejected because the queue had a standing delay above the target
+    uint64_t shed_overload;
+    // Last queue wait observed by a worker
+    uint64_t last_sojourn_ns;
+    int overloaded;
+} http_queue_stats_t;
+
+/**
+ * Bounded ring buffer of tasks shared between the acceptor and the workers.
+ *
+ * Admission follows the CoDel idea: a queue is fine as long as the wait time of
+ * dequeued tasks goes below `target_ns` at least once every `interval_ns`.
+ * When the wait time stays above the target for a whole interval the queue is
+ * marked as overloaded and new tasks are rejected until the workers catch up.
+ */
+typedef struct HttpTaskQueue {
+    http_task_t *tasks;
+    size_t capacity;
+    size_t head;
+    size_t count;
+
+    pthread_mutex_t mutex;
+    // Readable while tasks are waiting, watched by every worker loop
+    int event_fd;
+    // Readable for good once the workers have to drain, see drain_http_tasks
+    int drain_fd;
+    uint64_t drain_timeout_ms;
+
+    uint64_t target_ns;
+    uint64_t interval_ns;
+    // Time after which a standing delay above target turns into overload, 0 if under target
+    uint64_t first_above_time;
+    int overloaded;
+
+    uint64_t admitted;
+    uint64_t shed_queue_full;
+    uint64_t shed_overload;
+    uint64_t last_sojourn_ns;
+} http_task_queue_t;
+
 typedef struct HttpStartThreadArgs {
-    http_task_t **tasks_queue;
-    size_t *tasks_queue_count;
+    http_task_queue_t *queue;
+    // Called on the loop of every worker when the queue drains, the loop is expected to
+    // stop by itself, otherwise expire is called on it once the drain timeout is over
+    void (*drain)(event_loop_t *loop);
+    void (*expire)(event_loop_t *loop);
 } http_thread_args_t;
 
-void enqueue_http_task(http_task_t **tasks_queue, size_t *tasks_queue_count, http_task_t *task);
+/**
+Returns
+- -1 if the task has been rejected (queue full or overloaded)
+- 0 if the task has been queued
+*/
+int enqueue_http_task(http_task_queue_t *queue, http_task_t *task);
 
 void *start_http_task(http_thread_args_t *args);
 
-void setup_http_tasks();
-void destroy_http_tasks();
+int setup_http_tasks(http_task_queue_t *queue, size_t capacity, uint64_t target_ns, uint64_t interval_ns);
+void drain_http_tasks(http_task_queue_t *queue, uint64_t timeout_ms);
+void destroy_http_tasks(http_task_queue_t *queue);
+
+void get_http_queue_stats(http_task_queue_t *queue, http_queue_stats_t *stats);
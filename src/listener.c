@@ -0,0 +1,348 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "listener.h"
+
+// Raised to net.core.somaxconn by the kernel, a burst of connections isn't turned into SYN retries
+const int DEFAULT_LISTEN_BACKLOG = 511;
+
+// Fills the address of "unix:/path" or "unix:@name", returns -1 if it doesn't fit
+static int parse_unix_address(listener_t *listener, char *path) {
+    struct sockaddr_un *address = (struct sockaddr_un *)&listener->address;
+    size_t length = strlen(path);
+
+    if (length == 0 || length >= sizeof(address->sun_path)) {
+        return -1;
+    }
+
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, path, length);
+
+    // Abstract names start with a NUL byte and are as long as the address says, paths end with one
+    if (path[0] == '@') {
+        address->sun_path[0] = '\0';
+        listener->address_length = offsetof(struct sockaddr_un, sun_path) + length;
+    } else {
+        listener->address_length = offsetof(struct sockaddr_un, sun_path) + length + 1;
+    }
+
+    return 0;
+}
+
+// Fills the address of "PORT", "HOST:PORT" or "[IPV6]:PORT", returns -1 if it can't be resolved
+static int parse_inet_address(listener_t *listener, char *text) {
+    char *host = NULL;
+    char *port = text;
+    char *separator = strrchr(text, ':');
+
+    if (separator != NULL) {
+        host = text;
+        port = separator + 1;
+        *separator = '\0';
+
+        size_t host_length = strlen(host);
+        if (host[0] == '[' && host_length > 1 && host[host_length - 1] == ']') {
+            host[host_length - 1] = '\0';
+            host++;
+        }
+
+        if (*host == '\0') {
+            host = NULL;
+        }
+    }
+
+    // A bare port listens on every IPv4 address, like the server always did
+    struct addrinfo hints = {
+        .ai_family = host == NULL ? AF_INET : AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE | AI_NUMERICSERV,
+    };
+    struct addrinfo *result = NULL;
+
+    if (getaddrinfo(host, port, &hints, &result) != 0) {
+        return -1;
+    }
+
+    memcpy(&listener->address, result->ai_addr, result->ai_addrlen);
+    listener->address_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+typedef struct ListenerOption {
+    char *name;
+    size_t offset;
+    int base;
+    long min;
+    long max;
+} listener_option_t;
+
+// Options taking a number, v6only is the only flag
+static const listener_option_t listener_options[] = {
+    {"backlog", offsetof(listener_t, backlog), 10, 1, INT_MAX},
+    {"mode", offsetof(listener_t, mode), 8, 0, 0777},
+    {"nodelay", offsetof(listener_t, nodelay), 10, 0, 1},
+    {"defer_accept", offsetof(listener_t, defer_accept), 10, 0, INT_MAX},
+    {"fastopen", offsetof(listener_t, fastopen), 10, 0, INT_MAX},
+    {"busy_poll", offsetof(listener_t, busy_poll), 10, 0, INT_MAX},
+};
+
+static const size_t LISTENER_OPTIONS_SIZE = sizeof(listener_options) / sizeof(listener_options[0]);
+
+// Returns -1 if the option is unknown or its value invalid, otherwise 0
+static int parse_listener_option(listener_t *listener, char *option) {
+    if (strcmp(option, "v6only") == 0) {
+        listener->v6only = 1;
+        return 0;
+    }
+
+    char *value = strchr(option, '=');
+    if (value == NULL) {
+        return -1;
+    }
+
+    size_t name_length = value++ - option;
+
+    for (size_t i = 0; i < LISTENER_OPTIONS_SIZE; i++) {
+        const listener_option_t *known = &listener_options[i];
+        if (strlen(known->name) != name_length || strncmp(known->name, option, name_length) != 0) {
+            continue;
+        }
+
+        char *end = NULL;
+        long number = strtol(value, &end, known->base);
+        if (end == value || *end != '\0' || number < known->min || number > known->max) {
+            return -1;
+        }
+
+        *(int *)((char *)listener + known->offset) = number;
+        return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * Parses a listener given as ADDRESS[,OPTION...], see listener.h
+ *
+Returns
+- -1 if the address or an option is invalid
+- 0 if succeed
+*/
+int parse_listener(listener_t *listener, char *spec) {
+    memset(listener, 0, sizeof(listener_t));
+    listener->fd = -1;
+    listener->backlog = DEFAULT_LISTEN_BACKLOG;
+    listener->mode = -1;
+    listener->nodelay = 1;
+
+    char *copy = strdup(spec);
+    if (copy == NULL) {
+        return -1;
+    }
+
+    char *options = strchr(copy, ',');
+    if (options != NULL) {
+        *options++ = '\0';
+    }
+
+    listener->name = strdup(copy);
+    if (listener->name == NULL) {
+        free(copy);
+        return -1;
+    }
+
+    int result = strncmp(copy, "unix:", 5) == 0 ? parse_unix_address(listener, copy + 5)
+                                                 : parse_inet_address(listener, copy);
+
+    char *state = NULL;
+    for (char *option = options != NULL ? strtok_r(options, ",", &state) : NULL; option != NULL && result == 0;
+         option = strtok_r(NULL, ",", &state)) {
+        result = parse_listener_option(listener, option);
+    }
+
+    free(copy);
+
+    if (result == -1) {
+        free(listener->name);
+        listener->name = NULL;
+    }
+
+    return result;
+}
+
+// Returns 1 if fd is a listening socket bound to the address of listener, otherwise 0
+static int is_bound_to(int fd, listener_t *listener) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    int listening = 0;
+    socklen_t listening_length = sizeof(listening);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &listening_length) == -1 || !listening ||
+        getsockname(fd, (struct sockaddr *)&address, &length) == -1 ||
+        address.ss_family != listener->address.ss_family) {
+        return 0;
+    }
+
+    switch (address.ss_family) {
+    case AF_INET: {
+        struct sockaddr_in *bound = (struct sockaddr_in *)&address;
+        struct sockaddr_in *wanted = (struct sockaddr_in *)&listener->address;
+        return bound->sin_port == wanted->sin_port && bound->sin_addr.s_addr == wanted->sin_addr.s_addr;
+    }
+
+    case AF_INET6: {
+        struct sockaddr_in6 *bound = (struct sockaddr_in6 *)&address;
+        struct sockaddr_in6 *wanted = (struct sockaddr_in6 *)&listener->address;
+        return bound->sin6_port == wanted->sin6_port &&
+               memcmp(&bound->sin6_addr, &wanted->sin6_addr, sizeof(struct in6_addr)) == 0;
+    }
+
+    case AF_UNIX:
+        return length == listener->address_length && memcmp(&address, &listener->address, length) == 0;
+    }
+
+    return 0;
+}
+
+// A Unix socket path left behind by a server that is gone refuses connections, it can be removed
+static int is_stale_socket(listener_t *listener) {
+    struct sockaddr_un *address = (struct sockaddr_un *)&listener->address;
+    if (address->sun_path[0] == '\0') {
+        return 0;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return 0;
+    }
+
+    int stale = connect(fd, (struct sockaddr *)address, listener->address_length) == -1 && errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+// Returns -1 if the address can't be bound, otherwise 0
+static int bind_listener(listener_t *listener, int fd) {
+    if (listener->address.ss_family == AF_INET6) {
+        int v6only = listener->v6only;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+
+    struct sockaddr *address = (struct sockaddr *)&listener->address;
+    if (bind(fd, address, listener->address_length) == 0) {
+        return 0;
+    }
+
+    if (errno != EADDRINUSE || listener->address.ss_family != AF_UNIX || !is_stale_socket(listener)) {
+        return -1;
+    }
+
+    unlink(((struct sockaddr_un *)address)->sun_path);
+    return bind(fd, address, listener->address_length);
+}
+
+// Sets the options of a TCP listener, accepted sockets inherit them. Returns -1 if one is refused
+static int set_tcp_options(listener_t *listener, int fd) {
+    if (listener->address.ss_family == AF_UNIX) {
+        return 0;
+    }
+
+    // Set even when disabled, an inherited socket may have had them. Busy polling above
+    // net.core.busy_read needs CAP_NET_ADMIN
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &listener->nodelay, sizeof(int)) == -1 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &listener->defer_accept, sizeof(int)) == -1 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &listener->fastopen, sizeof(int)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &listener->busy_poll, sizeof(int)) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Opens the socket of listener, or takes the one bound to its address out of the
+ * sockets inherited from a previous server (its entry is set to -1). Listening
+ * sockets are non blocking, the acceptor polls them all.
+ *
+Returns
+- -1 if the socket can't be bound or listen
+- 0 if succeed
+*/
+int open_listener(listener_t *listener, int *inherited_fds, size_t inherited_count) {
+    for (size_t i = 0; i < inherited_count; i++) {
+        if (inherited_fds[i] != -1 && is_bound_to(inherited_fds[i], listener)) {
+            listener->fd = inherited_fds[i];
+            inherited_fds[i] = -1;
+
+            int flags = fcntl(listener->fd, F_GETFL);
+            fcntl(listener->fd, F_SETFL, flags | O_NONBLOCK);
+
+            // The options may have changed since it was opened, listen again takes the new backlog
+            if (set_tcp_options(listener, listener->fd) == -1 || listen(listener->fd, listener->backlog) == -1) {
+                printf("Failed to set the options of %s\n", listener->name);
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    // Not close on exec, a reload hands the socket over to the next server
+    int fd = socket(listener->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        printf("Failed to open a socket for %s\n", listener->name);
+        return -1;
+    }
+
+    if (bind_listener(listener, fd) == -1) {
+        if (errno == EADDRINUSE) {
+            printf("Address %s already in use\n", listener->name);
+        } else {
+            printf("Failed to bind %s\n", listener->name);
+        }
+
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_un *path = (struct sockaddr_un *)&listener->address;
+    int has_path = listener->address.ss_family == AF_UNIX && path->sun_path[0] != '\0';
+
+    if (set_tcp_options(listener, fd) == -1) {
+        printf("Failed to set the options of %s\n", listener->name);
+        close(fd);
+        return -1;
+    }
+
+    // Nobody can connect before the permissions are set, the socket isn't listening yet
+    if ((has_path && listener->mode != -1 && chmod(path->sun_path, listener->mode) == -1) ||
+        listen(fd, listener->backlog) == -1) {
+        printf("Failed to listen on %s\n", listener->name);
+        close(fd);
+        return -1;
+    }
+
+    listener->fd = fd;
+    return 0;
+}
+
+void close_listener(listener_t *listener) {
+    if (listener->fd != -1) {
+        close(listener->fd);
+        listener->fd = -1;
+    }
+
+    free(listener->name);
+    listener->name = NULL;
+}
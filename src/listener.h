@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+// Listening sockets of the server, all of them feed the same acceptor and workers
+//
+// A listener is given with --listen=ADDRESS[,OPTION...], which can be repeated:
+// - PORT or HOST:PORT, an IPv6 host goes in brackets. "[::]:PORT" is dual stack, IPv4
+//   clients reach it too unless the v6only option is given
+// - unix:/path for a Unix socket path, unix:@name for the abstract namespace
+//
+// Options:
+// - backlog=N connections waiting to be accepted (511)
+// - mode=0660 permissions of a Unix socket path, set before it listens
+// - v6only only takes IPv6 clients on an IPv6 address
+//
+// TCP options, inherited by the accepted sockets:
+// - nodelay=0|1 TCP_NODELAY (1), responses are framed with MSG_MORE so that Nagle's algorithm
+//   would only hold their last segment back until the client acknowledges the previous ones
+// - defer_accept=SECONDS TCP_DEFER_ACCEPT, a connection is only accepted once its request
+//   arrives (or after that many seconds), idle connections never reach the workers
+// - fastopen=QUEUE TCP_FASTOPEN, clients that connected before send their request with the SYN
+// - busy_poll=MICROSECONDS SO_BUSY_POLL, reads poll the device queue instead of sleeping
+//
+// Without --listen the server listens on every IPv4 address of its port. Listeners
+// handed over by a previous server (see handover.h and master.h) are matched to the
+// configured ones by address, so that the new server keeps their sockets.
+
+#define MAX_LISTENERS 16
+
+typedef struct Listener {
+    int fd;
+    // As given on the command line, for the logs and the stats
+    char *name;
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    int backlog;
+    // Permissions of a Unix socket path, -1 keeps the ones of the umask
+    int mode;
+    int v6only;
+    int nodelay;
+    // Seconds, 0 disables
+    int defer_accept;
+    // Pending Fast Open requests, 0 disables
+    int fastopen;
+    // Microseconds, 0 disables
+    int busy_poll;
+} listener_t;
+
+extern const int DEFAULT_LISTEN_BACKLOG;
+
+int parse_listener(listener_t *listener, char *spec);
+int open_listener(listener_t *listener, int *inherited_fds, size_t inherited_count);
+void close_listener(listener_t *listener);
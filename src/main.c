@@ -1,7 +1,9 @@
 #include <errno.h>
 #include <linux/limits.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,466 +11,591 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-#include "fs.h"
-#include "http/content-type.h"
+#include "bundle.h"
+#include "clock.h"
+#include "config.h"
+#include "connection.h"
+#include "file_pool.h"
+#include "handover.h"
 #include "http/headers.h"
+#include "http/http.h"
 #include "http/parser.h"
 #include "http/status.h"
 #include "http_thread.h"
+#include "listener.h"
+#include "master.h"
+#include "rate_limit.h"
+#include "router.h"
+#include "stats.h"
 #include "str.h"
+#include "tls.h"
 
 const int MAX_THREAD_COUNT = 8;
 
-request_t *parse_request(int client_fd) {
-    const int CHUNK_SIZE = 512;
-    size_t buffer_size = 0;
-    size_t buffer_capacity = CHUNK_SIZE;
-    char *buffer = calloc(CHUNK_SIZE, 1);
+// Counters of every process, see stats.h
+static server_stats_t *server_stats = NULL;
 
-    if (buffer == NULL) {
+// Per client limits of every process, NULL when disabled, see rate_limit.h
+static rate_limiter_t *rate_limiter = NULL;
+
+// TLS resumption state of every process, NULL without TLS, see tls.h
+static tls_shared_t *tls_shared = NULL;
+
+// Admission control for the task queue, see http_task_queue_t
+const size_t MAX_QUEUE_SIZE = 100;
+const uint64_t QUEUE_TARGET_DELAY_NS = 5 * 1000000ull;
+const uint64_t QUEUE_INTERVAL_NS = 100 * 1000000ull;
+
+// Connections accepted from a listener before the others get their turn
+const int ACCEPT_BATCH = 64;
+
+// File jobs waiting for a file thread, the loops run the next ones themselves
+const size_t FILE_QUEUE_SIZE = 1024;
+
+// Mounts the directories given with --mount, the packs given with --pack and the embedded
+// assets given with --bundle, or the public directory on / by default, then the prefixes given
+// with --proxy, the paths given with --websocket and the prefixes given with --events
+static router_t *setup_router(char *public_path, response_cache_t *cache) {
+    router_t *router = create_router();
+    if (router == NULL) {
+        printf("Failed to allocate the router\n");
         return NULL;
     }
 
-    long read_result = -2;
+    int mount_public =
+        server_config.mounts.length == 0 && server_config.packs.length == 0 && server_config.bundle_prefix == NULL;
+    if (mount_public && router_mount(router, "/", public_path) == -1) {
+        printf("Failed to mount %s\n", public_path);
+        free_router(router);
+        return NULL;
+    }
 
-    while (read_result == -2 || read_result == CHUNK_SIZE) {
-        read_result = read(client_fd, buffer + buffer_size, CHUNK_SIZE);
+    for (size_t i = 0; i < server_config.packs.length; i++) {
+        char *prefix = server_config.packs.items[i];
+        char *file = strchr(prefix, '=');
 
-        if (read_result == -1) {
-            // TODO handle error
+        if (file == NULL) {
+            printf("Invalid pack %s, expected PREFIX=FILE\n", prefix);
+            free_router(router);
             return NULL;
         }
 
-        if (buffer_size + CHUNK_SIZE + 1 >= buffer_capacity) {
-            size_t new_capacity = buffer_capacity + CHUNK_SIZE + 1;
-            char *new_buffer = realloc(buffer, new_capacity);
+        *file = '\0';
+        file++;
 
-            if (new_buffer == NULL) {
-                return NULL;
-            }
-
-            buffer = new_buffer;
-            buffer_capacity = new_capacity;
+        if (router_pack(router, prefix, file) == -1) {
+            printf("Failed to serve the pack %s on %s\n", file, prefix);
+            free_router(router);
+            return NULL;
         }
 
-        buffer_size += read_result;
+        printf("Serving the pack %s on %s\n", file, prefix);
     }
 
-    buffer[buffer_size] = '\0';
+    if (server_config.bundle_prefix != NULL) {
+        if (router_bundle(router, server_config.bundle_prefix) == -1) {
+            printf("Failed to serve the embedded assets on %s, is the server built with -DEMBED_PUBLIC=ON?\n",
+                   server_config.bundle_prefix);
+            free_router(router);
+            return NULL;
+        }
 
-    buffer_size++;
+        printf("Serving %zu embedded assets on %s\n", bundle_asset_count, server_config.bundle_prefix);
+    }
 
-    // 0 is a simple request - 1 is not
-    int simple_request_candidate = 1;
-    char *method = NULL;
-    char *uri = NULL;
-    http_version_t *version = NULL;
-    header_list_t *header_list = NULL;
-    char *body = NULL;
+    for (size_t i = 0; i < server_config.mounts.length; i++) {
+        char *prefix = server_config.mounts.items[i];
+        char *directory = strchr(prefix, '=');
+
+        if (directory == NULL) {
+            printf("Invalid mount %s, expected PREFIX=DIRECTORY\n", prefix);
+            free_router(router);
+            return NULL;
+        }
 
-    // Body Content Length must be extracted from the headers
-    // However we should also check that the data is there
-    long content_length = 0;
+        *directory = '\0';
+        directory++;
 
-    size_t i = 0;
+        if (router_mount(router, prefix, directory) == -1) {
+            printf("Failed to mount %s on %s\n", directory, prefix);
+            free_router(router);
+            return NULL;
+        }
 
-    method = extract_method(&buffer, buffer_size, &i);
-    if (method == NULL) {
-        free(buffer);
-        // FAILED TO EXTRACT METHOD
-        return NULL;
+        printf("Serving %s on %s\n", directory, prefix);
     }
 
-    simple_request_candidate = strcmp(method, "GET");
+    for (size_t i = 0; i < server_config.proxies.length; i++) {
+        char *prefix = server_config.proxies.items[i];
+        char *upstreams = strchr(prefix, '=');
 
-    // AS for HTML 1 spec we have a space after a METHOD
-    if (expect_char(&buffer, &i, ' ') == -1) {
-        free(buffer);
-        free(method);
-        return NULL;
+        if (upstreams == NULL) {
+            printf("Invalid proxy %s, expected PREFIX=UPSTREAM[,UPSTREAM...]\n", prefix);
+            free_router(router);
+            return NULL;
+        }
+
+        *upstreams = '\0';
+        upstreams++;
+
+        if (router_proxy(router, prefix, upstreams, cache) == -1) {
+            printf("Failed to proxy %s to %s\n", prefix, upstreams);
+            free_router(router);
+            return NULL;
+        }
+
+        printf("Proxying %s to %s\n", prefix, upstreams);
     }
 
-    uri = extract_uri(&buffer, buffer_size, &i);
-    if (uri == NULL) {
-        free(buffer);
-        free(method);
-        return NULL;
+    for (size_t i = 0; i < server_config.websockets.length; i++) {
+        char *path = server_config.websockets.items[i];
+
+        if (router_websocket(router, path) == -1) {
+            printf("Failed to relay WebSocket messages on %s\n", path);
+            free_router(router);
+            return NULL;
+        }
+
+        printf("Relaying WebSocket messages on %s\n", path);
     }
 
-    // AS for HTML 1 spec we have a space after a URI
-    if (expect_char(&buffer, &i, ' ') == -1) {
-        free(buffer);
-        free(method);
-        free(uri);
-        return NULL;
+    for (size_t i = 0; i < server_config.events.length; i++) {
+        char *prefix = server_config.events.items[i];
+
+        if (router_events(router, prefix) == -1) {
+            printf("Failed to serve events on %s\n", prefix);
+            free_router(router);
+            return NULL;
+        }
+
+        printf("Serving events on %s\n", prefix);
     }
 
-    version = extract_http_version(&buffer, buffer_size, &i);
+    for (size_t i = 0; i < server_config.commands.length; i++) {
+        char *path = server_config.commands.items[i];
+        char *command = strchr(path, '=');
 
-    if (version == NULL) {
-        if (simple_request_candidate == 0) {
-            // IF NO VERSION we are receiving an HTTP/0.9 request so we can also
-            // fallback
-            version = malloc(sizeof(http_version_t));
-            if (version == NULL) {
-                free(buffer);
-                free(method);
-                free(uri);
-                return NULL;
-            }
+        if (command == NULL) {
+            printf("Invalid command %s, expected PATH=COMMAND\n", path);
+            free_router(router);
+            return NULL;
+        }
 
-            version->major = 0;
-            version->minor = 9;
+        *command = '\0';
+        command++;
 
-        } else {
-            free(buffer);
-            free(method);
-            free(uri);
+        if (router_command(router, path, command) == -1) {
+            printf("Failed to run %s on %s\n", command, path);
+            free_router(router);
             return NULL;
         }
-    } else {
-        simple_request_candidate = 1;
-    }
 
-    if (expect_char(&buffer, &i, '\r') == -1) {
-        free(buffer);
-        free(method);
-        free(uri);
-        return NULL;
+        printf("Running %s on %s\n", command, path);
     }
 
-    if (expect_char(&buffer, &i, '\n') == -1) {
-        free(buffer);
-        free(method);
-        free(uri);
+    return router;
+}
 
-        return NULL;
+void refuse_connection(int client_fd, int tls, const char *response, size_t length) {
+    // The socket is non blocking, a full send buffer can never stall the acceptor.
+    // A TLS client can't read a response before the handshake, it is only closed
+    if (!tls) {
+        send(client_fd, response, length, MSG_NOSIGNAL);
     }
+    close(client_fd);
+}
 
-    // No longer in HTTP/0.9 land
-    if (simple_request_candidate != 0) {
-        header_list = create_header_list(5);
+void print_queue_stats(http_task_queue_t *queue) {
+    http_queue_stats_t stats;
+    get_http_queue_stats(queue, &stats);
 
-        if (header_list == NULL) {
-            free(buffer);
-            free(method);
-            free(uri);
-            return NULL;
-        }
+    printf("Shedding load: depth %zu/%zu, admitted %lu, shed (full) %lu, shed (overload) %lu, wait %lums\n",
+           stats.depth, stats.capacity, stats.admitted, stats.shed_queue_full, stats.shed_overload,
+           stats.last_sojourn_ns / 1000000);
+}
+
+// Set by SIGUSR1 in a single process server, the acceptor prints the stats
+static volatile sig_atomic_t stats_requested = 0;
+
+static void request_stats(int signum) {
+    (void)signum;
+    stats_requested = 1;
+}
+
+// Set by SIGTERM and SIGINT, the acceptor stops and the workers drain their connections
+static volatile sig_atomic_t drain_requested = 0;
+
+static void request_drain(int signum) {
+    (void)signum;
+    drain_requested = 1;
+}
+
+// Accepts the connections waiting on the listener of that index, hands them to the workers
+static void accept_connections(http_task_queue_t *queue, connection_handler_t *handler, listener_t *listener,
+                               size_t index) {
+    int tls = handler->tls != NULL;
+
+    // Log at most once per second, shedding happens when we are already busy
+    static uint64_t last_shed_log = 0;
+
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_storage client_address;
+        socklen_t client_len = sizeof(client_address);
 
-        // Why this strange check ?
-        // IN HTTP spec we have atleast 4 charcater that separates the headers to
-        // the body As we see in the spec we have STATUS_LINE *(HEADERS) CRLF [BODY]
-        // Each section ends with CRLF so even if we dont have any header we can
-        // still consume the 4 tokens
-        while (i + 1 < buffer_size &&
-               !(buffer[i - 2] == '\r' && buffer[i - 1] == '\n' && buffer[i] == '\r' && buffer[i + 1] == '\n')) {
-
-            header_t *header = extract_header(&buffer, buffer_size, &i);
-            if (header == NULL) {
-                free(buffer);
-                free(method);
-                free(uri);
-                free_header_list(header_list);
-                // Failed to extract an header
-                return NULL;
+        int client_fd =
+            accept4(listener->fd, (struct sockaddr *)&client_address, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            // Another worker process may have taken it, a signal is handled by the caller
+            if (errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                printf("Failed to connect to client\n");
             }
+            return;
+        }
+
+        stats_count_connection(index);
+        client_limit_t *client = NULL;
+
+        if (rate_limiter != NULL &&
+            rate_limit_accept(rate_limiter, (struct sockaddr *)&client_address, monotonic_ms(), &client) == -1) {
+            refuse_connection(client_fd, tls, TOO_MANY_REQUESTS_RESPONSE, TOO_MANY_REQUESTS_RESPONSE_LENGTH);
+            stats_count_rate_limited();
+            stats_count_refused(index);
+            continue;
+        }
+
+        http_task_t task = {.handle = &open_connection, .arg1 = client_fd, .arg2 = handler, .arg3 = client};
 
-            // TODO header names are case insensitive as HTTP/1.0 spec
-            // We should lowercase them before comparing
-            if (strcmp("Content-Length", header->name) == 0) {
-                content_length = strtol(header->value, NULL, 10);
+        if (enqueue_http_task(queue, &task) == -1) {
+            refuse_connection(client_fd, tls, SERVICE_UNAVAILABLE_RESPONSE, SERVICE_UNAVAILABLE_RESPONSE_LENGTH);
+            stats_count_shed();
+            stats_count_refused(index);
+            if (client != NULL) {
+                rate_limit_release(client, monotonic_ms());
             }
 
-            append_header_list(header_list, header);
+            uint64_t now = monotonic_ms();
+            if (now - last_shed_log >= 1000) {
+                last_shed_log = now;
+                print_queue_stats(queue);
+            }
         }
-        // Increment to skip the \r and \n checks since they are done in the while
-        // loop
-        // TODO avoid overflow of buffer:
-        i += 2;
     }
+}
 
-    if (content_length > 0) {
-        body = malloc(content_length + 1);
+static void free_server(router_t *router, tls_context_t *tls, response_cache_t *cache) {
+    free_router(router);
+    if (tls != NULL) {
+        free_tls_context(tls);
+    }
+    if (cache != NULL) {
+        free_response_cache(cache);
+    }
+}
 
-        if (body == NULL) {
-            free(method);
-            free(uri);
-            free(version);
-            free(buffer);
-            free_header_list(header_list);
-            return NULL;
-        }
+/**
+ * Serves the listening sockets with the worker threads until SIGTERM or SIGINT, then
+ * drains the connections, the whole server of a process (of a worker process in prefork mode)
+ *
+ * Returns the exit status of the process
+ */
+static int serve(listener_t *listeners, size_t listener_count, void *arg) {
+    char *public_path = arg;
+    http_task_queue_t queue;
+    pthread_t threads[MAX_THREAD_COUNT];
 
-        if (i + content_length > buffer_size) {
-            // TODO handle error
-            // INVALID CONTENT_LENGHT provided
-            free(method);
-            free(uri);
-            free(version);
-            free(buffer);
-            free_header_list(header_list);
-            return NULL;
+    response_cache_t *cache = NULL;
+    if (server_config.cache_size > 0) {
+        cache = create_response_cache(server_config.cache_size, server_config.cache_max_entry_size);
+        if (cache == NULL) {
+            printf("Failed to allocate the response cache\n");
+            return EXIT_FAILURE;
         }
+    }
 
-        memcpy(body, buffer + i, content_length);
-        body[content_length] = '\0';
+    router_t *router = setup_router(public_path, cache);
+    if (router == NULL) {
+        if (cache != NULL) {
+            free_response_cache(cache);
+        }
+        return EXIT_FAILURE;
     }
 
-    request_t *request = malloc(sizeof(request_t));
-    if (request == NULL) {
-        free(method);
-        free(uri);
-        free(version);
-        free(buffer);
-        free(body);
-        free_header_list(header_list);
-        return NULL;
+    tls_context_t *tls = NULL;
+    if (server_config.tls_certificate != NULL || server_config.tls_key != NULL) {
+        if (server_config.tls_certificate == NULL || server_config.tls_key == NULL) {
+            printf("TLS needs both --tls-cert and --tls-key\n");
+            free_server(router, NULL, cache);
+            return EXIT_FAILURE;
+        }
+
+        tls = create_tls_context(server_config.tls_certificate, server_config.tls_key, tls_shared);
+        if (tls == NULL) {
+            printf("Failed to load the TLS certificate %s\n", server_config.tls_certificate);
+            free_server(router, NULL, cache);
+            return EXIT_FAILURE;
+        }
     }
 
-    free(buffer);
+    // INITIALIZE THREADS FOR THREAD POOL
 
-    request->method = method;
-    request->uri = uri;
-    request->version = version;
-    request->body = body;
-    request->headers = header_list;
+    if (setup_http_tasks(&queue, MAX_QUEUE_SIZE, QUEUE_TARGET_DELAY_NS, QUEUE_INTERVAL_NS) == -1) {
+        printf("Failed to allocate the task queue\n");
+        free_server(router, tls, cache);
+        return EXIT_FAILURE;
+    }
 
-    return request;
-}
+    connection_handler_t handler = {.handle = &route_request, .arg = router, .tls = tls};
+
+    // No SA_RESTART, the signal has to interrupt accept
+    struct sigaction drain_action = {.sa_handler = request_drain};
+    sigemptyset(&drain_action.sa_mask);
+    sigaction(SIGTERM, &drain_action, NULL);
+    sigaction(SIGINT, &drain_action, NULL);
+
+    // The signals have to interrupt the acceptor, the other threads never take them. The acceptor
+    // only takes them while it waits in ppoll: one arriving between the check of drain_requested
+    // and the wait would otherwise be missed until the next connection
+    sigset_t acceptor_signals;
+    sigset_t waiting_mask;
+    sigemptyset(&acceptor_signals);
+    sigaddset(&acceptor_signals, SIGUSR1);
+    sigaddset(&acceptor_signals, SIGTERM);
+    sigaddset(&acceptor_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &acceptor_signals, &waiting_mask);
+
+    if (start_file_pool(server_config.file_threads, FILE_QUEUE_SIZE) == -1) {
+        printf("Failed to start the file threads\n");
+        destroy_http_tasks(&queue);
+        free_server(router, tls, cache);
+        return EXIT_FAILURE;
+    }
 
-string_t *create_response(request_t *request, response_t *response) {
-    string_t *res = create_string(10);
+    http_thread_args_t thread_args = {
+        .queue = &queue,
+        .drain = connection_drain_loop,
+        .expire = connection_close_all,
+    };
+    for (int i = 0; i < MAX_THREAD_COUNT; i++) {
+        if (pthread_create(&threads[i], NULL, (void *)start_http_task, &thread_args)) {
+            printf("Failed to start the worker threads\n");
 
-    char *status_code = int_to_str(response->status);
-    char *status_message = get_status_string(response->status);
+            // The threads started have no connection yet, they end right away
+            drain_http_tasks(&queue, 0);
+            for (int j = 0; j < i; j++) {
+                pthread_join(threads[j], NULL);
+            }
 
-    if (status_code == NULL) {
-        // TODO make free_string_t function
-        free(res->data);
-        free(res);
-        return NULL;
+            stop_file_pool();
+            destroy_http_tasks(&queue);
+            free_server(router, tls, cache);
+            return EXIT_FAILURE;
+        }
     }
 
-    char *body_length = int_to_str(strlen(response->body));
+    // The master of a prefork server hands the socket over itself
+    if (server_config.workers == 0 && server_config.handover_path != NULL) {
+        if (handover_listen(server_config.handover_path, listeners, listener_count) == -1) {
+            printf("Failed to listen for a handover on %s\n", server_config.handover_path);
+        }
+        handover_ready();
+    }
 
-    if (body_length == NULL) {
-        // TODO make free_string_t function
-        free(res->data);
-        free(res);
-        free(status_code);
-        return NULL;
+    struct pollfd polled[MAX_LISTENERS];
+    for (size_t i = 0; i < listener_count; i++) {
+        polled[i] = (struct pollfd){.fd = listeners[i].fd, .events = POLLIN};
     }
 
-    append_string(res, "HTTP/1.0");
-    append_string(res, " ");
-    append_string(res, status_code);
-    append_string(res, " ");
-    append_string(res, status_message);
-    append_string(res, "\r\n");
+    while (!drain_requested) {
+        if (stats_requested) {
+            stats_requested = 0;
+            print_server_stats(server_stats);
+        }
+
+        // The signals are unblocked for the wait only, and interrupt it
+        if (ppoll(polled, listener_count, NULL, &waiting_mask) == -1) {
+            continue;
+        }
 
-    if (response->headers && response->headers->length > 0) {
-        for (size_t i = 0; i < response->headers->length; i++) {
-            char *header_str = format_header_string(response->headers->data[i]);
-            append_string(res, header_str);
-            free(header_str);
+        for (size_t i = 0; i < listener_count && !drain_requested; i++) {
+            if (polled[i].revents != 0) {
+                accept_connections(&queue, &handler, &listeners[i], i);
+            }
         }
     }
 
-    append_string(res, "\r\n");
+    // Another process may still accept on the sockets (a handover or the other workers),
+    // the connections of this one end within the drain timeout
+    printf("Draining connections (pid %d)\n", getpid());
+    fflush(stdout);
+    for (size_t i = 0; i < listener_count; i++) {
+        close(listeners[i].fd);
+        listeners[i].fd = -1;
+    }
+    drain_http_tasks(&queue, (uint64_t)server_config.drain_timeout * 1000);
 
-    append_rawchars(res, response->body, response->body_length);
+    for (int i = 0; i < MAX_THREAD_COUNT; i++) {
+        if (pthread_join(threads[i], NULL)) {
+            printf("Failed to join threads\n");
+            return EXIT_FAILURE;
+        }
+    }
 
-    free(body_length);
-    free(status_code);
+    stop_file_pool();
+    destroy_http_tasks(&queue);
+    free_server(router, tls, cache);
+    return EXIT_SUCCESS;
+}
 
-    return res;
+static void close_listeners(listener_t *listeners, size_t listener_count) {
+    for (size_t i = 0; i < listener_count; i++) {
+        close_listener(&listeners[i]);
+    }
 }
 
-void handle_http_request(int client_fd, char *public_path) {
-    request_t *request = parse_request(client_fd);
-    if (request == NULL) {
-        // TODO implement request reply for errors
-        // We are either in 2 cases
-        // - The request has failed to parse for some reason (like malformed)
-        // - The request has failed to parse for memory issues (failed to malloc / realloc)
-        // We should reply with a 500 or close the socket directly based on the situation
-        // 500 -> An error by our end
-        // socket close -> Malformed request
-        return;
-    }
-
-    printf("[%s] %s\n", request->method, request->uri);
-
-    header_list_t *header_list = create_header_list(3);
-    response_t response = {
-        .status = 200,
-        .headers = header_list,
-    };
+/**
+ * Opens the listeners given with --listen, or the one of the port, taking over the
+ * sockets of the server before a reload or of the server running with the same
+ * --handover path
+ *
+ * Returns their count, 0 on failure
+ */
+static size_t setup_listeners(listener_t *listeners) {
+    config_list_t *specs = &server_config.listeners;
+
+    if (specs->length > MAX_LISTENERS) {
+        printf("At most %d listeners can be given\n", MAX_LISTENERS);
+        return 0;
+    }
 
-    if (strcmp(request->method, "GET") == 0) {
-        // TODO make this section separate to handle filesystem
+    char default_spec[32];
+    char *default_specs[] = {default_spec};
+    config_list_t default_list = {.items = default_specs, .length = 1};
 
-        char file_path[PATH_MAX] = "\0";
-        strcat(file_path, public_path);
-        // TODO verify uri length
-        strcat(file_path, request->uri);
+    if (specs->length == 0) {
+        snprintf(default_spec, sizeof(default_spec), "0.0.0.0:%d", server_config.port);
+        specs = &default_list;
+    }
 
-        long uri_len = strlen(request->uri);
-        if (request->uri[uri_len - 1] == '/') {
-            // IF ends with slash append index.html
-            strcat(file_path, "index.html");
-        }
+    // A reloaded master keeps the sockets of the previous one, a new server takes the ones
+    // of the server running with the same --handover path
+    int inherited_fds[MAX_LISTENERS];
+    size_t inherited_count = inherit_listeners(inherited_fds, MAX_LISTENERS);
 
-        // Full path should be used only if resolved is equal to NULL
-        // TODO usaged of full_path
-        char *full_path = NULL;
-        char *resolved = realpath(file_path, full_path);
-
-        if (resolved == NULL) {
-            // Failed to resolve path
-            response.body = "<!DOCTYPE html><html><body><h1>File not found :(</h1></body></html>";
-            response.body_length = strlen(response.body);
-            response.status = 404;
-        } else {
-            // Check if path traversal is occurred
-            if (!start_with(resolved, public_path)) {
-                response.body = "<!DOCTYPE html><html><body><h1>File not found :(</h1></body></html>";
-                response.body_length = strlen(response.body);
-                response.status = 404;
-            } else {
-                char *extension = get_extension(resolved);
-
-                // TODO handle NULL for content_type
-                header_t *content_type = get_content_type_header(extension);
-                append_header_list(response.headers, content_type);
-
-                FILE *file = fopen(resolved, "rb");
-                file_info_t *file_response = read_file(file);
-                fclose(file);
-
-                response.body = file_response->data;
-                response.body_length = file_response->size;
-
-                char *buff_size_len = int_to_str(file_response->size);
-                header_t *content_length = create_header("Content-Length", buff_size_len);
-                append_header_list(response.headers, content_length);
-
-                free(full_path);
-                free(file_response);
-            }
+    if (inherited_count == 0 && server_config.handover_path != NULL) {
+        inherited_count = handover_receive(server_config.handover_path, inherited_fds, MAX_LISTENERS);
+        if (inherited_count > 0) {
+            printf("Took over the listening sockets of the running server\n");
         }
     }
 
-    string_t *res = create_response(NULL, &response);
+    size_t count = 0;
+    int result = 0;
 
-    send(client_fd, res->data, res->length, 0);
+    while (count < specs->length && result == 0) {
+        if (parse_listener(&listeners[count], specs->items[count]) == -1) {
+            printf("Invalid listener %s\n", specs->items[count]);
+            result = -1;
+        } else if (open_listener(&listeners[count++], inherited_fds, inherited_count) == -1) {
+            result = -1;
+        }
+    }
 
-    // TODO replace this with free_string_t when made
-    free(res->data);
-    free(res);
+    // Sockets of the previous server that are no longer configured
+    for (size_t i = 0; i < inherited_count; i++) {
+        if (inherited_fds[i] != -1) {
+            close(inherited_fds[i]);
+        }
+    }
 
-    // TODO add free response.body when all bodies are heap allocated
-    // TODO add free response.headers when all headers are heap allocated
+    if (result == -1) {
+        close_listeners(listeners, count);
+        return 0;
+    }
 
-    if (shutdown(client_fd, SHUT_RDWR) == -1) {
-        printf("Failed to close client connection\n");
-        return;
+    for (size_t i = 0; i < count; i++) {
+        printf("Socket ready on %s%s\n", listeners[i].name, server_config.tls_certificate != NULL ? " (TLS)" : "");
     }
 
-    close(client_fd);
+    return count;
 }
 
 int main(int argc, char **argv) {
-    http_task_t *tasks = malloc(sizeof(http_task_t) * 100);
-    size_t tasks_count = 0;
-
-    pthread_t threads[MAX_THREAD_COUNT];
-    struct sockaddr_in address;
-    int fd;
-
-    int port = 3000;
-
-    if (argc > 1) {
-        port = atoi(argv[1]);
+    if (parse_server_config(&server_config, argc, argv) == -1) {
+        print_server_config_usage(argv[0]);
+        return EXIT_FAILURE;
     }
 
+    // Writes to a client that went away must fail with EPIPE instead of killing the server
+    signal(SIGPIPE, SIG_IGN);
+
     char cwd[PATH_MAX];
     if (getcwd(cwd, sizeof(cwd)) != NULL) {
         printf("Current working dir: %s\n", cwd);
     }
 
-    // TODO this should be more dynamic with a router struct
-    // the struct should allow us to bind multiple directories
-    // At the moment we only have one
     char public_path[PATH_MAX] = "\0";
     strcat(public_path, cwd);
     strcat(public_path, "/public");
 
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    listener_t listeners[MAX_LISTENERS];
+    size_t listener_count = setup_listeners(listeners);
 
-    if (fd == -1) {
-        printf("Failed to open a socket\n");
+    if (listener_count == 0) {
         return EXIT_FAILURE;
     }
 
-    address.sin_port = htons(port);
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_family = AF_INET;
-
-    if (bind(fd, (struct sockaddr_in *)&address, sizeof(struct sockaddr_in)) == -1) {
-
-        if (errno == EADDRINUSE) {
-            printf("Port %i already in use\n", port);
+    if (server_config.rate_limit > 0 || server_config.max_client_connections > 0) {
+        int max_connections = server_config.max_client_connections;
+        rate_limiter = create_rate_limiter(server_config.rate_limit > 0 ? server_config.rate_limit : 0,
+                                           server_config.rate_burst > 0 ? server_config.rate_burst : 0,
+                                           max_connections > 0 ? max_connections : 0);
+        if (rate_limiter == NULL) {
+            printf("Failed to map the rate limits\n");
             return EXIT_FAILURE;
-        } else {
-            printf("Failed to bind socket\n");
         }
+    }
 
-        return EXIT_FAILURE;
+    // Before the workers are forked, a client resumes its session on any of them
+    if (server_config.tls_certificate != NULL && server_config.tls_key != NULL) {
+        tls_shared = create_tls_shared();
+        if (tls_shared == NULL) {
+            printf("Failed to map the TLS sessions\n");
+            return EXIT_FAILURE;
+        }
     }
 
-    if (listen(fd, 10) == -1) {
+    int worker_count = server_config.workers;
+    server_stats = create_server_stats(worker_count > 0 ? worker_count : 1);
+    if (server_stats == NULL) {
+        printf("Failed to map the stats\n");
         return EXIT_FAILURE;
     }
 
-    printf("Socket ready at port %i\n", port);
-
-    // INITIALIZE THREADS FOR THREAD POOL
+    stats_name_listeners(server_stats, listeners, listener_count);
 
-    setup_http_tasks();
-    for (int i = 0; i < MAX_THREAD_COUNT; i++) {
-        if (pthread_create(&threads[i], NULL, (void *)start_http_task,
-                           &(http_thread_args_t){.tasks_queue_count = &tasks_count, .tasks_queue = &tasks})) {
-            return EXIT_FAILURE;
+    if (worker_count > 0) {
+        int result = run_master(listeners, listener_count, server_stats, serve, public_path, argv);
+        free_server_stats(server_stats);
+        if (tls_shared != NULL) {
+            free_tls_shared(tls_shared);
         }
+        close_listeners(listeners, listener_count);
+        return result;
     }
 
-    // TODO implement a way to close all fd even when doing SIGINT
-    while (1) {
-        struct sockaddr_in client_address;
-        socklen_t client_len;
-        int client_fd;
+    stats_use_slot(server_stats, 0);
 
-        client_fd = accept(fd, &client_address, &client_len);
-        if (client_fd == -1) {
-            printf("Failed to connect to client\n");
-            continue;
-        }
+    struct sigaction action = {.sa_handler = request_stats};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
 
-        http_task_t task = {.handle = &handle_http_request, .arg1 = client_fd, .arg2 = public_path};
-
-        // TODO we should check if tasks has enought space to store in queue
-        enqueue_http_task(&tasks, &tasks_count, &task);
+    int result = serve(listeners, listener_count, public_path);
+    if (tls_shared != NULL) {
+        free_tls_shared(tls_shared);
     }
-
-    for (int i = 0; i < MAX_THREAD_COUNT; i++) {
-        if (pthread_join(threads[i], NULL)) {
-            printf("Failed to join threads\n");
-            return EXIT_FAILURE;
-        }
-    }
-
-    destroy_http_tasks();
-    return 0;
+    close_listeners(listeners, listener_count);
+    return result;
 }
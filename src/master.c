@@ -0,0 +1,329 @@
+#include <linux/limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "config.h"
+#include "handover.h"
+#include "master.h"
+
+// Environment variable giving the comma separated listening sockets to the server executed by a reload
+static const char LISTEN_FD_VARIABLE[] = "SERVER_LISTEN_FD";
+
+// A worker dying sooner than this after its start is forked again after this delay,
+// so a worker crashing on every request doesn't keep the master forking
+const uint64_t WORKER_RESTART_DELAY_MS = 1000;
+
+typedef struct Master {
+    listener_t *listeners;
+    size_t listener_count;
+    server_stats_t *stats;
+    worker_main_t worker_main;
+    void *arg;
+
+    // Signal mask to restore in the workers
+    sigset_t worker_mask;
+    // Monotonic time of the last start of every worker
+    uint64_t *started_ms;
+    // Time at which a dead worker is forked again, 0 when it is running
+    uint64_t *restart_ms;
+} master_t;
+
+/**
+ * Fills fds with the listening sockets handed over by the master before a reload
+ *
+ * Returns their count, 0 when the server starts from scratch
+ */
+size_t inherit_listeners(int *fds, size_t max_count) {
+    char *value = getenv(LISTEN_FD_VARIABLE);
+    if (value == NULL) {
+        return 0;
+    }
+
+    size_t count = 0;
+    char *next = value;
+
+    while (count < max_count && *next != '\0') {
+        char *end = NULL;
+        long fd = strtol(next, &end, 10);
+        if (end == next) {
+            break;
+        }
+
+        int listening = 0;
+        socklen_t length = sizeof(listening);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) == 0 && listening) {
+            fds[count++] = fd;
+        }
+
+        next = *end == ',' ? end + 1 : end;
+    }
+
+    unsetenv(LISTEN_FD_VARIABLE);
+    return count;
+}
+
+// Returns -1 if the fork fails, otherwise 0
+static int spawn_worker(master_t *master, size_t slot) {
+    pid_t master_pid = getpid();
+
+    // Buffered output would be written again by the worker
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        return -1;
+    }
+
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &master->worker_mask, NULL);
+
+        // Workers don't outlive the master, the listening sockets would stay open in them
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != master_pid) {
+            _exit(EXIT_FAILURE);
+        }
+
+        stats_use_slot(master->stats, slot);
+        exit(master->worker_main(master->listeners, master->listener_count, master->arg));
+    }
+
+    master->stats->slots[slot].pid = pid;
+    master->started_ms[slot] = monotonic_ms();
+    master->restart_ms[slot] = 0;
+    return 0;
+}
+
+// Workers told to stop drain their connections first
+static void signal_workers(master_t *master, int signum) {
+    server_stats_t *stats = master->stats;
+
+    for (size_t i = 0; i < stats->slot_count; i++) {
+        if (stats->slots[i].pid > 0) {
+            kill(stats->slots[i].pid, signum);
+        }
+    }
+}
+
+static void stop_workers(master_t *master) {
+    server_stats_t *stats = master->stats;
+    signal_workers(master, SIGTERM);
+
+    for (size_t i = 0; i < stats->slot_count; i++) {
+        if (stats->slots[i].pid > 0) {
+            waitpid(stats->slots[i].pid, NULL, 0);
+            stats->slots[i].pid = 0;
+        }
+    }
+}
+
+/**
+ * Collects the workers that exited and plans their restart
+ *
+Returns
+- -1 if a worker failed to start, the server has to stop
+- 0 if succeed
+*/
+static int reap_workers(master_t *master) {
+    server_stats_t *stats = master->stats;
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        size_t slot = 0;
+        while (slot < stats->slot_count && stats->slots[slot].pid != pid) {
+            slot++;
+        }
+
+        // A worker of the server before the reload
+        if (slot == stats->slot_count) {
+            continue;
+        }
+
+        uint64_t now = monotonic_ms();
+        int early = now - master->started_ms[slot] < WORKER_RESTART_DELAY_MS;
+        stats->slots[slot].pid = 0;
+
+        if (WIFSIGNALED(status)) {
+            printf("Worker %zu (pid %d) killed by signal %d\n", slot, pid, WTERMSIG(status));
+        } else {
+            printf("Worker %zu (pid %d) exited with status %d\n", slot, pid, WEXITSTATUS(status));
+
+            if (early && WEXITSTATUS(status) != EXIT_SUCCESS) {
+                return -1;
+            }
+        }
+
+        stats->slots[slot].restarts++;
+        master->restart_ms[slot] = early ? now + WORKER_RESTART_DELAY_MS : now;
+    }
+
+    return 0;
+}
+
+// Forks the workers whose restart time has come, returns the time until the next one or -1 if none
+static int64_t restart_workers(master_t *master) {
+    server_stats_t *stats = master->stats;
+    uint64_t now = monotonic_ms();
+    int64_t next = -1;
+
+    for (size_t i = 0; i < stats->slot_count; i++) {
+        if (master->restart_ms[i] == 0) {
+            continue;
+        }
+
+        if (master->restart_ms[i] <= now) {
+            if (spawn_worker(master, i) == 0) {
+                continue;
+            }
+
+            printf("Failed to fork worker %zu\n", i);
+            master->restart_ms[i] = now + WORKER_RESTART_DELAY_MS;
+        }
+
+        int64_t wait = master->restart_ms[i] - now;
+        if (next == -1 || wait < next) {
+            next = wait;
+        }
+    }
+
+    return next;
+}
+
+// Executes the server again with the listening sockets, returns only if it fails
+static void reload(master_t *master, char *program, char **argv) {
+    char value[MAX_LISTENERS * 12] = "";
+    size_t length = 0;
+
+    for (size_t i = 0; i < master->listener_count; i++) {
+        length += snprintf(value + length, sizeof(value) - length, i == 0 ? "%d" : ",%d", master->listeners[i].fd);
+    }
+
+    // The old workers drain while the new ones accept, they are children of the new master
+    signal_workers(master, SIGTERM);
+    fflush(stdout);
+
+    sigprocmask(SIG_SETMASK, &master->worker_mask, NULL);
+    setenv(LISTEN_FD_VARIABLE, value, 1);
+    execv(program, argv);
+
+    printf("Failed to execute %s, keeping the current server\n", program);
+    unsetenv(LISTEN_FD_VARIABLE);
+
+    for (size_t i = 0; i < master->stats->slot_count; i++) {
+        master->stats->slots[i].pid = 0;
+    }
+}
+
+/**
+ * Forks a worker per stats slot running worker_main and supervises them until
+ * the master is told to stop
+ *
+ * Returns the exit status of the master
+ */
+int run_master(listener_t *listeners, size_t listener_count, server_stats_t *stats, worker_main_t worker_main,
+               void *arg, char **argv) {
+    master_t master = {
+        .listeners = listeners,
+        .listener_count = listener_count,
+        .stats = stats,
+        .worker_main = worker_main,
+        .arg = arg,
+        .started_ms = calloc(stats->slot_count, sizeof(uint64_t)),
+        .restart_ms = calloc(stats->slot_count, sizeof(uint64_t)),
+    };
+
+    // Resolved now, a binary upgrade replaces the file behind the path
+    char program[PATH_MAX];
+    ssize_t program_length = readlink("/proc/self/exe", program, sizeof(program) - 1);
+
+    if (master.started_ms == NULL || master.restart_ms == NULL || program_length == -1) {
+        free(master.started_ms);
+        free(master.restart_ms);
+        return EXIT_FAILURE;
+    }
+    program[program_length] = '\0';
+
+    // Signals are taken synchronously, workers get back the original mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &signals, &master.worker_mask);
+
+    for (size_t i = 0; i < stats->slot_count; i++) {
+        if (spawn_worker(&master, i) == -1) {
+            printf("Failed to fork worker %zu\n", i);
+            master.restart_ms[i] = monotonic_ms() + WORKER_RESTART_DELAY_MS;
+        }
+    }
+
+    // The handover thread takes none of the signals blocked above
+    if (server_config.handover_path != NULL) {
+        if (handover_listen(server_config.handover_path, listeners, listener_count) == -1) {
+            printf("Failed to listen for a handover on %s\n", server_config.handover_path);
+        }
+        handover_ready();
+    }
+
+    printf("Master %d running %zu workers\n", getpid(), stats->slot_count);
+    fflush(stdout);
+
+    int result = EXIT_SUCCESS;
+    int running = 1;
+
+    while (running) {
+        int64_t next_restart = restart_workers(&master);
+
+        struct timespec timeout = {.tv_sec = next_restart / 1000, .tv_nsec = (next_restart % 1000) * 1000000};
+        siginfo_t info;
+        int received = sigtimedwait(&signals, &info, next_restart == -1 ? NULL : &timeout);
+
+        switch (received) {
+        case SIGCHLD:
+            if (reap_workers(&master) == -1) {
+                printf("A worker failed to start, stopping\n");
+                result = EXIT_FAILURE;
+                running = 0;
+            }
+            break;
+
+        case SIGUSR1:
+            print_server_stats(stats);
+            break;
+
+        case SIGHUP:
+            printf("Reloading %s\n", program);
+            reload(&master, program, argv);
+
+            for (size_t i = 0; i < stats->slot_count; i++) {
+                master.restart_ms[i] = monotonic_ms();
+            }
+            break;
+
+        case SIGINT:
+        case SIGTERM:
+            running = 0;
+            break;
+        }
+
+        fflush(stdout);
+    }
+
+    stop_workers(&master);
+    print_server_stats(stats);
+
+    free(master.started_ms);
+    free(master.restart_ms);
+    return result;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "listener.h"
+#include "stats.h"
+
+// Prefork mode: a master process supervising worker processes
+//
+// The master binds the listening sockets and forks the workers, each one runs the whole
+// server (its own threads, event loops and allocator arenas) and accepts on the sockets
+// it inherited. A crashed worker is forked again in its stats slot, one exiting with an
+// error right after its start is taken for a configuration error and stops the server.
+//
+// Signals of the master:
+// - SIGUSR1 prints the stats of all workers
+// - SIGHUP executes the server binary again with the same arguments while the workers drain,
+//   the listening sockets are handed over so they stay bound through reloads and upgrades
+// - SIGINT and SIGTERM drain the workers then stop the master
+
+// Runs a worker on the listening sockets, returns its exit status
+typedef int (*worker_main_t)(listener_t *listeners, size_t listener_count, void *arg);
+
+size_t inherit_listeners(int *fds, size_t max_count);
+int run_master(listener_t *listeners, size_t listener_count, server_stats_t *stats, worker_main_t worker_main,
+               void *arg, char **argv);
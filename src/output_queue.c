@@ -0,0 +1,416 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "output_queue.h"
+#include "str.h"
+
+#define MAX_IOVECS 64
+
+// Upper bound of a single sendfile call, so a big file doesn't monopolize the loop
+const size_t SENDFILE_CHUNK_SIZE = 1024 * 1024;
+
+/**
+ * Allocates a buffer of `length` bytes holding one reference, the caller fills
+ * data before queuing it anywhere
+ *
+ * Returns NULL on allocation failure
+ */
+shared_buffer_t *create_shared_buffer(size_t length) {
+    shared_buffer_t *buffer = malloc(sizeof(shared_buffer_t) + length);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    atomic_init(&buffer->references, 1);
+    buffer->length = length;
+    return buffer;
+}
+
+void retain_shared_buffer(shared_buffer_t *buffer) {
+    atomic_fetch_add_explicit(&buffer->references, 1, memory_order_relaxed);
+}
+
+void release_shared_buffer(shared_buffer_t *buffer) {
+    if (atomic_fetch_sub_explicit(&buffer->references, 1, memory_order_acq_rel) == 1) {
+        free(buffer);
+    }
+}
+
+void output_queue_init(output_queue_t *queue) {
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->buffered_bytes = 0;
+    queue->spliced_bytes = 0;
+}
+
+static void free_segment(output_segment_t *segment) {
+    if (segment->shared != NULL) {
+        release_shared_buffer(segment->shared);
+    } else if (segment->type == OUTPUT_SEGMENT_BUFFER && !segment->borrowed) {
+        put_buffer(segment->data, segment->capacity);
+    } else if (segment->type == OUTPUT_SEGMENT_FILE && !segment->borrowed) {
+        close(segment->fd);
+    }
+
+    free(segment);
+}
+
+static void pop_segment(output_queue_t *queue) {
+    output_segment_t *segment = queue->head;
+
+    queue->head = segment->next;
+    if (queue->head == NULL) {
+        queue->tail = NULL;
+    }
+
+    free_segment(segment);
+}
+
+void output_queue_clear(output_queue_t *queue) {
+    while (queue->head != NULL) {
+        pop_segment(queue);
+    }
+
+    queue->buffered_bytes = 0;
+    queue->spliced_bytes = 0;
+}
+
+/**
+ * Returns 1 if there is nothing left to send
+ * otherwise 0
+ */
+int output_queue_empty(output_queue_t *queue) {
+    return queue->head == NULL;
+}
+
+static output_segment_t *push_segment(output_queue_t *queue, output_segment_type_t type) {
+    output_segment_t *segment = malloc(sizeof(output_segment_t));
+    if (segment == NULL) {
+        return NULL;
+    }
+
+    segment->next = NULL;
+    segment->type = type;
+    segment->data = NULL;
+    segment->shared = NULL;
+    segment->borrowed = 0;
+    segment->capacity = 0;
+    segment->fd = -1;
+    segment->offset = 0;
+    segment->length = 0;
+
+    if (queue->tail == NULL) {
+        queue->head = segment;
+    } else {
+        queue->tail->next = segment;
+    }
+    queue->tail = segment;
+
+    return segment;
+}
+
+/**
+ * Takes ownership of data, it is released with free() once sent
+ *
+Returns
+- -1 if append fails
+- 0 if succeed
+*/
+int output_queue_push_buffer(output_queue_t *queue, char *data, size_t length) {
+    if (length == 0) {
+        free(data);
+        return 0;
+    }
+
+    output_segment_t *segment = push_segment(queue, OUTPUT_SEGMENT_BUFFER);
+    if (segment == NULL) {
+        free(data);
+        return -1;
+    }
+
+    segment->data = data;
+    segment->length = length;
+    queue->buffered_bytes += length;
+
+    return 0;
+}
+
+// Takes ownership of the string, its data goes back to the buffer pool once sent
+int output_queue_push_string(output_queue_t *queue, string_t *string) {
+    char *data = string->data;
+    size_t length = string->length;
+    size_t capacity = string->capacity;
+    free(string);
+
+    if (length == 0) {
+        put_buffer(data, capacity);
+        return 0;
+    }
+
+    if (output_queue_push_buffer(queue, data, length) == -1) {
+        return -1;
+    }
+
+    queue->tail->capacity = capacity;
+    return 0;
+}
+
+// Queues `length` bytes of a shared buffer, the segment holds a reference until they are sent
+int output_queue_push_shared(output_queue_t *queue, shared_buffer_t *buffer, size_t offset, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    output_segment_t *segment = push_segment(queue, OUTPUT_SEGMENT_BUFFER);
+    if (segment == NULL) {
+        return -1;
+    }
+
+    retain_shared_buffer(buffer);
+    segment->data = buffer->data;
+    segment->shared = buffer;
+    segment->offset = offset;
+    segment->length = length;
+    queue->buffered_bytes += length;
+
+    return 0;
+}
+
+// Queues bytes living as long as the program, they are sent without a copy
+int output_queue_push_static(output_queue_t *queue, const char *data, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    output_segment_t *segment = push_segment(queue, OUTPUT_SEGMENT_BUFFER);
+    if (segment == NULL) {
+        return -1;
+    }
+
+    segment->data = (char *)data;
+    segment->borrowed = 1;
+    segment->length = length;
+    queue->buffered_bytes += length;
+
+    return 0;
+}
+
+// Takes ownership of fd, it is closed once the segment is sent
+int output_queue_push_file(output_queue_t *queue, int fd, off_t offset, size_t length) {
+    if (length == 0) {
+        close(fd);
+        return 0;
+    }
+
+    output_segment_t *segment = push_segment(queue, OUTPUT_SEGMENT_FILE);
+    if (segment == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    segment->fd = fd;
+    segment->offset = offset;
+    segment->length = length;
+
+    return 0;
+}
+
+// Queues a range of a file opened for longer than the segment, the fd is left open
+int output_queue_push_borrowed_file(output_queue_t *queue, int fd, off_t offset, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    output_segment_t *segment = push_segment(queue, OUTPUT_SEGMENT_FILE);
+    if (segment == NULL) {
+        return -1;
+    }
+
+    segment->fd = fd;
+    segment->borrowed = 1;
+    segment->offset = offset;
+    segment->length = length;
+
+    return 0;
+}
+
+// `length` bytes already written to the pipe are sent in order with the rest of the queue
+int output_queue_push_pipe(output_queue_t *queue, int pipe_fd, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    output_segment_t *segment = push_segment(queue, OUTPUT_SEGMENT_PIPE);
+    if (segment == NULL) {
+        return -1;
+    }
+
+    segment->fd = pipe_fd;
+    segment->length = length;
+    queue->spliced_bytes += length;
+
+    return 0;
+}
+
+// Consumes `written` bytes from the buffer segments at the head of the queue
+static void consume_buffers(output_queue_t *queue, size_t written) {
+    queue->buffered_bytes -= written;
+
+    while (written > 0) {
+        output_segment_t *segment = queue->head;
+
+        if (written < segment->length) {
+            segment->offset += written;
+            segment->length -= written;
+            return;
+        }
+
+        written -= segment->length;
+        pop_segment(queue);
+    }
+}
+
+/**
+Returns
+- -1 if the socket failed
+- 0 if the socket is full and we have to wait for it to be writable
+- 1 if the queue has been fully sent
+*/
+int output_queue_flush(output_queue_t *queue, int socket_fd) {
+    while (queue->head != NULL) {
+        output_segment_t *segment = queue->head;
+        ssize_t written;
+
+        if (segment->type == OUTPUT_SEGMENT_FILE) {
+            size_t length = segment->length < SENDFILE_CHUNK_SIZE ? segment->length : SENDFILE_CHUNK_SIZE;
+            written = sendfile(socket_fd, segment->fd, &segment->offset, length);
+
+            if (written == 0) {
+                // The file is shorter than expected (truncated while sending)
+                return -1;
+            }
+
+            if (written > 0) {
+                segment->length -= written;
+                if (segment->length == 0) {
+                    pop_segment(queue);
+                }
+                continue;
+            }
+        } else if (segment->type == OUTPUT_SEGMENT_PIPE) {
+            written = splice(segment->fd, NULL, socket_fd, NULL, segment->length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (written == 0) {
+                return -1;
+            }
+
+            if (written > 0) {
+                segment->length -= written;
+                queue->spliced_bytes -= written;
+                if (segment->length == 0) {
+                    pop_segment(queue);
+                }
+                continue;
+            }
+        } else {
+            struct iovec iovecs[MAX_IOVECS];
+            int count = 0;
+            output_segment_t *current = segment;
+
+            for (; current != NULL && current->type == OUTPUT_SEGMENT_BUFFER && count < MAX_IOVECS;
+                 current = current->next) {
+                iovecs[count].iov_base = current->data + current->offset;
+                iovecs[count].iov_len = current->length;
+                count++;
+            }
+
+            // A head followed by a file or a pipe leaves with its first bytes instead of a segment
+            // of its own, the last send of the queue pushes everything out
+            struct msghdr message = {.msg_iov = iovecs, .msg_iovlen = count};
+            written = sendmsg(socket_fd, &message, MSG_NOSIGNAL | (current != NULL ? MSG_MORE : 0));
+
+            if (written > 0) {
+                consume_buffers(queue, written);
+                continue;
+            }
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * Moves up to `length` bytes from the front of the queue to data, for the output
+ * that doesn't go straight to a socket (HTTP/2 streams)
+ *
+Returns
+- -1 if a file or pipe segment failed, errno is EAGAIN when the pipe is empty
+- otherwise the number of bytes copied, 0 when the queue is empty
+*/
+ssize_t output_queue_read(output_queue_t *queue, char *data, size_t length) {
+    size_t copied = 0;
+
+    while (copied < length && queue->head != NULL) {
+        output_segment_t *segment = queue->head;
+        size_t wanted = length - copied < segment->length ? length - copied : segment->length;
+        ssize_t read_result;
+
+        if (segment->type == OUTPUT_SEGMENT_BUFFER) {
+            memcpy(data + copied, segment->data + segment->offset, wanted);
+            consume_buffers(queue, wanted);
+            copied += wanted;
+            continue;
+        }
+
+        if (segment->type == OUTPUT_SEGMENT_FILE) {
+            read_result = pread(segment->fd, data + copied, wanted, segment->offset);
+        } else {
+            read_result = read(segment->fd, data + copied, wanted);
+        }
+
+        if (read_result == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (read_result == -1 && errno == EAGAIN && copied > 0) {
+            return copied;
+        }
+
+        if (read_result <= 0) {
+            // The file is shorter than expected (truncated while sending)
+            if (read_result == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+
+        segment->offset += read_result;
+        segment->length -= read_result;
+        if (segment->type == OUTPUT_SEGMENT_PIPE) {
+            queue->spliced_bytes -= read_result;
+        }
+        if (segment->length == 0) {
+            pop_segment(queue);
+        }
+        copied += read_result;
+    }
+
+    return copied;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "str.h"
+
+// Queue of pending output for a connection
+//
+// Consecutive memory buffers are written with a single gathering sendmsg() (a writev()
+// that accepts MSG_NOSIGNAL), file segments go straight from the page cache to the
+// socket with sendfile() and pipe segments are moved to the socket with splice().
+
+// Immutable bytes queued on many connections at once (broadcasts),
+// released with the last segment or producer holding them
+typedef struct SharedBuffer {
+    atomic_int references;
+    size_t length;
+    char data[];
+} shared_buffer_t;
+
+typedef enum OutputSegmentType {
+    OUTPUT_SEGMENT_BUFFER,
+    OUTPUT_SEGMENT_FILE,
+    OUTPUT_SEGMENT_PIPE,
+} output_segment_type_t;
+
+typedef struct OutputSegment {
+    struct OutputSegment *next;
+    output_segment_type_t type;
+
+    // OUTPUT_SEGMENT_BUFFER, the data is owned by the segment unless it belongs to a shared buffer
+    char *data;
+    shared_buffer_t *shared;
+    // OUTPUT_SEGMENT_FILE, the fd is owned by the segment
+    // OUTPUT_SEGMENT_PIPE, read end of a pipe owned by the caller
+    int fd;
+    // The data or the fd outlive the segment (embedded assets, asset packs), it never releases them
+    int borrowed;
+    // Size of a data buffer checked out of the buffer pool, 0 for the plain allocations
+    size_t capacity;
+
+    // Offset in the data or in the file of the next byte to send
+    off_t offset;
+    // Bytes left to send
+    size_t length;
+} output_segment_t;
+
+typedef struct OutputQueue {
+    output_segment_t *head;
+    output_segment_t *tail;
+    // Bytes held in memory by buffer segments, used for the watermarks
+    size_t buffered_bytes;
+    // Bytes waiting in pipes, they are kept by the kernel
+    size_t spliced_bytes;
+} output_queue_t;
+
+shared_buffer_t *create_shared_buffer(size_t length);
+void retain_shared_buffer(shared_buffer_t *buffer);
+void release_shared_buffer(shared_buffer_t *buffer);
+
+void output_queue_init(output_queue_t *queue);
+void output_queue_clear(output_queue_t *queue);
+int output_queue_empty(output_queue_t *queue);
+
+int output_queue_push_buffer(output_queue_t *queue, char *data, size_t length);
+int output_queue_push_string(output_queue_t *queue, string_t *string);
+int output_queue_push_file(output_queue_t *queue, int fd, off_t offset, size_t length);
+int output_queue_push_borrowed_file(output_queue_t *queue, int fd, off_t offset, size_t length);
+int output_queue_push_shared(output_queue_t *queue, shared_buffer_t *buffer, size_t offset, size_t length);
+int output_queue_push_static(output_queue_t *queue, const char *data, size_t length);
+int output_queue_push_pipe(output_queue_t *queue, int pipe_fd, size_t length);
+
+int output_queue_flush(output_queue_t *queue, int socket_fd);
+ssize_t output_queue_read(output_queue_t *queue, char *data, size_t length);
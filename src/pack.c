@@ -0,0 +1,203 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "http/headers.h"
+#include "http/status.h"
+#include "pack.h"
+
+// Bodies below this size are copied from the mapping with the head into a single write,
+// larger ones are worth a sendfile
+const size_t PACK_SENDFILE_MIN_SIZE = 16 * 1024;
+
+// Index page of the directories, like the directory mounts
+static const char INDEX_FILE[] = "index.html";
+
+static const char NOT_FOUND_BODY[] = "<!DOCTYPE html><html><body><h1>File not found :(</h1></body></html>";
+
+/**
+ * Maps a pack and checks its header, the entries are checked when they are looked up
+ * so that opening doesn't depend on their number
+ *
+ * Returns NULL if the file can't be mapped or isn't a pack
+ */
+asset_pack_t *open_asset_pack(char *path) {
+    asset_pack_t *pack = calloc(1, sizeof(asset_pack_t));
+    if (pack == NULL) {
+        return NULL;
+    }
+
+    pack->fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+
+    if (pack->fd == -1 || fstat(pack->fd, &file_stat) == -1 || (size_t)file_stat.st_size < sizeof(pack_header_t)) {
+        if (pack->fd != -1) {
+            close(pack->fd);
+        }
+        free(pack);
+        return NULL;
+    }
+
+    pack->size = file_stat.st_size;
+    pack->data = mmap(NULL, pack->size, PROT_READ, MAP_SHARED, pack->fd, 0);
+    if (pack->data == MAP_FAILED) {
+        close(pack->fd);
+        free(pack);
+        return NULL;
+    }
+
+    const pack_header_t *header = (const pack_header_t *)pack->data;
+    uint64_t index_size = (uint64_t)header->entry_count * sizeof(pack_entry_t);
+
+    if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0 || header->version != PACK_VERSION ||
+        header->file_size != pack->size || header->index_offset % sizeof(uint64_t) != 0 ||
+        header->index_offset > pack->size || index_size > pack->size - header->index_offset) {
+        free_asset_pack(pack);
+        return NULL;
+    }
+
+    pack->entries = (const pack_entry_t *)(pack->data + header->index_offset);
+    pack->entry_count = header->entry_count;
+
+    // Requests touch scattered small files, reading ahead would only evict them
+    madvise(pack->data, pack->size, MADV_RANDOM);
+    return pack;
+}
+
+void free_asset_pack(void *pack) {
+    asset_pack_t *asset_pack = pack;
+
+    munmap(asset_pack->data, asset_pack->size);
+    close(asset_pack->fd);
+    free(asset_pack);
+}
+
+// Returns the NUL terminated string at offset, or NULL if it runs past the pack
+static const char *get_pack_string(asset_pack_t *pack, uint64_t offset) {
+    if (offset >= pack->size || memchr(pack->data + offset, '\0', pack->size - offset) == NULL) {
+        return NULL;
+    }
+
+    return pack->data + offset;
+}
+
+// Returns 1 if the variant lies inside the pack, otherwise 0
+static int is_valid_variant(asset_pack_t *pack, const pack_variant_t *variant) {
+    return variant->data_offset <= pack->size && variant->length <= pack->size - variant->data_offset &&
+           get_pack_string(pack, variant->headers_offset) != NULL &&
+           get_pack_string(pack, variant->etag_offset) != NULL;
+}
+
+/**
+ * Binary search of the sorted index, in the byte order of strcmp
+ *
+ * Returns NULL if the pack has no such path
+ */
+const pack_entry_t *find_pack_entry(asset_pack_t *pack, char *path, size_t length) {
+    size_t low = 0;
+    size_t high = pack->entry_count;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const pack_entry_t *entry = &pack->entries[middle];
+
+        if (entry->path_offset > pack->size || entry->path_length > pack->size - entry->path_offset) {
+            return NULL;
+        }
+
+        size_t shortest = entry->path_length < length ? entry->path_length : length;
+        int order = memcmp(pack->data + entry->path_offset, path, shortest);
+        if (order == 0 && entry->path_length != length) {
+            order = entry->path_length < length ? -1 : 1;
+        }
+
+        if (order == 0) {
+            return entry;
+        }
+
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns -1 to close the connection, otherwise 0
+static int send_variant(connection_t *connection, request_t *request, asset_pack_t *pack,
+                        const pack_variant_t *variant) {
+    const char *etag = pack->data + variant->etag_offset;
+    response_t response = {
+        .status = OK,
+        .raw_headers = pack->data + variant->headers_offset,
+        .body_length = variant->length,
+    };
+
+    // The head still carries the length of the representation, the body is left out
+    if (has_header_token(request->headers, "If-None-Match", (char *)etag) ||
+        has_header_token(request->headers, "If-None-Match", "*")) {
+        response.status = NOT_MODIFIED;
+        return connection_send_string(connection, create_response(request, &response));
+    }
+
+    if (connection_send_string(connection, create_response(request, &response)) == -1) {
+        return -1;
+    }
+
+    if (variant->length < PACK_SENDFILE_MIN_SIZE) {
+        return connection_send_static(connection, pack->data + variant->data_offset, variant->length);
+    }
+
+    return connection_send_borrowed_file(connection, pack->fd, variant->data_offset, variant->length);
+}
+
+/**
+ * Request handler serving the assets of the pack given as arg, the asset is the "path"
+ * parameter of the route. The gzip variant goes to the clients accepting it and a
+ * matching If-None-Match is answered with 304.
+ *
+ * Returns -1 to close the connection, otherwise 0
+ */
+int serve_asset_pack(connection_t *connection, request_t *request, void *arg) {
+    asset_pack_t *pack = arg;
+    char *path = get_request_param(request, "path");
+
+    if (path == NULL) {
+        path = "";
+    }
+
+    // Directories are requested with a trailing slash, the prefix itself with an empty path
+    size_t path_length = strlen(path);
+    const pack_entry_t *entry = NULL;
+
+    if (path_length == 0 || path[path_length - 1] == '/') {
+        char index_path[1024];
+        if (path_length + sizeof(INDEX_FILE) <= sizeof(index_path)) {
+            memcpy(index_path, path, path_length);
+            memcpy(index_path + path_length, INDEX_FILE, sizeof(INDEX_FILE));
+            entry = find_pack_entry(pack, index_path, path_length + sizeof(INDEX_FILE) - 1);
+        }
+    } else {
+        entry = find_pack_entry(pack, path, path_length);
+    }
+
+    if (entry == NULL || !is_valid_variant(pack, &entry->identity)) {
+        response_t response = {
+            .status = NOT_FOUND,
+            .body = (char *)NOT_FOUND_BODY,
+            .body_length = sizeof(NOT_FOUND_BODY) - 1,
+        };
+        return connection_send_string(connection, create_response(request, &response));
+    }
+
+    int gzip = entry->gzip.data_offset != 0 && is_valid_variant(pack, &entry->gzip) &&
+               has_header_token(request->headers, "Accept-Encoding", "gzip");
+
+    return send_variant(connection, request, pack, gzip ? &entry->gzip : &entry->identity);
+}
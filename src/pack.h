@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "connection.h"
+#include "http/http.h"
+#include "pack_format.h"
+
+// Serves an asset pack built by tools/pack_assets.c, a whole directory in one file
+//
+// The pack is mapped read-only: opening it and looking a path up (a binary search on the
+// sorted index) cost the same for a thousand files or a million, and the worker processes
+// share its pages through the page cache. Small bodies are gathered with the head straight
+// from the mapping, larger ones are sent with sendfile on the pack at their offset.
+
+typedef struct AssetPack {
+    int fd;
+    char *data;
+    size_t size;
+    const pack_entry_t *entries;
+    uint32_t entry_count;
+} asset_pack_t;
+
+asset_pack_t *open_asset_pack(char *path);
+void free_asset_pack(void *pack);
+const pack_entry_t *find_pack_entry(asset_pack_t *pack, char *path, size_t length);
+int serve_asset_pack(connection_t *connection, request_t *request, void *arg);
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+// On-disk layout of an asset pack, written by tools/pack_assets.c and served by pack.c
+//
+// All integers are little endian, offsets are from the start of the file:
+// - header
+// - contents of the assets, each variant 16 bytes aligned
+// - strings: paths, header lines and ETags, each one NUL terminated
+// - index: one entry per asset, sorted by path in the byte order of strcmp
+
+#define PACK_MAGIC "HTTPPACK"
+#define PACK_VERSION 1
+
+typedef struct PackHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint64_t index_offset;
+    uint64_t file_size;
+} pack_header_t;
+
+typedef struct PackVariant {
+    uint64_t data_offset;
+    uint64_t length;
+    // Header lines of the response, without Content-Length
+    uint64_t headers_offset;
+    uint64_t etag_offset;
+} pack_variant_t;
+
+typedef struct PackEntry {
+    uint64_t path_offset;
+    uint64_t path_length;
+    pack_variant_t identity;
+    // Gzip compressed content, data_offset is 0 when there is none
+    pack_variant_t gzip;
+} pack_entry_t;
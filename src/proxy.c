@@ -0,0 +1,1584 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "clock.h"
+#include "event_loop.h"
+#include "http/chunked.h"
+#include "http/status.h"
+#include "output_queue.h"
+#include "proxy.h"
+#include "str.h"
+
+// Idle connections kept per upstream by each worker, and how long they are kept
+const int PROXY_MAX_IDLE_CONNECTIONS = 16;
+const uint64_t PROXY_IDLE_TIMEOUT_MS = 30000;
+
+// Deadline of the connect and of the response head, then of every read of the body
+const uint64_t PROXY_RESPONSE_TIMEOUT_MS = 30000;
+
+const size_t PROXY_MAX_HEAD_SIZE = 64 * 1024;
+const size_t PROXY_READ_SIZE = 16 * 1024;
+
+// Request body queued for the upstream above which the client is paused, and below which it resumes
+const size_t PROXY_BODY_HIGH_WATERMARK = 64 * 1024;
+const size_t PROXY_BODY_LOW_WATERMARK = 16 * 1024;
+
+// Consecutive failures after which an upstream is skipped, and for how long
+const int PROXY_MAX_FAILURES = 3;
+const uint64_t PROXY_FAILURE_BACKOFF_MS = 10000;
+
+typedef struct ProxyExchange proxy_exchange_t;
+
+typedef struct UpstreamConnection {
+    // Must be the first member, the loop hands the watcher back to us
+    io_watcher_t watcher;
+    // Idle timeout while pooled
+    wheel_timer_t timer;
+    event_loop_t *loop;
+    upstream_t *upstream;
+    // Next idle connection of the worker pool
+    struct UpstreamConnection *next;
+    // NULL while idle
+    proxy_exchange_t *exchange;
+} upstream_connection_t;
+
+typedef enum ProxyState {
+    PROXY_CONNECTING,
+    // The request is sent and the response head read
+    PROXY_WAITING_HEAD,
+    // The head is known, the body is relayed by the producer of the client stream
+    PROXY_RELAYING,
+    // No response could be obtained, an error response is sent instead
+    PROXY_FAILED,
+    // The response failed after its head has been sent, the client connection is closed
+    PROXY_ABORTED,
+    // Another request is fetching the response for the cache
+    PROXY_CACHE_WAITING,
+    // The response is served from the cache
+    PROXY_CACHED,
+    PROXY_DONE,
+} proxy_state_t;
+
+typedef enum ProxyBodyType {
+    PROXY_BODY_NONE,
+    PROXY_BODY_LENGTH,
+    PROXY_BODY_CHUNKED,
+    // Ends when the upstream closes the connection
+    PROXY_BODY_CLOSE,
+} proxy_body_type_t;
+
+struct ProxyExchange {
+    // NULL once the response is complete, the exchange may outlive it to drop the rest of the request body
+    connection_t *connection;
+    event_loop_t *loop;
+    upstream_t *upstream;
+    upstream_connection_t *upstream_connection;
+    wheel_timer_t timer;
+    proxy_state_t state;
+    int failure_status;
+    // Released by the client stream and by the body reader
+    int references;
+
+    // What the response head needs from the request, which is freed once its body is read,
+    // all the headers are kept when the cache may need them for Vary
+    http_version_t client_version;
+    header_list_t *client_headers;
+    int head_request;
+
+    // NULL when the response can't come from the cache
+    response_cache_t *cache;
+    char *cache_key;
+    // Set while this exchange fetches the response of its key for the cache
+    int cache_fill;
+    // Linked to the fill of another exchange while waiting for it, and to the cache waits of the thread
+    cache_waiter_t cache_waiter;
+    int cache_waiting;
+    int wake_fd;
+    atomic_int fill_ended;
+    proxy_exchange_t *previous_waiting;
+    proxy_exchange_t *next_waiting;
+    // Copy of the body to be stored, NULL once the response turned out not to be cacheable
+    string_t *cache_body;
+    cache_lifetime_t cache_lifetime;
+    cache_entry_t *cached;
+
+    // Request to the upstream
+    output_queue_t output;
+    // Kept to retry an idempotent request without body when a pooled connection turns out to be closed
+    string_t *request_head;
+    int request_chunked;
+    int request_complete;
+    int reused;
+    // Set once a byte of the response arrived, and when the upstream closed the connection before
+    int response_started;
+    int upstream_closed;
+
+    // Response head, followed by the first bytes of the body
+    char *head;
+    size_t head_length;
+    size_t head_end;
+    int status;
+    header_list_t *response_headers;
+    int head_queued;
+
+    proxy_body_type_t body_type;
+    size_t body_remaining;
+    chunked_decoder_t decoder;
+    int upstream_keep_alive;
+    // Set while the producer waits for the upstream to be readable
+    int relay_waiting;
+};
+
+static __thread upstream_connection_t *idle_connections = NULL;
+
+// Exchanges of the loop waiting for cache fills, the thread ending a fill writes the eventfd
+typedef struct CacheWaits {
+    // Must be the first member, the loop hands the watcher back to us
+    io_watcher_t watcher;
+    proxy_exchange_t *exchanges;
+} cache_waits_t;
+
+static __thread cache_waits_t *cache_waits = NULL;
+
+static void on_upstream_event(event_loop_t *loop, io_watcher_t *watcher, uint32_t events);
+static void on_exchange_timeout(wheel_timer_t *timer);
+static void resume_cache_wait(proxy_exchange_t *exchange);
+
+/**
+ * Parses "host:port" or "unix:/path"
+ *
+Returns
+- -1 if the address can't be resolved
+- 0 if succeed
+*/
+static int resolve_upstream(upstream_t *upstream, char *name) {
+    memset(&upstream->address, 0, sizeof(upstream->address));
+
+    if (strncmp(name, "unix:", 5) == 0) {
+        struct sockaddr_un *address = (struct sockaddr_un *)&upstream->address;
+        char *path = name + 5;
+
+        if (strlen(path) >= sizeof(address->sun_path)) {
+            return -1;
+        }
+
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, path);
+        upstream->address_length = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    char *separator = strrchr(name, ':');
+    if (separator == NULL) {
+        return -1;
+    }
+
+    char *host = strndup(name, separator - name);
+    if (host == NULL) {
+        return -1;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *result = NULL;
+    int error = getaddrinfo(host, separator + 1, &hints, &result);
+    free(host);
+
+    if (error != 0) {
+        return -1;
+    }
+
+    memcpy(&upstream->address, result->ai_addr, result->ai_addrlen);
+    upstream->address_length = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    return 0;
+}
+
+/**
+ * Creates a proxy to a comma separated list of upstreams, its responses are
+ * cached in `cache` unless it is NULL
+ *
+ * Returns NULL if an upstream can't be resolved or on allocation failure
+ */
+proxy_t *create_proxy(char *upstreams, response_cache_t *cache) {
+    proxy_t *proxy = calloc(1, sizeof(proxy_t));
+    if (proxy == NULL) {
+        return NULL;
+    }
+
+    size_t count = 1;
+    for (char *c = upstreams; *c != '\0'; c++) {
+        count += *c == ',';
+    }
+
+    proxy->upstreams = calloc(count, sizeof(upstream_t));
+    if (proxy->upstreams == NULL) {
+        free(proxy);
+        return NULL;
+    }
+
+    char *start = upstreams;
+    for (size_t i = 0; i < count; i++) {
+        size_t length = strcspn(start, ",");
+        upstream_t *upstream = &proxy->upstreams[i];
+
+        upstream->name = strndup(start, length);
+        proxy->upstream_count++;
+
+        if (upstream->name == NULL || resolve_upstream(upstream, upstream->name) == -1) {
+            free_proxy(proxy);
+            return NULL;
+        }
+
+        atomic_init(&upstream->failures, 0);
+        atomic_init(&upstream->down_until, 0);
+        start += length + 1;
+    }
+
+    atomic_init(&proxy->next, 0);
+    proxy->cache = cache;
+
+    return proxy;
+}
+
+void free_proxy(void *arg) {
+    proxy_t *proxy = arg;
+
+    for (size_t i = 0; i < proxy->upstream_count; i++) {
+        free(proxy->upstreams[i].name);
+    }
+
+    free(proxy->upstreams);
+    free(proxy);
+}
+
+static void record_failure(upstream_t *upstream) {
+    int failures = atomic_fetch_add_explicit(&upstream->failures, 1, memory_order_relaxed) + 1;
+
+    if (failures >= PROXY_MAX_FAILURES) {
+        atomic_store_explicit(&upstream->down_until, monotonic_ms() + PROXY_FAILURE_BACKOFF_MS, memory_order_relaxed);
+        printf("Upstream %s is failing, skipped for %lums\n", upstream->name, PROXY_FAILURE_BACKOFF_MS);
+    }
+}
+
+static void record_success(upstream_t *upstream) {
+    atomic_store_explicit(&upstream->failures, 0, memory_order_relaxed);
+}
+
+// Round robin over the healthy upstreams, when none is healthy they are tried anyway
+static upstream_t *select_upstream(proxy_t *proxy) {
+    size_t start = atomic_fetch_add_explicit(&proxy->next, 1, memory_order_relaxed);
+    uint64_t now = monotonic_ms();
+
+    for (size_t i = 0; i < proxy->upstream_count; i++) {
+        upstream_t *upstream = &proxy->upstreams[(start + i) % proxy->upstream_count];
+
+        if (atomic_load_explicit(&upstream->down_until, memory_order_relaxed) <= now) {
+            return upstream;
+        }
+    }
+
+    return &proxy->upstreams[start % proxy->upstream_count];
+}
+
+static void close_upstream_connection(upstream_connection_t *upstream_connection) {
+    event_loop_cancel(upstream_connection->loop, &upstream_connection->timer);
+    close(upstream_connection->watcher.fd);
+    event_loop_forget(upstream_connection->loop, &upstream_connection->watcher);
+    free(upstream_connection);
+}
+
+static void remove_idle_connection(upstream_connection_t *upstream_connection) {
+    for (upstream_connection_t **link = &idle_connections; *link != NULL; link = &(*link)->next) {
+        if (*link == upstream_connection) {
+            *link = upstream_connection->next;
+            return;
+        }
+    }
+}
+
+static void on_idle_timeout(wheel_timer_t *timer) {
+    upstream_connection_t *upstream_connection =
+        (upstream_connection_t *)((char *)timer - offsetof(upstream_connection_t, timer));
+
+    remove_idle_connection(upstream_connection);
+    close_upstream_connection(upstream_connection);
+}
+
+static upstream_connection_t *take_idle_connection(upstream_t *upstream) {
+    for (upstream_connection_t **link = &idle_connections; *link != NULL; link = &(*link)->next) {
+        upstream_connection_t *upstream_connection = *link;
+
+        if (upstream_connection->upstream == upstream) {
+            *link = upstream_connection->next;
+            event_loop_cancel(upstream_connection->loop, &upstream_connection->timer);
+            return upstream_connection;
+        }
+    }
+
+    return NULL;
+}
+
+// Keeps the connection for the next request of the worker, the pool of each upstream is bounded
+static void put_idle_connection(upstream_connection_t *upstream_connection) {
+    int count = 0;
+    for (upstream_connection_t *idle = idle_connections; idle != NULL; idle = idle->next) {
+        count += idle->upstream == upstream_connection->upstream;
+    }
+
+    // Readable while idle means the upstream closed the connection
+    if (count >= PROXY_MAX_IDLE_CONNECTIONS ||
+        event_loop_modify(upstream_connection->loop, &upstream_connection->watcher, EPOLLIN) == -1) {
+        close_upstream_connection(upstream_connection);
+        return;
+    }
+
+    upstream_connection->exchange = NULL;
+    upstream_connection->next = idle_connections;
+    idle_connections = upstream_connection;
+
+    event_loop_schedule(upstream_connection->loop, &upstream_connection->timer, PROXY_IDLE_TIMEOUT_MS);
+}
+
+/**
+ * Closes the pooled connections of the thread, once its loop stopped
+ */
+void release_idle_connections() {
+    while (idle_connections != NULL) {
+        upstream_connection_t *upstream_connection = idle_connections;
+        idle_connections = upstream_connection->next;
+
+        close(upstream_connection->watcher.fd);
+        free(upstream_connection);
+    }
+}
+
+static upstream_connection_t *connect_upstream(event_loop_t *loop, upstream_t *upstream) {
+    int fd = socket(upstream->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (upstream->address.ss_family != AF_UNIX) {
+        // Heads and small bodies are written in one go, there is nothing to coalesce
+        int enabled = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+    }
+
+    if (connect(fd, (struct sockaddr *)&upstream->address, upstream->address_length) == -1 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        return NULL;
+    }
+
+    upstream_connection_t *upstream_connection = calloc(1, sizeof(upstream_connection_t));
+    if (upstream_connection == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    io_watcher_init(&upstream_connection->watcher, fd, on_upstream_event);
+    wheel_timer_init(&upstream_connection->timer, on_idle_timeout);
+    upstream_connection->loop = loop;
+    upstream_connection->upstream = upstream;
+
+    // Writable once connected
+    if (event_loop_add(loop, &upstream_connection->watcher, EPOLLOUT) == -1) {
+        close(fd);
+        free(upstream_connection);
+        return NULL;
+    }
+
+    return upstream_connection;
+}
+
+// Hop-by-hop headers only concern a single connection, they are never forwarded
+static int is_hop_by_hop_header(char *name) {
+    switch (get_header_id(name)) {
+    case HEADER_CONNECTION:
+    case HEADER_KEEP_ALIVE:
+    case HEADER_PROXY_CONNECTION:
+    case HEADER_TE:
+    case HEADER_TRAILER:
+    case HEADER_TRANSFER_ENCODING:
+    case HEADER_UPGRADE:
+    case HEADER_EXPECT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static string_t *create_upstream_request_head(request_t *request, upstream_t *upstream) {
+    string_t *head = create_string(256);
+    if (head == NULL) {
+        return NULL;
+    }
+
+    // The resource the route was matched on, not the raw target an upstream could resolve differently
+    char *target = encode_target(request->target, request->path_length);
+    if (target == NULL) {
+        free_string(head);
+        return NULL;
+    }
+
+    append_string(head, request->method);
+    append_string(head, " ");
+    append_string(head, target);
+    append_string(head, " HTTP/1.1\r\n");
+    free(target);
+
+    for (size_t i = 0; i < request->headers->length; i++) {
+        header_t *header = request->headers->data[i];
+
+        // The framing is the one the body is relayed with, written below
+        if (!is_hop_by_hop_header(header->name) && header->id != HEADER_CONTENT_LENGTH) {
+            char *line = format_header_string(header);
+            if (line == NULL) {
+                free_string(head);
+                return NULL;
+            }
+
+            append_string(head, line);
+            free(line);
+        }
+    }
+
+    // HTTP/1.0 clients may not send one, it is mandatory in HTTP/1.1
+    if (find_known_header(request->headers, HEADER_HOST) == NULL) {
+        append_string(head, "Host: ");
+        append_string(head, upstream->name);
+        append_string(head, "\r\n");
+    }
+
+    if (request->chunked) {
+        append_string(head, "Transfer-Encoding: chunked\r\n");
+    } else if (request->content_length > 0 || find_known_header(request->headers, HEADER_CONTENT_LENGTH) != NULL) {
+        char length[48];
+        snprintf(length, sizeof(length), "Content-Length: %ld\r\n", request->content_length);
+        append_string(head, length);
+    }
+
+    append_string(head, "\r\n");
+
+    return head;
+}
+
+// Lets the requests waiting for this fill go on, `bypass` sends them to the upstream directly
+static void end_cache_fill(proxy_exchange_t *exchange, int bypass) {
+    if (exchange->cache_fill) {
+        cache_end_fill(exchange->cache, exchange->cache_key, bypass);
+        exchange->cache_fill = 0;
+    }
+
+    free_string(exchange->cache_body);
+    exchange->cache_body = NULL;
+}
+
+// Called by the thread ending the fill, the loop of the exchange looks at it next
+static void wake_cache_waiter(cache_waiter_t *waiter) {
+    proxy_exchange_t *exchange = (proxy_exchange_t *)((char *)waiter - offsetof(proxy_exchange_t, cache_waiter));
+    uint64_t value = 1;
+
+    atomic_store(&exchange->fill_ended, 1);
+    write(exchange->wake_fd, &value, sizeof(value));
+}
+
+static void unlink_cache_wait(proxy_exchange_t *exchange) {
+    if (!exchange->cache_waiting) {
+        return;
+    }
+
+    exchange->cache_waiting = 0;
+    if (exchange->previous_waiting != NULL) {
+        exchange->previous_waiting->next_waiting = exchange->next_waiting;
+    } else {
+        cache_waits->exchanges = exchange->next_waiting;
+    }
+
+    if (exchange->next_waiting != NULL) {
+        exchange->next_waiting->previous_waiting = exchange->previous_waiting;
+    }
+
+    exchange->previous_waiting = NULL;
+    exchange->next_waiting = NULL;
+}
+
+static void on_cache_waits(event_loop_t *loop, io_watcher_t *watcher, uint32_t events) {
+    (void)loop;
+    (void)events;
+    uint64_t value;
+
+    read(watcher->fd, &value, sizeof(value));
+
+    // Resuming an exchange may make it wait again, the ended ones are taken out first
+    proxy_exchange_t *ended = NULL;
+    proxy_exchange_t *exchange = cache_waits->exchanges;
+
+    while (exchange != NULL) {
+        proxy_exchange_t *next = exchange->next_waiting;
+
+        if (atomic_load(&exchange->fill_ended)) {
+            unlink_cache_wait(exchange);
+            exchange->next_waiting = ended;
+            ended = exchange;
+        }
+        exchange = next;
+    }
+
+    while (ended != NULL) {
+        proxy_exchange_t *next = ended->next_waiting;
+        ended->next_waiting = NULL;
+        event_loop_cancel(ended->loop, &ended->timer);
+        resume_cache_wait(ended);
+        ended = next;
+    }
+}
+
+/**
+ * Prepares the exchange to wait for the fill of its key, the cache waits of the
+ * thread are set up on first use
+ *
+Returns
+- -1 if the loop can't be woken, the exchange fetches the response itself
+- 0 if succeed
+*/
+static int prepare_cache_wait(proxy_exchange_t *exchange) {
+    if (cache_waits == NULL) {
+        cache_waits = calloc(1, sizeof(cache_waits_t));
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (cache_waits == NULL || fd == -1) {
+            free(cache_waits);
+            cache_waits = NULL;
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+
+        io_watcher_init(&cache_waits->watcher, fd, on_cache_waits);
+        if (event_loop_add(exchange->loop, &cache_waits->watcher, EPOLLIN) == -1) {
+            close(fd);
+            free(cache_waits);
+            cache_waits = NULL;
+            return -1;
+        }
+    }
+
+    exchange->cache_waiter.wake = wake_cache_waiter;
+    exchange->wake_fd = cache_waits->watcher.fd;
+    atomic_store(&exchange->fill_ended, 0);
+    return 0;
+}
+
+// Links the exchange to the waits of the loop once the cache registered it on the fill
+static void start_cache_wait(proxy_exchange_t *exchange) {
+    exchange->state = PROXY_CACHE_WAITING;
+    exchange->cache_waiting = 1;
+    exchange->previous_waiting = NULL;
+    exchange->next_waiting = cache_waits->exchanges;
+    if (cache_waits->exchanges != NULL) {
+        cache_waits->exchanges->previous_waiting = exchange;
+    }
+    cache_waits->exchanges = exchange;
+
+    // An abandoned fill is taken over after this long
+    event_loop_schedule(exchange->loop, &exchange->timer, CACHE_FILL_TIMEOUT_MS);
+}
+
+// Stops waiting before the fill ended, the exchange is never woken afterwards
+static void stop_cache_wait(proxy_exchange_t *exchange) {
+    if (!exchange->cache_waiting) {
+        return;
+    }
+
+    cache_cancel_wait(exchange->cache, exchange->cache_key, &exchange->cache_waiter);
+    unlink_cache_wait(exchange);
+}
+
+/**
+ * Closes the cache waits of the thread, once its loop stopped
+ */
+void release_proxy_cache_waits() {
+    if (cache_waits == NULL) {
+        return;
+    }
+
+    close(cache_waits->watcher.fd);
+    free(cache_waits);
+    cache_waits = NULL;
+}
+
+static void release_exchange(void *state) {
+    proxy_exchange_t *exchange = state;
+
+    if (--exchange->references > 0) {
+        return;
+    }
+
+    event_loop_cancel(exchange->loop, &exchange->timer);
+    stop_cache_wait(exchange);
+
+    if (exchange->upstream_connection != NULL) {
+        close_upstream_connection(exchange->upstream_connection);
+    }
+
+    end_cache_fill(exchange, 0);
+
+    if (exchange->cached != NULL) {
+        release_cache_entry(exchange->cached);
+    }
+
+    output_queue_clear(&exchange->output);
+    free_string(exchange->request_head);
+    free(exchange->cache_key);
+    free_header_list(exchange->client_headers);
+    free_header_list(exchange->response_headers);
+    free(exchange->head);
+    free(exchange);
+}
+
+// The stream is over, the body reader may still be reading the rest of the request
+static void finish_exchange(proxy_exchange_t *exchange) {
+    exchange->state = PROXY_DONE;
+    exchange->connection = NULL;
+}
+
+/**
+Returns
+- -1 if the interest can't be changed
+- 0 if succeed
+*/
+static int update_upstream_interest(proxy_exchange_t *exchange) {
+    upstream_connection_t *upstream_connection = exchange->upstream_connection;
+    uint32_t events = 0;
+
+    if (exchange->state == PROXY_CONNECTING || !output_queue_empty(&exchange->output)) {
+        events |= EPOLLOUT;
+    }
+
+    if (exchange->state == PROXY_WAITING_HEAD || (exchange->state == PROXY_RELAYING && exchange->relay_waiting)) {
+        events |= EPOLLIN;
+    }
+
+    return event_loop_modify(upstream_connection->loop, &upstream_connection->watcher, events);
+}
+
+/**
+ * Sends the request on a pooled connection or on a new one
+ *
+Returns
+- -1 if no connection can be opened
+- 0 if succeed
+*/
+static int start_upstream_request(proxy_exchange_t *exchange) {
+    event_loop_t *loop = exchange->loop;
+
+    upstream_connection_t *upstream_connection = take_idle_connection(exchange->upstream);
+    exchange->reused = upstream_connection != NULL;
+
+    if (upstream_connection == NULL) {
+        upstream_connection = connect_upstream(loop, exchange->upstream);
+        if (upstream_connection == NULL) {
+            return -1;
+        }
+    }
+
+    upstream_connection->exchange = exchange;
+    exchange->upstream_connection = upstream_connection;
+    exchange->state = exchange->reused ? PROXY_WAITING_HEAD : PROXY_CONNECTING;
+
+    event_loop_schedule(loop, &exchange->timer, PROXY_RESPONSE_TIMEOUT_MS);
+
+    return update_upstream_interest(exchange);
+}
+
+/**
+ * Ends the exchange with the upstream after an error, the client gets an error response
+ * if nothing has been sent yet, otherwise its connection is closed
+ *
+ * Must be the last use of the exchange, the client connection may be closed when it returns
+ */
+static void fail_exchange(proxy_exchange_t *exchange, int status) {
+    if (exchange->upstream_connection != NULL) {
+        close_upstream_connection(exchange->upstream_connection);
+        exchange->upstream_connection = NULL;
+    }
+
+    // A pooled connection may have been closed by the upstream before it got the request, an idempotent
+    // request without body is sent again on a fresh connection. After a timeout or once the response
+    // started, the upstream may have acted on it already
+    if (exchange->reused && exchange->upstream_closed && !exchange->response_started &&
+        exchange->request_head != NULL && exchange->state == PROXY_WAITING_HEAD) {
+        string_t *head = create_string(exchange->request_head->length + 1);
+
+        if (head != NULL) {
+            append_rawchars(head, exchange->request_head->data, exchange->request_head->length);
+            output_queue_clear(&exchange->output);
+
+            if (output_queue_push_string(&exchange->output, head) == 0 && start_upstream_request(exchange) == 0) {
+                exchange->reused = 0;
+                exchange->upstream_closed = 0;
+                return;
+            }
+        }
+    }
+
+    record_failure(exchange->upstream);
+    end_cache_fill(exchange, 0);
+
+    event_loop_cancel(exchange->loop, &exchange->timer);
+    output_queue_clear(&exchange->output);
+
+    exchange->state = exchange->head_queued ? PROXY_ABORTED : PROXY_FAILED;
+    exchange->failure_status = status;
+
+    connection_stream_resume(exchange->connection);
+}
+
+/**
+ * Looks for the response in the cache, a miss claims the fill of the key
+ * unless another request is already fetching it
+ *
+ * Returns 1 if the response is served from the cache or has to wait, 0 to fetch it from the upstream
+ */
+static int consult_cache(proxy_exchange_t *exchange) {
+    cache_freshness_t freshness;
+    cache_entry_t *entry = cache_lookup(exchange->cache, exchange->cache_key, exchange->client_headers, &freshness);
+
+    if (entry != NULL && freshness == CACHE_FRESH) {
+        exchange->cached = entry;
+        exchange->state = PROXY_CACHED;
+        return 1;
+    }
+
+    // Without a stale entry to serve, a request finding a fill in progress waits to be woken by it
+    cache_waiter_t *waiter = NULL;
+    if (entry == NULL && !exchange->head_request && prepare_cache_wait(exchange) == 0) {
+        waiter = &exchange->cache_waiter;
+    }
+
+    // HEAD responses have no body to store, they are served from GET ones only
+    cache_fill_status_t status = exchange->head_request
+                                     ? CACHE_FILL_BYPASS
+                                     : cache_begin_fill(exchange->cache, exchange->cache_key, waiter);
+
+    if (status == CACHE_FILL_PENDING && waiter != NULL) {
+        start_cache_wait(exchange);
+        return 1;
+    }
+
+    // The loop can't be woken, the response is fetched without filling
+    if (status == CACHE_FILL_PENDING && entry == NULL) {
+        return 0;
+    }
+
+    // A stale entry is served while another request refreshes it
+    if (status == CACHE_FILL_PENDING) {
+        exchange->cached = entry;
+        exchange->state = PROXY_CACHED;
+        return 1;
+    }
+
+    if (entry != NULL) {
+        release_cache_entry(entry);
+    }
+
+    exchange->cache_fill = status == CACHE_FILL_STARTED;
+    return 0;
+}
+
+/**
+ * Serves the request from the cache or sends it to the upstream
+ *
+ * Returns -1 if no upstream connection can be opened, otherwise 0
+ */
+static int start_exchange(proxy_exchange_t *exchange) {
+    if (exchange->cache != NULL && consult_cache(exchange) == 1) {
+        return 0;
+    }
+
+    return start_upstream_request(exchange);
+}
+
+// Looks at the cache again once the fill waited for ended, or was abandoned
+static void resume_cache_wait(proxy_exchange_t *exchange) {
+    if (start_exchange(exchange) == -1) {
+        record_failure(exchange->upstream);
+        exchange->state = PROXY_FAILED;
+        exchange->failure_status = BAD_GATEWAY;
+    }
+
+    if (exchange->state != PROXY_CACHE_WAITING) {
+        connection_stream_resume(exchange->connection);
+    }
+}
+
+static void on_exchange_timeout(wheel_timer_t *timer) {
+    proxy_exchange_t *exchange = (proxy_exchange_t *)((char *)timer - offsetof(proxy_exchange_t, timer));
+
+    if (exchange->state != PROXY_CACHE_WAITING) {
+        fail_exchange(exchange, GATEWAY_TIMEOUT);
+        return;
+    }
+
+    stop_cache_wait(exchange);
+    resume_cache_wait(exchange);
+}
+
+static header_t *create_header_slice(char *name, size_t name_length, char *value, size_t value_length) {
+    char *name_copy = strndup(name, name_length);
+    char *value_copy = strndup(value, value_length);
+    header_t *header = NULL;
+
+    if (name_copy != NULL && value_copy != NULL) {
+        header = create_header(name_copy, value_copy);
+    }
+
+    free(name_copy);
+    free(value_copy);
+    return header;
+}
+
+/**
+ * Parses the status line and the headers of the response head
+ *
+Returns
+- -1 if the head is malformed
+- 0 if succeed
+*/
+static int parse_upstream_head(proxy_exchange_t *exchange) {
+    char *line = exchange->head;
+    char *end = exchange->head + exchange->head_end;
+
+    // "HTTP/1.x NNN Reason"
+    if (exchange->head_end < 12 || strncmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ') {
+        return -1;
+    }
+
+    int minor = line[7] - '0';
+    exchange->status = strtol(line + 9, NULL, 10);
+    if (exchange->status < 100 || exchange->status > 999) {
+        return -1;
+    }
+
+    exchange->response_headers = create_header_list(8);
+    if (exchange->response_headers == NULL) {
+        return -1;
+    }
+
+    long content_length = -1;
+    transfer_coding_t coding = TRANSFER_IDENTITY;
+    int close_requested = minor == 0;
+
+    line = memchr(line, '\n', end - line) + 1;
+
+    while (line < end && !(line[0] == '\r' && line[1] == '\n')) {
+        char *line_end = memchr(line, '\n', end - line);
+        char *colon = memchr(line, ':', line_end - line);
+
+        if (colon == NULL) {
+            return -1;
+        }
+
+        char *value = colon + 1;
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+
+        size_t value_length = line_end - value;
+        while (value_length > 0 && (value[value_length - 1] == '\r' || value[value_length - 1] == ' ')) {
+            value_length--;
+        }
+
+        header_t *header = create_header_slice(line, colon - line, value, value_length);
+        if (header == NULL) {
+            return -1;
+        }
+
+        // Looked up by id below, the list only sets it once the header is appended
+        header->id = get_header_id(header->name);
+
+        if (header->id == HEADER_CONTENT_LENGTH && add_content_length(&content_length, header->value) == -1) {
+            free_header(header);
+            return -1;
+        } else if (header->id == HEADER_TRANSFER_ENCODING) {
+            coding = add_transfer_codings(coding, header->value);
+        } else if (header->id == HEADER_CONNECTION) {
+            if (minor == 0) {
+                close_requested = strcasecmp(header->value, "keep-alive") != 0;
+            } else {
+                close_requested = strcasecmp(header->value, "close") == 0;
+            }
+        }
+
+        // The framing is decided again for the client, see send_response_head
+        if (is_hop_by_hop_header(header->name) || header->id == HEADER_CONTENT_LENGTH) {
+            free_header(header);
+        } else if (append_header_list(exchange->response_headers, header) == -1) {
+            free_header(header);
+            return -1;
+        }
+
+        line = line_end + 1;
+    }
+
+    // A response framed both ways could be read differently by the client, it is refused like a malformed one
+    if (coding == TRANSFER_UNSUPPORTED || (coding == TRANSFER_CHUNKED && content_length != -1)) {
+        return -1;
+    }
+
+    if (exchange->head_request || exchange->status == NO_CONTENT || exchange->status == NOT_MODIFIED) {
+        exchange->body_type = PROXY_BODY_NONE;
+
+        // The length of the representation the response is about, there is no body to frame
+        char length[24];
+        snprintf(length, sizeof(length), "%ld", content_length);
+        if (content_length >= 0 && exchange->status != NO_CONTENT &&
+            append_header_list(exchange->response_headers, create_header("Content-Length", length)) == -1) {
+            return -1;
+        }
+    } else if (coding == TRANSFER_CHUNKED) {
+        exchange->body_type = PROXY_BODY_CHUNKED;
+        chunked_decoder_init(&exchange->decoder);
+    } else if (content_length >= 0) {
+        exchange->body_type = content_length > 0 ? PROXY_BODY_LENGTH : PROXY_BODY_NONE;
+        exchange->body_remaining = content_length;
+    } else {
+        exchange->body_type = PROXY_BODY_CLOSE;
+    }
+
+    exchange->upstream_keep_alive = !close_requested && exchange->body_type != PROXY_BODY_CLOSE;
+
+    return 0;
+}
+
+/**
+ * Reads the response head from the upstream, interim 1xx responses are skipped
+ *
+Returns
+- -1 if the upstream failed or sent a malformed head
+- 0 if the head is not complete yet
+- 1 if the head has been parsed
+*/
+static int read_upstream_head(proxy_exchange_t *exchange) {
+    while (1) {
+        if (exchange->head == NULL) {
+            exchange->head = malloc(PROXY_MAX_HEAD_SIZE);
+            if (exchange->head == NULL) {
+                return -1;
+            }
+        }
+
+        if (exchange->head_length == PROXY_MAX_HEAD_SIZE) {
+            return -1;
+        }
+
+        ssize_t read_result = read(exchange->upstream_connection->watcher.fd, exchange->head + exchange->head_length,
+                                   PROXY_MAX_HEAD_SIZE - exchange->head_length);
+
+        if (read_result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return 0;
+        }
+
+        if (read_result == 0 || read_result == -1) {
+            exchange->upstream_closed = read_result == 0 || errno == ECONNRESET;
+            return -1;
+        }
+
+        exchange->response_started = 1;
+        exchange->head_length += read_result;
+
+        while (1) {
+            char *head_end = memmem(exchange->head, exchange->head_length, "\r\n\r\n", 4);
+            if (head_end == NULL) {
+                break;
+            }
+
+            exchange->head_end = head_end + 4 - exchange->head;
+
+            // 101 would switch protocols, which is not supported
+            if (exchange->head_length >= 12 && exchange->head[9] == '1' && strncmp(exchange->head, "HTTP/1.", 7) == 0 &&
+                strncmp(exchange->head + 9, "101", 3) != 0) {
+                exchange->head_length -= exchange->head_end;
+                memmove(exchange->head, exchange->head + exchange->head_end, exchange->head_length);
+                continue;
+            }
+
+            return parse_upstream_head(exchange) == -1 ? -1 : 1;
+        }
+    }
+}
+
+static void on_upstream_event(event_loop_t *loop, io_watcher_t *watcher, uint32_t events) {
+    (void)loop;
+    upstream_connection_t *upstream_connection = (upstream_connection_t *)watcher;
+    proxy_exchange_t *exchange = upstream_connection->exchange;
+
+    // Idle connections are only watched to notice the upstream closing them
+    if (exchange == NULL) {
+        remove_idle_connection(upstream_connection);
+        close_upstream_connection(upstream_connection);
+        return;
+    }
+
+    if (exchange->state == PROXY_CONNECTING) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+
+        if (getsockopt(watcher->fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 || error != 0) {
+            fail_exchange(exchange, BAD_GATEWAY);
+            return;
+        }
+
+        exchange->state = PROXY_WAITING_HEAD;
+        events |= EPOLLOUT;
+    }
+
+    int wake_body = 0;
+    int wake_stream = 0;
+
+    if ((events & (EPOLLOUT | EPOLLERR)) && !output_queue_empty(&exchange->output)) {
+        if (output_queue_flush(&exchange->output, watcher->fd) == -1) {
+            exchange->upstream_closed = errno == EPIPE || errno == ECONNRESET;
+            fail_exchange(exchange, BAD_GATEWAY);
+            return;
+        }
+
+        // The request body was paused until the upstream caught up
+        connection_t *connection = exchange->connection;
+        wake_body = connection != NULL && connection->body_paused &&
+                    exchange->output.buffered_bytes <= PROXY_BODY_LOW_WATERMARK;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        if (exchange->state == PROXY_WAITING_HEAD) {
+            int result = read_upstream_head(exchange);
+
+            if (result == -1) {
+                fail_exchange(exchange, BAD_GATEWAY);
+                return;
+            }
+
+            if (result == 1) {
+                record_success(exchange->upstream);
+                exchange->state = PROXY_RELAYING;
+                wake_stream = 1;
+            }
+        } else if (exchange->state == PROXY_RELAYING && exchange->relay_waiting) {
+            exchange->relay_waiting = 0;
+            wake_stream = 1;
+        }
+    }
+
+    if (exchange->upstream_connection != NULL && update_upstream_interest(exchange) == -1) {
+        fail_exchange(exchange, BAD_GATEWAY);
+        return;
+    }
+
+    // Both wake ups drive the client connection, which may close it, so only one is made
+    if (wake_stream) {
+        if (wake_body) {
+            exchange->connection->body_paused = 0;
+        }
+        connection_stream_resume(exchange->connection);
+    } else if (wake_body) {
+        connection_resume_body(exchange->connection);
+    }
+}
+
+// Sends the error response when no response could be obtained from the upstream
+static stream_status_t send_failure(proxy_exchange_t *exchange, connection_t *connection) {
+    request_t client = {.version = &exchange->client_version, .headers = exchange->client_headers};
+    char *message = get_status_string(exchange->failure_status);
+    response_t response = {
+        .status = exchange->failure_status,
+        .body = message,
+        .body_length = strlen(message),
+        .closing = 1,
+    };
+
+    connection_end_keep_alive(connection);
+    finish_exchange(exchange);
+
+    // The rest of the request body is read and dropped
+    connection->body_paused = 0;
+
+    if (connection_send_string(connection, create_response(&client, &response)) == -1) {
+        return STREAM_ERROR;
+    }
+
+    return STREAM_DONE;
+}
+
+/**
+Returns
+- -1 if the head can't be queued
+- 0 if succeed
+*/
+static int send_response_head(proxy_exchange_t *exchange, connection_t *connection) {
+    request_t client = {.version = &exchange->client_version, .headers = exchange->client_headers};
+    response_t response = {
+        .status = exchange->status,
+        .headers = exchange->response_headers,
+        .body_length = exchange->body_type == PROXY_BODY_LENGTH ? exchange->body_remaining : 0,
+        .streaming = exchange->body_type == PROXY_BODY_CHUNKED || exchange->body_type == PROXY_BODY_CLOSE,
+    };
+
+    // Bodies of unknown length are framed again, with chunked encoding when the client supports it
+    if (response.streaming) {
+        if (is_http_1_1_request(&client)) {
+            connection->stream->chunked = 1;
+        } else {
+            connection_end_keep_alive(connection);
+        }
+    }
+
+    response.closing = !connection->keep_alive;
+    exchange->head_queued = 1;
+
+    // The body is copied while relayed when it can be stored
+    if (exchange->cache_fill) {
+        cache_lifetime_t *lifetime = &exchange->cache_lifetime;
+        int cacheable = get_cache_lifetime(exchange->status, exchange->response_headers, lifetime) == 0 &&
+                        (exchange->body_type != PROXY_BODY_LENGTH ||
+                         exchange->body_remaining <= exchange->cache->max_entry_size);
+
+        exchange->cache_body = cacheable ? create_string(exchange->body_remaining + 1) : NULL;
+
+        if (exchange->cache_body == NULL) {
+            end_cache_fill(exchange, 1);
+        }
+    }
+
+    return connection_send_string(connection, create_response(&client, &response));
+}
+
+/**
+ * Queues decoded body bytes for the client, and copies them for the cache
+ *
+Returns
+- -1 if the bytes can't be queued
+- 0 if succeed
+*/
+static int relay_data(proxy_exchange_t *exchange, connection_t *connection, char *data, size_t length) {
+    if (exchange->cache_body != NULL) {
+        // A body growing past the entry limit is not stored, the waiting requests are let go
+        if (exchange->cache_body->length + length > exchange->cache->max_entry_size ||
+            append_rawchars(exchange->cache_body, data, length) == -1) {
+            end_cache_fill(exchange, 1);
+        }
+    }
+
+    return connection_stream_write(connection, data, length);
+}
+
+/**
+ * Relays body bytes that went through user space, the ones read with the head
+ * or the ones of a body that has to be decoded
+ *
+Returns
+- -1 if the body is malformed or can't be queued
+- 0 if more body is expected
+- 1 if the body is complete
+*/
+static int relay_body_bytes(proxy_exchange_t *exchange, connection_t *connection, char *data, size_t length) {
+    switch (exchange->body_type) {
+    case PROXY_BODY_NONE:
+        // Nothing is expected, extra bytes make the connection unusable
+        exchange->upstream_keep_alive &= length == 0;
+        return 1;
+
+    case PROXY_BODY_LENGTH: {
+        size_t relayed = length < exchange->body_remaining ? length : exchange->body_remaining;
+
+        exchange->upstream_keep_alive &= relayed == length;
+        exchange->body_remaining -= relayed;
+
+        if (relay_data(exchange, connection, data, relayed) == -1) {
+            return -1;
+        }
+
+        return exchange->body_remaining == 0;
+    }
+
+    case PROXY_BODY_CHUNKED: {
+        size_t consumed = 0;
+
+        while (consumed < length && exchange->decoder.state != CHUNKED_DONE) {
+            char *decoded;
+            size_t decoded_length;
+
+            consumed +=
+                chunked_decode(&exchange->decoder, data + consumed, length - consumed, &decoded, &decoded_length);
+
+            if (exchange->decoder.state == CHUNKED_ERROR) {
+                return -1;
+            }
+
+            if (decoded_length > 0 && relay_data(exchange, connection, decoded, decoded_length) == -1) {
+                return -1;
+            }
+        }
+
+        if (exchange->decoder.state == CHUNKED_DONE) {
+            exchange->upstream_keep_alive &= consumed == length;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    case PROXY_BODY_CLOSE:
+        return relay_data(exchange, connection, data, length) == -1 ? -1 : 0;
+    }
+
+    return -1;
+}
+
+static stream_status_t end_relay(proxy_exchange_t *exchange, connection_t *connection) {
+    upstream_connection_t *upstream_connection = exchange->upstream_connection;
+    exchange->upstream_connection = NULL;
+
+    // The connection can only serve another request once both messages are complete
+    if (exchange->upstream_keep_alive && exchange->request_complete && output_queue_empty(&exchange->output)) {
+        put_idle_connection(upstream_connection);
+    } else {
+        close_upstream_connection(upstream_connection);
+    }
+
+    if (exchange->cache_body != NULL) {
+        cache_store(exchange->cache, exchange->cache_key, exchange->client_headers, exchange->status,
+                    exchange->response_headers, exchange->cache_body->data, exchange->cache_body->length,
+                    &exchange->cache_lifetime);
+    }
+
+    end_cache_fill(exchange, 0);
+    event_loop_cancel(exchange->loop, &exchange->timer);
+    finish_exchange(exchange);
+
+    // The rest of the request body is read and dropped
+    connection->body_paused = 0;
+
+    return STREAM_DONE;
+}
+
+static stream_status_t send_cached(proxy_exchange_t *exchange, connection_t *connection) {
+    request_t client = {
+        .method = exchange->head_request ? "HEAD" : "GET",
+        .version = &exchange->client_version,
+        .headers = exchange->client_headers,
+    };
+
+    finish_exchange(exchange);
+
+    string_t *res = create_cached_response(&client, exchange->cached, !connection->keep_alive);
+    if (connection_send_string(connection, res) == -1) {
+        return STREAM_ERROR;
+    }
+
+    return STREAM_DONE;
+}
+
+// Producer of the client stream, every step waits for the upstream to be ready
+static stream_status_t produce_proxy_response(connection_t *connection, void *state) {
+    proxy_exchange_t *exchange = state;
+
+    switch (exchange->state) {
+    case PROXY_CONNECTING:
+    case PROXY_WAITING_HEAD:
+    case PROXY_CACHE_WAITING:
+    case PROXY_DONE:
+        return STREAM_WAIT;
+
+    case PROXY_CACHED:
+        return send_cached(exchange, connection);
+
+    case PROXY_FAILED:
+        return send_failure(exchange, connection);
+
+    case PROXY_ABORTED:
+        return STREAM_ERROR;
+
+    case PROXY_RELAYING:
+        break;
+    }
+
+    if (!exchange->head_queued) {
+        if (send_response_head(exchange, connection) == -1) {
+            return STREAM_ERROR;
+        }
+
+        int result = relay_body_bytes(exchange, connection, exchange->head + exchange->head_end,
+                                      exchange->head_length - exchange->head_end);
+        if (result == -1) {
+            return STREAM_ERROR;
+        }
+
+        if (result == 1 || exchange->body_type == PROXY_BODY_NONE) {
+            return end_relay(exchange, connection);
+        }
+
+        return STREAM_MORE;
+    }
+
+    int fd = exchange->upstream_connection->watcher.fd;
+    ssize_t relayed;
+
+    // Bodies copied for the cache go through user space
+    if (exchange->body_type == PROXY_BODY_LENGTH && exchange->cache_body == NULL) {
+        relayed = connection_stream_splice(connection, fd, exchange->body_remaining);
+
+        if (relayed > 0) {
+            exchange->body_remaining -= relayed;
+        }
+    } else {
+        char buffer[PROXY_READ_SIZE];
+        relayed = read(fd, buffer, sizeof(buffer));
+
+        if (relayed > 0) {
+            int result = relay_body_bytes(exchange, connection, buffer, relayed);
+
+            if (result == -1) {
+                return STREAM_ERROR;
+            }
+
+            if (result == 1) {
+                return end_relay(exchange, connection);
+            }
+        }
+    }
+
+    if (relayed == 0) {
+        // Only a close-delimited body may end with the connection
+        if (exchange->body_type == PROXY_BODY_CLOSE) {
+            return end_relay(exchange, connection);
+        }
+
+        record_failure(exchange->upstream);
+        return STREAM_ERROR;
+    }
+
+    if (relayed == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return STREAM_ERROR;
+        }
+
+        // The pipe is full, what it holds has to reach the client first
+        if (exchange->body_type == PROXY_BODY_LENGTH && connection->output.spliced_bytes >= connection->pipe_capacity) {
+            return STREAM_MORE;
+        }
+
+        exchange->relay_waiting = 1;
+        if (update_upstream_interest(exchange) == -1) {
+            return STREAM_ERROR;
+        }
+
+        return STREAM_WAIT;
+    }
+
+    event_loop_schedule(exchange->loop, &exchange->timer, PROXY_RESPONSE_TIMEOUT_MS);
+
+    if (exchange->body_type == PROXY_BODY_LENGTH && exchange->body_remaining == 0) {
+        return end_relay(exchange, connection);
+    }
+
+    return STREAM_MORE;
+}
+
+static int on_proxy_body_data(connection_t *connection, request_t *request, char *data, size_t length, void *state) {
+    (void)request;
+    proxy_exchange_t *exchange = state;
+
+    // The response is already decided, the rest of the body is dropped
+    if (exchange->state == PROXY_FAILED || exchange->state == PROXY_ABORTED || exchange->state == PROXY_DONE) {
+        return 0;
+    }
+
+    // Once a part of the body went out the request can't be sent again
+    free_string(exchange->request_head);
+    exchange->request_head = NULL;
+
+    if (exchange->request_chunked) {
+        char size_line[20];
+        int size_length = snprintf(size_line, sizeof(size_line), "%zx\r\n", length);
+        char *chunk = malloc(size_length + length + 2);
+
+        if (chunk == NULL) {
+            return -1;
+        }
+
+        memcpy(chunk, size_line, size_length);
+        memcpy(chunk + size_length, data, length);
+        memcpy(chunk + size_length + length, "\r\n", 2);
+
+        if (output_queue_push_buffer(&exchange->output, chunk, size_length + length + 2) == -1) {
+            return -1;
+        }
+    } else {
+        char *copy = malloc(length);
+        if (copy == NULL) {
+            return -1;
+        }
+
+        memcpy(copy, data, length);
+
+        if (output_queue_push_buffer(&exchange->output, copy, length) == -1) {
+            return -1;
+        }
+    }
+
+    if (exchange->output.buffered_bytes >= PROXY_BODY_HIGH_WATERMARK) {
+        connection_pause_body(connection);
+    }
+
+    if (exchange->state != PROXY_CONNECTING && update_upstream_interest(exchange) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int on_proxy_body_end(connection_t *connection, request_t *request, void *state) {
+    (void)connection;
+    (void)request;
+    proxy_exchange_t *exchange = state;
+
+    exchange->request_complete = 1;
+
+    if (exchange->state == PROXY_FAILED || exchange->state == PROXY_ABORTED || exchange->state == PROXY_DONE) {
+        return 0;
+    }
+
+    if (exchange->request_chunked && output_queue_push_buffer(&exchange->output, strdup("0\r\n\r\n"), 5) == -1) {
+        return -1;
+    }
+
+    if (exchange->state != PROXY_CONNECTING && update_upstream_interest(exchange) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Requests that can be sent twice with the effect of sending them once (RFC 9110 section 9.2.2)
+static int is_idempotent_method(char *method) {
+    return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0 || strcmp(method, "OPTIONS") == 0 ||
+           strcmp(method, "TRACE") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "DELETE") == 0;
+}
+
+static proxy_exchange_t *create_exchange(connection_t *connection, request_t *request, proxy_t *proxy) {
+    proxy_exchange_t *exchange = calloc(1, sizeof(proxy_exchange_t));
+    if (exchange == NULL) {
+        return NULL;
+    }
+
+    exchange->connection = connection;
+    exchange->loop = connection->loop;
+    exchange->upstream = select_upstream(proxy);
+    exchange->references = 1;
+    exchange->client_version = *request->version;
+    exchange->head_request = strcmp(request->method, "HEAD") == 0;
+    exchange->request_chunked = request->chunked;
+    exchange->request_complete = !request->chunked && request->content_length == 0;
+    wheel_timer_init(&exchange->timer, on_exchange_timeout);
+    output_queue_init(&exchange->output);
+
+    if (proxy->cache != NULL && is_cacheable_request(request)) {
+        exchange->cache = proxy->cache;
+        exchange->cache_key = encode_target(request->target, request->path_length);
+        exchange->client_headers = copy_header_list(request->headers);
+    } else {
+        // The response head tells the client whether the connection is kept, which depends on this header
+        header_t *connection_header = find_header(request->headers, "Connection");
+        exchange->client_headers = create_header_list(1);
+
+        if (exchange->client_headers != NULL && connection_header != NULL &&
+            append_header_list(exchange->client_headers, create_header("Connection", connection_header->value)) == -1) {
+            free_header_list(exchange->client_headers);
+            exchange->client_headers = NULL;
+        }
+    }
+
+    if (exchange->client_headers == NULL || (exchange->cache != NULL && exchange->cache_key == NULL)) {
+        release_exchange(exchange);
+        return NULL;
+    }
+
+    string_t *head = create_upstream_request_head(request, exchange->upstream);
+    if (head == NULL) {
+        release_exchange(exchange);
+        return NULL;
+    }
+
+    if (exchange->request_complete && is_idempotent_method(request->method)) {
+        exchange->request_head = create_string(head->length + 1);
+        if (exchange->request_head != NULL) {
+            append_rawchars(exchange->request_head, head->data, head->length);
+        }
+    }
+
+    if (output_queue_push_string(&exchange->output, head) == -1) {
+        release_exchange(exchange);
+        return NULL;
+    }
+
+    return exchange;
+}
+
+/**
+ * Request handler forwarding the request to the proxy given as arg
+ *
+ * Returns -1 to close the connection, otherwise 0
+ */
+int proxy_request(connection_t *connection, request_t *request, void *arg) {
+    proxy_exchange_t *exchange = create_exchange(connection, request, arg);
+    if (exchange == NULL) {
+        return -1;
+    }
+
+    if (connection_defer_response(connection, produce_proxy_response, release_exchange, exchange) == -1) {
+        return -1;
+    }
+
+    if (!exchange->request_complete) {
+        exchange->references++;
+
+        body_reader_t reader = {
+            .on_data = on_proxy_body_data,
+            .on_end = on_proxy_body_end,
+            .release = release_exchange,
+            .state = exchange,
+        };
+
+        if (connection_read_body(connection, &reader) == -1) {
+            return -1;
+        }
+    }
+
+    if (start_exchange(exchange) == -1) {
+        // Reported to the client once the producer runs
+        record_failure(exchange->upstream);
+        exchange->state = PROXY_FAILED;
+        exchange->failure_status = BAD_GATEWAY;
+    }
+
+    // The stream is resumed by the loop once the handler returns
+    if (exchange->state == PROXY_FAILED || exchange->state == PROXY_CACHED) {
+        connection->stream->waiting = 0;
+    }
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "cache.h"
+#include "connection.h"
+#include "http/http.h"
+
+// Reverse proxy forwarding the requests of a route to a group of upstream servers
+//
+// Every worker keeps its own pool of idle keep-alive connections per upstream, so most
+// requests skip the connect. Response bodies of known length are spliced from the upstream
+// socket to the client socket through a pipe and never enter user space, chunked or
+// close-delimited bodies are decoded and framed again for the client.
+// Request bodies are relayed from the body reader of the client connection.
+// GET and HEAD responses allowing it with Cache-Control are kept in the response cache.
+// An upstream failing several times in a row is skipped for a while, the first request
+// after that delay probes it again.
+
+typedef struct Upstream {
+    // As configured, "host:port" or "unix:/path"
+    char *name;
+    struct sockaddr_storage address;
+    socklen_t address_length;
+
+    // Shared by the workers
+    atomic_int failures;
+    _Atomic uint64_t down_until;
+} upstream_t;
+
+typedef struct Proxy {
+    upstream_t *upstreams;
+    size_t upstream_count;
+    // Round robin position, shared by the workers
+    atomic_size_t next;
+    // Shared with the other proxies, NULL when caching is disabled
+    response_cache_t *cache;
+} proxy_t;
+
+proxy_t *create_proxy(char *upstreams, response_cache_t *cache);
+void free_proxy(void *proxy);
+
+int proxy_request(connection_t *connection, request_t *request, void *arg);
+void release_idle_connections();
+void release_proxy_cache_waits();
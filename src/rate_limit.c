@@ -0,0 +1,230 @@
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <time.h>
+
+#include "rate_limit.h"
+
+// 64 shards of 1024 clients, 2MB shared by every worker
+#define RATE_LIMIT_SHARD_BITS 6
+#define RATE_LIMIT_SHARD_SLOTS 1024
+
+// Slots of its shard where a client is looked for
+const size_t RATE_LIMIT_PROBES = 8;
+
+// Clients without connection and silent for this long give their slot up
+const uint32_t RATE_LIMIT_IDLE_MS = 60000;
+
+// Thousandths of tokens, a request costs a whole token
+static const uint64_t TOKEN = 1000;
+
+// Set once before the workers start
+static uint64_t refill_per_ms = 0;
+static uint64_t bucket_capacity = 0;
+static uint32_t max_client_connections = 0;
+
+/**
+ * Maps the table of `requests_per_second` requests (with bursts of `burst`) and
+ * `max_connections` connections per client, 0 disables either limit
+ *
+ * Returns NULL if the table can't be mapped
+ */
+rate_limiter_t *create_rate_limiter(size_t requests_per_second, size_t burst, size_t max_connections) {
+    size_t slot_count = (size_t)RATE_LIMIT_SHARD_SLOTS << RATE_LIMIT_SHARD_BITS;
+    size_t size = sizeof(rate_limiter_t) + slot_count * sizeof(client_limit_t);
+
+    // Shared with the forked workers, the pages start zeroed (every slot free)
+    rate_limiter_t *limiter = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (limiter == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (getrandom(&limiter->seed, sizeof(limiter->seed), 0) != sizeof(limiter->seed)) {
+        limiter->seed = (uint64_t)time(NULL) * 0x9E3779B97F4A7C15ull;
+    }
+
+    limiter->mapped_size = size;
+
+    // Tokens per second are thousandths of tokens per ms
+    refill_per_ms = requests_per_second;
+    bucket_capacity = (burst > 0 ? burst : 1) * TOKEN;
+    max_client_connections = max_connections;
+
+    return limiter;
+}
+
+void free_rate_limiter(rate_limiter_t *limiter) {
+    munmap(limiter, limiter->mapped_size);
+}
+
+static uint64_t mix(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDull;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ull;
+    value ^= value >> 33;
+    return value;
+}
+
+// Fingerprint of the client of address, never 0. Returns 0 for other address families
+static uint64_t get_client_key(rate_limiter_t *limiter, struct sockaddr *address) {
+    uint64_t high = 0;
+    uint64_t low = 0;
+
+    if (address->sa_family == AF_INET) {
+        low = ((struct sockaddr_in *)address)->sin_addr.s_addr;
+    } else if (address->sa_family == AF_INET6) {
+        struct in6_addr *ip = &((struct sockaddr_in6 *)address)->sin6_addr;
+
+        // IPv4 clients of a dual stack socket keep their own address
+        if (IN6_IS_ADDR_V4MAPPED(ip)) {
+            memcpy(&low, &ip->s6_addr[12], 4);
+        } else {
+            memcpy(&high, &ip->s6_addr[0], 8);
+            high |= 1;
+        }
+    } else {
+        return 0;
+    }
+
+    uint64_t key = mix(mix(limiter->seed ^ high) ^ low);
+    return key != 0 ? key : 1;
+}
+
+/**
+ * Finds the entry of a client, or takes a free or idle slot of its shard over
+ *
+ * Returns NULL if every slot looked at belongs to an active client
+ */
+static client_limit_t *find_client(rate_limiter_t *limiter, uint64_t key, uint32_t now) {
+    client_limit_t *shard = &limiter->slots[(key >> (64 - RATE_LIMIT_SHARD_BITS)) * RATE_LIMIT_SHARD_SLOTS];
+    size_t start = key & (RATE_LIMIT_SHARD_SLOTS - 1);
+    client_limit_t *candidate = NULL;
+    uint64_t candidate_key = 0;
+
+    for (size_t i = 0; i < RATE_LIMIT_PROBES; i++) {
+        client_limit_t *client = &shard[(start + i) & (RATE_LIMIT_SHARD_SLOTS - 1)];
+        uint64_t client_key = atomic_load_explicit(&client->key, memory_order_acquire);
+
+        if (client_key == key) {
+            atomic_store_explicit(&client->last_seen, now, memory_order_relaxed);
+            return client;
+        }
+
+        if (candidate != NULL && candidate_key == 0) {
+            continue;
+        }
+
+        uint32_t idle = now - (uint32_t)atomic_load_explicit(&client->last_seen, memory_order_relaxed);
+        if (client_key == 0 ||
+            (idle >= RATE_LIMIT_IDLE_MS && atomic_load_explicit(&client->connections, memory_order_relaxed) == 0)) {
+            candidate = client;
+            candidate_key = client_key;
+        }
+    }
+
+    // Another thread may be taking the same slot, the loser is not limited this time
+    if (candidate == NULL ||
+        !atomic_compare_exchange_strong_explicit(&candidate->key, &candidate_key, key, memory_order_acq_rel,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+
+    atomic_store_explicit(&candidate->bucket, ((uint64_t)now << 32) | bucket_capacity, memory_order_relaxed);
+    atomic_store_explicit(&candidate->connections, 0, memory_order_relaxed);
+    atomic_store_explicit(&candidate->last_seen, now, memory_order_relaxed);
+    return candidate;
+}
+
+// Refills the bucket of a client and takes `cost` thousandths of tokens if it holds a whole one.
+// Returns 0 if it did, otherwise -1
+static int take_tokens(client_limit_t *client, uint32_t now, uint64_t cost) {
+    uint64_t bucket = atomic_load_explicit(&client->bucket, memory_order_relaxed);
+
+    while (1) {
+        uint32_t refilled_at = bucket >> 32;
+        uint64_t tokens = bucket & 0xFFFFFFFF;
+
+        // Another thread may have refilled it with a later time
+        if ((int32_t)(now - refilled_at) > 0) {
+            tokens += (uint64_t)(now - refilled_at) * refill_per_ms;
+            refilled_at = now;
+        }
+
+        if (tokens > bucket_capacity) {
+            tokens = bucket_capacity;
+        }
+
+        int allowed = tokens >= TOKEN;
+        if (allowed) {
+            tokens -= cost;
+        }
+
+        uint64_t next = ((uint64_t)refilled_at << 32) | tokens;
+        if (atomic_compare_exchange_weak_explicit(&client->bucket, &bucket, next, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            return allowed ? 0 : -1;
+        }
+    }
+}
+
+/**
+ * Admits a connection accepted from address, a client whose bucket is empty or who
+ * reached the connection cap is refused. The connection holds `client` (NULL for a
+ * client not limited) until rate_limit_release.
+ *
+Returns
+- -1 if the client is over its limits, the connection has to be refused
+- 0 if it is admitted
+*/
+int rate_limit_accept(rate_limiter_t *limiter, struct sockaddr *address, uint64_t now_ms, client_limit_t **client) {
+    uint64_t key = get_client_key(limiter, address);
+    *client = key != 0 ? find_client(limiter, key, now_ms) : NULL;
+
+    if (*client == NULL) {
+        return 0;
+    }
+
+    // The bucket is only looked at, the requests take the tokens
+    if (refill_per_ms > 0 && take_tokens(*client, now_ms, 0) == -1) {
+        *client = NULL;
+        return -1;
+    }
+
+    uint32_t connections = atomic_fetch_add_explicit(&(*client)->connections, 1, memory_order_relaxed);
+    if (max_client_connections > 0 && connections >= max_client_connections) {
+        atomic_fetch_sub_explicit(&(*client)->connections, 1, memory_order_relaxed);
+        *client = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Takes a token of the client for a request
+ *
+Returns
+- -1 if the client is over its rate, the request gets a 429 (Too Many Requests)
+- 0 if it can be handled
+*/
+int rate_limit_request(client_limit_t *client, uint64_t now_ms) {
+    if (refill_per_ms == 0) {
+        return 0;
+    }
+
+    return take_tokens(client, now_ms, TOKEN);
+}
+
+// Gives the connection of a client back once closed
+void rate_limit_release(client_limit_t *client, uint64_t now_ms) {
+    atomic_store_explicit(&client->last_seen, now_ms, memory_order_relaxed);
+
+    // The slot may have been reset by another client meanwhile
+    uint_fast32_t connections = atomic_load_explicit(&client->connections, memory_order_relaxed);
+    while (connections > 0 && !atomic_compare_exchange_weak_explicit(&client->connections, &connections,
+                                                                     connections - 1, memory_order_relaxed,
+                                                                     memory_order_relaxed)) {
+    }
+}
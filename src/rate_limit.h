@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Per client limits: a token bucket of requests and a cap on open connections
+//
+// Clients are identified by their IPv4 address, or the /64 prefix of their IPv6 address
+// (a single host usually owns a whole /64). Their state lives in a table of fixed size
+// mapped before the workers are forked, so that every process and thread shares it
+// without locks: entries are claimed and updated with atomic operations only. The table
+// is split in shards, a client is looked up in a few slots of its shard and takes over
+// the slot of a client gone idle when none is free. A client finding no slot at all is
+// not limited, so a flood of addresses can't grow the memory nor lock anyone out.
+//
+// The limits are approximate by design: concurrent updates of an entry being taken
+// over by another client may be lost.
+
+typedef struct ClientLimit {
+    // Fingerprint of the client address, 0 for a free slot
+    atomic_uint_fast64_t key;
+    // Time of the last refill in ms in the high 32 bits, thousandths of tokens in the low ones
+    atomic_uint_fast64_t bucket;
+    atomic_uint_fast32_t connections;
+    // Last use of the entry in ms, idle entries are reused by other clients
+    atomic_uint_fast32_t last_seen;
+} __attribute__((aligned(32))) client_limit_t;
+
+typedef struct RateLimiter {
+    // Random, so that a client can't pick addresses colliding in a shard
+    uint64_t seed;
+    size_t mapped_size;
+    client_limit_t slots[];
+} rate_limiter_t;
+
+rate_limiter_t *create_rate_limiter(size_t requests_per_second, size_t burst, size_t max_connections);
+void free_rate_limiter(rate_limiter_t *limiter);
+int rate_limit_accept(rate_limiter_t *limiter, struct sockaddr *address, uint64_t now_ms, client_limit_t **client);
+int rate_limit_request(client_limit_t *client, uint64_t now_ms);
+void rate_limit_release(client_limit_t *client, uint64_t now_ms);
@@ -0,0 +1,664 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle.h"
+#include "command.h"
+#include "coroutine_handler.h"
+#include "http/status.h"
+#include "pack.h"
+#include "proxy.h"
+#include "router.h"
+#include "sse.h"
+#include "static_files.h"
+#include "str.h"
+#include "websocket.h"
+
+static router_node_t *create_node(router_node_type_t type, char *label, size_t label_length) {
+    router_node_t *node = calloc(1, sizeof(router_node_t));
+    if (node == NULL) {
+        return NULL;
+    }
+
+    node->label = strndup(label, label_length);
+    if (node->label == NULL) {
+        free(node);
+        return NULL;
+    }
+
+    node->type = type;
+    node->label_length = label_length;
+
+    return node;
+}
+
+static void free_node(router_node_t *node) {
+    if (node == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < node->child_count; i++) {
+        free_node(node->children[i]);
+    }
+
+    free_node(node->param_child);
+    free_node(node->wildcard_child);
+
+    route_t *route = node->routes;
+    while (route != NULL) {
+        route_t *next = route->next;
+
+        if (route->release != NULL) {
+            route->release(route->arg);
+        }
+        free(route->method);
+        free(route);
+
+        route = next;
+    }
+
+    free(node->children);
+    free(node->label);
+    free(node);
+}
+
+router_t *create_router() {
+    router_t *router = malloc(sizeof(router_t));
+    if (router == NULL) {
+        return NULL;
+    }
+
+    router->root = create_node(ROUTER_NODE_STATIC, "", 0);
+    if (router->root == NULL) {
+        free(router);
+        return NULL;
+    }
+
+    return router;
+}
+
+void free_router(router_t *router) {
+    free_node(router->root);
+    free(router);
+}
+
+static router_node_t *find_static_child(router_node_t *node, char c) {
+    for (size_t i = 0; i < node->child_count; i++) {
+        if (node->children[i]->label[0] == c) {
+            return node->children[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int append_child(router_node_t *node, router_node_t *child) {
+    router_node_t **children = realloc(node->children, sizeof(router_node_t *) * (node->child_count + 1));
+    if (children == NULL) {
+        return -1;
+    }
+
+    children[node->child_count] = child;
+    node->children = children;
+    node->child_count++;
+
+    return 0;
+}
+
+// Keeps the first `length` bytes of the label in the node and moves the rest to a new child
+static int split_node(router_node_t *node, size_t length) {
+    router_node_t *tail = create_node(ROUTER_NODE_STATIC, node->label + length, node->label_length - length);
+    router_node_t **children = malloc(sizeof(router_node_t *));
+
+    if (tail == NULL || children == NULL) {
+        free_node(tail);
+        free(children);
+        return -1;
+    }
+
+    tail->children = node->children;
+    tail->child_count = node->child_count;
+    tail->param_child = node->param_child;
+    tail->wildcard_child = node->wildcard_child;
+    tail->routes = node->routes;
+
+    children[0] = tail;
+    node->children = children;
+    node->child_count = 1;
+    node->param_child = NULL;
+    node->wildcard_child = NULL;
+    node->routes = NULL;
+
+    node->label[length] = '\0';
+    node->label_length = length;
+
+    return 0;
+}
+
+/**
+ * Inserts the nodes of a pattern, sharing the common prefixes with the existing ones
+ *
+ * Returns the node where the pattern ends, NULL if the pattern is invalid or on allocation failure
+ */
+static router_node_t *insert_pattern(router_node_t *node, char *pattern) {
+    char *p = pattern;
+    size_t param_count = 0;
+
+    while (*p != '\0') {
+        if (*p == ':' || *p == '*') {
+            router_node_type_t type = *p == ':' ? ROUTER_NODE_PARAM : ROUTER_NODE_WILDCARD;
+            char *name = p + 1;
+            size_t name_length = strcspn(name, "/");
+
+            if (name_length == 0 || ++param_count > MAX_ROUTE_PARAMS) {
+                return NULL;
+            }
+
+            // The wildcard takes the rest of the path, nothing can follow it
+            if (type == ROUTER_NODE_WILDCARD && name[name_length] != '\0') {
+                return NULL;
+            }
+
+            router_node_t **slot = type == ROUTER_NODE_PARAM ? &node->param_child : &node->wildcard_child;
+
+            if (*slot == NULL) {
+                *slot = create_node(type, name, name_length);
+                if (*slot == NULL) {
+                    return NULL;
+                }
+            } else if ((*slot)->label_length != name_length || strncmp((*slot)->label, name, name_length) != 0) {
+                // Patterns sharing a parameter position must give it the same name
+                return NULL;
+            }
+
+            node = *slot;
+            p = name + name_length;
+            continue;
+        }
+
+        size_t literal_length = strcspn(p, ":*");
+        router_node_t *child = find_static_child(node, *p);
+
+        if (child == NULL) {
+            child = create_node(ROUTER_NODE_STATIC, p, literal_length);
+            if (child == NULL || append_child(node, child) == -1) {
+                free_node(child);
+                return NULL;
+            }
+
+            node = child;
+            p += literal_length;
+            continue;
+        }
+
+        size_t common = 0;
+        while (common < literal_length && common < child->label_length && p[common] == child->label[common]) {
+            common++;
+        }
+
+        if (common < child->label_length && split_node(child, common) == -1) {
+            return NULL;
+        }
+
+        node = child;
+        p += common;
+    }
+
+    return node;
+}
+
+/**
+ * Registers a handler for the requests of `method` whose path matches `pattern`
+ *
+Returns
+- -1 if the pattern is invalid, already registered for the method or on allocation failure
+- 0 if succeed
+*/
+static int add_route(router_t *router, char *method, char *pattern, request_handler_t handle, void *arg,
+                     void (*release)(void *arg)) {
+    router_node_t *node = insert_pattern(router->root, pattern);
+    if (node == NULL) {
+        return -1;
+    }
+
+    for (route_t *route = node->routes; route != NULL; route = route->next) {
+        if (strcmp(route->method, method) == 0) {
+            return -1;
+        }
+    }
+
+    route_t *route = malloc(sizeof(route_t));
+    if (route == NULL) {
+        return -1;
+    }
+
+    route->method = strdup(method);
+    if (route->method == NULL) {
+        free(route);
+        return -1;
+    }
+
+    route->handle = handle;
+    route->arg = arg;
+    route->release = release;
+    route->next = node->routes;
+    node->routes = route;
+
+    return 0;
+}
+
+int router_add(router_t *router, char *method, char *pattern, request_handler_t handle, void *arg) {
+    return add_route(router, method, pattern, handle, arg, NULL);
+}
+
+/**
+ * Adds a handler written in a blocking style, it runs on a coroutine, see coroutine_handler.h
+ *
+Returns
+- -1 if the route can't be added
+- 0 if succeed
+*/
+int router_add_coroutine(router_t *router, char *method, char *pattern, request_handler_t handle, void *arg) {
+    coroutine_route_t *route = malloc(sizeof(coroutine_route_t));
+    if (route == NULL) {
+        return -1;
+    }
+
+    route->handle = handle;
+    route->arg = arg;
+
+    if (add_route(router, method, pattern, run_coroutine_handler, route, free) == -1) {
+        free(route);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Pattern of everything below `prefix`, "/assets" gives "/assets/*path", NULL on allocation failure
+static char *create_prefix_pattern(char *prefix) {
+    size_t prefix_length = strlen(prefix);
+    while (prefix_length > 0 && prefix[prefix_length - 1] == '/') {
+        prefix_length--;
+    }
+
+    size_t pattern_size = prefix_length + sizeof("/*path");
+    char *pattern = malloc(pattern_size);
+    if (pattern == NULL) {
+        return NULL;
+    }
+
+    snprintf(pattern, pattern_size, "%.*s/*path", (int)prefix_length, prefix);
+    return pattern;
+}
+
+/**
+ * Serves the files of `directory` under `prefix`, "/assets" serves "/assets/<path>"
+ *
+Returns
+- -1 if the directory doesn't exist or the route can't be added
+- 0 if succeed
+*/
+int router_mount(router_t *router, char *prefix, char *directory) {
+    static_mount_t *mount = create_static_mount(directory);
+    if (mount == NULL) {
+        return -1;
+    }
+
+    char *pattern = create_prefix_pattern(prefix);
+    if (pattern == NULL) {
+        free_static_mount(mount);
+        return -1;
+    }
+
+    int result = add_route(router, "GET", pattern, serve_static_files, mount, free_static_mount);
+    free(pattern);
+
+    if (result == -1) {
+        free_static_mount(mount);
+    }
+
+    return result;
+}
+
+/**
+ * Serves the assets embedded at build time under `prefix`, see bundle.h
+ *
+Returns
+- -1 if the binary has no embedded asset or the route can't be added
+- 0 if succeed
+*/
+int router_bundle(router_t *router, char *prefix) {
+    if (bundle_asset_count == 0) {
+        return -1;
+    }
+
+    char *pattern = create_prefix_pattern(prefix);
+    if (pattern == NULL) {
+        return -1;
+    }
+
+    int result = router_add(router, "GET", pattern, serve_bundle, NULL);
+    free(pattern);
+
+    return result;
+}
+
+/**
+ * Serves the assets of the pack `file` under `prefix`, see pack.h
+ *
+Returns
+- -1 if the file isn't a pack or the route can't be added
+- 0 if succeed
+*/
+int router_pack(router_t *router, char *prefix, char *file) {
+    asset_pack_t *pack = open_asset_pack(file);
+    if (pack == NULL) {
+        return -1;
+    }
+
+    char *pattern = create_prefix_pattern(prefix);
+    if (pattern == NULL) {
+        free_asset_pack(pack);
+        return -1;
+    }
+
+    int result = add_route(router, "GET", pattern, serve_asset_pack, pack, free_asset_pack);
+    free(pattern);
+
+    if (result == -1) {
+        free_asset_pack(pack);
+    }
+
+    return result;
+}
+
+/**
+ * Forwards the requests of every method under `prefix` to a comma separated list of upstreams,
+ * the path is forwarded as is, prefix included, and the responses go through `cache` unless it is NULL
+ *
+Returns
+- -1 if an upstream can't be resolved or the route can't be added
+- 0 if succeed
+*/
+int router_proxy(router_t *router, char *prefix, char *upstreams, response_cache_t *cache) {
+    proxy_t *proxy = create_proxy(upstreams, cache);
+    if (proxy == NULL) {
+        return -1;
+    }
+
+    char *pattern = create_prefix_pattern(prefix);
+    if (pattern == NULL) {
+        free_proxy(proxy);
+        return -1;
+    }
+
+    int result = add_route(router, "*", pattern, proxy_request, proxy, free_proxy);
+    free(pattern);
+
+    if (result == -1) {
+        free_proxy(proxy);
+    }
+
+    return result;
+}
+
+/**
+ * Relays the messages of the WebSocket clients of `path` to all of them
+ *
+Returns
+- -1 if the route can't be added
+- 0 if succeed
+*/
+int router_websocket(router_t *router, char *path) {
+    broadcast_hub_t *hub = create_broadcast_hub(NULL, 0);
+    if (hub == NULL) {
+        return -1;
+    }
+
+    if (add_route(router, "GET", path, websocket_relay_request, hub, free_broadcast_hub) == -1) {
+        free_broadcast_hub(hub);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Answers GET and HEAD requests of `path` with the output of `command`, run on a coroutine, see command.h
+ *
+Returns
+- -1 if the route can't be added
+- 0 if succeed
+*/
+int router_command(router_t *router, char *path, char *command) {
+    if (router_add_coroutine(router, "GET", path, command_request, command) == -1) {
+        return -1;
+    }
+
+    return router_add_coroutine(router, "HEAD", path, command_request, command);
+}
+
+/**
+ * Serves the event streams of the topics under `prefix`: a GET on "<prefix>/<topic>"
+ * subscribes to the topic and a POST publishes its body there
+ *
+Returns
+- -1 if the routes can't be added
+- 0 if succeed
+*/
+int router_events(router_t *router, char *prefix) {
+    size_t prefix_length = strlen(prefix);
+    while (prefix_length > 0 && prefix[prefix_length - 1] == '/') {
+        prefix_length--;
+    }
+
+    size_t pattern_size = prefix_length + sizeof("/:topic");
+    char *pattern = malloc(pattern_size);
+    sse_registry_t *registry = create_sse_registry();
+
+    if (pattern == NULL || registry == NULL) {
+        free(pattern);
+        if (registry != NULL) {
+            free_sse_registry(registry);
+        }
+        return -1;
+    }
+
+    snprintf(pattern, pattern_size, "%.*s/:topic", (int)prefix_length, prefix);
+
+    // The GET route owns the registry, it is added first so that it is released on failure
+    int result = add_route(router, "GET", pattern, sse_subscribe_request, registry, free_sse_registry);
+    if (result == -1) {
+        free_sse_registry(registry);
+    } else {
+        result = router_add(router, "POST", pattern, sse_publish_request, registry);
+    }
+
+    free(pattern);
+    return result;
+}
+
+static route_t *find_method_route(router_node_t *node, char *method, route_match_t *match) {
+    route_t *any = NULL;
+
+    for (route_t *route = node->routes; route != NULL; route = route->next) {
+        if (strcmp(route->method, method) == 0) {
+            return route;
+        }
+
+        if (strcmp(route->method, "*") == 0) {
+            any = route;
+        }
+    }
+
+    if (any != NULL) {
+        return any;
+    }
+
+    // The most specific path is tried first, its methods are the ones reported
+    if (node->routes != NULL && match->allowed == NULL) {
+        match->allowed = node->routes;
+    }
+
+    return NULL;
+}
+
+// The label of `node` has already been matched, `path` is what follows it
+static route_t *match_node(router_node_t *node, char *method, char *path, size_t length, route_match_t *match) {
+    route_t *route;
+
+    if (length == 0) {
+        route = find_method_route(node, method, match);
+        if (route != NULL) {
+            return route;
+        }
+    } else {
+        router_node_t *child = find_static_child(node, *path);
+
+        if (child != NULL && child->label_length <= length && memcmp(child->label, path, child->label_length) == 0) {
+            route = match_node(child, method, path + child->label_length, length - child->label_length, match);
+            if (route != NULL) {
+                return route;
+            }
+        }
+
+        size_t segment_length = 0;
+        while (segment_length < length && path[segment_length] != '/') {
+            segment_length++;
+        }
+
+        // A parameter never matches an empty segment
+        if (node->param_child != NULL && segment_length > 0) {
+            size_t index = match->param_count++;
+            match->params[index].name = node->param_child->label;
+            match->params[index].value = path;
+            match->params[index].value_length = segment_length;
+
+            route = match_node(node->param_child, method, path + segment_length, length - segment_length, match);
+            if (route != NULL) {
+                return route;
+            }
+
+            match->param_count = index;
+        }
+    }
+
+    if (node->wildcard_child != NULL) {
+        route = find_method_route(node->wildcard_child, method, match);
+
+        if (route != NULL) {
+            size_t index = match->param_count++;
+            match->params[index].name = node->wildcard_child->label;
+            match->params[index].value = path;
+            match->params[index].value_length = length;
+            return route;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Finds the route of a request path (without its query)
+ *
+ * Returns the route with its parameters in `match`, NULL if none accepts the method
+ */
+route_t *router_match(router_t *router, char *method, char *path, size_t path_length, route_match_t *match) {
+    match->param_count = 0;
+    match->allowed = NULL;
+
+    return match_node(router->root, method, path, path_length, match);
+}
+
+// Copies the matched parameters into the request, they outlive the request buffer
+static int set_request_params(request_t *request, route_match_t *match) {
+    if (match->param_count == 0) {
+        return 0;
+    }
+
+    request->params = create_header_list(match->param_count);
+    if (request->params == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < match->param_count; i++) {
+        char *value = strndup(match->params[i].value, match->params[i].value_length);
+        if (value == NULL) {
+            return -1;
+        }
+
+        header_t *param = create_header(match->params[i].name, value);
+        free(value);
+
+        if (param == NULL || append_header_list(request->params, param) == -1) {
+            free_header(param);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int send_route_error(connection_t *connection, request_t *request, route_match_t *match) {
+    header_list_t *header_list = create_header_list(1);
+    response_t response = {
+        .status = match->allowed != NULL ? METHOD_NOT_ALLOWED : NOT_FOUND,
+        .headers = header_list,
+    };
+
+    response.body = get_status_string(response.status);
+    response.body_length = strlen(response.body);
+
+    if (header_list == NULL) {
+        return -1;
+    }
+
+    // 405 responses list the methods the path accepts
+    if (match->allowed != NULL) {
+        string_t *allow = create_string(32);
+        if (allow == NULL) {
+            free_header_list(header_list);
+            return -1;
+        }
+
+        for (route_t *route = match->allowed; route != NULL; route = route->next) {
+            append_string(allow, route->method);
+            if (route->next != NULL) {
+                append_string(allow, ", ");
+            }
+        }
+
+        append_header_list(header_list, create_header("Allow", allow->data));
+        free_string(allow);
+    }
+
+    string_t *res = create_response(request, &response);
+    free_header_list(header_list);
+
+    return connection_send_string(connection, res);
+}
+
+/**
+ * Request handler dispatching to the routes of the router given as arg
+ *
+ * Returns -1 to close the connection, otherwise the result of the route handler
+ */
+int route_request(connection_t *connection, request_t *request, void *arg) {
+    router_t *router = arg;
+
+    printf("[%s] %s\n", request->method, request->uri);
+
+    route_match_t match;
+    route_t *route = router_match(router, request->method, request->target, request->path_length, &match);
+
+    if (route == NULL) {
+        return send_route_error(connection, request, &match);
+    }
+
+    if (set_request_params(request, &match) == -1) {
+        return -1;
+    }
+
+    return route->handle(connection, request, route->arg);
+}
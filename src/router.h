@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "cache.h"
+#include "connection.h"
+#include "http/http.h"
+
+// Maps requests to their handler with a compressed radix trie of path patterns
+//
+// Patterns are made of literal parts, `:name` parameters matching one path segment
+// and a trailing `*name` wildcard matching the rest of the path (possibly empty).
+// The trie is walked once along the request path, so a lookup costs the length of
+// the path whatever the number of routes. Literal parts win over parameters and
+// parameters over wildcards: "/users/me" is preferred to "/users/:id".
+
+#define MAX_ROUTE_PARAMS 8
+
+typedef struct Route {
+    // Other routes of the same pattern, one per method
+    struct Route *next;
+    // "*" accepts every method without its own route
+    char *method;
+    request_handler_t handle;
+    void *arg;
+    // Called with arg when the router is freed, can be NULL
+    void (*release)(void *arg);
+} route_t;
+
+typedef enum RouterNodeType {
+    ROUTER_NODE_STATIC,
+    ROUTER_NODE_PARAM,
+    ROUTER_NODE_WILDCARD,
+} router_node_type_t;
+
+typedef struct RouterNode {
+    router_node_type_t type;
+    // Literal part of the path for static nodes, parameter name otherwise
+    char *label;
+    size_t label_length;
+
+    // Static children, their labels all start with a different byte
+    struct RouterNode **children;
+    size_t child_count;
+    struct RouterNode *param_child;
+    struct RouterNode *wildcard_child;
+
+    // Routes whose pattern ends here
+    route_t *routes;
+} router_node_t;
+
+typedef struct Router {
+    router_node_t *root;
+} router_t;
+
+typedef struct RouteParam {
+    char *name;
+    // Slice of the request path
+    char *value;
+    size_t value_length;
+} route_param_t;
+
+typedef struct RouteMatch {
+    route_param_t params[MAX_ROUTE_PARAMS];
+    size_t param_count;
+    // Routes of the path when none of them accepts the method, used for 405
+    route_t *allowed;
+} route_match_t;
+
+router_t *create_router();
+void free_router(router_t *router);
+
+int router_add(router_t *router, char *method, char *pattern, request_handler_t handle, void *arg);
+int router_add_coroutine(router_t *router, char *method, char *pattern, request_handler_t handle, void *arg);
+int router_mount(router_t *router, char *prefix, char *directory);
+int router_bundle(router_t *router, char *prefix);
+int router_pack(router_t *router, char *prefix, char *file);
+int router_proxy(router_t *router, char *prefix, char *upstreams, response_cache_t *cache);
+int router_websocket(router_t *router, char *path);
+int router_events(router_t *router, char *prefix);
+int router_command(router_t *router, char *path, char *command);
+
+route_t *router_match(router_t *router, char *method, char *path, size_t path_length, route_match_t *match);
+int route_request(connection_t *connection, request_t *request, void *arg);
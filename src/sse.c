@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http/headers.h"
+#include "http/status.h"
+#include "sse.h"
+
+// Topics above this count are refused, they are never freed while the server runs
+const size_t SSE_MAX_TOPICS = 4096;
+const size_t SSE_MAX_TOPIC_LENGTH = 128;
+// Comments sent to idle subscribers, proxies drop responses silent for a minute or so
+const uint64_t SSE_HEARTBEAT_INTERVAL_MS = 15000;
+
+// Chunk size in hex and its CRLF
+#define CHUNK_PREFIX_MAX_SIZE 18
+
+typedef struct SseSubscriber {
+    broadcast_subscriber_t subscription;
+} sse_subscriber_t;
+
+/**
+ * Serializes a payload once for both kinds of subscribers: the whole buffer is an
+ * HTTP/1.1 chunk and the message range is the raw payload
+ *
+ * `write` fills the payload, it is given its exact size
+ *
+ * Returns -1 on allocation failure, otherwise 0
+ */
+static int create_event_message(broadcast_message_t *message, size_t payload_length,
+                                void (*write)(char *payload, void *arg), void *arg) {
+    char prefix[CHUNK_PREFIX_MAX_SIZE];
+    int prefix_length = snprintf(prefix, sizeof(prefix), "%zx\r\n", payload_length);
+
+    shared_buffer_t *buffer = create_shared_buffer(prefix_length + payload_length + 2);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    memcpy(buffer->data, prefix, prefix_length);
+    write(buffer->data + prefix_length, arg);
+    memcpy(buffer->data + prefix_length + payload_length, "\r\n", 2);
+
+    message->buffer = buffer;
+    message->offset = prefix_length;
+    message->length = payload_length;
+    return 0;
+}
+
+static void write_heartbeat(char *payload, void *arg) {
+    (void)arg;
+    memcpy(payload, ":\n\n", 3);
+}
+
+sse_registry_t *create_sse_registry() {
+    sse_registry_t *registry = calloc(1, sizeof(sse_registry_t));
+    if (registry == NULL) {
+        return NULL;
+    }
+
+    pthread_rwlock_init(&registry->lock, NULL);
+    return registry;
+}
+
+// The worker loops must be done with the registry, see free_broadcast_hub
+void free_sse_registry(void *arg) {
+    sse_registry_t *registry = arg;
+
+    for (size_t i = 0; i < SSE_TOPIC_BUCKETS; i++) {
+        sse_topic_t *topic = registry->buckets[i];
+
+        while (topic != NULL) {
+            sse_topic_t *next = topic->next;
+            free_broadcast_hub(topic->hub);
+            free(topic->name);
+            free(topic);
+            topic = next;
+        }
+    }
+
+    pthread_rwlock_destroy(&registry->lock);
+    free(registry);
+}
+
+static sse_topic_t **get_bucket(sse_registry_t *registry, char *name) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (char *c = name; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+
+    return &registry->buckets[hash % SSE_TOPIC_BUCKETS];
+}
+
+static sse_topic_t *find_topic(sse_topic_t *topic, char *name) {
+    while (topic != NULL && strcmp(topic->name, name) != 0) {
+        topic = topic->next;
+    }
+
+    return topic;
+}
+
+static sse_topic_t *lookup_topic(sse_registry_t *registry, char *name) {
+    pthread_rwlock_rdlock(&registry->lock);
+    sse_topic_t *topic = find_topic(*get_bucket(registry, name), name);
+    pthread_rwlock_unlock(&registry->lock);
+
+    return topic;
+}
+
+// Returns the topic, created on first use, or NULL when it can't be
+static sse_topic_t *get_topic(sse_registry_t *registry, char *name) {
+    sse_topic_t *topic = lookup_topic(registry, name);
+    if (topic != NULL) {
+        return topic;
+    }
+
+    pthread_rwlock_wrlock(&registry->lock);
+
+    // Another thread may have created it in between
+    sse_topic_t **bucket = get_bucket(registry, name);
+    topic = find_topic(*bucket, name);
+
+    if (topic == NULL && registry->topic_count < SSE_MAX_TOPICS) {
+        broadcast_message_t heartbeat;
+        topic = calloc(1, sizeof(sse_topic_t));
+
+        if (topic != NULL && (topic->name = strdup(name)) != NULL &&
+            create_event_message(&heartbeat, 3, write_heartbeat, NULL) == 0 &&
+            (topic->hub = create_broadcast_hub(&heartbeat, SSE_HEARTBEAT_INTERVAL_MS)) != NULL) {
+            atomic_init(&topic->next_id, 1);
+            topic->next = *bucket;
+            *bucket = topic;
+            registry->topic_count++;
+        } else {
+            if (topic != NULL) {
+                free(topic->name);
+            }
+            free(topic);
+            topic = NULL;
+        }
+    }
+
+    pthread_rwlock_unlock(&registry->lock);
+    return topic;
+}
+
+typedef struct EventFields {
+    uint64_t id;
+    char *event;
+    char *data;
+    size_t length;
+} event_fields_t;
+
+// Calls `line` with every line of data, a trailing newline doesn't start another one
+static size_t for_each_line(char *data, size_t length, void (*line)(char *start, size_t length, void *arg),
+                            void *arg) {
+    size_t count = 0;
+    size_t start = 0;
+
+    for (size_t i = 0; i <= length; i++) {
+        if (i < length && data[i] != '\n') {
+            continue;
+        }
+
+        if (i == length && start == length && count > 0) {
+            break;
+        }
+
+        // CRLF ends a line too, a CR left in it would end it for the client
+        size_t end = i > start && data[i - 1] == '\r' ? i - 1 : i;
+        if (line != NULL) {
+            line(data + start, end - start, arg);
+        }
+
+        count++;
+        start = i + 1;
+    }
+
+    return count;
+}
+
+static void count_line(char *start, size_t length, void *arg) {
+    (void)start;
+    *(size_t *)arg += sizeof("data: ") - 1 + length + 1;
+}
+
+static void write_line(char *start, size_t length, void *arg) {
+    char **cursor = arg;
+
+    memcpy(*cursor, "data: ", sizeof("data: ") - 1);
+    *cursor += sizeof("data: ") - 1;
+    memcpy(*cursor, start, length);
+    *cursor += length;
+    *(*cursor)++ = '\n';
+}
+
+static void write_event(char *payload, void *arg) {
+    event_fields_t *fields = arg;
+    char *cursor = payload + sprintf(payload, "id: %lu\n", (unsigned long)fields->id);
+
+    if (fields->event != NULL) {
+        cursor += sprintf(cursor, "event: %s\n", fields->event);
+    }
+
+    for_each_line(fields->data, fields->length, write_line, &cursor);
+    *cursor = '\n';
+}
+
+/**
+ * Sends an event to every subscriber of topic, can be called from any thread
+ *
+ * Every line of data gets its own field, event is the type of the event or NULL
+ * for the default "message". A topic without subscribers drops the event.
+ *
+Returns
+- -1 if the event is invalid or can't be allocated
+- 0 if succeed
+*/
+int sse_publish(sse_registry_t *registry, char *topic_name, char *event, char *data, size_t length) {
+    if (event != NULL && strpbrk(event, "\r\n") != NULL) {
+        return -1;
+    }
+
+    sse_topic_t *topic = lookup_topic(registry, topic_name);
+    if (topic == NULL || broadcast_subscriber_count(topic->hub) == 0) {
+        return 0;
+    }
+
+    event_fields_t fields = {
+        .id = atomic_fetch_add(&topic->next_id, 1),
+        .event = event,
+        .data = data,
+        .length = length,
+    };
+
+    // "id: " and the id, the optional "event: " line, the data lines and the blank line ending the event
+    char id[32];
+    size_t payload_length = snprintf(id, sizeof(id), "id: %lu\n", (unsigned long)fields.id) + 1;
+    if (event != NULL) {
+        payload_length += sizeof("event: ") - 1 + strlen(event) + 1;
+    }
+
+    size_t data_length = 0;
+    for_each_line(data, length, count_line, &data_length);
+    payload_length += data_length;
+
+    broadcast_message_t message;
+    if (create_event_message(&message, payload_length, write_event, &fields) == -1) {
+        return -1;
+    }
+
+    int result = broadcast_publish(topic->hub, &message);
+    release_shared_buffer(message.buffer);
+
+    return result;
+}
+
+// Events are pushed to the output by the groups of the hub, the producer waits until the server stops
+static stream_status_t produce_events(connection_t *connection, void *state) {
+    (void)state;
+    return connection->loop->draining ? STREAM_DONE : STREAM_WAIT;
+}
+
+static void release_subscriber(void *state) {
+    sse_subscriber_t *subscriber = state;
+
+    broadcast_unsubscribe(&subscriber->subscription);
+    free(subscriber);
+}
+
+static int send_status(connection_t *connection, request_t *request, int status) {
+    response_t response = {
+        .status = status,
+        .body = get_status_string(status),
+    };
+    response.body_length = strlen(response.body);
+
+    return connection_send_string(connection, create_response(request, &response));
+}
+
+/**
+ * Request handler subscribing to the "topic" parameter of the route, the registry
+ * is given as arg
+ *
+ * Returns -1 to close the connection, otherwise 0
+ */
+int sse_subscribe_request(connection_t *connection, request_t *request, void *arg) {
+    char *name = get_request_param(request, "topic");
+
+    if (name == NULL || strlen(name) > SSE_MAX_TOPIC_LENGTH) {
+        return send_status(connection, request, NOT_FOUND);
+    }
+
+    sse_topic_t *topic = get_topic(arg, name);
+    if (topic == NULL) {
+        return send_status(connection, request, SERVICE_UNAVAILABLE);
+    }
+
+    sse_subscriber_t *subscriber = calloc(1, sizeof(sse_subscriber_t));
+    header_list_t *headers = create_header_list(2);
+
+    if (subscriber == NULL || headers == NULL ||
+        append_header_list(headers, create_header("Content-Type", "text/event-stream")) == -1 ||
+        append_header_list(headers, create_header("Cache-Control", "no-cache")) == -1) {
+        free(subscriber);
+        if (headers != NULL) {
+            free_header_list(headers);
+        }
+        return -1;
+    }
+
+    response_t response = {
+        .status = OK,
+        .headers = headers,
+    };
+
+    int result = connection_stream_response(connection, request, &response, produce_events, release_subscriber,
+                                            subscriber);
+    free_header_list(headers);
+
+    if (result == -1) {
+        return -1;
+    }
+
+    // Chunked responses take the whole buffer, the others are delimited by the end of the connection
+    subscriber->subscription.framed = connection->stream->chunked;
+    connection->stream->unbounded = 1;
+    return broadcast_subscribe(topic->hub, &subscriber->subscription, connection);
+}
+
+static int publish_collected_body(connection_t *connection, request_t *request, void *arg) {
+    request_body_t *body = request->body;
+
+    // Events are sent from memory, spilled bodies are too big for one
+    if (body->data == NULL && body->length > 0) {
+        return send_status(connection, request, PAYLOAD_TOO_LARGE);
+    }
+
+    header_t *event = find_header(request->headers, "Event-Type");
+    int result = sse_publish(arg, get_request_param(request, "topic"), event == NULL ? NULL : event->value,
+                             body->data == NULL ? "" : body->data, body->length);
+
+    return send_status(connection, request, result == 0 ? ACCEPTED : BAD_REQUEST);
+}
+
+/**
+ * Request handler publishing the body as an event of the "topic" parameter of the
+ * route, the registry is given as arg. The Event-Type header names the event.
+ *
+ * Returns -1 to close the connection, otherwise 0
+ */
+int sse_publish_request(connection_t *connection, request_t *request, void *arg) {
+    (void)request;
+    return connection_collect_body(connection, publish_collected_body, arg);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "broadcast.h"
+#include "connection.h"
+#include "http/http.h"
+
+// Server-Sent Events (text/event-stream) published on named topics
+//
+// A GET on a topic keeps the response open and subscribes the connection to the
+// broadcast hub of the topic (see broadcast.h), an event is serialized once and every
+// subscriber queues the same buffer. An idle subscriber holds no read buffer and no
+// timer: the groups of the hub send a comment to all of their subscribers every
+// heartbeat interval, which keeps proxies from timing out and finds the dead peers.
+// Topics are created by their first subscriber and live as long as the registry.
+
+#define SSE_TOPIC_BUCKETS 256
+
+typedef struct SseTopic {
+    char *name;
+    broadcast_hub_t *hub;
+    // Id of the next event, sent so that clients can tell what they missed
+    atomic_uint_fast64_t next_id;
+    struct SseTopic *next;
+} sse_topic_t;
+
+typedef struct SseRegistry {
+    pthread_rwlock_t lock;
+    sse_topic_t *buckets[SSE_TOPIC_BUCKETS];
+    size_t topic_count;
+} sse_registry_t;
+
+sse_registry_t *create_sse_registry();
+void free_sse_registry(void *registry);
+
+int sse_publish(sse_registry_t *registry, char *topic, char *event, char *data, size_t length);
+int sse_subscribe_request(connection_t *connection, request_t *request, void *arg);
+int sse_publish_request(connection_t *connection, request_t *request, void *arg);
@@ -0,0 +1,630 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <linux/limits.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "file_pool.h"
+#include "http/content-type.h"
+#include "http/headers.h"
+#include "http/http.h"
+#include "http/parser_helpers.h"
+#include "http/status.h"
+#include "static_files.h"
+#include "str.h"
+
+// Directory entries written per chunk of a generated listing
+const int LISTING_ENTRIES_PER_CHUNK = 64;
+
+// Bodies up to this size are read and sent with the head in a single write, larger ones go out with sendfile
+const size_t FILE_INLINE_MAX_SIZE = 16 * 1024;
+
+// Start of a cold file read by a file thread before the file is sent with sendfile
+const size_t FILE_READAHEAD_SIZE = 1024 * 1024;
+
+static const char INDEX_FILE[] = "index.html";
+
+static const char NOT_FOUND_BODY[] = "<!DOCTYPE html><html><body><h1>File not found :(</h1></body></html>";
+
+typedef enum LookupStatus {
+    LOOKUP_NOT_FOUND,
+    // A regular file, fd is open
+    LOOKUP_FILE,
+    // A directory without index.html, dir is open
+    LOOKUP_LISTING,
+} lookup_status_t;
+
+// What a request resolved to, found on the loop when it is cached or on a file thread otherwise
+typedef struct FileLookup {
+    // Must be the first member, the file pool hands the job back to us
+    file_job_t job;
+    connection_t *connection;
+    static_mount_t *mount;
+    char *path;
+    char *uri;
+    // Directories are requested with a trailing slash, the mount point itself with an empty path
+    int is_directory;
+
+    lookup_status_t status;
+    int fd;
+    off_t size;
+    // Path of the file once resolved by realpath, its extension gives the type
+    char *resolved;
+    // Whole content of small files, read with the lookup
+    char *body;
+    size_t body_capacity;
+    size_t body_length;
+
+    DIR *dir;
+    // Next piece of the listing, read by a file thread
+    string_t *chunk;
+    int listing_started;
+    int listing_done;
+
+    // Set while a file thread runs the job, the response waits for it
+    int pending;
+    // Set once the connection no longer needs the lookup, the completion frees it
+    int released;
+    int head_sent;
+
+    // What the head needs of the request once the response has been deferred
+    http_version_t version;
+    header_list_t *request_headers;
+} file_lookup_t;
+
+/**
+ * Opens the mount point whose files are served, its path is resolved once
+ *
+ * Returns NULL if the directory can't be opened
+ */
+static_mount_t *create_static_mount(char *directory) {
+    static_mount_t *mount = malloc(sizeof(static_mount_t));
+    if (mount == NULL) {
+        return NULL;
+    }
+
+    mount->root = realpath(directory, NULL);
+    mount->root_fd = mount->root != NULL ? open(mount->root, O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+
+    if (mount->root_fd == -1) {
+        free(mount->root);
+        free(mount);
+        return NULL;
+    }
+
+    return mount;
+}
+
+void free_static_mount(void *mount) {
+    static_mount_t *static_mount = mount;
+
+    close(static_mount->root_fd);
+    free(static_mount->root);
+    free(static_mount);
+}
+
+static int append_html_escaped(string_t *string, char *text) {
+    for (char *c = text; *c != '\0'; c++) {
+        int result;
+
+        switch (*c) {
+        case '<':
+            result = append_string(string, "&lt;");
+            break;
+        case '>':
+            result = append_string(string, "&gt;");
+            break;
+        case '&':
+            result = append_string(string, "&amp;");
+            break;
+        case '"':
+            result = append_string(string, "&quot;");
+            break;
+        default:
+            result = append_char(string, *c);
+        }
+
+        if (result == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Appends a file name as a relative link: everything but the unreserved characters
+ * (RFC 3986 section 2.3) is percent-encoded, so that a '%', '?' or '#' of the name
+ * reaches the server as part of the path and a ':' can't read as a scheme.
+ * The result needs no HTML escaping.
+ */
+static int append_uri_encoded(string_t *string, char *text) {
+    static const char hex_digits[] = "0123456789ABCDEF";
+
+    for (unsigned char *c = (unsigned char *)text; *c != '\0'; c++) {
+        if (is_alpha(*c) || is_numeric(*c) || *c == '-' || *c == '.' || *c == '_' || *c == '~') {
+            if (append_char(string, *c) == -1) {
+                return -1;
+            }
+        } else {
+            char escape[] = {'%', hex_digits[*c >> 4], hex_digits[*c & 0x0f], '\0'};
+            if (append_string(string, escape) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void free_lookup(file_lookup_t *lookup) {
+    if (lookup->fd != -1) {
+        close(lookup->fd);
+    }
+
+    if (lookup->dir != NULL) {
+        closedir(lookup->dir);
+    }
+
+    put_buffer(lookup->body, lookup->body_capacity);
+    free_string(lookup->chunk);
+    free_header_list(lookup->request_headers);
+    free(lookup->resolved);
+    free(lookup->path);
+    free(lookup->uri);
+    free(lookup);
+}
+
+static void release_lookup(void *state) {
+    file_lookup_t *lookup = state;
+
+    // The file thread still uses it
+    if (lookup->pending) {
+        lookup->released = 1;
+        return;
+    }
+
+    free_lookup(lookup);
+}
+
+// A resolved path is served only if it is the root or below it, "/srv/public2" is not in "/srv/public"
+static int is_inside_root(char *path, char *root) {
+    size_t root_length = strlen(root);
+    return strncmp(path, root, root_length) == 0 && (path[root_length] == '/' || path[root_length] == '\0');
+}
+
+// Reads the whole content of a small file, blocking, it is left to sendfile if that fails
+static void read_body(file_lookup_t *lookup) {
+    if (lookup->body == NULL) {
+        lookup->body = get_buffer(lookup->size > 0 ? lookup->size : 1, &lookup->body_capacity);
+    }
+
+    while (lookup->body != NULL && lookup->body_length < (size_t)lookup->size) {
+        ssize_t result = pread(lookup->fd, lookup->body + lookup->body_length, lookup->size - lookup->body_length,
+                               lookup->body_length);
+
+        if (result <= 0 && !(result == -1 && errno == EINTR)) {
+            put_buffer(lookup->body, lookup->body_capacity);
+            lookup->body = NULL;
+            lookup->body_length = 0;
+            return;
+        }
+
+        lookup->body_length += result > 0 ? result : 0;
+    }
+}
+
+/**
+ * Resolves the request like the cached lookup but with realpath, which also allows the
+ * absolute symbolic links staying inside the root, then reads what will be sent.
+ * Runs on a file thread.
+ */
+static void resolve_file(file_job_t *job) {
+    file_lookup_t *lookup = (file_lookup_t *)job;
+    char *root = lookup->mount->root;
+
+    if (lookup->fd == -1) {
+        char file_path[PATH_MAX];
+        int file_path_length = snprintf(file_path, sizeof(file_path), "%s/%s%s", root, lookup->path,
+                                        lookup->is_directory ? INDEX_FILE : "");
+
+        // Paths too long for the buffer are not found
+        int fits = file_path_length < (int)sizeof(file_path);
+        lookup->resolved = fits ? realpath(file_path, NULL) : NULL;
+
+        if (lookup->resolved == NULL && lookup->is_directory && fits) {
+            // No index.html, list the directory instead
+            char *directory = realpath(dirname(file_path), NULL);
+
+            if (directory != NULL && is_inside_root(directory, root)) {
+                lookup->dir = opendir(directory);
+                lookup->status = lookup->dir != NULL ? LOOKUP_LISTING : LOOKUP_NOT_FOUND;
+            }
+
+            free(directory);
+            return;
+        }
+
+        // Check if path traversal is occurred
+        if (lookup->resolved != NULL && is_inside_root(lookup->resolved, root)) {
+            lookup->fd = open(lookup->resolved, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        }
+
+        struct stat file_stat;
+        if (lookup->fd != -1 && (fstat(lookup->fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode))) {
+            close(lookup->fd);
+            lookup->fd = -1;
+        }
+
+        if (lookup->fd == -1) {
+            return;
+        }
+
+        lookup->status = LOOKUP_FILE;
+        lookup->size = file_stat.st_size;
+    }
+
+    if ((size_t)lookup->size <= FILE_INLINE_MAX_SIZE) {
+        read_body(lookup);
+    } else {
+        // sendfile then finds the start of the file in the page cache
+        readahead(lookup->fd, 0, FILE_READAHEAD_SIZE);
+    }
+}
+
+// Opens a path below the mount with what is in the dentry cache, fails with EAGAIN if it would block
+static int open_cached(file_lookup_t *lookup, char *path) {
+    struct open_how how = {
+        .flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS | RESOLVE_CACHED,
+    };
+
+    return syscall(SYS_openat2, lookup->mount->root_fd, path, &how, sizeof(how));
+}
+
+/**
+ * Resolves the request without blocking: the path from the dentry cache, the content
+ * from the page cache (RWF_NOWAIT reads)
+ *
+Returns
+- -1 if part of the lookup has to run on a file thread, the rest goes on from where this one stopped
+- 0 if the lookup is complete
+*/
+static int lookup_cached_file(file_lookup_t *lookup) {
+    char index_path[PATH_MAX];
+    char *path = lookup->path;
+
+    if (lookup->is_directory) {
+        if (snprintf(index_path, sizeof(index_path), "%s%s", lookup->path, INDEX_FILE) >= (int)sizeof(index_path)) {
+            return -1;
+        }
+        path = index_path;
+    }
+
+    lookup->fd = open_cached(lookup, path[0] == '\0' ? "." : path);
+
+    if (lookup->fd == -1) {
+        // A missing index is listed, anything else but a cached miss (symbolic links leaving the
+        // root, old kernels) gets the full lookup
+        if (errno == ENOENT && !lookup->is_directory) {
+            lookup->status = LOOKUP_NOT_FOUND;
+            return 0;
+        }
+        return -1;
+    }
+
+    struct stat file_stat;
+    if (fstat(lookup->fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+        close(lookup->fd);
+        lookup->fd = -1;
+        lookup->status = LOOKUP_NOT_FOUND;
+        return 0;
+    }
+
+    lookup->status = LOOKUP_FILE;
+    lookup->size = file_stat.st_size;
+
+    if ((size_t)lookup->size > FILE_INLINE_MAX_SIZE) {
+        // The start of the file tells whether it has been read lately
+        char byte;
+        struct iovec probe = {.iov_base = &byte, .iov_len = 1};
+        return lookup->size == 0 || preadv2(lookup->fd, &probe, 1, 0, RWF_NOWAIT) == 1 ? 0 : -1;
+    }
+
+    lookup->body = get_buffer(lookup->size > 0 ? lookup->size : 1, &lookup->body_capacity);
+    if (lookup->body == NULL) {
+        return -1;
+    }
+
+    while (lookup->body_length < (size_t)lookup->size) {
+        struct iovec body = {
+            .iov_base = lookup->body + lookup->body_length,
+            .iov_len = lookup->size - lookup->body_length,
+        };
+        ssize_t result = preadv2(lookup->fd, &body, 1, lookup->body_length, RWF_NOWAIT);
+
+        if (result <= 0) {
+            return -1;
+        }
+
+        lookup->body_length += result;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the next entries of the listing in a chunk, the first one starts the page.
+ * Runs on a file thread.
+ */
+static void read_listing_chunk(file_job_t *job) {
+    file_lookup_t *lookup = (file_lookup_t *)job;
+
+    string_t *html = create_string(1024);
+    if (html == NULL) {
+        return;
+    }
+
+    // Without a chunk the listing fails, there is no going back over the entries read
+    if (!lookup->listing_started && (append_string(html, "<!DOCTYPE html><html><body><h1>Index of ") == -1 ||
+                                     append_html_escaped(html, lookup->uri) == -1 ||
+                                     append_string(html, "</h1><ul>") == -1)) {
+        free_string(html);
+        return;
+    }
+
+    int done = 0;
+
+    for (int i = 0; i < LISTING_ENTRIES_PER_CHUNK; i++) {
+        struct dirent *entry = readdir(lookup->dir);
+
+        if (entry == NULL) {
+            if (append_string(html, "</ul></body></html>") == -1) {
+                free_string(html);
+                return;
+            }
+
+            done = 1;
+            break;
+        }
+
+        // Hidden files, "." and ".." are not listed
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        // The link is percent-encoded, the text only HTML escaped
+        if (append_string(html, "<li><a href=\"") == -1 || append_uri_encoded(html, entry->d_name) == -1 ||
+            append_string(html, entry->d_type == DT_DIR ? "/\">" : "\">") == -1 ||
+            append_html_escaped(html, entry->d_name) == -1 || append_string(html, "</a></li>") == -1) {
+            free_string(html);
+            return;
+        }
+    }
+
+    lookup->listing_started = 1;
+    lookup->listing_done = done;
+    lookup->chunk = html;
+}
+
+static void on_lookup_complete(file_job_t *job) {
+    file_lookup_t *lookup = (file_lookup_t *)job;
+
+    lookup->pending = 0;
+
+    if (lookup->released) {
+        free_lookup(lookup);
+    } else {
+        connection_stream_resume(lookup->connection);
+    }
+}
+
+/**
+ * Hands run to a file thread, or runs it right away when the pool refuses it
+ *
+ * Returns 1 if the job runs on a file thread, 0 if it already ran
+ */
+static int run_lookup_job(file_lookup_t *lookup, file_job_callback_t run) {
+    lookup->job.run = run;
+    lookup->job.complete = on_lookup_complete;
+
+    if (file_pool_submit(lookup->connection->loop, &lookup->job) == 0) {
+        lookup->pending = 1;
+        return 1;
+    }
+
+    run(&lookup->job);
+    return 0;
+}
+
+// Queues the head and the body of a file, or the 404 page. Returns -1 to close the connection, otherwise 0
+static int send_file_response(connection_t *connection, request_t *request, file_lookup_t *lookup) {
+    header_list_t *header_list = create_header_list(1);
+    response_t response = {
+        .status = OK,
+        .headers = header_list,
+    };
+
+    if (header_list == NULL) {
+        return -1;
+    }
+
+    if (lookup->status == LOOKUP_FILE) {
+        // A directory serves its index.html
+        char *type_path = lookup->resolved != NULL ? lookup->resolved : lookup->path;
+        char *extension = lookup->resolved == NULL && lookup->is_directory ? ".html" : get_extension(type_path);
+
+        append_header_list(response.headers, get_content_type_header(extension));
+
+        // The head carries the length of the body, small bodies follow it in the same buffer
+        response.body = lookup->body;
+        response.body_length = lookup->size;
+    } else {
+        response.status = NOT_FOUND;
+        response.body = (char *)NOT_FOUND_BODY;
+        response.body_length = sizeof(NOT_FOUND_BODY) - 1;
+    }
+
+    string_t *res = create_response(request, &response);
+    free_header_list(response.headers);
+
+    if (connection_send_string(connection, res) == -1) {
+        return -1;
+    }
+
+    if (lookup->status == LOOKUP_FILE && lookup->body == NULL) {
+        int fd = lookup->fd;
+
+        // The queue owns the fd from now on
+        lookup->fd = -1;
+        return connection_send_file(connection, fd, 0, lookup->size);
+    }
+
+    return 0;
+}
+
+// Streams the listing a few entries at a time, huge directories never sit in memory
+static stream_status_t produce_listing(connection_t *connection, file_lookup_t *lookup) {
+    if (lookup->chunk == NULL && !lookup->listing_done && run_lookup_job(lookup, read_listing_chunk)) {
+        return STREAM_WAIT;
+    }
+
+    if (lookup->chunk == NULL) {
+        return lookup->listing_done ? STREAM_DONE : STREAM_ERROR;
+    }
+
+    int result = connection_stream_write(connection, lookup->chunk->data, lookup->chunk->length);
+    free_string(lookup->chunk);
+    lookup->chunk = NULL;
+
+    if (result == -1) {
+        return STREAM_ERROR;
+    }
+
+    return lookup->listing_done ? STREAM_DONE : STREAM_MORE;
+}
+
+// Producer of the responses waiting for a file thread, and of the listings
+static stream_status_t produce_static_response(connection_t *connection, void *state) {
+    file_lookup_t *lookup = state;
+
+    if (lookup->pending) {
+        return STREAM_WAIT;
+    }
+
+    if (lookup->head_sent) {
+        return produce_listing(connection, lookup);
+    }
+
+    request_t client = {.version = &lookup->version, .headers = lookup->request_headers};
+    lookup->head_sent = 1;
+
+    if (lookup->status != LOOKUP_LISTING) {
+        return send_file_response(connection, &client, lookup) == -1 ? STREAM_ERROR : STREAM_DONE;
+    }
+
+    // Deferred responses frame their body themselves
+    if (is_http_1_1_request(&client)) {
+        connection->stream->chunked = 1;
+    } else {
+        connection_end_keep_alive(connection);
+    }
+
+    response_t response = {.status = OK, .streaming = 1, .closing = !connection->keep_alive};
+    response.headers = create_header_list(1);
+
+    if (response.headers == NULL ||
+        append_header_list(response.headers, create_header("Content-Type", "text/html")) == -1) {
+        free_header_list(response.headers);
+        return STREAM_ERROR;
+    }
+
+    int result = connection_send_string(connection, create_response(&client, &response));
+    free_header_list(response.headers);
+
+    return result == -1 ? STREAM_ERROR : STREAM_MORE;
+}
+
+// Copies what the head needs of the request, it is released before a deferred response is sent
+static int keep_request_head(file_lookup_t *lookup, request_t *request) {
+    header_t *connection_header = find_known_header(request->headers, HEADER_CONNECTION);
+
+    lookup->version = *request->version;
+    lookup->request_headers = create_header_list(1);
+
+    return lookup->request_headers == NULL ||
+                   (connection_header != NULL &&
+                    append_header_list(lookup->request_headers,
+                                       create_header("Connection", connection_header->value)) == -1)
+               ? -1
+               : 0;
+}
+
+/**
+ * Request handler serving the files of the mount given as arg, the file is the "path"
+ * parameter of the route
+ *
+ * Files found in the caches are answered right away, the other lookups run on a file
+ * thread while the response waits, so that a cold disk never stalls the loop.
+ *
+ * Returns -1 to close the connection, otherwise 0
+ */
+int serve_static_files(connection_t *connection, request_t *request, void *arg) {
+    char *path = get_request_param(request, "path");
+
+    if (path == NULL) {
+        path = "";
+    }
+
+    file_lookup_t *lookup = calloc(1, sizeof(file_lookup_t));
+    if (lookup == NULL) {
+        return -1;
+    }
+
+    size_t path_length = strlen(path);
+    lookup->connection = connection;
+    lookup->mount = arg;
+    lookup->fd = -1;
+    lookup->path = strdup(path);
+    lookup->uri = strdup(request->uri);
+    lookup->is_directory = path_length == 0 || path[path_length - 1] == '/';
+
+    if (lookup->path == NULL || lookup->uri == NULL || keep_request_head(lookup, request) == -1) {
+        free_lookup(lookup);
+        return -1;
+    }
+
+    if (lookup_cached_file(lookup) == -1 && run_lookup_job(lookup, resolve_file)) {
+        return connection_defer_response(connection, produce_static_response, release_lookup, lookup);
+    }
+
+    if (lookup->status == LOOKUP_LISTING) {
+        response_t response = {.status = OK, .headers = create_header_list(1)};
+
+        if (response.headers == NULL ||
+            append_header_list(response.headers, create_header("Content-Type", "text/html")) == -1) {
+            free_header_list(response.headers);
+            free_lookup(lookup);
+            return -1;
+        }
+
+        lookup->head_sent = 1;
+        int result = connection_stream_response(connection, request, &response, produce_static_response,
+                                                release_lookup, lookup);
+        free_header_list(response.headers);
+        return result;
+    }
+
+    int result = send_file_response(connection, request, lookup);
+    free_lookup(lookup);
+    return result;
+}
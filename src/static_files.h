@@ -0,0 +1,21 @@
+#pragma once
+
+#include "connection.h"
+#include "http/http.h"
+
+// Serves the files of a directory mounted on the router, see router_mount
+//
+// Regular files are sent with sendfile, directories without an index.html
+// are listed as a streamed HTML page. Lookups missing the kernel caches run
+// on the file threads, see file_pool.h.
+
+typedef struct StaticMount {
+    // Resolved path of the mounted directory
+    char *root;
+    // Opened once, the files are looked up beneath it
+    int root_fd;
+} static_mount_t;
+
+static_mount_t *create_static_mount(char *directory);
+void free_static_mount(void *mount);
+int serve_static_files(connection_t *connection, request_t *request, void *arg);
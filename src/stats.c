@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+// Slot of the current process, counting is a no-op until one is chosen
+static worker_stats_t *current_slot = NULL;
+
+/**
+ * Maps a zeroed segment shared with the processes forked afterwards
+ *
+ * Returns NULL on failure
+ */
+server_stats_t *create_server_stats(size_t slot_count) {
+    size_t size = sizeof(server_stats_t) + sizeof(worker_stats_t) * slot_count;
+    server_stats_t *stats = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (stats == MAP_FAILED) {
+        return NULL;
+    }
+
+    stats->slot_count = slot_count;
+    stats->mapped_size = size;
+    return stats;
+}
+
+void free_server_stats(server_stats_t *stats) {
+    munmap(stats, stats->mapped_size);
+}
+
+// Called by a worker process before it serves anything
+void stats_use_slot(server_stats_t *stats, size_t slot) {
+    current_slot = &stats->slots[slot];
+}
+
+void stats_name_listeners(server_stats_t *stats, listener_t *listeners, size_t listener_count) {
+    stats->listener_count = listener_count;
+
+    for (size_t i = 0; i < listener_count; i++) {
+        stats->listener_names[i] = listeners[i].name;
+    }
+}
+
+// Counts a connection accepted on the listener of that index
+void stats_count_connection(size_t listener) {
+    if (current_slot != NULL) {
+        atomic_fetch_add_explicit(&current_slot->connections, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&current_slot->listener_connections[listener], 1, memory_order_relaxed);
+    }
+}
+
+// Counts a connection of the listener refused by the acceptor, on top of the reason it was refused for
+void stats_count_refused(size_t listener) {
+    if (current_slot != NULL) {
+        atomic_fetch_add_explicit(&current_slot->listener_refused[listener], 1, memory_order_relaxed);
+    }
+}
+
+void stats_count_shed() {
+    if (current_slot != NULL) {
+        atomic_fetch_add_explicit(&current_slot->shed, 1, memory_order_relaxed);
+    }
+}
+
+void stats_count_rate_limited() {
+    if (current_slot != NULL) {
+        atomic_fetch_add_explicit(&current_slot->rate_limited, 1, memory_order_relaxed);
+    }
+}
+
+void stats_count_response(int status) {
+    if (current_slot != NULL && status >= 100 && status < 600) {
+        atomic_fetch_add_explicit(&current_slot->responses[status / 100 - 1], 1, memory_order_relaxed);
+    }
+}
+
+// Counts a request that took duration_ns from its head to its whole response being queued
+void stats_record_request(uint64_t duration_ns) {
+    if (current_slot == NULL) {
+        return;
+    }
+
+    uint64_t duration_ms = duration_ns / 1000000;
+    size_t bucket = 0;
+
+    while (bucket < STATS_LATENCY_BUCKETS - 1 && duration_ms >= (1ull << bucket)) {
+        bucket++;
+    }
+
+    atomic_fetch_add_explicit(&current_slot->requests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&current_slot->latency[bucket], 1, memory_order_relaxed);
+}
+
+// Adds the counters of a buffer pool, batched by its thread
+void stats_count_buffers(uint64_t hits, uint64_t misses, int64_t cached_change) {
+    if (current_slot == NULL) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&current_slot->buffer_hits, hits, memory_order_relaxed);
+    atomic_fetch_add_explicit(&current_slot->buffer_misses, misses, memory_order_relaxed);
+    atomic_fetch_add_explicit(&current_slot->buffers_cached, cached_change, memory_order_relaxed);
+}
+
+static uint64_t load(atomic_uint_fast64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Prints the totals of every slot, then what each worker did
+void print_server_stats(server_stats_t *stats) {
+    uint64_t connections = 0;
+    uint64_t shed = 0;
+    uint64_t rate_limited = 0;
+    uint64_t requests = 0;
+    uint64_t responses[5] = {0};
+    uint64_t latency[STATS_LATENCY_BUCKETS] = {0};
+    uint64_t buffer_hits = 0;
+    uint64_t buffer_misses = 0;
+    int64_t buffers_cached = 0;
+
+    for (size_t i = 0; i < stats->slot_count; i++) {
+        worker_stats_t *slot = &stats->slots[i];
+
+        connections += load(&slot->connections);
+        shed += load(&slot->shed);
+        rate_limited += load(&slot->rate_limited);
+        requests += load(&slot->requests);
+        for (size_t j = 0; j < 5; j++) {
+            responses[j] += load(&slot->responses[j]);
+        }
+        for (size_t j = 0; j < STATS_LATENCY_BUCKETS; j++) {
+            latency[j] += load(&slot->latency[j]);
+        }
+        buffer_hits += load(&slot->buffer_hits);
+        buffer_misses += load(&slot->buffer_misses);
+        buffers_cached += atomic_load_explicit(&slot->buffers_cached, memory_order_relaxed);
+    }
+
+    printf("Stats: %lu connections, %lu shed, %lu rate limited, %lu requests, responses 1xx %lu 2xx %lu 3xx %lu "
+           "4xx %lu 5xx %lu\n",
+           connections, shed, rate_limited, requests, responses[0], responses[1], responses[2], responses[3],
+           responses[4]);
+
+    printf("Latency:");
+    for (size_t i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        if (latency[i] == 0) {
+            continue;
+        }
+
+        if (i < STATS_LATENCY_BUCKETS - 1) {
+            printf(" <%llums %lu", 1ull << i, latency[i]);
+        } else {
+            printf(" >=%llums %lu", 1ull << (i - 1), latency[i]);
+        }
+    }
+    printf("\n");
+
+    printf("Buffers: %lu reused, %lu allocated, %ld cached\n", buffer_hits, buffer_misses, buffers_cached);
+
+    for (size_t i = 0; stats->listener_count > 1 && i < stats->listener_count; i++) {
+        uint64_t listener_connections = 0;
+        uint64_t listener_refused = 0;
+
+        for (size_t j = 0; j < stats->slot_count; j++) {
+            listener_connections += load(&stats->slots[j].listener_connections[i]);
+            listener_refused += load(&stats->slots[j].listener_refused[i]);
+        }
+
+        printf("Listener %s: %lu connections, %lu refused\n", stats->listener_names[i], listener_connections,
+               listener_refused);
+    }
+
+    if (stats->slot_count > 1) {
+        for (size_t i = 0; i < stats->slot_count; i++) {
+            worker_stats_t *slot = &stats->slots[i];
+            printf("Worker %zu: pid %d, %lu connections, %lu requests, %lu restarts\n", i, slot->pid,
+                   load(&slot->connections), load(&slot->requests), slot->restarts);
+        }
+    }
+
+    fflush(stdout);
+}
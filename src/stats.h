@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "listener.h"
+
+// Server counters, kept in a shared memory segment mapped before the workers are forked
+//
+// Every worker process owns a slot that its threads update with relaxed atomics, the
+// master reads all of them to report totals. A slot fills its own cache lines so that
+// workers never write to the lines of each other. A single process server uses one slot.
+
+// Request latencies are counted in power of two buckets: under 1ms, under 2ms, ... and the rest
+#define STATS_LATENCY_BUCKETS 16
+
+typedef struct WorkerStats {
+    atomic_uint_fast64_t connections;
+    // Connections refused by the acceptor because the workers were busy
+    atomic_uint_fast64_t shed;
+    // Connections and requests refused with 429 because their client went over its limits
+    atomic_uint_fast64_t rate_limited;
+    atomic_uint_fast64_t requests;
+    // Responses per status class, 1xx to 5xx
+    atomic_uint_fast64_t responses[5];
+    atomic_uint_fast64_t latency[STATS_LATENCY_BUCKETS];
+    // I/O buffers checked out of the thread pools or allocated, and cached by the pools
+    atomic_uint_fast64_t buffer_hits;
+    atomic_uint_fast64_t buffer_misses;
+    atomic_int_fast64_t buffers_cached;
+    // Connections accepted on each listener, and the ones refused (shed or rate limited) among them
+    atomic_uint_fast64_t listener_connections[MAX_LISTENERS];
+    atomic_uint_fast64_t listener_refused[MAX_LISTENERS];
+
+    // Only written by the master
+    pid_t pid;
+    uint64_t restarts;
+} __attribute__((aligned(64))) worker_stats_t;
+
+typedef struct ServerStats {
+    size_t slot_count;
+    size_t mapped_size;
+    // Names of the listeners, the same in the master and the workers it forks
+    size_t listener_count;
+    const char *listener_names[MAX_LISTENERS];
+    worker_stats_t slots[];
+} server_stats_t;
+
+server_stats_t *create_server_stats(size_t slot_count);
+void free_server_stats(server_stats_t *stats);
+void stats_use_slot(server_stats_t *stats, size_t slot);
+void stats_name_listeners(server_stats_t *stats, listener_t *listeners, size_t listener_count);
+void print_server_stats(server_stats_t *stats);
+
+void stats_count_connection(size_t listener);
+void stats_count_refused(size_t listener);
+void stats_count_shed();
+void stats_count_rate_limited();
+void stats_count_response(int status);
+void stats_record_request(uint64_t duration_ns);
+void stats_count_buffers(uint64_t hits, uint64_t misses, int64_t cached_change);
@@ -72,7 +72,8 @@ int append_string(string_t *string, char *text) {
 }
 
 int append_char(string_t *string, char c) {
-    if (string->length == string->capacity) {
+    // Room for the null terminator too
+    if (string->length + 1 >= string->capacity) {
         size_t new_capacity = string->capacity * 2 + 1;
         char *new_data = realloc(string->data, new_capacity);
 
@@ -159,3 +160,12 @@ int start_with(char *text, char *str) {
 char *get_extension(char *text) {
     return strrchr(text, '.');
 }
+
+void free_string(string_t *string) {
+    if (string == NULL) {
+        return;
+    }
+
+    free(string->data);
+    free(string);
+}
@@ -19,3 +19,4 @@ char *int_to_str(long value);
 int start_with(char *text, char *str);
 
 char *get_extension(char *text);
+void free_string(string_t *string);
@@ -0,0 +1,206 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "timer_wheel.h"
+
+static const uint64_t SLOT_MASK = TIMER_WHEEL_SLOTS - 1;
+
+static void list_init(wheel_timer_t *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static int list_empty(wheel_timer_t *head) {
+    return head->next == head;
+}
+
+static void list_push(wheel_timer_t *head, wheel_timer_t *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_unlink(wheel_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+// Moves every element of `from` at the end of `to`
+static void list_splice(wheel_timer_t *from, wheel_timer_t *to) {
+    if (list_empty(from)) {
+        return;
+    }
+
+    from->next->prev = to->prev;
+    to->prev->next = from->next;
+    from->prev->next = to;
+    to->prev = from->prev;
+
+    list_init(from);
+}
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t tick_ms, uint64_t now_ms) {
+    wheel->tick_ms = tick_ms;
+    wheel->current_tick = now_ms / tick_ms;
+    wheel->count = 0;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+void wheel_timer_init(wheel_timer_t *timer, wheel_timer_callback_t callback) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+}
+
+/**
+ * Returns 1 if the timer is scheduled
+ * otherwise 0
+ */
+int wheel_timer_pending(wheel_timer_t *timer) {
+    return timer->next != NULL;
+}
+
+// Places the timer in the slot matching its distance from the current tick
+static void insert_timer(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer->expires < wheel->current_tick) {
+        timer->expires = wheel->current_tick;
+    }
+
+    uint64_t delta = timer->expires - wheel->current_tick;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t level_span = 1ull << (TIMER_WHEEL_SLOT_BITS * (level + 1));
+
+        if (delta < level_span || level == TIMER_WHEEL_LEVELS - 1) {
+            if (delta >= level_span) {
+                // Too far in the future, park it in the furthest slot, it will be
+                // reinserted when the slot cascades
+                timer->expires = wheel->current_tick + level_span - 1;
+            }
+
+            uint64_t slot = (timer->expires >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK;
+            list_push(&wheel->slots[level][slot], timer);
+            return;
+        }
+    }
+}
+
+void timer_wheel_schedule(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t expires_ms) {
+    if (wheel_timer_pending(timer)) {
+        list_unlink(timer);
+        wheel->count--;
+    }
+
+    // Round up so a timer never fires before its deadline
+    timer->expires = (expires_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    insert_timer(wheel, timer);
+    wheel->count++;
+}
+
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (!wheel_timer_pending(timer)) {
+        return;
+    }
+
+    list_unlink(timer);
+    wheel->count--;
+}
+
+// Moves the timers of an upper level slot to the lower levels
+static void cascade(timer_wheel_t *wheel, int level) {
+    uint64_t slot = (wheel->current_tick >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK;
+
+    wheel_timer_t pending;
+    list_init(&pending);
+    list_splice(&wheel->slots[level][slot], &pending);
+
+    while (!list_empty(&pending)) {
+        wheel_timer_t *timer = pending.next;
+        list_unlink(timer);
+        insert_timer(wheel, timer);
+    }
+}
+
+size_t timer_wheel_advance(timer_wheel_t *wheel, uint64_t now_ms) {
+    uint64_t target_tick = now_ms / wheel->tick_ms;
+
+    // Expired timers are collected first so that callbacks can safely
+    // schedule or cancel other timers
+    wheel_timer_t expired;
+    list_init(&expired);
+
+    while (wheel->current_tick <= target_tick) {
+        uint64_t slot = wheel->current_tick & SLOT_MASK;
+
+        if (slot == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                cascade(wheel, level);
+
+                if (((wheel->current_tick >> (TIMER_WHEEL_SLOT_BITS * level)) & SLOT_MASK) != 0) {
+                    break;
+                }
+            }
+        }
+
+        list_splice(&wheel->slots[0][slot], &expired);
+        wheel->current_tick++;
+
+        if (wheel->count == 0) {
+            // Nothing left to fire, jump straight to the target
+            wheel->current_tick = target_tick + 1;
+        }
+    }
+
+    size_t expired_count = 0;
+
+    while (!list_empty(&expired)) {
+        wheel_timer_t *timer = expired.next;
+        list_unlink(timer);
+        wheel->count--;
+        expired_count++;
+
+        timer->callback(timer);
+    }
+
+    return expired_count;
+}
+
+int timer_wheel_next_timeout(timer_wheel_t *wheel, uint64_t now_ms) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    uint64_t next_tick = wheel->current_tick;
+
+    // Look for the next busy slot of the first level, if there is none we
+    // have to wake up when the level wraps to cascade the upper levels
+    for (uint64_t i = 0; (next_tick & SLOT_MASK) != 0 && i < TIMER_WHEEL_SLOTS; i++) {
+        uint64_t tick = wheel->current_tick + i;
+
+        if (!list_empty(&wheel->slots[0][tick & SLOT_MASK])) {
+            next_tick = tick;
+            break;
+        }
+
+        if (((tick + 1) & SLOT_MASK) == 0) {
+            next_tick = tick + 1;
+            break;
+        }
+    }
+
+    uint64_t next_ms = next_tick * wheel->tick_ms;
+    if (next_ms <= now_ms) {
+        return 0;
+    }
+
+    return (int)(next_ms - now_ms);
+}
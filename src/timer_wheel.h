@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel
+//
+// Level 0 has one slot per tick, every upper level has slots that are 64 times
+// larger than the level below. Scheduling and cancelling are O(1), timers of the
+// upper levels are moved down (cascaded) when the level below wraps around.
+//
+// With a 10ms tick the wheel covers 10ms * 64^4 (about 46 hours), timers further
+// away are clamped to the last slot and rescheduled when they cascade.
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+typedef struct WheelTimer wheel_timer_t;
+
+typedef void (*wheel_timer_callback_t)(wheel_timer_t *timer);
+
+// Timers are embedded in the structure they belong to, the wheel never allocates
+struct WheelTimer {
+    wheel_timer_t *next;
+    wheel_timer_t *prev;
+    // Expiration expressed in ticks
+    uint64_t expires;
+    wheel_timer_callback_t callback;
+};
+
+typedef struct TimerWheel {
+    uint64_t tick_ms;
+    // Next tick to be processed
+    uint64_t current_tick;
+    size_t count;
+    // Each slot is the sentinel of a circular doubly linked list
+    wheel_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t tick_ms, uint64_t now_ms);
+
+void wheel_timer_init(wheel_timer_t *timer, wheel_timer_callback_t callback);
+int wheel_timer_pending(wheel_timer_t *timer);
+
+// Schedules (or reschedules) the timer to expire at the absolute time `expires_ms`
+void timer_wheel_schedule(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t expires_ms);
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+
+// Runs the callback of every timer expired up to `now_ms`, returns how many expired
+size_t timer_wheel_advance(timer_wheel_t *wheel, uint64_t now_ms);
+
+// Returns the milliseconds until the wheel needs to be advanced again or -1 if empty
+int timer_wheel_next_timeout(timer_wheel_t *wheel, uint64_t now_ms);
@@ -0,0 +1,484 @@
+#include <errno.h>
+#include <limits.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "clock.h"
+#include "tls.h"
+
+// A new key seals the tickets every period, the previous ones keep opening theirs
+// until they fall off the ring, tickets live as long as their key
+const uint64_t TLS_TICKET_ROTATION_MS = 60 * 60 * 1000;
+static const unsigned char SESSION_ID_CONTEXT[] = "http-server";
+// ALPN protocols in order of preference, each prefixed by its length
+static const unsigned char ALPN_PROTOCOLS[] = "\x02h2\x08http/1.1";
+
+static int generate_ticket_key(tls_ticket_key_t *key, uint64_t now) {
+    if (RAND_bytes(key->name, sizeof(key->name)) != 1 || RAND_bytes(key->aes_key, sizeof(key->aes_key)) != 1 ||
+        RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) != 1) {
+        return -1;
+    }
+
+    key->created_ms = now;
+    return 0;
+}
+
+// Locks a mutex of the shared state, taking it over from a worker that died holding it
+static void lock_shared(pthread_mutex_t *lock) {
+    if (pthread_mutex_lock(lock) == EOWNERDEAD) {
+        // A ring or a slot left half written only fails the resumptions that use it
+        pthread_mutex_consistent(lock);
+    }
+}
+
+static int init_shared_lock(pthread_mutex_t *lock) {
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+
+    int result = pthread_mutex_init(lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    return result == 0 ? 0 : -1;
+}
+
+/**
+ * Maps the ticket keys and the session cache shared by every process, before the workers are forked
+ *
+ * Returns NULL if the state can't be mapped or the first ticket key generated
+ */
+tls_shared_t *create_tls_shared() {
+    // The pages start zeroed, every session slot free
+    tls_shared_t *shared =
+        mmap(NULL, sizeof(tls_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        return NULL;
+    }
+
+    shared->mapped_size = sizeof(tls_shared_t);
+
+    int failed = init_shared_lock(&shared->ticket_lock) == -1;
+    for (int i = 0; i < TLS_SESSION_LOCKS; i++) {
+        failed |= init_shared_lock(&shared->session_locks[i]) == -1;
+    }
+
+    if (failed || generate_ticket_key(&shared->ticket_keys[0], monotonic_ms()) == -1) {
+        munmap(shared, shared->mapped_size);
+        return NULL;
+    }
+    shared->ticket_key_count = 1;
+
+    return shared;
+}
+
+void free_tls_shared(tls_shared_t *shared) {
+    OPENSSL_cleanse(shared->ticket_keys, sizeof(shared->ticket_keys));
+    munmap(shared, shared->mapped_size);
+}
+
+// Must be called with the ticket lock held
+static void rotate_ticket_keys(tls_shared_t *shared) {
+    uint64_t now = monotonic_ms();
+    uint64_t age = now - shared->ticket_keys[0].created_ms;
+
+    if (age < TLS_TICKET_ROTATION_MS) {
+        return;
+    }
+
+    // Keys that would have been rotated out meanwhile are dropped all at once
+    int kept = shared->ticket_key_count < TLS_TICKET_KEYS ? shared->ticket_key_count : TLS_TICKET_KEYS - 1;
+    if (age >= TLS_TICKET_ROTATION_MS * TLS_TICKET_KEYS) {
+        kept = 0;
+    }
+
+    tls_ticket_key_t key;
+    if (generate_ticket_key(&key, now) == -1) {
+        // Keep sealing with the current key rather than failing handshakes
+        return;
+    }
+
+    memmove(&shared->ticket_keys[1], &shared->ticket_keys[0], sizeof(tls_ticket_key_t) * kept);
+    shared->ticket_keys[0] = key;
+    shared->ticket_key_count = kept + 1;
+}
+
+static int set_ticket_mac_key(EVP_MAC_CTX *mac, tls_ticket_key_t *key) {
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac_key, sizeof(key->hmac_key)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end(),
+    };
+
+    return EVP_MAC_CTX_set_params(mac, params) == 1 ? 0 : -1;
+}
+
+/**
+ * Seals (encrypt is 1) or opens a session ticket with the shared key ring
+ *
+Returns
+- -1 on failure
+- 0 if the ticket key is unknown, the client does a full handshake
+- 1 if succeed
+- 2 if the ticket has been opened with an older key, a new ticket is issued
+*/
+static int handle_ticket_key(SSL *ssl, unsigned char key_name[TLS_TICKET_KEY_NAME_SIZE], unsigned char *iv,
+                             EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int encrypt) {
+    tls_context_t *context = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    tls_shared_t *shared = context->shared;
+    tls_ticket_key_t key;
+    int index = -1;
+
+    lock_shared(&shared->ticket_lock);
+    rotate_ticket_keys(shared);
+
+    if (encrypt) {
+        index = 0;
+    } else {
+        for (int i = 0; i < shared->ticket_key_count; i++) {
+            if (memcmp(shared->ticket_keys[i].name, key_name, TLS_TICKET_KEY_NAME_SIZE) == 0) {
+                index = i;
+                break;
+            }
+        }
+    }
+
+    if (index != -1) {
+        key = shared->ticket_keys[index];
+    }
+    pthread_mutex_unlock(&shared->ticket_lock);
+
+    if (index == -1) {
+        return 0;
+    }
+
+    if (encrypt) {
+        memcpy(key_name, key.name, TLS_TICKET_KEY_NAME_SIZE);
+
+        if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1 ||
+            EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1 ||
+            set_ticket_mac_key(mac, &key) == -1) {
+            return -1;
+        }
+
+        return 1;
+    }
+
+    if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1 ||
+        set_ticket_mac_key(mac, &key) == -1) {
+        return -1;
+    }
+
+    return index == 0 ? 1 : 2;
+}
+
+static size_t get_session_slot(const unsigned char *id, unsigned int id_length) {
+    // FNV-1a, session ids are random
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned int i = 0; i < id_length; i++) {
+        hash = (hash ^ id[i]) * 1099511628211ULL;
+    }
+
+    return hash % TLS_SESSION_SLOTS;
+}
+
+// Encodes a new session in the slot of its id, OpenSSL keeps its own reference
+static int store_session(SSL *ssl, SSL_SESSION *session) {
+    tls_context_t *context = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    unsigned int id_length;
+    const unsigned char *id = SSL_SESSION_get_id(session, &id_length);
+
+    int length = i2d_SSL_SESSION(session, NULL);
+    if (length <= 0 || length > TLS_SESSION_MAX_SIZE || id_length > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+        return 0;
+    }
+
+    size_t index = get_session_slot(id, id_length);
+    tls_session_slot_t *slot = &context->shared->sessions[index];
+    pthread_mutex_t *lock = &context->shared->session_locks[index % TLS_SESSION_LOCKS];
+    unsigned char *data = slot->data;
+
+    lock_shared(lock);
+    memcpy(slot->id, id, id_length);
+    slot->id_length = id_length;
+    slot->expires_ms = monotonic_ms() + (uint64_t)SSL_SESSION_get_timeout(session) * 1000;
+    int written = i2d_SSL_SESSION(session, &data);
+    slot->length = written > 0 ? written : 0;
+    pthread_mutex_unlock(lock);
+
+    return 0;
+}
+
+// Decodes the session of an id from its slot, stored by any worker. NULL if it is unknown or expired
+static SSL_SESSION *find_session(SSL *ssl, const unsigned char *id, int id_length, int *copy) {
+    tls_context_t *context = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    size_t index = get_session_slot(id, id_length);
+    tls_session_slot_t *slot = &context->shared->sessions[index];
+    pthread_mutex_t *lock = &context->shared->session_locks[index % TLS_SESSION_LOCKS];
+    unsigned char data[TLS_SESSION_MAX_SIZE];
+    unsigned int length = 0;
+
+    // The session is decoded out of the lock, it is a fresh one the caller owns
+    *copy = 0;
+
+    lock_shared(lock);
+    if (slot->length > 0 && slot->length <= TLS_SESSION_MAX_SIZE && slot->id_length == (unsigned int)id_length &&
+        memcmp(slot->id, id, id_length) == 0 && slot->expires_ms > monotonic_ms()) {
+        length = slot->length;
+        memcpy(data, slot->data, length);
+    }
+    pthread_mutex_unlock(lock);
+
+    const unsigned char *input = data;
+    return length > 0 ? d2i_SSL_SESSION(NULL, &input, length) : NULL;
+}
+
+static void remove_session(SSL_CTX *ssl_context, SSL_SESSION *session) {
+    tls_context_t *context = SSL_CTX_get_app_data(ssl_context);
+    unsigned int id_length;
+    const unsigned char *id = SSL_SESSION_get_id(session, &id_length);
+    size_t index = get_session_slot(id, id_length);
+    tls_session_slot_t *slot = &context->shared->sessions[index];
+    pthread_mutex_t *lock = &context->shared->session_locks[index % TLS_SESSION_LOCKS];
+
+    lock_shared(lock);
+    if (slot->id_length == id_length && memcmp(slot->id, id, id_length) == 0) {
+        slot->length = 0;
+    }
+    pthread_mutex_unlock(lock);
+}
+
+static int select_protocol(SSL *ssl, const unsigned char **out, unsigned char *out_length, const unsigned char *in,
+                           unsigned int in_length, void *arg) {
+    (void)ssl;
+    (void)arg;
+
+    if (SSL_select_next_proto((unsigned char **)out, out_length, ALPN_PROTOCOLS, sizeof(ALPN_PROTOCOLS) - 1, in,
+                              in_length) != OPENSSL_NPN_NEGOTIATED) {
+        // No protocol in common, the connection goes on without ALPN
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Loads the certificate chain and the private key (PEM files) in a server context,
+ * resuming the sessions of the shared state
+ *
+ * Returns NULL on failure, the OpenSSL errors are printed
+ */
+tls_context_t *create_tls_context(char *certificate_path, char *key_path, tls_shared_t *shared) {
+    tls_context_t *context = calloc(1, sizeof(tls_context_t));
+    if (context == NULL) {
+        return NULL;
+    }
+
+    context->shared = shared;
+
+    SSL_CTX *ssl_context = SSL_CTX_new(TLS_server_method());
+    if (ssl_context == NULL) {
+        free_tls_context(context);
+        return NULL;
+    }
+    context->ssl_context = ssl_context;
+    SSL_CTX_set_app_data(ssl_context, context);
+
+    SSL_CTX_set_min_proto_version(ssl_context, TLS1_2_VERSION);
+    // Clients closing without close_notify are a plain end of stream, as they are for HTTP
+    SSL_CTX_set_options(ssl_context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE |
+                                         SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // Idle keep-alive connections don't hold their record buffers
+    SSL_CTX_set_mode(ssl_context,
+                     SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    // Only the shared cache, the internal one of a worker would miss the sessions of the others
+    SSL_CTX_set_session_cache_mode(ssl_context, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ssl_context, store_session);
+    SSL_CTX_sess_set_get_cb(ssl_context, find_session);
+    SSL_CTX_sess_set_remove_cb(ssl_context, remove_session);
+    SSL_CTX_set_session_id_context(ssl_context, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+    SSL_CTX_set_timeout(ssl_context, TLS_TICKET_ROTATION_MS * TLS_TICKET_KEYS / 1000);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_context, handle_ticket_key);
+
+    SSL_CTX_set_alpn_select_cb(ssl_context, select_protocol, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(ssl_context, certificate_path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ssl_context, key_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ssl_context) != 1) {
+        ERR_print_errors_fp(stdout);
+        free_tls_context(context);
+        return NULL;
+    }
+
+    return context;
+}
+
+void free_tls_context(tls_context_t *context) {
+    if (context->ssl_context != NULL) {
+        SSL_CTX_free(context->ssl_context);
+    }
+
+    free(context);
+}
+
+/**
+ * Starts the server side of a TLS connection on an accepted socket,
+ * the handshake goes on with the first reads
+ *
+ * Returns NULL on failure
+ */
+tls_connection_t *create_tls_connection(tls_context_t *context, int fd) {
+    tls_connection_t *tls = calloc(1, sizeof(tls_connection_t));
+    if (tls == NULL) {
+        return NULL;
+    }
+
+    tls->ssl = SSL_new(context->ssl_context);
+    if (tls->ssl == NULL || SSL_set_fd(tls->ssl, fd) != 1) {
+        free_tls_connection(tls);
+        return NULL;
+    }
+
+    SSL_set_accept_state(tls->ssl);
+    return tls;
+}
+
+// Sends close_notify when the session is still sound, without waiting for the one of the peer
+void free_tls_connection(tls_connection_t *tls) {
+    if (tls->ssl != NULL) {
+        if (!tls->failed && SSL_is_init_finished(tls->ssl)) {
+            SSL_shutdown(tls->ssl);
+        }
+        SSL_free(tls->ssl);
+    }
+
+    free(tls->pending);
+    free(tls);
+}
+
+// Maps the outcome of SSL_read or SSL_write, errno is EAGAIN when the socket has to be waited for
+static int handle_ssl_error(tls_connection_t *tls, int result) {
+    switch (SSL_get_error(tls->ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+
+    case SSL_ERROR_SYSCALL:
+        tls->failed = 1;
+        if (errno == 0) {
+            errno = EIO;
+        }
+        return -1;
+
+    default:
+        tls->failed = 1;
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+/**
+ * Reads decrypted bytes, the handshake is carried out by the first reads
+ *
+ * A length of TLS_MAX_RECORD_SIZE at least makes sure that no decrypted bytes are left buffered.
+ * When the handshake has to write and the socket is full, read_wants_write is set and
+ * the read must be retried once the socket is writable.
+ *
+Returns
+- -1 on failure, errno is EAGAIN when there is nothing to read for now
+- 0 if the peer closed the connection
+- otherwise the number of bytes read
+*/
+ssize_t tls_read(tls_connection_t *tls, char *data, size_t length) {
+    tls->read_wants_write = 0;
+
+    ERR_clear_error();
+    errno = 0;
+    int result = SSL_read(tls->ssl, data, length > INT_MAX ? INT_MAX : length);
+
+    if (result > 0) {
+        return result;
+    }
+
+    if (SSL_get_error(tls->ssl, result) == SSL_ERROR_WANT_WRITE) {
+        tls->read_wants_write = 1;
+    }
+
+    return handle_ssl_error(tls, result);
+}
+
+/**
+ * Sends the queue, straight to the socket with kTLS or through SSL_write otherwise
+ *
+Returns
+- -1 if the connection failed
+- 0 if the socket is full and we have to wait for it to be writable
+- 1 if the queue has been fully sent
+*/
+int tls_flush(tls_connection_t *tls, output_queue_t *queue, int socket_fd) {
+    if (!tls->handshake_done && SSL_is_init_finished(tls->ssl)) {
+        tls->handshake_done = 1;
+        tls->ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) == 1;
+    }
+
+    if (tls->ktls_send) {
+        return output_queue_flush(queue, socket_fd);
+    }
+
+    while (1) {
+        if (tls->pending_offset == tls->pending_length) {
+            if (output_queue_empty(queue)) {
+                // Keep-alive connections don't hold on the buffer between responses
+                free(tls->pending);
+                tls->pending = NULL;
+                tls->pending_offset = 0;
+                tls->pending_length = 0;
+                return 1;
+            }
+
+            if (tls->pending == NULL) {
+                tls->pending = malloc(TLS_MAX_RECORD_SIZE);
+                if (tls->pending == NULL) {
+                    return -1;
+                }
+            }
+
+            ssize_t read_result = output_queue_read(queue, tls->pending, TLS_MAX_RECORD_SIZE);
+            if (read_result == -1) {
+                return errno == EAGAIN ? 0 : -1;
+            }
+
+            tls->pending_offset = 0;
+            tls->pending_length = read_result;
+        }
+
+        ERR_clear_error();
+        errno = 0;
+        int written =
+            SSL_write(tls->ssl, tls->pending + tls->pending_offset, tls->pending_length - tls->pending_offset);
+
+        if (written > 0) {
+            tls->pending_offset += written;
+            continue;
+        }
+
+        return handle_ssl_error(tls, written) == -1 && errno == EAGAIN ? 0 : -1;
+    }
+}
+
+// Output already taken from the queue but not written yet
+int tls_output_pending(tls_connection_t *tls) {
+    return tls->pending_offset < tls->pending_length;
+}
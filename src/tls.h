@@ -0,0 +1,105 @@
+#pragma once
+
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "output_queue.h"
+
+// TLS termination of the listener with OpenSSL
+//
+// A single context is shared by the worker threads of a process, and its resumption
+// state by every process: it is mapped before the prefork workers are forked, so a
+// client resumes whichever worker gets its next connection. Resumption is cheap both ways:
+// - session tickets are sealed with keys of our own that rotate periodically, the
+//   previous keys still open the tickets issued with them (and ask for a fresh one)
+// - clients without tickets resume from the shared session cache, a slot per session
+//   id hash holding the encoded session
+// A worker dying while it holds a lock of the shared state leaves it usable (robust mutexes).
+//
+// Every connection reads with SSL_read. The output goes to the socket with the kernel
+// TLS (kTLS) when OpenSSL could enable it, so files are still sent with sendfile()
+// and pipes spliced, otherwise it is moved through a record sized buffer to SSL_write.
+//
+// ALPN selects h2 when the client offers it, the connection then starts with the
+// HTTP/2 preface and is served as prior knowledge (see http2.h).
+
+// Largest plaintext of a TLS record, reading that much at once never leaves
+// decrypted bytes behind in OpenSSL that epoll wouldn't tell us about
+#define TLS_MAX_RECORD_SIZE 16384
+
+#define TLS_TICKET_KEY_NAME_SIZE 16
+// Current key and the previous ones still accepted
+#define TLS_TICKET_KEYS 3
+
+// Sessions of the clients without tickets, a new one replaces the one of its slot
+#define TLS_SESSION_SLOTS (16 * 1024)
+#define TLS_SESSION_LOCKS 64
+// Largest encoded session kept, a session without client certificate takes a few hundred bytes
+#define TLS_SESSION_MAX_SIZE 512
+
+typedef struct TlsTicketKey {
+    unsigned char name[TLS_TICKET_KEY_NAME_SIZE];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    uint64_t created_ms;
+} tls_ticket_key_t;
+
+typedef struct TlsSessionSlot {
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned int id_length;
+    uint64_t expires_ms;
+    // 0 when the slot is free
+    unsigned int length;
+    unsigned char data[TLS_SESSION_MAX_SIZE];
+} tls_session_slot_t;
+
+// Mapped shared before the workers are forked, every process seals and opens with the same keys
+typedef struct TlsSharedState {
+    size_t mapped_size;
+
+    pthread_mutex_t ticket_lock;
+    // Newest first, only the first one seals new tickets
+    tls_ticket_key_t ticket_keys[TLS_TICKET_KEYS];
+    int ticket_key_count;
+
+    // Slot i is guarded by lock i % TLS_SESSION_LOCKS
+    pthread_mutex_t session_locks[TLS_SESSION_LOCKS];
+    tls_session_slot_t sessions[TLS_SESSION_SLOTS];
+} tls_shared_t;
+
+typedef struct TlsContext {
+    SSL_CTX *ssl_context;
+    tls_shared_t *shared;
+} tls_context_t;
+
+typedef struct TlsConnection {
+    SSL *ssl;
+    int handshake_done;
+    // Set once the handshake is done and the kernel encrypts what we write to the socket
+    int ktls_send;
+    // The session can't be shut down cleanly anymore (socket or protocol error)
+    int failed;
+    // SSL_read needs the socket to be writable (handshake messages) before reading again
+    int read_wants_write;
+
+    // Output taken from the queue, SSL_write has to be retried with it when blocked
+    char *pending;
+    size_t pending_offset;
+    size_t pending_length;
+} tls_connection_t;
+
+tls_shared_t *create_tls_shared();
+void free_tls_shared(tls_shared_t *shared);
+
+tls_context_t *create_tls_context(char *certificate_path, char *key_path, tls_shared_t *shared);
+void free_tls_context(tls_context_t *context);
+
+tls_connection_t *create_tls_connection(tls_context_t *context, int fd);
+void free_tls_connection(tls_connection_t *tls);
+
+ssize_t tls_read(tls_connection_t *tls, char *data, size_t length);
+int tls_flush(tls_connection_t *tls, output_queue_t *queue, int socket_fd);
+int tls_output_pending(tls_connection_t *tls);
@@ -0,0 +1,640 @@
+#include <errno.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "config.h"
+#include "http/headers.h"
+#include "http/status.h"
+#include "str.h"
+#include "websocket.h"
+
+// Appended to the key of the client before hashing it (RFC 6455 section 1.3)
+static const char WEBSOCKET_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+// Base64 of the 16 random bytes of Sec-WebSocket-Key
+#define WEBSOCKET_KEY_LENGTH 24
+
+// Frames sent by the server are not masked, 2 bytes and a 64 bits length at most
+#define FRAME_MAX_HEADER_SIZE 10
+
+// Control frames carry at most this much, without fragmentation
+#define CONTROL_MAX_PAYLOAD 125
+
+// Output above which we stop reading frames, the socket flush resumes it
+const size_t WEBSOCKET_OUTPUT_LIMIT = 256 * 1024;
+
+/**
+ * XORs the payload of a client frame with its masking key, 16 or 32 bytes at a time
+ * when SSE2 or AVX2 are available, then 8 bytes at a time
+ *
+ * The key is repeated in the wide words in memory order, so every block starts on a
+ * multiple of 4 bytes and the tail goes on with the right key byte.
+ */
+void websocket_unmask(uint8_t *data, size_t length, const uint8_t mask[4]) {
+    uint32_t key;
+    memcpy(&key, mask, sizeof(key));
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    __m256i key256 = _mm256_set1_epi32((int)key);
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((__m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(block, key256));
+    }
+#endif
+
+#if defined(__SSE2__)
+    __m128i key128 = _mm_set1_epi32((int)key);
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((__m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(block, key128));
+    }
+#endif
+
+    uint64_t key64 = ((uint64_t)key << 32) | key;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        word ^= key64;
+        memcpy(data + i, &word, sizeof(word));
+    }
+
+    for (; i < length; i++) {
+        data[i] ^= mask[i & 3];
+    }
+}
+
+// Returns 1 if data is well formed UTF-8 (no overlong forms, surrogates or code points above U+10FFFF)
+static int is_valid_utf8(const uint8_t *data, size_t length) {
+    size_t i = 0;
+
+    while (i < length) {
+        // ASCII runs are skipped 8 bytes at a time
+        if (i + 8 <= length) {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+            if ((word & 0x8080808080808080ull) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+
+        uint8_t c = data[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+
+        size_t continuation;
+        uint32_t code_point;
+        uint32_t minimum;
+
+        if ((c & 0xe0) == 0xc0) {
+            continuation = 1;
+            code_point = c & 0x1f;
+            minimum = 0x80;
+        } else if ((c & 0xf0) == 0xe0) {
+            continuation = 2;
+            code_point = c & 0x0f;
+            minimum = 0x800;
+        } else if ((c & 0xf8) == 0xf0) {
+            continuation = 3;
+            code_point = c & 0x07;
+            minimum = 0x10000;
+        } else {
+            return 0;
+        }
+
+        if (length - i <= continuation) {
+            return 0;
+        }
+
+        for (size_t j = 1; j <= continuation; j++) {
+            if ((data[i + j] & 0xc0) != 0x80) {
+                return 0;
+            }
+            code_point = (code_point << 6) | (data[i + j] & 0x3f);
+        }
+
+        if (code_point < minimum || code_point > 0x10ffff || (code_point >= 0xd800 && code_point <= 0xdfff)) {
+            return 0;
+        }
+
+        i += continuation + 1;
+    }
+
+    return 1;
+}
+
+// Returns the size of the header written for a final frame of `length` bytes
+static size_t encode_frame_header(uint8_t *header, websocket_opcode_t opcode, size_t length) {
+    header[0] = 0x80 | opcode;
+
+    if (length < 126) {
+        header[1] = length;
+        return 2;
+    }
+
+    if (length <= 0xffff) {
+        header[1] = 126;
+        header[2] = length >> 8;
+        header[3] = length;
+        return 4;
+    }
+
+    header[1] = 127;
+    for (int i = 0; i < 8; i++) {
+        header[2 + i] = (uint64_t)length >> (56 - 8 * i);
+    }
+    return 10;
+}
+
+/**
+ * Upgrades are only taken for HTTP/1.1 GET requests without body, as RFC 6455 section 4.1 requires
+ *
+ * Returns 1 if the request opens a WebSocket, otherwise 0
+ */
+int is_websocket_request(request_t *request) {
+    return strcmp(request->method, "GET") == 0 && is_http_1_1_request(request) && !request->chunked &&
+           request->content_length == 0 && has_header_token(request->headers, "Upgrade", "websocket") &&
+           has_header_token(request->headers, "Connection", "Upgrade") &&
+           find_header(request->headers, "Sec-WebSocket-Key") != NULL;
+}
+
+// Refuses a handshake, clients speaking another version are told the one we support
+static int reject_handshake(connection_t *connection, request_t *request) {
+    header_list_t *headers = create_header_list(1);
+    if (headers == NULL || append_header_list(headers, create_header("Sec-WebSocket-Version", "13")) == -1) {
+        if (headers != NULL) {
+            free_header_list(headers);
+        }
+        return -1;
+    }
+
+    response_t response = {
+        .status = BAD_REQUEST,
+        .headers = headers,
+        .body = get_status_string(BAD_REQUEST),
+        .closing = 1,
+    };
+    response.body_length = strlen(response.body);
+
+    string_t *result = create_response(request, &response);
+    free_header_list(headers);
+
+    connection_end_keep_alive(connection);
+    return connection_send_string(connection, result);
+}
+
+/**
+ * Answers the handshake with 101 (Switching Protocols), the connection reads frames
+ * once the request is done and hands their messages to handler
+ *
+ * Invalid handshakes are answered with 400. Connections of an HTTP/2 stream can't be
+ * upgraded (RFC 8441 is not supported) and are refused the same way.
+ *
+Returns
+- -1 if append fails, the connection has to be closed
+- 0 if succeed
+*/
+int websocket_accept(connection_t *connection, request_t *request, websocket_handler_t *handler) {
+    header_t *version = find_header(request->headers, "Sec-WebSocket-Version");
+    header_t *key = find_header(request->headers, "Sec-WebSocket-Key");
+
+    if (connection->http2_stream != NULL || !is_websocket_request(request) || version == NULL ||
+        strcmp(version->value, "13") != 0 || strlen(key->value) != WEBSOCKET_KEY_LENGTH) {
+        if (handler->release != NULL) {
+            handler->release(handler->state);
+        }
+        return reject_handshake(connection, request);
+    }
+
+    char challenge[WEBSOCKET_KEY_LENGTH + sizeof(WEBSOCKET_GUID)];
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    // Base64 of the digest and its null terminator
+    unsigned char accept[(SHA_DIGEST_LENGTH + 2) / 3 * 4 + 1];
+
+    memcpy(challenge, key->value, WEBSOCKET_KEY_LENGTH);
+    memcpy(challenge + WEBSOCKET_KEY_LENGTH, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+    SHA1((unsigned char *)challenge, WEBSOCKET_KEY_LENGTH + sizeof(WEBSOCKET_GUID) - 1, digest);
+    EVP_EncodeBlock(accept, digest, SHA_DIGEST_LENGTH);
+
+    websocket_t *websocket = calloc(1, sizeof(websocket_t));
+    string_t *response = create_string(160);
+    char *status_code = int_to_str(SWITCHING_PROTOCOLS);
+
+    int failed = websocket == NULL || response == NULL || status_code == NULL ||
+                 append_string(response, "HTTP/1.1 ") == -1 || append_string(response, status_code) == -1 ||
+                 append_string(response, " ") == -1 ||
+                 append_string(response, get_status_string(SWITCHING_PROTOCOLS)) == -1 ||
+                 append_string(response, "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ") ==
+                     -1 ||
+                 append_string(response, (char *)accept) == -1 || append_string(response, "\r\n\r\n") == -1;
+
+    free(status_code);
+
+    if (failed) {
+        free(websocket);
+        if (response != NULL) {
+            free_string(response);
+        }
+        if (handler->release != NULL) {
+            handler->release(handler->state);
+        }
+        return -1;
+    }
+
+    websocket->handler = *handler;
+    connection->websocket = websocket;
+
+    return connection_send_string(connection, response);
+}
+
+/**
+ * Queues a final frame, frames are dropped once the close frame has been sent
+ *
+Returns
+- -1 if append fails
+- 0 if succeed
+*/
+int websocket_send(connection_t *connection, websocket_opcode_t opcode, char *data, size_t length) {
+    websocket_t *websocket = connection->websocket;
+    if (websocket->close_sent) {
+        return 0;
+    }
+
+    char *frame = malloc(FRAME_MAX_HEADER_SIZE + length);
+    if (frame == NULL) {
+        return -1;
+    }
+
+    size_t header_length = encode_frame_header((uint8_t *)frame, opcode, length);
+    if (length > 0) {
+        memcpy(frame + header_length, data, length);
+    }
+
+    return output_queue_push_buffer(&connection->output, frame, header_length + length);
+}
+
+/**
+ * Queues a close frame and stops reading, the connection is closed once it is sent
+ *
+Returns
+- -1 if append fails
+- 0 if succeed
+*/
+int websocket_close(connection_t *connection, websocket_close_code_t code) {
+    char payload[2] = {code >> 8, code & 0xff};
+
+    int result = websocket_send(connection, WEBSOCKET_CLOSE, payload, sizeof(payload));
+    connection->websocket->close_sent = 1;
+    connection->state = CONNECTION_CLOSING;
+
+    return result;
+}
+
+/**
+ * Closes with `code` after a violation of the peer
+ *
+ * Returns -1 if the connection has been closed, otherwise 0
+ */
+static int fail_websocket(connection_t *connection, websocket_close_code_t code) {
+    if (websocket_close(connection, code) == -1) {
+        close_connection(connection);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Codes a peer may send (RFC 6455 section 7.4)
+static int is_valid_close_code(int code) {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) || (code >= 3000 && code <= 4999);
+}
+
+/**
+Returns
+- -1 if the connection has been closed
+- 0 if succeed
+*/
+static int deliver_message(connection_t *connection, websocket_opcode_t opcode, char *data, size_t length) {
+    websocket_t *websocket = connection->websocket;
+
+    if (opcode == WEBSOCKET_TEXT && !is_valid_utf8((uint8_t *)data, length)) {
+        return fail_websocket(connection, WEBSOCKET_CLOSE_INVALID_DATA);
+    }
+
+    if (websocket->handler.on_message(connection, opcode, data, length, websocket->handler.state) == -1) {
+        close_connection(connection);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+Returns
+- -1 if the connection has been closed
+- 0 if succeed
+*/
+static int handle_control_frame(connection_t *connection, websocket_opcode_t opcode, char *payload, size_t length) {
+    if (opcode == WEBSOCKET_PING) {
+        if (websocket_send(connection, WEBSOCKET_PONG, payload, length) == -1) {
+            close_connection(connection);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (opcode == WEBSOCKET_PONG) {
+        return 0;
+    }
+
+    // Close, answered with the code of the peer
+    int code = WEBSOCKET_CLOSE_NORMAL;
+
+    if (length == 1) {
+        code = WEBSOCKET_CLOSE_PROTOCOL_ERROR;
+    } else if (length >= 2) {
+        int received = ((uint8_t)payload[0] << 8) | (uint8_t)payload[1];
+
+        if (!is_valid_close_code(received)) {
+            code = WEBSOCKET_CLOSE_PROTOCOL_ERROR;
+        } else if (!is_valid_utf8((uint8_t *)payload + 2, length - 2)) {
+            code = WEBSOCKET_CLOSE_INVALID_DATA;
+        } else {
+            code = received;
+        }
+    }
+
+    return fail_websocket(connection, code);
+}
+
+/**
+ * Gathers the fragments of data messages, complete messages go to the handler
+ *
+Returns
+- -1 if the connection has been closed
+- 0 if succeed
+*/
+static int handle_data_frame(connection_t *connection, int final, websocket_opcode_t opcode, char *payload,
+                             size_t length) {
+    websocket_t *websocket = connection->websocket;
+
+    // A continuation needs a started message, and a new message can't start in the middle of one
+    if ((opcode == WEBSOCKET_CONTINUATION) != (websocket->message_opcode != 0)) {
+        return fail_websocket(connection, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+    }
+
+    // Unfragmented messages are handed over in place
+    if (final && opcode != WEBSOCKET_CONTINUATION) {
+        return deliver_message(connection, opcode, payload, length);
+    }
+
+    if (websocket->message_length + length > websocket->message_capacity) {
+        size_t new_capacity = websocket->message_capacity * 2;
+        if (new_capacity < websocket->message_length + length) {
+            new_capacity = websocket->message_length + length;
+        }
+
+        char *message = realloc(websocket->message, new_capacity);
+        if (message == NULL) {
+            close_connection(connection);
+            return -1;
+        }
+
+        websocket->message = message;
+        websocket->message_capacity = new_capacity;
+    }
+
+    memcpy(websocket->message + websocket->message_length, payload, length);
+    websocket->message_length += length;
+
+    if (opcode != WEBSOCKET_CONTINUATION) {
+        websocket->message_opcode = opcode;
+    }
+
+    if (!final) {
+        return 0;
+    }
+
+    websocket_opcode_t message_opcode = websocket->message_opcode;
+    size_t message_length = websocket->message_length;
+    websocket->message_opcode = 0;
+    websocket->message_length = 0;
+
+    return deliver_message(connection, message_opcode, websocket->message, message_length);
+}
+
+/**
+ * Handles the frames received, messages are delivered as they complete
+ *
+ * Messages above the largest accepted body are refused with 1009 as soon as their
+ * frame header arrives. Reading stops while the output is above its limit.
+ *
+ * Returns -1 if the connection has been closed, otherwise 0
+ */
+int websocket_input(connection_t *connection) {
+    websocket_t *websocket = connection->websocket;
+    size_t offset = 0;
+
+    while (connection->state == CONNECTION_WEBSOCKET && !connection->reading_paused) {
+        uint8_t *frame = (uint8_t *)connection->buffer + offset;
+        size_t available = connection->buffer_length - offset;
+
+        if (available < 2) {
+            break;
+        }
+
+        int final = frame[0] & 0x80;
+        websocket_opcode_t opcode = frame[0] & 0x0f;
+        uint64_t length = frame[1] & 0x7f;
+        size_t header_length = 2;
+
+        if (length == 126) {
+            if (available < 4) {
+                break;
+            }
+            length = (frame[2] << 8) | frame[3];
+            header_length = 4;
+        } else if (length == 127) {
+            if (available < 10) {
+                break;
+            }
+            length = 0;
+            for (int i = 0; i < 8; i++) {
+                length = (length << 8) | frame[2 + i];
+            }
+            header_length = 10;
+        }
+
+        int control = opcode & 0x8;
+        int known = opcode <= WEBSOCKET_BINARY || (opcode >= WEBSOCKET_CLOSE && opcode <= WEBSOCKET_PONG);
+
+        // No extension is negotiated so the reserved bits are never set, and clients always mask
+        if ((frame[0] & 0x70) != 0 || !(frame[1] & 0x80) || !known ||
+            (control && (!final || length > CONTROL_MAX_PAYLOAD))) {
+            if (fail_websocket(connection, WEBSOCKET_CLOSE_PROTOCOL_ERROR) == -1) {
+                return -1;
+            }
+            break;
+        }
+
+        if (!control && length > server_config.max_body_size - websocket->message_length) {
+            if (fail_websocket(connection, WEBSOCKET_CLOSE_TOO_BIG) == -1) {
+                return -1;
+            }
+            break;
+        }
+
+        // Masking key
+        header_length += 4;
+
+        if (available < header_length + length) {
+            break;
+        }
+
+        char *payload = (char *)frame + header_length;
+        websocket_unmask((uint8_t *)payload, length, frame + header_length - 4);
+        offset += header_length + length;
+
+        // Any frame shows the peer is alive
+        websocket->ping_pending = 0;
+
+        int result = control ? handle_control_frame(connection, opcode, payload, length)
+                             : handle_data_frame(connection, final, opcode, payload, length);
+        if (result == -1) {
+            return -1;
+        }
+
+        if (connection->output.buffered_bytes >= WEBSOCKET_OUTPUT_LIMIT) {
+            connection->reading_paused = 1;
+        }
+    }
+
+    // Driven without any input when the server drains, the buffer may not even exist
+    if (offset > 0) {
+        connection->buffer_length -= offset;
+        memmove(connection->buffer, connection->buffer + offset, connection->buffer_length);
+    }
+
+    return 0;
+}
+
+/**
+ * Called on the keep-alive deadline, pings the peer unless the previous ping went unanswered
+ *
+ * Returns -1 when the connection has to be closed, otherwise 0
+ */
+int websocket_keep_alive(connection_t *connection) {
+    websocket_t *websocket = connection->websocket;
+
+    if (websocket->ping_pending || websocket_send(connection, WEBSOCKET_PING, NULL, 0) == -1) {
+        return -1;
+    }
+
+    websocket->ping_pending = 1;
+    return 0;
+}
+
+// Called when the connection is closed
+void free_websocket(connection_t *connection) {
+    websocket_t *websocket = connection->websocket;
+
+    broadcast_unsubscribe(&websocket->subscription);
+
+    if (websocket->handler.release != NULL) {
+        websocket->handler.release(websocket->handler.state);
+    }
+
+    free(websocket->message);
+    free(websocket);
+    connection->websocket = NULL;
+}
+
+/**
+ * Subscribes an accepted WebSocket connection to the broadcasts of hub,
+ * until it is closed
+ *
+Returns
+- -1 on failure
+- 0 if succeed
+*/
+int websocket_subscribe(connection_t *connection, broadcast_hub_t *hub) {
+    websocket_t *websocket = connection->websocket;
+    if (websocket == NULL || websocket->subscription.group != NULL) {
+        return -1;
+    }
+
+    websocket->subscription.framed = 1;
+    return broadcast_subscribe(hub, &websocket->subscription, connection);
+}
+
+/**
+ * Sends a message to every WebSocket subscribed to hub, can be called from any thread
+ *
+Returns
+- -1 if the frame can't be allocated or a group missed it
+- 0 if succeed
+*/
+int websocket_broadcast(broadcast_hub_t *hub, websocket_opcode_t opcode, char *data, size_t length) {
+    uint8_t header[FRAME_MAX_HEADER_SIZE];
+    size_t header_length = encode_frame_header(header, opcode, length);
+
+    shared_buffer_t *frame = create_shared_buffer(header_length + length);
+    if (frame == NULL) {
+        return -1;
+    }
+
+    memcpy(frame->data, header, header_length);
+    if (length > 0) {
+        memcpy(frame->data + header_length, data, length);
+    }
+
+    broadcast_message_t message = {.buffer = frame, .offset = header_length, .length = length};
+    int result = broadcast_publish(hub, &message);
+
+    release_shared_buffer(frame);
+    return result;
+}
+
+static int relay_message(connection_t *connection, websocket_opcode_t opcode, char *data, size_t length,
+                         void *state) {
+    (void)connection;
+    broadcast_hub_t *hub = state;
+
+    return websocket_broadcast(hub, opcode, data, length);
+}
+
+/**
+ * Request handler of a relay: every client of the hub given as arg receives the
+ * messages sent by any of them (a publisher pushing to live dashboards)
+ *
+ * Returns -1 to close the connection, otherwise 0
+ */
+int websocket_relay_request(connection_t *connection, request_t *request, void *arg) {
+    broadcast_hub_t *hub = arg;
+    websocket_handler_t handler = {.on_message = relay_message, .state = hub};
+
+    if (websocket_accept(connection, request, &handler) == -1) {
+        return -1;
+    }
+
+    // Refused handshakes got their response
+    if (connection->websocket == NULL) {
+        return 0;
+    }
+
+    return websocket_subscribe(connection, hub);
+}
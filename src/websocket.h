@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "broadcast.h"
+#include "connection.h"
+#include "http/http.h"
+
+// WebSocket connections (RFC 6455), upgraded from a GET request by its handler
+//
+// Once the 101 response is queued the connection reads frames instead of requests.
+// Frames are unmasked in place in the read buffer, unfragmented messages are handed
+// to the handler without copy, fragmented ones are gathered first. Pings are answered
+// and the connection timer pings an idle peer, which has to show up before the next
+// deadline.
+//
+// Connections subscribe to broadcast hubs (see broadcast.h), a broadcast encodes its
+// frame once and every subscriber queues the same buffer.
+
+typedef enum WebSocketOpcode {
+    WEBSOCKET_CONTINUATION = 0x0,
+    WEBSOCKET_TEXT = 0x1,
+    WEBSOCKET_BINARY = 0x2,
+    WEBSOCKET_CLOSE = 0x8,
+    WEBSOCKET_PING = 0x9,
+    WEBSOCKET_PONG = 0xa,
+} websocket_opcode_t;
+
+// Status codes of close frames
+typedef enum WebSocketCloseCode {
+    WEBSOCKET_CLOSE_NORMAL = 1000,
+    WEBSOCKET_CLOSE_GOING_AWAY = 1001,
+    WEBSOCKET_CLOSE_PROTOCOL_ERROR = 1002,
+    WEBSOCKET_CLOSE_INVALID_DATA = 1007,
+    WEBSOCKET_CLOSE_POLICY_VIOLATION = 1008,
+    WEBSOCKET_CLOSE_TOO_BIG = 1009,
+} websocket_close_code_t;
+
+/**
+ * Receives the messages of a WebSocket connection
+ *
+ * on_message is called with every complete text or binary message, the data is only
+ * valid during the call. It returns -1 to close the connection, otherwise 0
+ */
+typedef struct WebSocketHandler {
+    int (*on_message)(connection_t *connection, websocket_opcode_t opcode, char *data, size_t length, void *state);
+    // Called once the connection is closed, can be NULL
+    void (*release)(void *state);
+    void *state;
+} websocket_handler_t;
+
+typedef struct WebSocket {
+    websocket_handler_t handler;
+
+    // Fragments of the message being received, its opcode is 0 when there is none
+    websocket_opcode_t message_opcode;
+    char *message;
+    size_t message_length;
+    size_t message_capacity;
+
+    // A ping went out on the keep-alive deadline, the peer has until the next one to answer
+    int ping_pending;
+    int close_sent;
+
+    // Set once subscribed to a hub, subscribers take whole frames
+    broadcast_subscriber_t subscription;
+} websocket_t;
+
+int is_websocket_request(request_t *request);
+int websocket_accept(connection_t *connection, request_t *request, websocket_handler_t *handler);
+int websocket_input(connection_t *connection);
+int websocket_keep_alive(connection_t *connection);
+void free_websocket(connection_t *connection);
+
+int websocket_send(connection_t *connection, websocket_opcode_t opcode, char *data, size_t length);
+int websocket_close(connection_t *connection, websocket_close_code_t code);
+void websocket_unmask(uint8_t *data, size_t length, const uint8_t mask[4]);
+
+int websocket_subscribe(connection_t *connection, broadcast_hub_t *hub);
+int websocket_broadcast(broadcast_hub_t *hub, websocket_opcode_t opcode, char *data, size_t length);
+int websocket_relay_request(connection_t *connection, request_t *request, void *arg);
@@ -0,0 +1,265 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "../src/fs.h"
+#include "../src/http/content-type.h"
+#include "../src/http/headers.h"
+#include "assets.h"
+
+// Content hash of the ETag
+static uint64_t hash_content(char *data, size_t length) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+#ifdef HAVE_ZLIB
+// Keeps the gzip variant only when it is smaller than the asset
+static void compress_asset(asset_t *asset) {
+    z_stream stream = {0};
+
+    // 16 + 15 window bits writes a gzip header
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + 15, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return;
+    }
+
+    size_t capacity = deflateBound(&stream, asset->length);
+    char *output = malloc(capacity);
+
+    if (output != NULL) {
+        stream.next_in = (unsigned char *)asset->data;
+        stream.avail_in = asset->length;
+        stream.next_out = (unsigned char *)output;
+        stream.avail_out = capacity;
+
+        if (deflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out < asset->length) {
+            asset->gzip_data = output;
+            asset->gzip_length = stream.total_out;
+        } else {
+            free(output);
+        }
+    }
+
+    deflateEnd(&stream);
+}
+#endif
+
+/**
+Returns
+- -1 if the list can't grow
+- 0 if succeed
+*/
+static int add_asset(asset_list_t *list, char *path, char *file_path, size_t length) {
+    if (list->length == list->capacity) {
+        size_t capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        asset_t *items = realloc(list->items, sizeof(asset_t) * capacity);
+
+        if (items == NULL) {
+            return -1;
+        }
+
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    asset_t *asset = &list->items[list->length];
+    memset(asset, 0, sizeof(asset_t));
+    asset->path = strdup(path);
+    asset->file_path = strdup(file_path);
+    asset->length = length;
+
+    if (asset->path == NULL || asset->file_path == NULL) {
+        free(asset->path);
+        free(asset->file_path);
+        return -1;
+    }
+
+    list->length++;
+    return 0;
+}
+
+// Adds the files below directory, path is their prefix in the list ("" at the root)
+static int walk_directory(asset_list_t *list, char *directory, char *path) {
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        fprintf(stderr, "Failed to open %s\n", directory);
+        return -1;
+    }
+
+    struct dirent *entry;
+    int result = 0;
+
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        // Hidden files are not served by the directory mounts either
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        size_t file_path_size = strlen(directory) + strlen(entry->d_name) + 2;
+        size_t entry_path_size = strlen(path) + strlen(entry->d_name) + 2;
+        char *file_path = malloc(file_path_size);
+        char *entry_path = malloc(entry_path_size);
+
+        if (file_path == NULL || entry_path == NULL) {
+            free(file_path);
+            free(entry_path);
+            result = -1;
+            break;
+        }
+
+        snprintf(file_path, file_path_size, "%s/%s", directory, entry->d_name);
+        snprintf(entry_path, entry_path_size, "%s%s%s", path, path[0] == '\0' ? "" : "/", entry->d_name);
+
+        struct stat file_stat;
+        if (stat(file_path, &file_stat) == -1) {
+            fprintf(stderr, "Failed to stat %s\n", file_path);
+            result = -1;
+        } else if (S_ISDIR(file_stat.st_mode)) {
+            result = walk_directory(list, file_path, entry_path);
+        } else if (S_ISREG(file_stat.st_mode)) {
+            result = add_asset(list, entry_path, file_path, file_stat.st_size);
+        }
+
+        free(file_path);
+        free(entry_path);
+    }
+
+    closedir(dir);
+    return result;
+}
+
+/**
+ * Lists the regular files below directory (hidden ones excepted), their
+ * content is only read by load_asset
+ *
+Returns
+- -1 if a directory can't be walked
+- 0 if succeed
+*/
+int collect_assets(asset_list_t *list, char *directory) {
+    return walk_directory(list, directory, "");
+}
+
+static int compare_assets(const void *a, const void *b) {
+    return strcmp(((const asset_t *)a)->path, ((const asset_t *)b)->path);
+}
+
+// Sorts the assets by path, in the byte order of strcmp
+void sort_assets(asset_list_t *list) {
+    qsort(list->items, list->length, sizeof(asset_t), compare_assets);
+}
+
+void free_assets(asset_list_t *list) {
+    for (size_t i = 0; i < list->length; i++) {
+        unload_asset(&list->items[i]);
+        free(list->items[i].path);
+        free(list->items[i].file_path);
+    }
+
+    free(list->items);
+    list->items = NULL;
+    list->length = 0;
+    list->capacity = 0;
+}
+
+/**
+ * Reads the content of the asset, hashes it and compresses it when asked to
+ * (and built with zlib)
+ *
+Returns
+- -1 if the file can't be read
+- 0 if succeed
+*/
+int load_asset(asset_t *asset, int compress) {
+    FILE *file = fopen(asset->file_path, "rb");
+    file_info_t *info = read_file(file);
+
+    if (file != NULL) {
+        fclose(file);
+    }
+
+    if (info == NULL) {
+        fprintf(stderr, "Failed to read %s\n", asset->file_path);
+        return -1;
+    }
+
+    asset->data = info->data;
+    asset->length = info->size;
+    asset->hash = hash_content(asset->data, asset->length);
+    free(info);
+
+#ifdef HAVE_ZLIB
+    if (compress) {
+        compress_asset(asset);
+    }
+#else
+    (void)compress;
+#endif
+
+    return 0;
+}
+
+void unload_asset(asset_t *asset) {
+    free(asset->data);
+    free(asset->gzip_data);
+    asset->data = NULL;
+    asset->gzip_data = NULL;
+    asset->gzip_length = 0;
+}
+
+// Writes the quoted ETag of a variant of a loaded asset in etag, ASSET_ETAG_SIZE bytes
+void format_asset_etag(asset_t *asset, int gzip, char *etag) {
+    snprintf(etag, ASSET_ETAG_SIZE, "\"%016llx%s\"", (unsigned long long)asset->hash, gzip ? "-gz" : "");
+}
+
+/**
+ * Header lines of a variant of a loaded asset, the server adds Content-Length
+ *
+ * Returns NULL on allocation failure
+ */
+string_t *create_asset_headers(asset_t *asset, int gzip) {
+    char etag[ASSET_ETAG_SIZE];
+    format_asset_etag(asset, gzip, etag);
+
+    header_t *content_type = get_content_type_header(get_extension(asset->path));
+    if (content_type == NULL) {
+        return NULL;
+    }
+
+    char *content_type_line = format_header_string(content_type);
+    string_t *headers = create_string(128);
+    free_header(content_type);
+
+    if (content_type_line == NULL || headers == NULL) {
+        free(content_type_line);
+        free_string(headers);
+        return NULL;
+    }
+
+    append_string(headers, content_type_line);
+    append_string(headers, "ETag: ");
+    append_string(headers, etag);
+    append_string(headers, "\r\n");
+    if (asset->gzip_data != NULL) {
+        append_string(headers, "Vary: Accept-Encoding\r\n");
+    }
+    if (gzip) {
+        append_string(headers, "Content-Encoding: gzip\r\n");
+    }
+
+    free(content_type_line);
+    return headers;
+}
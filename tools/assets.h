@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../src/str.h"
+
+// Files of a directory prepared for serving without the file system, shared by
+// embed_assets (compiled in bundle) and pack_assets (memory mapped pack)
+
+// Quoted ETag, "-gz" is appended for the gzip variant
+#define ASSET_ETAG_SIZE 32
+
+typedef struct Asset {
+    // Path below the directory, "index.html" or "css/site.css"
+    char *path;
+    char *file_path;
+    size_t length;
+
+    // Filled by load_asset, gzip_data stays NULL when it wouldn't be smaller
+    char *data;
+    char *gzip_data;
+    size_t gzip_length;
+    uint64_t hash;
+} asset_t;
+
+typedef struct AssetList {
+    asset_t *items;
+    size_t length;
+    size_t capacity;
+} asset_list_t;
+
+int collect_assets(asset_list_t *list, char *directory);
+void sort_assets(asset_list_t *list);
+void free_assets(asset_list_t *list);
+
+int load_asset(asset_t *asset, int compress);
+void unload_asset(asset_t *asset);
+
+void format_asset_etag(asset_t *asset, int gzip, char *etag);
+string_t *create_asset_headers(asset_t *asset, int gzip);
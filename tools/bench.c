@@ -0,0 +1,541 @@
+// Load generator measuring the throughput and latency of the server, to compare options
+//
+// Usage: bench [--connections=N] [--threads=N] [--seconds=N] [--path=PATH] [--close] ADDRESS
+//
+// ADDRESS is HOST:PORT, unix:/path or unix:@name. Every connection sends a GET of PATH,
+// waits for the whole response then sends the next one, on keep-alive connections unless
+// --close is given, which opens a connection per request to measure the accept path.
+// Responses need a Content-Length or have to end with the connection.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Latencies are counted in buckets of a quarter of a power of two of microseconds
+#define LATENCY_BUCKETS 128
+
+// Largest response head, the body is only counted
+#define RESPONSE_HEAD_SIZE (16 * 1024)
+
+typedef struct BenchOptions {
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    int connections;
+    int threads;
+    int seconds;
+    int close;
+    char request[1024];
+    size_t request_length;
+} bench_options_t;
+
+typedef struct BenchResults {
+    uint64_t requests;
+    uint64_t errors;
+    // Responses with a status other than 2xx or 3xx
+    uint64_t failures;
+    uint64_t connects;
+    uint64_t bytes;
+    uint64_t latency[LATENCY_BUCKETS];
+} bench_results_t;
+
+typedef enum BenchState {
+    BENCH_CONNECTING,
+    BENCH_SENDING,
+    BENCH_READING,
+} bench_state_t;
+
+typedef struct BenchConnection {
+    int fd;
+    bench_state_t state;
+    size_t sent;
+    char head[RESPONSE_HEAD_SIZE + 1];
+    size_t head_length;
+    int head_done;
+    // Bytes of the body still expected, a response without Content-Length ends with the connection
+    int has_length;
+    int64_t remaining;
+    int keep_alive;
+    uint64_t started_ns;
+} bench_connection_t;
+
+typedef struct BenchThread {
+    pthread_t thread;
+    bench_options_t *options;
+    int connection_count;
+    bench_results_t results;
+} bench_thread_t;
+
+static uint64_t now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+static size_t latency_bucket(uint64_t duration_ns) {
+    uint64_t us = duration_ns / 1000 + 1;
+    size_t octave = 63 - __builtin_clzll(us);
+    // The two bits below the highest one split the octave in quarters
+    size_t quarter = octave >= 2 ? (us >> (octave - 2)) & 3 : 0;
+    size_t bucket = octave * 4 + quarter;
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// Lower bound of a bucket in microseconds
+static uint64_t bucket_us(size_t bucket) {
+    size_t octave = bucket / 4;
+    uint64_t base = 1ull << octave;
+    return base + (octave >= 2 ? (base / 4) * (bucket % 4) : 0) - 1;
+}
+
+/**
+ * Parses HOST:PORT, unix:/path or unix:@name
+ *
+Returns
+- -1 if the address can't be resolved
+- 0 if succeed
+*/
+static int parse_address(bench_options_t *options, char *text) {
+    memset(&options->address, 0, sizeof(options->address));
+
+    if (strncmp(text, "unix:", 5) == 0) {
+        struct sockaddr_un *address = (struct sockaddr_un *)&options->address;
+        char *path = text + 5;
+        size_t length = strlen(path);
+
+        if (length == 0 || length >= sizeof(address->sun_path)) {
+            return -1;
+        }
+
+        address->sun_family = AF_UNIX;
+        memcpy(address->sun_path, path, length);
+        options->address_length = offsetof(struct sockaddr_un, sun_path) + length + (path[0] != '@');
+
+        if (path[0] == '@') {
+            address->sun_path[0] = '\0';
+        }
+        return 0;
+    }
+
+    char *separator = strrchr(text, ':');
+    if (separator == NULL) {
+        return -1;
+    }
+
+    *separator = '\0';
+    char *host = text;
+    size_t host_length = strlen(host);
+
+    if (host[0] == '[' && host_length > 1 && host[host_length - 1] == ']') {
+        host[host_length - 1] = '\0';
+        host++;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *result = NULL;
+    int error = getaddrinfo(host, separator + 1, &hints, &result);
+    *separator = ':';
+
+    if (error != 0) {
+        return -1;
+    }
+
+    memcpy(&options->address, result->ai_addr, result->ai_addrlen);
+    options->address_length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+// Returns -1 if the connection can't be opened, otherwise 0
+static int open_bench_connection(int epoll_fd, bench_options_t *options, bench_connection_t *connection,
+                                 bench_results_t *results) {
+    int fd = socket(options->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (options->address.ss_family != AF_UNIX) {
+        int enabled = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+    }
+
+    connection->fd = fd;
+    connection->state = BENCH_CONNECTING;
+    connection->sent = 0;
+    connection->started_ns = now_ns();
+    results->connects++;
+
+    if (connect(fd, (struct sockaddr *)&options->address, options->address_length) == -1 && errno != EINPROGRESS &&
+        errno != EAGAIN) {
+        close(fd);
+        return -1;
+    }
+
+    struct epoll_event event = {.events = EPOLLOUT, .data.ptr = connection};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void close_bench_connection(bench_connection_t *connection) {
+    close(connection->fd);
+    connection->fd = -1;
+}
+
+static void start_request(bench_connection_t *connection) {
+    connection->state = BENCH_SENDING;
+    connection->sent = 0;
+    connection->head_length = 0;
+    connection->head_done = 0;
+    connection->has_length = 0;
+    connection->remaining = 0;
+    connection->keep_alive = 1;
+}
+
+// Parses the head once it is complete, returns -1 if it isn't a valid response
+static int parse_response_head(bench_connection_t *connection, bench_results_t *results) {
+    connection->head[connection->head_length] = '\0';
+
+    char *end = strstr(connection->head, "\r\n\r\n");
+    if (end == NULL) {
+        return connection->head_length == RESPONSE_HEAD_SIZE ? -1 : 0;
+    }
+
+    int status = 0;
+    if (sscanf(connection->head, "HTTP/1.%*d %d", &status) != 1) {
+        return -1;
+    }
+
+    if (status < 200 || status >= 400) {
+        results->failures++;
+    }
+
+    size_t head_size = end + 4 - connection->head;
+    *end = '\0';
+
+    // Part of the body may have come with the head
+    char *length = strcasestr(connection->head, "\r\ncontent-length:");
+    if (length != NULL) {
+        int64_t body_received = connection->head_length - head_size;
+        connection->has_length = 1;
+        connection->remaining = (int64_t)strtoull(length + 17, NULL, 10) - body_received;
+    }
+    connection->keep_alive = strcasestr(connection->head, "\r\nconnection: close") == NULL;
+    connection->head_done = 1;
+    return 0;
+}
+
+/**
+ * Reads what the server sent
+ *
+Returns
+- -1 if the connection failed
+- 0 while the response isn't complete
+- 1 once it is
+*/
+static int read_response(bench_connection_t *connection, bench_results_t *results) {
+    static __thread char scratch[64 * 1024];
+
+    while (1) {
+        char *target = connection->head_done ? scratch : connection->head + connection->head_length;
+        size_t space = connection->head_done ? sizeof(scratch) : RESPONSE_HEAD_SIZE - connection->head_length;
+        ssize_t received = read(connection->fd, target, space);
+
+        if (received == 0) {
+            // The end of the connection ends a response without length
+            return connection->head_done && !connection->has_length ? 1 : -1;
+        }
+
+        if (received == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        results->bytes += received;
+
+        if (!connection->head_done) {
+            connection->head_length += received;
+            if (parse_response_head(connection, results) == -1) {
+                return -1;
+            }
+        } else {
+            connection->remaining -= received;
+        }
+
+        if (connection->head_done && connection->has_length) {
+            // More than the response means the length was wrong
+            if (connection->remaining <= 0) {
+                return connection->remaining == 0 ? 1 : -1;
+            }
+        }
+    }
+}
+
+// Returns -1 if the request can't be sent, 0 while it isn't fully sent, 1 once it is
+static int send_request(bench_connection_t *connection, bench_options_t *options) {
+    while (connection->sent < options->request_length) {
+        ssize_t written = send(connection->fd, options->request + connection->sent,
+                               options->request_length - connection->sent, MSG_NOSIGNAL);
+        if (written == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        connection->sent += written;
+    }
+
+    return 1;
+}
+
+static void watch(int epoll_fd, bench_connection_t *connection, uint32_t events) {
+    struct epoll_event event = {.events = events, .data.ptr = connection};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+// Sends the next request of the connection, or opens a new one, returns -1 if it failed
+static int next_request(int epoll_fd, bench_options_t *options, bench_connection_t *connection,
+                        bench_results_t *results) {
+    if (connection->fd == -1) {
+        start_request(connection);
+        return open_bench_connection(epoll_fd, options, connection, results);
+    }
+
+    start_request(connection);
+    connection->started_ns = now_ns();
+
+    int result = send_request(connection, options);
+    if (result == -1) {
+        return -1;
+    }
+
+    connection->state = result == 1 ? BENCH_READING : BENCH_SENDING;
+    watch(epoll_fd, connection, result == 1 ? EPOLLIN : EPOLLOUT);
+    return 0;
+}
+
+// Handles an event of a connection, returns -1 if it failed
+static int on_bench_event(int epoll_fd, bench_options_t *options, bench_connection_t *connection,
+                          bench_results_t *results) {
+    if (connection->state == BENCH_CONNECTING) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        if (getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+            return -1;
+        }
+        connection->state = BENCH_SENDING;
+    }
+
+    if (connection->state == BENCH_SENDING) {
+        int result = send_request(connection, options);
+        if (result != 1) {
+            return result;
+        }
+
+        connection->state = BENCH_READING;
+        watch(epoll_fd, connection, EPOLLIN);
+        return 0;
+    }
+
+    int result = read_response(connection, results);
+    if (result != 1) {
+        return result;
+    }
+
+    results->requests++;
+    results->latency[latency_bucket(now_ns() - connection->started_ns)]++;
+
+    if (options->close || !connection->keep_alive) {
+        close_bench_connection(connection);
+    }
+
+    return next_request(epoll_fd, options, connection, results);
+}
+
+static void *run_bench_thread(void *arg) {
+    bench_thread_t *thread = arg;
+    bench_options_t *options = thread->options;
+    bench_results_t *results = &thread->results;
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    bench_connection_t *connections = calloc(thread->connection_count, sizeof(bench_connection_t));
+
+    if (epoll_fd == -1 || connections == NULL) {
+        fprintf(stderr, "Failed to start a thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < thread->connection_count; i++) {
+        connections[i].fd = -1;
+        if (next_request(epoll_fd, options, &connections[i], results) == -1) {
+            results->errors++;
+        }
+    }
+
+    uint64_t deadline = now_ns() + (uint64_t)options->seconds * 1000000000ull;
+    struct epoll_event events[256];
+
+    while (now_ns() < deadline) {
+        int count = epoll_wait(epoll_fd, events, 256, 100);
+
+        for (int i = 0; i < count; i++) {
+            bench_connection_t *connection = events[i].data.ptr;
+
+            if (on_bench_event(epoll_fd, options, connection, results) == 0) {
+                continue;
+            }
+
+            // A failed connection is replaced, so the load stays the same
+            results->errors++;
+            if (connection->fd != -1) {
+                close_bench_connection(connection);
+            }
+            if (next_request(epoll_fd, options, connection, results) == -1) {
+                results->errors++;
+            }
+        }
+    }
+
+    for (int i = 0; i < thread->connection_count; i++) {
+        if (connections[i].fd != -1) {
+            close(connections[i].fd);
+        }
+    }
+
+    free(connections);
+    close(epoll_fd);
+    return NULL;
+}
+
+// Returns the latency under which `fraction` of the requests completed, in microseconds. There must be requests
+static uint64_t latency_percentile(bench_results_t *results, double fraction) {
+    uint64_t target = (uint64_t)(results->requests * fraction);
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += results->latency[i];
+        if (seen > target) {
+            return bucket_us(i + 1);
+        }
+    }
+
+    return bucket_us(LATENCY_BUCKETS - 1);
+}
+
+static void print_usage(char *program) {
+    fprintf(stderr, "Usage: %s [--connections=N] [--threads=N] [--seconds=N] [--path=PATH] [--close] ADDRESS\n",
+            program);
+}
+
+int main(int argc, char **argv) {
+    bench_options_t options = {.connections = 64, .threads = 2, .seconds = 5};
+    char *path = "/";
+    char *target = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        char *argument = argv[i];
+
+        if (strncmp(argument, "--connections=", 14) == 0) {
+            options.connections = atoi(argument + 14);
+        } else if (strncmp(argument, "--threads=", 10) == 0) {
+            options.threads = atoi(argument + 10);
+        } else if (strncmp(argument, "--seconds=", 10) == 0) {
+            options.seconds = atoi(argument + 10);
+        } else if (strncmp(argument, "--path=", 7) == 0) {
+            path = argument + 7;
+        } else if (strcmp(argument, "--close") == 0) {
+            options.close = 1;
+        } else if (argument[0] != '-' && target == NULL) {
+            target = argument;
+        } else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (target == NULL || options.connections <= 0 || options.threads <= 0 || options.seconds <= 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (parse_address(&options, target) == -1) {
+        fprintf(stderr, "Failed to resolve %s\n", target);
+        return EXIT_FAILURE;
+    }
+
+    if (options.threads > options.connections) {
+        options.threads = options.connections;
+    }
+
+    int length = snprintf(options.request, sizeof(options.request), "GET %s HTTP/1.1\r\nHost: bench\r\n%s\r\n", path,
+                          options.close ? "Connection: close\r\n" : "");
+    if (length < 0 || (size_t)length >= sizeof(options.request)) {
+        fprintf(stderr, "The path is too long\n");
+        return EXIT_FAILURE;
+    }
+    options.request_length = length;
+
+    bench_thread_t *threads = calloc(options.threads, sizeof(bench_thread_t));
+    if (threads == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    uint64_t started = now_ns();
+
+    for (int i = 0; i < options.threads; i++) {
+        threads[i].options = &options;
+        threads[i].connection_count =
+            options.connections / options.threads + (i < options.connections % options.threads ? 1 : 0);
+
+        if (pthread_create(&threads[i].thread, NULL, run_bench_thread, &threads[i]) != 0) {
+            fprintf(stderr, "Failed to start the threads\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    bench_results_t total = {0};
+
+    for (int i = 0; i < options.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+
+        bench_results_t *results = &threads[i].results;
+        total.requests += results->requests;
+        total.errors += results->errors;
+        total.failures += results->failures;
+        total.connects += results->connects;
+        total.bytes += results->bytes;
+        for (size_t j = 0; j < LATENCY_BUCKETS; j++) {
+            total.latency[j] += results->latency[j];
+        }
+    }
+
+    double elapsed = (now_ns() - started) / 1e9;
+
+    printf("%lu requests in %.2fs, %.0f requests/s, %.1f MB/s\n", total.requests, elapsed, total.requests / elapsed,
+           total.bytes / elapsed / (1024 * 1024));
+    printf("%lu connections, %lu errors, %lu non 2xx/3xx responses\n", total.connects, total.errors,
+           total.failures);
+    // Without a response there is no latency to report
+    if (total.requests == 0) {
+        printf("Latency: n/a\n");
+    } else {
+        printf("Latency: p50 %luus, p90 %luus, p99 %luus, p99.9 %luus\n", latency_percentile(&total, 0.5),
+               latency_percentile(&total, 0.9), latency_percentile(&total, 0.99), latency_percentile(&total, 0.999));
+    }
+
+    free(threads);
+    return total.requests > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
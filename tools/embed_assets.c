@@ -0,0 +1,323 @@
+// Generates the C source of the embedded asset bundle, see src/bundle.h
+//
+// Usage: embed_assets OUTPUT [DIRECTORY]
+//
+// Every regular file below DIRECTORY (hidden ones excepted) becomes an aligned byte array
+// with its precomputed header lines, ETag and gzip variant, indexed by a perfect hash of its
+// path. Without DIRECTORY the bundle is empty, the server is then built without assets.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assets.h"
+
+// Paths per bucket of the perfect hash, and slots per path
+const size_t KEYS_PER_BUCKET = 4;
+const double SLOTS_PER_KEY = 1.25;
+
+// Seeds tried for a bucket before giving up
+const uint32_t MAX_SEED = 1u << 24;
+
+// Same hash as find_bundle_asset in src/bundle.c, both have to agree
+static uint32_t hash_path(char *path, size_t length, uint32_t seed) {
+    // FNV-1a with the seed in the offset basis, then the murmur3 finalizer
+    uint32_t hash = 2166136261u ^ seed;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+typedef struct Bucket {
+    size_t index;
+    size_t *keys;
+    size_t length;
+} bucket_t;
+
+static int compare_buckets(const void *a, const void *b) {
+    const bucket_t *first = a;
+    const bucket_t *second = b;
+
+    if (first->length != second->length) {
+        return first->length > second->length ? -1 : 1;
+    }
+    return first->index < second->index ? -1 : first->index > second->index;
+}
+
+// Returns the first seed sending every path of the bucket to a free slot, their slots in taken, or 0 if none
+static uint32_t find_seed(asset_list_t *list, bucket_t *bucket, int32_t *slots, size_t slot_count, size_t *taken) {
+    for (uint32_t seed = 1; seed < MAX_SEED; seed++) {
+        size_t placed = 0;
+
+        for (; placed < bucket->length; placed++) {
+            asset_t *asset = &list->items[bucket->keys[placed]];
+            size_t slot = hash_path(asset->path, strlen(asset->path), seed) % slot_count;
+
+            int collides = slots[slot] != -1;
+            for (size_t i = 0; i < placed && !collides; i++) {
+                collides = taken[i] == slot;
+            }
+
+            if (collides) {
+                break;
+            }
+            taken[placed] = slot;
+        }
+
+        if (placed == bucket->length) {
+            return seed;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Hash and displace: the paths are spread in buckets with the seed 0, then from the
+ * largest bucket down every bucket gets the first seed sending all its paths to free
+ * slots. A lookup costs two hashes and a single comparison.
+ *
+Returns
+- -1 if a bucket found no seed
+- 0 if succeed
+*/
+static int build_perfect_hash(asset_list_t *list, uint32_t *seeds, size_t bucket_count, int32_t *slots,
+                              size_t slot_count) {
+    bucket_t *buckets = calloc(bucket_count, sizeof(bucket_t));
+    size_t *keys = malloc(sizeof(size_t) * (list->length + 1));
+    size_t *bucket_of = malloc(sizeof(size_t) * (list->length + 1));
+    size_t *taken = malloc(sizeof(size_t) * (list->length + 1));
+    int result = buckets == NULL || keys == NULL || bucket_of == NULL || taken == NULL ? -1 : 0;
+
+    for (size_t i = 0; i < slot_count; i++) {
+        slots[i] = -1;
+    }
+
+    for (size_t i = 0; result == 0 && i < list->length; i++) {
+        asset_t *asset = &list->items[i];
+        bucket_of[i] = hash_path(asset->path, strlen(asset->path), 0) % bucket_count;
+        buckets[bucket_of[i]].length++;
+    }
+
+    // The keys of every bucket are a range of keys
+    size_t offset = 0;
+    for (size_t i = 0; result == 0 && i < bucket_count; i++) {
+        buckets[i].index = i;
+        buckets[i].keys = keys + offset;
+        offset += buckets[i].length;
+        buckets[i].length = 0;
+    }
+
+    for (size_t i = 0; result == 0 && i < list->length; i++) {
+        bucket_t *bucket = &buckets[bucket_of[i]];
+        bucket->keys[bucket->length++] = i;
+    }
+
+    if (result == 0) {
+        qsort(buckets, bucket_count, sizeof(bucket_t), compare_buckets);
+    }
+
+    for (size_t i = 0; result == 0 && i < bucket_count && buckets[i].length > 0; i++) {
+        bucket_t *bucket = &buckets[i];
+        uint32_t seed = find_seed(list, bucket, slots, slot_count, taken);
+
+        if (seed == 0) {
+            fprintf(stderr, "No perfect hash found for the bundle\n");
+            result = -1;
+            break;
+        }
+
+        seeds[bucket->index] = seed;
+        for (size_t j = 0; j < bucket->length; j++) {
+            slots[taken[j]] = bucket->keys[j];
+        }
+    }
+
+    free(buckets);
+    free(keys);
+    free(bucket_of);
+    free(taken);
+    return result;
+}
+
+static void write_bytes(FILE *output, char *name, char *data, size_t length) {
+    // Aligned for the copies of HTTP/2 and for the cache lines of sendmsg
+    fprintf(output, "static const char %s[] __attribute__((aligned(64))) = {", name);
+
+    for (size_t i = 0; i < length; i++) {
+        fprintf(output, "%s%d,", i % 24 == 0 ? "\n    " : "", (signed char)data[i]);
+    }
+
+    // Never empty, an empty file still has its array
+    fprintf(output, "%s0};\n", length % 24 == 0 ? "\n    " : "");
+}
+
+static void write_c_string(FILE *output, char *text) {
+    fputc('"', output);
+
+    for (char *c = text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(output, "\\%c", *c);
+        } else if (*c == '\r') {
+            fputs("\\r", output);
+        } else if (*c == '\n') {
+            fputs("\\n", output);
+        } else if ((unsigned char)*c < 0x20 || (unsigned char)*c >= 0x7f) {
+            fprintf(output, "\\%03o", (unsigned char)*c);
+        } else {
+            fputc(*c, output);
+        }
+    }
+
+    fputc('"', output);
+}
+
+// Writes a variant of the asset, the connection adds Content-Length to its header lines
+static int write_variant(FILE *output, asset_t *asset, size_t index, int gzip) {
+    char etag[ASSET_ETAG_SIZE];
+    format_asset_etag(asset, gzip, etag);
+
+    string_t *headers = create_asset_headers(asset, gzip);
+    if (headers == NULL) {
+        return -1;
+    }
+
+    fprintf(output, "{.data = asset_%zu%s, .length = %zu, .headers = ", index, gzip ? "_gzip" : "",
+            gzip ? asset->gzip_length : asset->length);
+    write_c_string(output, headers->data);
+    fprintf(output, ", .etag = ");
+    write_c_string(output, etag);
+    fprintf(output, "}");
+
+    free_string(headers);
+    return 0;
+}
+
+static int write_bundle(FILE *output, asset_list_t *list, char *directory) {
+    size_t bucket_count = list->length / KEYS_PER_BUCKET + 1;
+    size_t slot_count = (size_t)(list->length * SLOTS_PER_KEY) + 1;
+    uint32_t *seeds = calloc(bucket_count, sizeof(uint32_t));
+    int32_t *slots = malloc(sizeof(int32_t) * slot_count);
+
+    if (seeds == NULL || slots == NULL || build_perfect_hash(list, seeds, bucket_count, slots, slot_count) == -1) {
+        free(seeds);
+        free(slots);
+        return -1;
+    }
+
+    fprintf(output, "// Generated by embed_assets from %s, do not edit\n\n", directory != NULL ? directory : "nothing");
+    fprintf(output, "#include \"bundle.h\"\n\n");
+
+    for (size_t i = 0; i < list->length; i++) {
+        char name[64];
+        asset_t *asset = &list->items[i];
+
+        snprintf(name, sizeof(name), "asset_%zu", i);
+        write_bytes(output, name, asset->data, asset->length);
+
+        if (asset->gzip_data != NULL) {
+            snprintf(name, sizeof(name), "asset_%zu_gzip", i);
+            write_bytes(output, name, asset->gzip_data, asset->gzip_length);
+        }
+    }
+
+    int result = 0;
+    fprintf(output, "\nconst bundle_asset_t bundle_assets[] = {\n");
+    for (size_t i = 0; i < list->length; i++) {
+        asset_t *asset = &list->items[i];
+
+        fprintf(output, "    {\n        .path = ");
+        write_c_string(output, asset->path);
+        fprintf(output, ",\n        .identity = ");
+        if (write_variant(output, asset, i, 0) == -1) {
+            result = -1;
+        }
+        fprintf(output, ",\n");
+
+        if (asset->gzip_data != NULL) {
+            fprintf(output, "        .gzip = ");
+            if (write_variant(output, asset, i, 1) == -1) {
+                result = -1;
+            }
+            fprintf(output, ",\n");
+        }
+
+        fprintf(output, "    },\n");
+    }
+    if (list->length == 0) {
+        fprintf(output, "    {0},\n");
+    }
+    fprintf(output, "};\n\n");
+
+    fprintf(output, "const size_t bundle_asset_count = %zu;\n\n", list->length);
+
+    fprintf(output, "const uint32_t bundle_seeds[] = {");
+    for (size_t i = 0; i < bucket_count; i++) {
+        fprintf(output, "%s%u,", i % 12 == 0 ? "\n    " : "", seeds[i]);
+    }
+    fprintf(output, "\n};\nconst size_t bundle_bucket_count = %zu;\n\n", bucket_count);
+
+    fprintf(output, "const int32_t bundle_slots[] = {");
+    for (size_t i = 0; i < slot_count; i++) {
+        fprintf(output, "%s%d,", i % 12 == 0 ? "\n    " : "", slots[i]);
+    }
+    fprintf(output, "\n};\nconst size_t bundle_slot_count = %zu;\n", slot_count);
+
+    free(seeds);
+    free(slots);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s OUTPUT [DIRECTORY]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char *directory = argc == 3 ? argv[2] : NULL;
+    asset_list_t list = {0};
+
+    if (directory != NULL && collect_assets(&list, directory) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < list.length; i++) {
+        if (load_asset(&list.items[i], 1) == -1) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Written next to the output then renamed, a failed run never leaves half a bundle
+    size_t temporary_size = strlen(argv[1]) + sizeof(".tmp");
+    char *temporary = malloc(temporary_size);
+    if (temporary == NULL) {
+        return EXIT_FAILURE;
+    }
+    snprintf(temporary, temporary_size, "%s.tmp", argv[1]);
+
+    FILE *output = fopen(temporary, "w");
+    if (output == NULL) {
+        fprintf(stderr, "Failed to open %s\n", temporary);
+        return EXIT_FAILURE;
+    }
+
+    int result = write_bundle(output, &list, directory);
+    if (fclose(output) != 0 || result == -1 || rename(temporary, argv[1]) == -1) {
+        remove(temporary);
+        return EXIT_FAILURE;
+    }
+
+    free_assets(&list);
+    free(temporary);
+    return EXIT_SUCCESS;
+}
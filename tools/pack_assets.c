@@ -0,0 +1,204 @@
+// Packs a directory in a single indexed file served memory mapped, see src/pack_format.h
+//
+// Usage: pack_assets [--gzip] OUTPUT DIRECTORY
+//
+// Every regular file below DIRECTORY (hidden ones excepted) is stored with its precomputed
+// header lines and ETag, and with --gzip its gzip variant when it is smaller. Contents are
+// streamed to the pack one file at a time, only the index stays in memory.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/pack_format.h"
+#include "assets.h"
+
+// Alignment of the contents in the pack
+const size_t PACK_DATA_ALIGNMENT = 16;
+
+// What is kept of an asset once its content is written
+typedef struct PackedAsset {
+    pack_entry_t entry;
+    string_t *headers;
+    string_t *gzip_headers;
+    char etag[ASSET_ETAG_SIZE];
+    char gzip_etag[ASSET_ETAG_SIZE];
+} packed_asset_t;
+
+// Returns the offset reached, or -1 if the padding can't be written
+static int64_t pad_to(FILE *output, size_t alignment) {
+    int64_t offset = ftello(output);
+
+    while (offset != -1 && offset % alignment != 0) {
+        if (fputc(0, output) == EOF) {
+            return -1;
+        }
+        offset++;
+    }
+
+    return offset;
+}
+
+// Returns the offset of the bytes written, or -1 on failure
+static int64_t write_data(FILE *output, char *data, size_t length, size_t alignment) {
+    int64_t offset = pad_to(output, alignment);
+
+    if (offset == -1 || (length > 0 && fwrite(data, 1, length, output) != length)) {
+        return -1;
+    }
+
+    return offset;
+}
+
+static int64_t write_text(FILE *output, char *text) {
+    return write_data(output, text, strlen(text) + 1, 1);
+}
+
+/**
+ * Writes the content of an asset and its gzip variant, keeps its header lines and ETags
+ *
+Returns
+- -1 if the file can't be read or the pack written
+- 0 if succeed
+*/
+static int pack_content(FILE *output, asset_t *asset, packed_asset_t *packed, int compress) {
+    if (load_asset(asset, compress) == -1) {
+        return -1;
+    }
+
+    memset(packed, 0, sizeof(packed_asset_t));
+    packed->headers = create_asset_headers(asset, 0);
+    format_asset_etag(asset, 0, packed->etag);
+
+    int64_t offset = write_data(output, asset->data, asset->length, PACK_DATA_ALIGNMENT);
+    packed->entry.identity.data_offset = offset;
+    packed->entry.identity.length = asset->length;
+    int result = packed->headers == NULL || offset == -1 ? -1 : 0;
+
+    if (result == 0 && asset->gzip_data != NULL) {
+        packed->gzip_headers = create_asset_headers(asset, 1);
+        format_asset_etag(asset, 1, packed->gzip_etag);
+
+        offset = write_data(output, asset->gzip_data, asset->gzip_length, PACK_DATA_ALIGNMENT);
+        packed->entry.gzip.data_offset = offset;
+        packed->entry.gzip.length = asset->gzip_length;
+        result = packed->gzip_headers == NULL || offset == -1 ? -1 : 0;
+    }
+
+    unload_asset(asset);
+    return result;
+}
+
+// Returns -1 if a string can't be written, otherwise 0
+static int pack_strings(FILE *output, asset_t *asset, packed_asset_t *packed) {
+    pack_entry_t *entry = &packed->entry;
+    int64_t offsets[5] = {
+        write_text(output, asset->path),
+        write_text(output, packed->headers->data),
+        write_text(output, packed->etag),
+        packed->gzip_headers != NULL ? write_text(output, packed->gzip_headers->data) : 0,
+        packed->gzip_headers != NULL ? write_text(output, packed->gzip_etag) : 0,
+    };
+
+    for (size_t i = 0; i < 5; i++) {
+        if (offsets[i] == -1) {
+            return -1;
+        }
+    }
+
+    entry->path_offset = offsets[0];
+    entry->path_length = strlen(asset->path);
+    entry->identity.headers_offset = offsets[1];
+    entry->identity.etag_offset = offsets[2];
+    entry->gzip.headers_offset = offsets[3];
+    entry->gzip.etag_offset = offsets[4];
+    return 0;
+}
+
+static int write_pack(FILE *output, asset_list_t *list, int compress) {
+    packed_asset_t *packed = calloc(list->length + 1, sizeof(packed_asset_t));
+    if (packed == NULL) {
+        return -1;
+    }
+
+    pack_header_t header = {.version = PACK_VERSION, .entry_count = list->length};
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+
+    // Rewritten at the end with the offsets
+    int result = fwrite(&header, sizeof(header), 1, output) == 1 ? 0 : -1;
+
+    for (size_t i = 0; result == 0 && i < list->length; i++) {
+        result = pack_content(output, &list->items[i], &packed[i], compress);
+    }
+
+    for (size_t i = 0; result == 0 && i < list->length; i++) {
+        result = pack_strings(output, &list->items[i], &packed[i]);
+    }
+
+    int64_t index_offset = result == 0 ? pad_to(output, sizeof(uint64_t)) : -1;
+    result = index_offset == -1 ? -1 : 0;
+
+    for (size_t i = 0; result == 0 && i < list->length; i++) {
+        result = fwrite(&packed[i].entry, sizeof(pack_entry_t), 1, output) == 1 ? 0 : -1;
+    }
+
+    if (result == 0) {
+        header.index_offset = index_offset;
+        header.file_size = ftello(output);
+        result = fseeko(output, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, output) == 1 ? 0 : -1;
+    }
+
+    for (size_t i = 0; i < list->length; i++) {
+        free_string(packed[i].headers);
+        free_string(packed[i].gzip_headers);
+    }
+    free(packed);
+    return result;
+}
+
+int main(int argc, char **argv) {
+    int compress = argc > 1 && strcmp(argv[1], "--gzip") == 0;
+
+    if (argc != 3 + compress) {
+        fprintf(stderr, "Usage: %s [--gzip] OUTPUT DIRECTORY\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char *output_path = argv[1 + compress];
+    char *directory = argv[2 + compress];
+    asset_list_t list = {0};
+
+    if (collect_assets(&list, directory) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    // The server looks paths up with a binary search
+    sort_assets(&list);
+
+    // Written next to the output then renamed, a server never maps half a pack
+    size_t temporary_size = strlen(output_path) + sizeof(".tmp");
+    char *temporary = malloc(temporary_size);
+    if (temporary == NULL) {
+        return EXIT_FAILURE;
+    }
+    snprintf(temporary, temporary_size, "%s.tmp", output_path);
+
+    FILE *output = fopen(temporary, "wb");
+    if (output == NULL) {
+        fprintf(stderr, "Failed to open %s\n", temporary);
+        return EXIT_FAILURE;
+    }
+
+    int result = write_pack(output, &list, compress);
+    if (fclose(output) != 0 || result == -1 || rename(temporary, output_path) == -1) {
+        fprintf(stderr, "Failed to write %s\n", output_path);
+        remove(temporary);
+        return EXIT_FAILURE;
+    }
+
+    printf("Packed %zu files in %s\n", list.length, output_path);
+    free_assets(&list);
+    free(temporary);
+    return EXIT_SUCCESS;
+}